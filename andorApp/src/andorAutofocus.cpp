@@ -0,0 +1,303 @@
+/**
+ * Shamrock focus mirror autofocus for the ADAndor driver.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <epicsThread.h>
+
+#include "andorAutofocus.h"
+
+// Wavelengths closer than this are the same table entry, in nm
+static const double WavelengthTolerance = 0.5;
+
+static epicsThreadOnceId tablesOnce = EPICS_THREAD_ONCE_INIT;
+static epicsMutexId tablesLock;
+static AndorFocusTable *tables[AndorFocusTable::MaxDevices];
+
+template <typename epicsType>
+static double gradientEnergy(const epicsType *pData, size_t sizeX, size_t sizeY)
+{
+  const epicsType *pRow;
+  double mean, diff, gradient = 0., variance = 0.;
+
+  for (size_t y=0; y<sizeY; y++) {
+    pRow = pData + y * sizeX;
+    mean = 0.;
+    for (size_t x=0; x<sizeX; x++) mean += pRow[x];
+    mean /= sizeX;
+    for (size_t x=0; x<sizeX; x++) {
+      diff = pRow[x] - mean;
+      variance += diff * diff;
+    }
+    for (size_t x=1; x<sizeX; x++) {
+      diff = (double)pRow[x] - (double)pRow[x-1];
+      gradient += diff * diff;
+    }
+  }
+  return (variance > 0.) ? gradient / variance : 0.;
+}
+
+AndorFocusSearch::AndorFocusSearch()
+  : mLimitLow(0), mLimitHigh(0), mLow(0), mHigh(0), mStep(1), mMinStep(1), mNumPositions(0),
+    mIndex(0), mNumSamples(0), mBest(0), mBestSharpness(0.), mDone(true)
+{
+  memset(mPositions, 0, sizeof(mPositions));
+}
+
+/** Starts a search.
+  * \param[in] low Lowest focus mirror position searched.
+  * \param[in] high Highest focus mirror position searched.
+  * \param[in] coarseStep Step of the first pass.
+  * \param[in] minStep Step of the last pass.
+  * \return 0 on success, -1 if the range or steps are not valid. */
+int AndorFocusSearch::start(int low, int high, int coarseStep, int minStep)
+{
+  if ((high <= low) || (minStep < 1) || (coarseStep < minStep)) return -1;
+  mLimitLow = mLow = low;
+  mLimitHigh = mHigh = high;
+  mStep = coarseStep;
+  mMinStep = minStep;
+  mNumSamples = 0;
+  mBest = low;
+  mBestSharpness = -1.;
+  mDone = false;
+  plan();
+  return 0;
+}
+
+/** Reports the sharpness at position() and moves to the next position.
+  * \return True when the search is done, and best() is the sharpest position. */
+bool AndorFocusSearch::report(double sharpness)
+{
+  if (mDone) return true;
+  if (mNumSamples < MaxSamples) mSamples[mNumSamples++] = mPositions[mIndex];
+  if (sharpness > mBestSharpness) {
+    mBestSharpness = sharpness;
+    mBest = mPositions[mIndex];
+  }
+  if (++mIndex < mNumPositions) return false;
+  // Search around the best position with a smaller step, until a pass has a position
+  // that has not been measured yet
+  while (mStep > mMinStep) {
+    mLow = (mBest - mStep > mLimitLow) ? mBest - mStep : mLimitLow;
+    mHigh = (mBest + mStep < mLimitHigh) ? mBest + mStep : mLimitHigh;
+    mStep = (mStep / 4 > mMinStep) ? mStep / 4 : mMinStep;
+    if (plan() > 0) return false;
+  }
+  mDone = true;
+  return true;
+}
+
+bool AndorFocusSearch::measured(int position) const
+{
+  for (int i=0; i<mNumSamples; i++) {
+    if (mSamples[i] == position) return true;
+  }
+  return false;
+}
+
+/** Lists the positions of a pass from mLow to mHigh, including both ends.
+  * \return Number of positions not measured yet. */
+int AndorFocusSearch::plan()
+{
+  int position;
+
+  if ((mHigh - mLow) / mStep + 1 > MaxPassPositions) {
+    mStep = (mHigh - mLow + MaxPassPositions - 2) / (MaxPassPositions - 1);
+  }
+  mNumPositions = 0;
+  mIndex = 0;
+  for (position=mLow; (position<=mHigh) && (mNumPositions<MaxPassPositions); position+=mStep) {
+    if (!measured(position)) mPositions[mNumPositions++] = position;
+  }
+  if ((position - mStep < mHigh) && (mNumPositions < MaxPassPositions) && !measured(mHigh)) {
+    mPositions[mNumPositions++] = mHigh;
+  }
+  return mNumPositions;
+}
+
+/** Computes the sharpness of a spectrum or image.
+  * \param[in] pArray UInt16, UInt32 or Float32 array, 1-D or 2-D.
+  * \return The sharpness, 0 for a flat array, or -1 if the type is not supported. */
+double AndorFocusSearch::sharpness(const NDArray *pArray)
+{
+  size_t sizeX, sizeY;
+
+  if ((pArray->ndims < 1) || (pArray->ndims > 2)) return -1.;
+  sizeX = pArray->dims[0].size;
+  sizeY = (pArray->ndims > 1) ? pArray->dims[1].size : 1;
+  if (sizeX < 2) return -1.;
+  switch (pArray->dataType) {
+    case NDUInt16:  return gradientEnergy((const epicsUInt16 *)pArray->pData, sizeX, sizeY);
+    case NDUInt32:  return gradientEnergy((const epicsUInt32 *)pArray->pData, sizeX, sizeY);
+    case NDFloat32: return gradientEnergy((const epicsFloat32 *)pArray->pData, sizeX, sizeY);
+    default:        return -1.;
+  }
+}
+
+static void createTablesLock(void *)
+{
+  tablesLock = epicsMutexMustCreate();
+}
+
+AndorFocusTable::AndorFocusTable()
+  : mNumEntries(0), mSearching(false)
+{
+  mLock = epicsMutexMustCreate();
+  mMirrorLock = epicsMutexMustCreate();
+}
+
+/** Returns the table of a spectrograph, creating it on first use.
+  * \param[in] device Spectrograph index.
+  * \return The table, or NULL if the index is out of range. */
+AndorFocusTable *AndorFocusTable::device(int device)
+{
+  AndorFocusTable *pTable;
+
+  if ((device < 0) || (device >= MaxDevices)) return NULL;
+  epicsThreadOnce(&tablesOnce, createTablesLock, NULL);
+  epicsMutexLock(tablesLock);
+  if (!tables[device]) tables[device] = new AndorFocusTable();
+  pTable = tables[device];
+  epicsMutexUnlock(tablesLock);
+  return pTable;
+}
+
+/** Stores the focus for a grating and centre wavelength, replacing the entry for the
+  * same wavelength.
+  * \return 0 on success, -1 if the table is full. */
+int AndorFocusTable::store(int grating, double wavelength, int focus)
+{
+  int i, status = 0;
+
+  epicsMutexLock(mLock);
+  for (i=0; i<mNumEntries; i++) {
+    if ((mEntries[i].grating == grating) &&
+        (fabs(mEntries[i].wavelength - wavelength) < WavelengthTolerance)) break;
+  }
+  if (i < mNumEntries) {
+    mEntries[i].wavelength = wavelength;
+    mEntries[i].focus = focus;
+  } else if (mNumEntries < MaxEntries) {
+    mEntries[mNumEntries].grating = grating;
+    mEntries[mNumEntries].wavelength = wavelength;
+    mEntries[mNumEntries].focus = focus;
+    mNumEntries++;
+  } else {
+    status = -1;
+  }
+  epicsMutexUnlock(mLock);
+  return status;
+}
+
+/** Finds the focus for a grating and centre wavelength.  Between two stored wavelengths
+  * the focus is interpolated linearly; outside them the nearest entry is used.
+  * \param[out] pFocus Focus mirror position.
+  * \return True if the grating has an entry. */
+bool AndorFocusTable::lookup(int grating, double wavelength, int *pFocus)
+{
+  const Entry *pBelow = NULL, *pAbove = NULL, *pEntry;
+  double fraction;
+
+  epicsMutexLock(mLock);
+  for (int i=0; i<mNumEntries; i++) {
+    pEntry = &mEntries[i];
+    if (pEntry->grating != grating) continue;
+    if ((pEntry->wavelength <= wavelength) && (!pBelow || (pEntry->wavelength > pBelow->wavelength)))
+      pBelow = pEntry;
+    if ((pEntry->wavelength >= wavelength) && (!pAbove || (pEntry->wavelength < pAbove->wavelength)))
+      pAbove = pEntry;
+  }
+  if (pBelow && pAbove && (pAbove->wavelength > pBelow->wavelength)) {
+    fraction = (wavelength - pBelow->wavelength) / (pAbove->wavelength - pBelow->wavelength);
+    *pFocus = (int)floor(pBelow->focus + fraction * (pAbove->focus - pBelow->focus) + 0.5);
+  } else if (pBelow || pAbove) {
+    *pFocus = pBelow ? pBelow->focus : pAbove->focus;
+  }
+  epicsMutexUnlock(mLock);
+  return pBelow || pAbove;
+}
+
+int AndorFocusTable::size()
+{
+  int size;
+
+  epicsMutexLock(mLock);
+  size = mNumEntries;
+  epicsMutexUnlock(mLock);
+  return size;
+}
+
+/** Takes the lock held by both drivers while reading the mirror position and moving it. */
+void AndorFocusTable::lockMirror()
+{
+  epicsMutexLock(mMirrorLock);
+}
+
+void AndorFocusTable::unlockMirror()
+{
+  epicsMutexUnlock(mMirrorLock);
+}
+
+/** Marks an autofocus search of the spectrograph as running or ended. */
+void AndorFocusTable::setSearching(bool searching)
+{
+  epicsMutexLock(mLock);
+  mSearching = searching;
+  epicsMutexUnlock(mLock);
+}
+
+bool AndorFocusTable::searching()
+{
+  bool searching;
+
+  epicsMutexLock(mLock);
+  searching = mSearching;
+  epicsMutexUnlock(mLock);
+  return searching;
+}
+
+/** Replaces all entries with those in a file.  Each line has the grating, the centre
+  * wavelength in nm and the focus mirror position.
+  * \return 0 on success, -1 if the file could not be opened. */
+int AndorFocusTable::read(const char *fileName)
+{
+  FILE *fp = fopen(fileName, "r");
+  char line[256];
+  Entry entry;
+
+  if (!fp) return -1;
+  epicsMutexLock(mLock);
+  mNumEntries = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%d %lf %d", &entry.grating, &entry.wavelength, &entry.focus) != 3) continue;
+    if (mNumEntries < MaxEntries) mEntries[mNumEntries++] = entry;
+  }
+  epicsMutexUnlock(mLock);
+  fclose(fp);
+  return 0;
+}
+
+/** Writes all entries to a file.
+  * \return 0 on success, -1 on error. */
+int AndorFocusTable::write(const char *fileName)
+{
+  FILE *fp = fopen(fileName, "w");
+  int status = 0;
+
+  if (!fp) return -1;
+  fprintf(fp, "# ADAndor focus table: grating, centre wavelength (nm), focus mirror position\n");
+  epicsMutexLock(mLock);
+  for (int i=0; i<mNumEntries; i++) {
+    fprintf(fp, "%d %.3f %d\n", mEntries[i].grating, mEntries[i].wavelength, mEntries[i].focus);
+  }
+  epicsMutexUnlock(mLock);
+  if (ferror(fp)) status = -1;
+  if (fclose(fp)) status = -1;
+  return status;
+}
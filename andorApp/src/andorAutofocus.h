@@ -0,0 +1,100 @@
+/**
+ * Shamrock focus mirror autofocus for the ADAndor driver.
+ *
+ * AndorFocusSearch finds the focus mirror position that gives the sharpest spectra.  It
+ * measures a coarse grid of positions over the search range, then repeatedly searches
+ * around the best position with a smaller step, until the step reaches the minimum.
+ * Positions already measured are not measured again.  The sharpness of a spectrum is its
+ * gradient energy, the sum of the squared differences of neighbouring pixels along x,
+ * divided by the sum of the squared deviations from the mean of each row.  It does not
+ * depend on the intensity, and increases as the lines get narrower.
+ *
+ * AndorFocusTable holds the best focus found for each grating and centre wavelength, so
+ * the focus can be recalled when the grating or wavelength is changed.  There is one
+ * table per spectrograph, shared by the camera driver that finds the focus and the
+ * Shamrock driver that recalls it.  Both drivers move the focus mirror holding the
+ * table's mirror lock, since a move is a relative step from the position read before
+ * it, and the Shamrock driver does not move the mirror while a search is running.
+ */
+
+#ifndef ANDORAUTOFOCUS_H
+#define ANDORAUTOFOCUS_H
+
+#include <stddef.h>
+
+#include <epicsMutex.h>
+
+#include "NDArray.h"
+
+class AndorFocusSearch {
+ public:
+  enum {
+    MaxSamples = 1024,        // Positions measured in one search
+    MaxPassPositions = 256    // Positions in one pass; the step is increased to fit
+  };
+
+  AndorFocusSearch();
+  int start(int low, int high, int coarseStep, int minStep);
+  bool report(double sharpness);
+  int position() const { return mPositions[mIndex]; }
+  bool done() const { return mDone; }
+  int best() const { return mBest; }
+  double bestSharpness() const { return mBestSharpness; }
+  int samples() const { return mNumSamples; }
+  static double sharpness(const NDArray *pArray);
+
+ private:
+  bool measured(int position) const;
+  int plan();
+
+  int mLimitLow;              // Search range
+  int mLimitHigh;
+  int mLow;                   // Range of the current pass
+  int mHigh;
+  int mStep;
+  int mMinStep;
+  int mPositions[MaxPassPositions];
+  int mNumPositions;
+  int mIndex;
+  int mSamples[MaxSamples];
+  int mNumSamples;
+  int mBest;
+  double mBestSharpness;
+  bool mDone;
+};
+
+class AndorFocusTable {
+ public:
+  enum {
+    MaxEntries = 256,
+    MaxDevices = 8
+  };
+
+  static AndorFocusTable *device(int device);
+  int store(int grating, double wavelength, int focus);
+  bool lookup(int grating, double wavelength, int *pFocus);
+  int size();
+  int read(const char *fileName);
+  int write(const char *fileName);
+  void lockMirror();
+  void unlockMirror();
+  void setSearching(bool searching);
+  bool searching();
+
+ private:
+  typedef struct {
+    int grating;
+    double wavelength;        // nm
+    int focus;                // Focus mirror steps
+  } Entry;
+
+  AndorFocusTable();
+
+  epicsMutexId mLock;
+  Entry mEntries[MaxEntries];
+  int mNumEntries;
+  epicsMutexId mMirrorLock;   // Held while the focus mirror moves
+  bool mSearching;            // Protected by mLock
+};
+
+#endif //ANDORAUTOFOCUS_H
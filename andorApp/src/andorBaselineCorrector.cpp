@@ -0,0 +1,168 @@
+/**
+ * Reference column baseline correction for the ADAndor driver.
+ *
+ * The reference pixels are copied out before the frame is modified, so the subtraction
+ * and the removal of the reference columns are done in a single forward pass over each row.
+ * The destination of every pixel is at or before its source, so the pass is safe in place.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "andorBaselineCorrector.h"
+
+static const char *driverName = "andorBaselineCorrector";
+
+AndorBaselineCorrector::AndorBaselineCorrector()
+  : mReference(0), mRowBaseline(0), mMaxReference(0), mMaxRows(0),
+    mBaseline(0.), mTrendCount(0)
+{
+}
+
+AndorBaselineCorrector::~AndorBaselineCorrector()
+{
+  free(mReference);
+  free(mRowBaseline);
+}
+
+/** Discards the baseline trend. */
+void AndorBaselineCorrector::resetTrend()
+{
+  mTrendCount = 0;
+  mBaseline = 0.;
+}
+
+/** Returns the median of n values.  The values are reordered. */
+epicsFloat32 AndorBaselineCorrector::median(epicsFloat32 *pValues, size_t n)
+{
+  if (n <= 16) {
+    // Insertion sort is fastest for the few reference columns of a single row
+    for (size_t i=1; i<n; i++) {
+      epicsFloat32 value = pValues[i];
+      size_t j = i;
+      while ((j > 0) && (pValues[j-1] > value)) {
+        pValues[j] = pValues[j-1];
+        j--;
+      }
+      pValues[j] = value;
+    }
+    if (n & 1) return pValues[n/2];
+    return 0.5f * (pValues[n/2 - 1] + pValues[n/2]);
+  }
+  std::nth_element(pValues, pValues + n/2, pValues + n);
+  epicsFloat32 upper = pValues[n/2];
+  if (n & 1) return upper;
+  epicsFloat32 lower = *std::max_element(pValues, pValues + n/2);
+  return 0.5f * (lower + upper);
+}
+
+template <typename epicsType>
+void AndorBaselineCorrector::gather(const epicsType *pData, size_t sizeX, size_t sizeY,
+                                    size_t refStart, size_t numColumns)
+{
+  epicsFloat32 *pOut = mReference;
+
+  for (size_t y=0; y<sizeY; y++) {
+    const epicsType *pRow = pData + y * sizeX + refStart;
+    for (size_t x=0; x<numColumns; x++) *pOut++ = (epicsFloat32)pRow[x];
+  }
+}
+
+template <typename epicsType>
+void AndorBaselineCorrector::subtract(epicsType *pData, size_t sizeX, size_t sizeY,
+                                      size_t activeStart, size_t activeX, int mode, bool integer)
+{
+  for (size_t y=0; y<sizeY; y++) {
+    const epicsType *pSrc = pData + y * sizeX + activeStart;
+    epicsType *pDst = pData + y * activeX;
+    epicsFloat32 baseline = (mode == ModeRow) ? mRowBaseline[y] : (epicsFloat32)mBaseline;
+    if (integer) {
+      // subtract the rounded baseline and clip at 0
+      epicsType offset = (epicsType)(baseline + 0.5f);
+      if (baseline <= 0) offset = 0;
+      for (size_t x=0; x<activeX; x++) {
+        epicsType value = pSrc[x];
+        pDst[x] = (value > offset) ? value - offset : 0;
+      }
+    } else {
+      for (size_t x=0; x<activeX; x++) pDst[x] = pSrc[x] - (epicsType)baseline;
+    }
+  }
+}
+
+/** Subtracts the baseline measured in the reference columns and removes those columns.
+  * \param[in,out] pArray 2-D UInt16, UInt32 or Float32 frame, or a 1-D spectrum.
+  *                On success dims[0].size is reduced by numColumns.
+  * \param[in] mode ModeFrame or ModeRow.  With ModeOff the array is not changed.
+  * \param[in] numColumns Number of reference columns.
+  * \param[in] side SideLeft if the reference columns are the first columns of each row,
+  *            SideRight if they are the last.
+  * \return 0 on success, -1 if the array type is not supported, the frame has no columns
+  *         besides the reference columns or memory could not be allocated. */
+int AndorBaselineCorrector::process(NDArray *pArray, int mode, int numColumns, int side)
+{
+  size_t sizeX, sizeY, activeX, numReference, refStart, activeStart;
+  double sum;
+  bool integer;
+
+  if (mode == ModeOff) return 0;
+  if ((pArray->dataType != NDUInt16) && (pArray->dataType != NDUInt32) &&
+      (pArray->dataType != NDFloat32)) return -1;
+  if (numColumns < 1) return -1;
+  sizeX = pArray->dims[0].size;
+  sizeY = (pArray->ndims > 1) ? pArray->dims[1].size : 1;
+  if ((size_t)numColumns >= sizeX) return -1;
+  activeX = sizeX - numColumns;
+  numReference = numColumns * sizeY;
+  if (numReference > mMaxReference) {
+    free(mReference);
+    mReference = (epicsFloat32 *)malloc(numReference * sizeof(epicsFloat32));
+    mMaxReference = mReference ? numReference : 0;
+  }
+  if (sizeY > mMaxRows) {
+    free(mRowBaseline);
+    mRowBaseline = (epicsFloat32 *)malloc(sizeY * sizeof(epicsFloat32));
+    mMaxRows = mRowBaseline ? sizeY : 0;
+  }
+  if (!mReference || !mRowBaseline) {
+    printf("%s:process: unable to allocate %lu reference pixels\n", driverName, (unsigned long)numReference);
+    return -1;
+  }
+  integer = (pArray->dataType != NDFloat32);
+  refStart    = (side == SideRight) ? activeX : 0;
+  activeStart = (side == SideRight) ? 0 : numColumns;
+
+  switch (pArray->dataType) {
+    case NDUInt16: gather((epicsUInt16 *)pArray->pData, sizeX, sizeY, refStart, numColumns); break;
+    case NDUInt32: gather((epicsUInt32 *)pArray->pData, sizeX, sizeY, refStart, numColumns); break;
+    default:       gather((epicsFloat32 *)pArray->pData, sizeX, sizeY, refStart, numColumns); break;
+  }
+
+  if (mode == ModeRow) {
+    sum = 0.;
+    for (size_t y=0; y<sizeY; y++) {
+      mRowBaseline[y] = median(mReference + y * numColumns, numColumns);
+      sum += mRowBaseline[y];
+    }
+    mBaseline = sum / sizeY;
+  } else {
+    mBaseline = median(mReference, numReference);
+  }
+
+  switch (pArray->dataType) {
+    case NDUInt16: subtract((epicsUInt16 *)pArray->pData, sizeX, sizeY, activeStart, activeX, mode, integer); break;
+    case NDUInt32: subtract((epicsUInt32 *)pArray->pData, sizeX, sizeY, activeStart, activeX, mode, integer); break;
+    default:       subtract((epicsFloat32 *)pArray->pData, sizeX, sizeY, activeStart, activeX, mode, integer); break;
+  }
+  pArray->dims[0].size = activeX;
+
+  if (mTrendCount == TrendLength) {
+    memmove(mTrend, mTrend + 1, (TrendLength - 1) * sizeof(epicsFloat64));
+    mTrendCount--;
+  }
+  mTrend[mTrendCount++] = mBaseline;
+  return 0;
+}
@@ -0,0 +1,60 @@
+/**
+ * Reference column baseline correction for the ADAndor driver.
+ *
+ * The readout region can include prescan, overscan or masked columns at the left or
+ * right edge of the sensor that see no light.  Their median is the electronic baseline
+ * of the frame (ModeFrame) or of each row (ModeRow).  The baseline is subtracted from
+ * the other columns, and the reference columns are removed from the frame in place.
+ * The baseline of each frame is kept in a trend buffer for diagnostics.
+ */
+
+#ifndef ANDORBASELINECORRECTOR_H
+#define ANDORBASELINECORRECTOR_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#include "NDArray.h"
+
+class AndorBaselineCorrector {
+ public:
+  enum {
+    ModeOff = 0,
+    ModeFrame = 1,
+    ModeRow = 2
+  };
+  enum {
+    SideLeft = 0,
+    SideRight = 1
+  };
+  enum {
+    TrendLength = 1024
+  };
+
+  AndorBaselineCorrector();
+  ~AndorBaselineCorrector();
+  int process(NDArray *pArray, int mode, int numColumns, int side);
+  void resetTrend();
+  double baseline() const { return mBaseline; }
+  const epicsFloat64 *trend() const { return mTrend; }
+  size_t trendCount() const { return mTrendCount; }
+
+ private:
+  template <typename epicsType> void gather(const epicsType *pData, size_t sizeX, size_t sizeY,
+                                            size_t refStart, size_t numColumns);
+  template <typename epicsType> void subtract(epicsType *pData, size_t sizeX, size_t sizeY,
+                                              size_t activeStart, size_t activeX, int mode,
+                                              bool integer);
+  static epicsFloat32 median(epicsFloat32 *pValues, size_t n);
+
+  epicsFloat32 *mReference;    // Reference column pixels, one row after another
+  epicsFloat32 *mRowBaseline;  // Baseline of each row
+  size_t mMaxReference;
+  size_t mMaxRows;
+  double mBaseline;
+  epicsFloat64 mTrend[TrendLength];
+  size_t mTrendCount;
+};
+
+#endif //ANDORBASELINECORRECTOR_H
@@ -13,12 +13,14 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <string>
 #include <errno.h>
 
 #include <epicsTime.h>
 #include <epicsThread.h>
 #include <epicsEvent.h>
+#include <epicsAtomic.h>
 #include <epicsString.h>
 #include <iocsh.h>
 #include <epicsExit.h>
@@ -36,6 +38,13 @@
 
 #include <epicsExport.h>
 #include "andorCCD.h"
+#include "andorTimingTagger.h"
+#include "andorExposureEvents.h"
+#include "andorPipeline.h"
+#include "andorCubeBuilder.h"
+#include "andorMetrics.h"
+#include "andorFlightRecorder.h"
+#include "andorLock.h"
 
 #define DRIVER_VERSION      2
 #define DRIVER_REVISION     9
@@ -43,6 +52,9 @@
 
 static const char *driverName = "andorCCD";
 
+// Milliseconds between publishing processed frames while waiting for the next frame
+static const int pipelinePollMs = 10;
+
 //Definitions of static class data members
 
 const epicsInt32 AndorCCD::AImageFastKinetics = ADImageContinuous+1;
@@ -89,10 +101,50 @@ const epicsInt32 AndorCCD::AFFEDF  = 3;
 const epicsInt32 AndorCCD::AFFRAW  = 4;
 const epicsInt32 AndorCCD::AFFFITS = 5;
 const epicsInt32 AndorCCD::AFFSPE  = 6;
+const epicsInt32 AndorCCD::AFFFrameStore = 7;
+
+const epicsInt32 AndorCCD::AFilterNoAverage = 0;
+const epicsInt32 AndorCCD::AFilterRecursiveAverage = 5;
+const epicsInt32 AndorCCD::AFilterFrameAverage = 6;
+
+const epicsInt32 AndorCCD::ALatencyManual = 0;
+const epicsInt32 AndorCCD::ALatencyLow    = 1;
+const epicsInt32 AndorCCD::ALatencyLowest = 2;
+
+const epicsInt32 AndorCCD::ATimingTimeStamp    = 0;
+const epicsInt32 AndorCCD::ATimingFrameCounter = 1;
+const epicsInt32 AndorCCD::ATimingEvents       = 2;
+const epicsInt32 AndorCCD::ATimingSimulated    = 3;
+
+const epicsInt32 AndorCCD::APPKeyOddOn  = 0;
+const epicsInt32 AndorCCD::APPKeyEvenOn = 1;
+const epicsInt32 AndorCCD::APPKeyGate   = 2;
+
+const epicsInt32 AndorCCD::ADDGStepOff         = 0;
+const epicsInt32 AndorCCD::ADDGStepConstant    = 1;
+const epicsInt32 AndorCCD::ADDGStepExponential = 2;
+const epicsInt32 AndorCCD::ADDGStepLogarithmic = 3;
+const epicsInt32 AndorCCD::ADDGStepLinear      = 4;
+
+const epicsInt32 AndorCCD::AApplySync  = 0;
+const epicsInt32 AndorCCD::AApplyAsync = 1;
+
+const epicsInt32 AndorCCD::ARecoveryOff       = 0;
+const epicsInt32 AndorCCD::ARecoveryRestart   = 1;
+const epicsInt32 AndorCCD::ARecoveryReduceDMA = 2;
+
+const epicsInt32 AndorCCD::AFocusIdle    = 0;
+const epicsInt32 AndorCCD::AFocusBusy    = 1;
+const epicsInt32 AndorCCD::AFocusDone    = 2;
+const epicsInt32 AndorCCD::AFocusFailed  = 3;
+const epicsInt32 AndorCCD::AFocusAborted = 4;
 
 //C Function prototypes to tie in with EPICS
 static void andorStatusTaskC(void *drvPvt);
 static void andorDataTaskC(void *drvPvt);
+static void andorApplyTaskC(void *drvPvt);
+static void andorExposureTaskC(void *drvPvt);
+static void andorFocusTaskC(void *drvPvt);
 static void exitHandler(void *drvPvt);
 
 /** Constructor for Andor driver; most parameters are simply passed to ADDriver::ADDriver.
@@ -116,9 +168,14 @@ AndorCCD::AndorCCD(const char *portName, const char *installPath, int cameraSeri
                    int maxBuffers, size_t maxMemory, int priority, int stackSize)
 
   : ADDriver(portName, 1, 0, maxBuffers, maxMemory, 
-             asynEnumMask, asynEnumMask,
+             asynEnumMask | asynFloat64ArrayMask, asynEnumMask | asynFloat64ArrayMask,
              ASYN_CANBLOCK, 1, priority, stackSize),
-    mExiting(false), mExited(0), mShamrockId(shamrockID), mSPEDoc(0), mInitOK(false)
+    mSetupRequested(0), mSetupApplied(0), mExiting(false), mExited(0), mShamrockId(shamrockID), mSPEDoc(0), mFrameStore(0), mAverager(0), mAverageHardware(0), mBinner(0), mGate(0), mEventFinder(0), mBaseline(0), mCommonMode(0), mPeakTracker(0), mPeakCalibrationWidth(0), mPumpProbe(0), mPlanning(false), mFrameIndexOffset(0), mDDGActive(false), mTimingTagger(0), mExposureEvents(0), mExposuresPerFrame(0), mPipeline(0), mPipeDark(0), mPipeFlat(0), mCubeBuilder(0), mCubeUniqueId(0), mFocusSearch(0), mAFActive(false), mAFSkipUntil(0), mAFFrames(0), mAFSum(0.), mAFTarget(0), mAFFinal(false), mAFMove(0), mDelayModel(0),
+    mDelayNumPixels(0.), mMetrics(0), mFlightRecorder(0),
+    mPresets(0), mNumPresetInts(0), mNumPresetParams(0), mDeferSetup(false), mSetupPending(false),
+    mNumOAModes(0),
+    mPortLock(0), mSDKLock(0), mConfigLock(0),
+    mInitOK(false)
 {
 
   int status = asynSuccess;
@@ -166,7 +223,35 @@ AndorCCD::AndorCCD(const char *portName, const char *installPath, int cameraSeri
   createParam(AndorMaxImagesPerDMAString,         asynParamInt32, &AndorMaxImagesPerDMA);
   createParam(AndorSecondsPerDMAString,           asynParamFloat64, &AndorSecondsPerDMA);
   createParam(AndorIsolatedCropModeString,        asynParamInt32, &AndorIsolatedCropMode);
-
+  createParam(AndorNumberPrescansString,          asynParamInt32, &AndorNumberPrescans);
+  createParam(AndorBaselineOffsetString,          asynParamInt32, &AndorBaselineOffset);
+  createParam(AndorApplyModeString,               asynParamInt32, &AndorApplyMode);
+  createParam(AndorConfigBusyString,              asynParamInt32, &AndorConfigBusy);
+  createParam(AndorConfigRequestedString,         asynParamInt32, &AndorConfigRequested);
+  createParam(AndorConfigAppliedString,           asynParamInt32, &AndorConfigApplied);
+  createParam(AndorRecoveryModeString,            asynParamInt32, &AndorRecoveryMode);
+  createParam(AndorRecoveryMaxString,             asynParamInt32, &AndorRecoveryMax);
+  createParam(AndorRecoveryCountString,           asynParamInt32, &AndorRecoveryCount);
+  createParam(AndorRecoveryGapString,             asynParamFloat64, &AndorRecoveryGap);
+  createParam(AndorRecoveryFramesLostString,      asynParamInt32, &AndorRecoveryFramesLost);
+  createParam(AndorSingleTrackCentreString,       asynParamInt32, &AndorSingleTrackCentre);
+  createParam(AndorSingleTrackHeightString,       asynParamInt32, &AndorSingleTrackHeight);
+
+  mPortLock = new AndorLock("port", false);
+  mSDKLock = new AndorLock("sdk");
+  mConfigLock = new AndorLock("config");
+
+  // Each feature creates its parameters and objects.  The presets list parameters of the
+  // other features, so they come last.
+  status |= initFrameStore();
+  status |= initProcessing();
+  status |= initTiming();
+  status |= initDDG();
+  status |= initPipeline();
+  status |= initCube();
+  status |= initAutofocus();
+  status |= initDiagnostics();
+  status |= initPresets();
 
   // Create the epicsEvent for signaling to the status task when parameters should have changed.
   // This will cause it to do a poll immediately, rather than wait for the poll time period.
@@ -183,6 +268,15 @@ AndorCCD::AndorCCD(const char *portName, const char *installPath, int cameraSeri
     return;
   }
 
+  // Use this to signal the apply task that there are configuration changes to apply.
+  this->applyEvent = epicsEventMustCreate(epicsEventEmpty);
+
+  // Use this to signal the exposure event task that an acquisition with exposure events has started.
+  this->exposureEvent = epicsEventMustCreate(epicsEventEmpty);
+
+  // Use this to signal the focus task that the autofocus needs the focus mirror moved.
+  this->focusEvent = epicsEventMustCreate(epicsEventEmpty);
+
   // Initialize ADC enums
   for (i=0; i<MAX_ADC_SPEEDS; i++) {
     mADCSpeeds[i].EnumValue = i;
@@ -278,7 +372,7 @@ AndorCCD::AndorCCD(const char *portName, const char *installPath, int cameraSeri
   
 
   /* Set some default values for parameters */
-  status =  setStringParam(ADManufacturer, "Andor");
+  status |= setStringParam(ADManufacturer, "Andor");
   status |= setStringParam(ADModel, model);
   epicsSnprintf(tempString, sizeof(tempString), "%u", serialNumber);
   status |= setStringParam(ADSerialNumber, tempString);
@@ -299,6 +393,7 @@ AndorCCD::AndorCCD(const char *portName, const char *installPath, int cameraSeri
   status |= setIntegerParam(ADImageMode, ADImageSingle);
   status |= setIntegerParam(ADTriggerMode, AndorCCD::ATInternal);
   mAcquireTime = 1.0;
+  mAcquireTimeActual = mAcquireTime;
   status |= setDoubleParam (ADAcquireTime, mAcquireTime);
   mAcquirePeriod = 5.0;
   status |= setDoubleParam (ADAcquirePeriod, mAcquirePeriod);
@@ -306,6 +401,8 @@ AndorCCD::AndorCCD(const char *portName, const char *installPath, int cameraSeri
   status |= setIntegerParam(ADNumExposures, 1);
   status |= setIntegerParam(NDArraySizeX, sizeX);
   status |= setIntegerParam(NDArraySizeY, sizeY);
+  mReadoutConfig.sizeX = sizeX;
+  mReadoutConfig.sizeY = sizeY;
   status |= setIntegerParam(NDDataType, NDUInt16);
   status |= setIntegerParam(NDArraySize, sizeX*sizeY*sizeof(epicsUInt16)); 
   mAccumulatePeriod = 2.0;
@@ -325,10 +422,26 @@ AndorCCD::AndorCCD(const char *portName, const char *installPath, int cameraSeri
   status |= setIntegerParam(AndorMaxImagesPerDMA, 0);
   status |= setDoubleParam(AndorSecondsPerDMA, 0.03);
   status |= setIntegerParam(AndorIsolatedCropMode, 0);
+  status |= setIntegerParam(AndorNumberPrescans, 0);
+  status |= setIntegerParam(AndorBaselineOffset, 0);
+  status |= setIntegerParam(AndorApplyMode, AApplySync);
+  status |= setIntegerParam(AndorConfigBusy, 0);
+  status |= setIntegerParam(AndorConfigRequested, 0);
+  status |= setIntegerParam(AndorConfigApplied, 0);
+  status |= setIntegerParam(AndorRecoveryMode, ARecoveryOff);
+  status |= setIntegerParam(AndorRecoveryMax, 10);
+  status |= setIntegerParam(AndorRecoveryCount, 0);
+  status |= setDoubleParam(AndorRecoveryGap, 0.0);
+  status |= setIntegerParam(AndorRecoveryFramesLost, 0);
+  status |= setIntegerParam(AndorExposureEventAvail,
+    (mCapabilities.ulFeatures & (AC_FEATURES_STARTOFEXPOSURE_EVENT | AC_FEATURES_ENDOFEXPOSURE_EVENT)) ? 1 : 0);
+  status |= setIntegerParam(AndorSingleTrackCentre, sizeY/2);
+  status |= setIntegerParam(AndorSingleTrackHeight, 1);
 
   setupADCSpeeds();
   setupPreAmpGains();
   setupVerticalShiftPeriods();
+  setupOptAcquire();
   status |= setIntegerParam(AndorVerticalShiftPeriod, mVSIndex);
   status |= setIntegerParam(AndorVerticalShiftAmplitude, 0);
   status |= setupShutter(-1);
@@ -339,6 +452,7 @@ AndorCCD::AndorCCD(const char *portName, const char *installPath, int cameraSeri
   float keepCleanTime;
   checkStatus(GetKeepCleanTime(&keepCleanTime));
   status |= setDoubleParam(AndorKeepCleanTime, keepCleanTime);
+  updateReadoutConfig();
 
   callParamCallbacks();
 
@@ -355,6 +469,8 @@ AndorCCD::AndorCCD(const char *portName, const char *installPath, int cameraSeri
   mFastPollingPeriod = 0.05; // seconds
   // Define the polling period for the data task temperature reading
   mTempPollingPeriod = 0.5; // seconds
+  // Time without new changes the apply task waits for before applying them
+  mApplySettleTime = 0.02; // seconds
 
   mAcquiringData = 0;
   
@@ -386,6 +502,42 @@ AndorCCD::AndorCCD(const char *portName, const char *installPath, int cameraSeri
            driverName, functionName);
     return;
   }
+
+  /* Create the thread that applies configuration changes in asynchronous apply mode */
+  status = (epicsThreadCreate("AndorApplyTask",
+                              epicsThreadPriorityMedium,
+                              stackSize,
+                              (EPICSTHREADFUNC)andorApplyTaskC,
+                              this) == NULL);
+  if (status) {
+    printf("%s:%s: epicsThreadCreate failure for apply task\n",
+           driverName, functionName);
+    return;
+  }
+
+  /* Create the thread that time stamps the start and end of exposures */
+  status = (epicsThreadCreate("AndorExposureTask",
+                              epicsThreadPriorityHigh,
+                              stackSize,
+                              (EPICSTHREADFUNC)andorExposureTaskC,
+                              this) == NULL);
+  if (status) {
+    printf("%s:%s: epicsThreadCreate failure for exposure event task\n",
+           driverName, functionName);
+    return;
+  }
+
+  /* Create the thread that moves the focus mirror for the autofocus */
+  status = (epicsThreadCreate("AndorFocusTask",
+                              epicsThreadPriorityMedium,
+                              stackSize,
+                              (EPICSTHREADFUNC)andorFocusTaskC,
+                              this) == NULL);
+  if (status) {
+    printf("%s:%s: epicsThreadCreate failure for focus task\n",
+           driverName, functionName);
+    return;
+  }
   printf("CCD initialized OK!\n");
   mInitOK = true;
 }
@@ -396,10 +548,11 @@ AndorCCD::AndorCCD(const char *portName, const char *installPath, int cameraSeri
 AndorCCD::~AndorCCD() 
 {
   static const char *functionName = "~AndorCCD";
-  asynStatus status;
+  asynStatus status = asynSuccess;
 
   mExiting = true;
   this->lock();
+  mSDKLock->lock();
   printf("%s::%s Shutdown and freeing up memory...\n", driverName, functionName);
   try {
     int acquireStatus;
@@ -407,6 +560,12 @@ AndorCCD::~AndorCCD()
     if (acquireStatus == DRV_ACQUIRING)
       checkStatus(AbortAcquisition());
     epicsEventSignal(dataEvent);
+    epicsEventSignal(applyEvent);
+    epicsEventSignal(exposureEvent);
+    epicsEventSignal(focusEvent);
+    closeFrameStore();
+    mTimingTagger->stopSimulation();
+    mMetrics->stop();
     checkStatus(FreeInternalMemory());
     checkStatus(ShutDown());
   } catch (const std::string &e) {
@@ -415,8 +574,9 @@ AndorCCD::~AndorCCD()
       driverName, functionName, e.c_str());
       status = asynError;
   }
+  mSDKLock->unlock();
   this->unlock();
-  while ((mExited < 2) && (status != asynError))
+  while ((epicsAtomicGetIntT(&mExited) < 5) && (status != asynError))
       epicsThreadSleep(0.2);
 }
 
@@ -444,6 +604,7 @@ void AndorCCD::setupPreAmpGains()
   int enumValues[MAX_PREAMP_GAINS];
   int enumSeverities[MAX_PREAMP_GAINS];
   static const char *functionName = "setupPreAmpGains";
+  AndorLock::Guard sdkGuard(mSDKLock);
   
   mNumPreAmpGains = 0;
   getIntegerParam(AndorAdcSpeed, &adcSpeed);
@@ -505,6 +666,15 @@ asynStatus AndorCCD::readEnum(asynUser *pasynUser, char *strings[], int values[]
       severities[i] = 0;
     }
   }
+  else if (function == AndorOAMode) {
+    for (i=0; ((i<mNumOAModes) && (i<(int)nElements)); i++) {
+      if (strings[i]) free(strings[i]);
+      strings[i] = epicsStrDup(mOAModeNames[i]);
+      if (strlen(strings[i]) >= MAX_ENUM_STRING_SIZE) strings[i][MAX_ENUM_STRING_SIZE-1] = 0;
+      values[i] = i;
+      severities[i] = 0;
+    }
+  }
   else {
     *nIn = 0;
     return asynError;
@@ -565,6 +735,25 @@ void AndorCCD::setupVerticalShiftPeriods()
 }
 
 
+/** Lock the port, timing the wait and the hold in mPortLock. */
+asynStatus AndorCCD::lock()
+{
+  epicsTimeStamp requested;
+  asynStatus status;
+
+  epicsTimeGetCurrent(&requested);
+  status = ADDriver::lock();
+  if (mPortLock) mPortLock->acquired(&requested);
+  return status;
+}
+
+asynStatus AndorCCD::unlock()
+{
+  if (mPortLock) mPortLock->releasing();
+  return ADDriver::unlock();
+}
+
+
 /** Report status of the driver.
   * Prints details about the detector in us if details>0.
   * It then calls the ADDriver::report() method.
@@ -590,6 +779,7 @@ void AndorCCD::report(FILE *fp, int details)
 
   fprintf(fp, "Andor CCD port=%s\n", this->portName);
   if (details > 0) {
+    AndorLock::Guard sdkGuard(mSDKLock);
     try {
       checkStatus(GetHeadModel(sParam));
       fprintf(fp, "  Model: %s\n", sParam);
@@ -675,19 +865,47 @@ asynStatus AndorCCD::writeInt32(asynUser *pasynUser, epicsInt32 value)
     asynStatus status = asynSuccess;
     static const char *functionName = "writeInt32";
 
+    mFlightRecorder->record(AndorFlightRecorder::EventParamChange, function, value);
+
     // Set in param lib so the user sees a readback straight away. Save a backup in case of errors.
     getIntegerParam(function, &oldValue);
     status = setIntegerParam(function, value);
 
     if (function == ADAcquire) {
+      // applySetup takes the config lock, which comes before the SDK lock
+      AndorLock::Guard configGuard(mConfigLock);
+      AndorLock::Guard sdkGuard(mSDKLock);
       getIntegerParam(ADStatus, &adstatus);
-      if (value && (adstatus == ADStatusIdle)) {
+      if (value && (adstatus == ADStatusIdle) && mPlanning) {
+        // planCapacity releases the port lock for its write test, and plans for an idle camera
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+          "%s:%s: cannot start an acquisition while a run is being planned\n",
+          driverName, functionName);
+        setIntegerParam(ADAcquire, 0);
+        status = asynError;
+      }
+      else if (value && (adstatus == ADStatusIdle)) {
         // Start the acqusition here, then send an event to the dataTask at the end of this function
         try {
           // Set up acquisition
           mAcquiringData = 1;
-          status = setupAcquisition();
+          status = applySetup();
           if (status != asynSuccess) throw std::string("Setup acquisition failed");
+          // Open the frame store if we are saving to it
+          int autoSave, fileFormat;
+          getIntegerParam(NDAutoSave, &autoSave);
+          getIntegerParam(NDFileFormat, &fileFormat);
+          if (autoSave && (fileFormat == AFFFrameStore)) {
+            if (openFrameStore() != asynSuccess) throw std::string("Unable to open frame store");
+          }
+          // Each acquisition starts with fresh processing, timing, pipeline and cube state
+          setIntegerParam(AndorRecoveryCount, 0);
+          setIntegerParam(AndorRecoveryFramesLost, 0);
+          mFrameIndexOffset = 0;
+          startProcessing();
+          startTiming();
+          setupPipeline();
+          startCube();
           // Open the shutter if we control it
           int adShutterMode;
           getIntegerParam(ADShutterMode, &adShutterMode);
@@ -745,12 +963,19 @@ asynStatus AndorCCD::writeInt32(asynUser *pasynUser, epicsInt32 value)
              (function == AndorKeepClean)   || (function == AndorFastExtTrigger)    ||
              (function == AndorVerticalShiftPeriod) || (function == AndorVerticalShiftAmplitude) ||
              (function == AndorMaxImagesPerDMA) || (function == AndorIsolatedCropMode) ||
-             (function == AndorHighCapacity) || (function == AndorBaselineClamp)) {
-      status = setupAcquisition();
+             (function == AndorHighCapacity) || (function == AndorBaselineClamp)     ||
+             (function == AndorNumberPrescans) || (function == AndorBaselineOffset)   ||
+             (function == AndorSingleTrackCentre) || (function == AndorSingleTrackHeight)) {
+      status = requestSetup();
       if (function == AndorAdcSpeed) setupPreAmpGains();
       if (status != asynSuccess) setIntegerParam(function, oldValue);
     }
+    else if (function == AndorApplyMode) {
+      // Changes still waiting for the apply task are applied when leaving asynchronous mode
+      if ((value != AApplyAsync) && (mSetupApplied != mSetupRequested)) status = applySetup();
+    }
     else if (function == AndorCoolerParam) {
+      AndorLock::Guard sdkGuard(mSDKLock);
       try {
         if (value == 0) {
           asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
@@ -778,10 +1003,22 @@ asynStatus AndorCCD::writeInt32(asynUser *pasynUser, epicsInt32 value)
              (function == AndorShutterExTTL)) {
       status = setupShutter(-1);
     }
+    else if (writeProcessingInt32(function, value, oldValue, &status)  ||
+             writeTimingInt32(function, value, oldValue, &status)      ||
+             writeDDGInt32(function, value, oldValue, &status)         ||
+             writePipelineInt32(function, value, oldValue, &status)    ||
+             writeAutofocusInt32(function, value, oldValue, &status)   ||
+             writePresetsInt32(function, value, oldValue, &status)     ||
+             writeDiagnosticsInt32(function, value, oldValue, &status)) {
+      // Handled by one of the feature modules
+    }
     else {
       status = ADDriver::writeInt32(pasynUser, value);
     }
 
+    // The readout uses a copy of the parameters it needs
+    updateReadoutConfig();
+
     /* Do callbacks so higher layers see any changes */
     callParamCallbacks();
 
@@ -832,20 +1069,21 @@ asynStatus AndorCCD::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
 
     if (function == ADAcquireTime) {
       mAcquireTime = (float)value;  
-      status = setupAcquisition();
+      status = requestSetup();
     }
     else if (function == ADAcquirePeriod) {
       mAcquirePeriod = (float)value;  
-      status = setupAcquisition();
+      status = requestSetup();
     }
     else if (function == AndorAccumulatePeriod) {
       mAccumulatePeriod = (float)value;  
-      status = setupAcquisition();
+      status = requestSetup();
     }
     else if (function == ADTemperature) {
       asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
         "%s:%s:, Setting temperature value %f\n", 
         driverName, functionName, value);
+      AndorLock::Guard sdkGuard(mSDKLock);
       try {
         /* Check requested temperature is within our range */
         checkStatus(GetTemperatureRange(&minTemp, &maxTemp));
@@ -878,7 +1116,11 @@ asynStatus AndorCCD::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
       status = setupShutter(-1);
     }
     else if (function == AndorSecondsPerDMA) {
-      status = setupAcquisition();
+      status = requestSetup();
+    }
+    else if (writeTimingFloat64(function, value, &status) ||
+             writeDDGFloat64(function, value, &status)) {
+      // Handled by one of the feature modules
     }
     else {
       status = ADDriver::writeFloat64(pasynUser, value);
@@ -901,6 +1143,27 @@ asynStatus AndorCCD::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
     return status;
 }
 
+/** Called when asyn clients call pasynOctet->write().
+  * Passes the string parameters of the feature modules to them, and other parameters to ADDriver.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Address of the string to write.
+  * \param[in] nChars Number of characters to write.
+  * \param[out] nActual Number of characters actually written. */
+asynStatus AndorCCD::writeOctet(asynUser *pasynUser, const char *value, size_t nChars,
+                                size_t *nActual)
+{
+    int function = pasynUser->reason;
+    asynStatus status = asynSuccess;
+
+    if (writeProcessingOctet(function, value, nChars, nActual, &status) ||
+        writeAutofocusOctet(function, value, nChars, nActual, &status)  ||
+        writePresetsOctet(function, value, nChars, nActual, &status)) {
+      callParamCallbacks();
+      return status;
+    }
+    return ADDriver::writeOctet(pasynUser, value, nChars, nActual);
+}
+
 /** Controls shutter
  * @param[in] command 0=close, 1=open, -1=no change, only set other parameters */
 asynStatus AndorCCD::setupShutter(int command)
@@ -921,6 +1184,7 @@ asynStatus AndorCCD::setupShutter(int command)
   }
 
   /* We are using internal shutter mode */
+  AndorLock::Guard sdkGuard(mSDKLock);
   getDoubleParam(ADShutterOpenDelay, &dTemp);
   // Convert to ms
   openTime = (int)(dTemp * 1000.);
@@ -976,6 +1240,13 @@ asynStatus AndorCCD::setupShutter(int command)
 unsigned int AndorCCD::checkStatus(unsigned int returnStatus)
 {
   char message[256];
+  if (mMetrics) {
+    mMetrics->increment(MetricSDKCalls);
+    if (returnStatus != DRV_SUCCESS) mMetrics->increment(MetricSDKErrors);
+  }
+  if (mFlightRecorder && (returnStatus != DRV_SUCCESS)) {
+    mFlightRecorder->record(AndorFlightRecorder::EventSDKError, returnStatus);
+  }
   if (returnStatus == DRV_SUCCESS) {
     return 0;
   } else if (returnStatus == DRV_NOT_INITIALIZED) {
@@ -1068,9 +1339,14 @@ void AndorCCD::statusTask(void)
   int value = 0;
   float temperature;
   unsigned int uvalue = 0;
+  unsigned int lastStatus = ASIdle;
+  int autoDump;
   unsigned int status = 0;
   double timeout = 0.0;
   unsigned int forcedFastPolls = 0;
+  bool readTemperature;
+  unsigned int coolerStatus = DRV_SUCCESS, temperatureStatus = DRV_SUCCESS, cameraStatus;
+  int cooler = 0;
   static const char *functionName = "statusTask";
 
   printf("%s:%s: Status thread started...\n", driverName, functionName);
@@ -1103,22 +1379,39 @@ void AndorCCD::statusTask(void)
     }
 
     if (mExiting) break;
-    this->lock();
 
+    // Poll the camera holding only the SDK lock, then publish the results
+    mSDKLock->lock();
+    // Only read these if we are not acquiring data
+    readTemperature = !mAcquiringData;
+    if (readTemperature) {
+      coolerStatus = IsCoolerOn(&cooler);
+      temperatureStatus = GetTemperatureF(&temperature);
+    }
+    // Read detector status (idle, acquiring, error, etc.)
+    cameraStatus = GetStatus(&value);
+    mSDKLock->unlock();
+
+    this->lock();
     try {
-      // Only read these if we are not acquiring data
-      if (!mAcquiringData) {
-        // Read cooler status
-        checkStatus(IsCoolerOn(&value));
-        status = setIntegerParam(AndorCoolerParam, value);
-        // Read temperature of CCD
-        checkStatus(GetTemperatureF(&temperature));
+      if (readTemperature) {
+        checkStatus(coolerStatus);
+        status = setIntegerParam(AndorCoolerParam, cooler);
+        checkStatus(temperatureStatus);
         status = setDoubleParam(ADTemperatureActual, temperature);
       }
-
-      // Read detector status (idle, acquiring, error, etc.)
-      checkStatus(GetStatus(&value));
+      checkStatus(cameraStatus);
       uvalue = static_cast<unsigned int>(value);
+      if (uvalue != lastStatus) {
+        mFlightRecorder->record(AndorFlightRecorder::EventStatus, value);
+        // Keep a record of what the data path was doing before the fault
+        if ((uvalue == ASAcqBuffer) || (uvalue == ASSpoolError)) {
+          mFlightRecorder->record(AndorFlightRecorder::EventFault, value);
+          getIntegerParam(AndorFlightAutoDump, &autoDump);
+          if (autoDump) dumpFlightRecorder(value);
+        }
+        lastStatus = uvalue;
+      }
       if (uvalue == ASIdle) {
         setIntegerParam(ADStatus, ADStatusIdle);
         setStringParam(ADStatusMessage, "IDLE. Waiting on instructions.");
@@ -1144,6 +1437,7 @@ void AndorCCD::statusTask(void)
         setIntegerParam(ADStatus, ADStatusError);
         setStringParam(ADStatusMessage, "Overflow of the spool buffer.");
       }
+      updateMetrics();
     } catch (const std::string &e) {
       asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
         "%s:%s: %s\n",
@@ -1160,7 +1454,7 @@ void AndorCCD::statusTask(void)
       "%s:%s: Status thread exiting ...\n",
       driverName, functionName);
 
-  mExited++;
+  epicsAtomicIncrIntT(&mExited);
 }
 
 /** Set up acquisition parameters */
@@ -1192,11 +1486,27 @@ asynStatus AndorCCD::setupAcquisition()
   int isolatedCropMode;
   int highCapacity;
   int baselineClamp;
+  int numberPrescans;
+  int baselineOffset;
+  int triggerLatencyMode;
+  int delayCalibrate;
+  int trackCentre = 1, trackHeight = 1, trackHalf;
+  unsigned int hBinStatus;
+  bool externalTrigger, frameTransferTrigger, keepCleansActive;
+  double rowShiftTime, triggerLatency;
   static const char *functionName = "setupAcquisition";
   
   if (!mInitOK) {
     return asynDisabled;
   }
+  // While a preset is applied the camera is set up once, after all parameters are written
+  if (mDeferSetup) {
+    mSetupPending = true;
+    return asynSuccess;
+  }
+  AndorLock::Guard configGuard(mConfigLock);
+  AndorLock::Guard sdkGuard(mSDKLock);
+  mFlightRecorder->record(AndorFlightRecorder::EventSetupStart);
 
   // Get current readout mode
   getIntegerParam(AndorReadOutMode, &readOutMode);
@@ -1253,6 +1563,27 @@ asynStatus AndorCCD::setupAcquisition()
     sizeY = maxSizeY;
     binY = maxSizeY;
   }
+  else if (readOutMode == ARSingleTrack) {
+    // The track is binned into one row.  As in FVB, ADBinY, ADMinY and ADSizeY are preserved.
+    getIntegerParam(AndorSingleTrackCentre, &trackCentre);
+    getIntegerParam(AndorSingleTrackHeight, &trackHeight);
+    if (trackHeight < 1) trackHeight = 1;
+    if (trackHeight > maxSizeY) trackHeight = maxSizeY;
+    // The SDK centres the track on trackCentre, counting rows from 1
+    trackHalf = trackHeight / 2;
+    if (trackCentre - trackHalf < 1) trackCentre = trackHalf + 1;
+    if (trackCentre + (trackHeight - 1 - trackHalf) > maxSizeY) trackCentre = maxSizeY - (trackHeight - 1 - trackHalf);
+    setIntegerParam(AndorSingleTrackCentre, trackCentre);
+    setIntegerParam(AndorSingleTrackHeight, trackHeight);
+    minY = trackCentre - 1 - trackHalf;
+    sizeY = trackHeight;
+    binY = trackHeight;
+  }
+  if ((readOutMode == ARFullVerticalBinning) || (readOutMode == ARSingleTrack)) {
+    // Whole rows are read, ADBinX is the horizontal binning.  ADMinX and ADSizeX are preserved.
+    minX = 0;
+    sizeX = maxSizeX;
+  }
   if (minX > (maxSizeX - binX)) {
     minX = maxSizeX - binX;
     setIntegerParam(ADMinX, minX);
@@ -1282,9 +1613,12 @@ asynStatus AndorCCD::setupAcquisition()
   getIntegerParam(AndorPreAmpGain, &preAmpGain);
   
   // Unfortunately there does not seem to be a way to query the Andor SDK 
-  // for the actual size of the image, so we must compute it.
+  // for the actual size of the image, so we must compute it.  NDArraySizeX and Y are
+  // later set to the size of the processed frames, so the readout keeps its own copy.
   setIntegerParam(NDArraySizeX, sizeX/binX);
   setIntegerParam(NDArraySizeY, sizeY/binY);
+  mReadoutConfig.sizeX = sizeX/binX;
+  mReadoutConfig.sizeY = sizeY/binY;
 
   getIntegerParam(AndorFrameTransferMode, &frameTransferMode);
 
@@ -1302,12 +1636,63 @@ asynStatus AndorCCD::setupAcquisition()
 
   getIntegerParam(AndorBaselineClamp, &baselineClamp);
 
+  getIntegerParam(AndorNumberPrescans, &numberPrescans);
+
+  getIntegerParam(AndorBaselineOffset, &baselineOffset);
+
+  // Configure fast external trigger, keep cleans and frame transfer together to minimize
+  // the time from an external trigger to the start of the exposure
+  getIntegerParam(AndorDelayCalibrate, &delayCalibrate);
+
+  getIntegerParam(AndorTriggerLatencyMode, &triggerLatencyMode);
+  externalTrigger = (triggerMode == (int)ATExternal)         || (triggerMode == (int)ATExternalStart) ||
+                    (triggerMode == (int)ATExternalExposure) || (triggerMode == (int)ATExternalFVB);
+  // The values required by the latency mode are only sent to the SDK; the parameters keep
+  // the user's settings, which apply again when the mode is Manual or the trigger internal.
+  if (externalTrigger && (triggerLatencyMode != ALatencyManual)) {
+    // Fast external trigger lets a trigger interrupt a keep clean cycle
+    fastExtTrigger = 1;
+    if (triggerLatencyMode == ALatencyLowest) {
+      // No keep cleans at all, at the cost of charge building up between acquisitions
+      keepClean = 0;
+      // In frame transfer mode the trigger ends one exposure and starts the next,
+      // so there are no keep cleans between frames
+      if ((mCapabilities.ulAcqModes & AC_ACQMODE_FRAMETRANSFER) && (triggerMode == (int)ATExternal) &&
+          ((imageMode == ADImageMultiple) || (imageMode == ADImageContinuous))) {
+        frameTransferMode = 1;
+      }
+    }
+  }
+
   try {
     asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
       "%s:%s:, SetReadMode(%d)\n",
       driverName, functionName, readOutMode);
     checkStatus(SetReadMode(readOutMode));
 
+    // Horizontal binning of FVB and Single Track.  Cameras without it accept no binning.
+    if (readOutMode == ARFullVerticalBinning) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+        "%s:%s:, SetFVBHBin(%d)\n",
+        driverName, functionName, binX);
+      hBinStatus = SetFVBHBin(binX);
+      if (binX > 1) checkStatus(hBinStatus);
+    }
+    else if (readOutMode == ARSingleTrack) {
+      if (!(mCapabilities.ulReadModes & AC_READMODE_SINGLETRACK)) {
+        throw std::string("Single Track readout is not supported by this camera");
+      }
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+        "%s:%s:, SetSingleTrack(%d, %d)\n",
+        driverName, functionName, trackCentre, trackHeight);
+      checkStatus(SetSingleTrack(trackCentre, trackHeight));
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+        "%s:%s:, SetSingleTrackHBin(%d)\n",
+        driverName, functionName, binX);
+      hBinStatus = SetSingleTrackHBin(binX);
+      if (binX > 1) checkStatus(hBinStatus);
+    }
+
     asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
       "%s:%s:, SetTriggerMode(%d)\n", 
       driverName, functionName, triggerMode);
@@ -1330,6 +1715,21 @@ asynStatus AndorCCD::setupAcquisition()
       checkStatus(EnableKeepCleans(keepClean));
     }
 
+    // Frame time stamps are needed to measure the time stamp delay
+    if (mCapabilities.ulFeatures & AC_FEATURES_METADATA) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                "%s:%s:, SetMetaData(%d)\n",
+                driverName, functionName, delayCalibrate);
+      checkStatus(SetMetaData(delayCalibrate));
+    }
+
+    if (mCapabilities.ulFeatures & AC_FEATURES_KEEPCLEANCONTROL) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                "%s:%s:, SetKeepCleanMode(%d)\n",
+                driverName, functionName, keepClean);
+      checkStatus(SetKeepCleanMode(keepClean));
+    }
+
     asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
       "%s:%s:, SetADChannel(%d)\n", 
       driverName, functionName, pSpeed->ADCIndex);
@@ -1347,6 +1747,13 @@ asynStatus AndorCCD::setupAcquisition()
       checkStatus(SetBaselineClamp(baselineClamp));
     }
 
+    if (mCapabilities.ulSetFunctions & AC_SETFUNCTION_BASELINEOFFSET) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+          "%s:%s:, SetBaselineOffset(%d)\n",
+          driverName, functionName, baselineOffset);
+      checkStatus(SetBaselineOffset(baselineOffset));
+    }
+
     if (mCapabilities.ulSetFunctions & AC_SETFUNCTION_HIGHCAPACITY) {
       asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
           "%s:%s:, SetHighCapacity(%d)\n",
@@ -1427,6 +1834,8 @@ asynStatus AndorCCD::setupAcquisition()
         driverName, functionName, verticalShiftAmplitude);
     checkStatus(SetVSAmplitude(verticalShiftAmplitude));
 
+    setupDDG();
+
     switch (imageMode) {
       case ADImageSingle:
         if (numExposures == 1) {
@@ -1471,6 +1880,13 @@ asynStatus AndorCCD::setupAcquisition()
           "%s:%s:, SetKineticCycleTime(%f)\n", 
           driverName, functionName, mAcquirePeriod);
         checkStatus(SetKineticCycleTime(mAcquirePeriod));
+        // Prescans are only supported in kinetic series mode
+        if (mCapabilities.ulSetFunctions & AC_SETFUNCTION_PRESCANS) {
+          asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+            "%s:%s:, SetNumberPrescans(%d)\n",
+            driverName, functionName, numberPrescans);
+          checkStatus(SetNumberPrescans(numberPrescans));
+        }
         break;
 
       case ADImageContinuous:
@@ -1500,6 +1916,8 @@ asynStatus AndorCCD::setupAcquisition()
         checkStatus(SetFastKineticsEx(sizeY, numImages, mAcquireTime, FKmode, binX, binY, FKOffset));
         setIntegerParam(NDArraySizeX, maxSizeX/binX);
         setIntegerParam(NDArraySizeY, sizeY/binY);
+        mReadoutConfig.sizeX = maxSizeX/binX;
+        mReadoutConfig.sizeY = sizeY/binY;
         break;
     }
     // Read the actual times
@@ -1511,6 +1929,7 @@ asynStatus AndorCCD::setupAcquisition()
         "%s:%s:, GetAcquisitionTimings(exposure=%f, accumulate=%f, kinetic=%f)\n",
         driverName, functionName, acquireTimeAct, accumulatePeriodAct, acquirePeriodAct);
     }
+    mAcquireTimeActual = acquireTimeAct;
     setDoubleParam(ADAcquireTime, acquireTimeAct);
     setDoubleParam(ADAcquirePeriod, acquirePeriodAct);
     setDoubleParam(AndorAccumulatePeriod, accumulatePeriodAct);
@@ -1527,6 +1946,35 @@ asynStatus AndorCCD::setupAcquisition()
               driverName, functionName, keepCleanTime);
     setDoubleParam(AndorKeepCleanTime, keepCleanTime);
 
+    // Worst case time from an external trigger to the start of the exposure.  A keep clean
+    // cycle in progress delays the trigger unless fast external trigger is on, in which
+    // case the cycle is interrupted after the current row shift.
+    triggerLatency = 0.;
+    if (externalTrigger) {
+      rowShiftTime = 0.;
+      if ((verticalShiftPeriod >= 0) && (verticalShiftPeriod < mNumVSPeriods))
+        rowShiftTime = mVSPeriods[verticalShiftPeriod].Period * 1e-6;
+      frameTransferTrigger = frameTransferMode && (triggerMode == (int)ATExternal);
+      keepCleansActive = keepClean ||
+        !((mCapabilities.ulFeatures & AC_FEATURES_KEEPCLEANCONTROL) ||
+          ((readOutMode == ARFullVerticalBinning) && (triggerMode == (int)ATExternal)));
+      if (keepCleansActive && !fastExtTrigger && !frameTransferTrigger)
+        triggerLatency = keepCleanTime;
+      else
+        triggerLatency = rowShiftTime;
+    }
+    setDoubleParam(AndorTriggerLatency, triggerLatency);
+
+    // Readout configuration for the time stamp delay model
+    mDelayKey[0] = readOutMode;
+    mDelayKey[1] = adcSpeed;
+    mDelayKey[2] = preAmpGain;
+    mDelayKey[3] = verticalShiftPeriod;
+    mDelayKey[4] = sizeX/binX;
+    mDelayKey[5] = sizeY/binY;
+    mDelayNumPixels = (double)(sizeX/binX) * (sizeY/binY);
+    updateDelayStatus();
+
     // Set the DMA parameters
     checkStatus(SetDMAParameters(maxImagesPerDMA, secondsPerDMA));
     asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
@@ -1534,15 +1982,100 @@ asynStatus AndorCCD::setupAcquisition()
               driverName, functionName, maxImagesPerDMA, secondsPerDMA);
     setIntegerParam(AndorMaxImagesPerDMA, maxImagesPerDMA);
     setDoubleParam(AndorSecondsPerDMA, secondsPerDMA);
+
+    // Choose between SDK and software frame averaging
+    if (setupAveraging(false) != asynSuccess) throw std::string("Unable to set up frame averaging");
   } catch (const std::string &e) {
     asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
       "%s:%s: %s\n",
       driverName, functionName, e.c_str());
+    mFlightRecorder->record(AndorFlightRecorder::EventSetupEnd, 1);
     return asynError;
   }
+  mFlightRecorder->record(AndorFlightRecorder::EventSetupEnd, 0);
+  return asynSuccess;
+}
+
+
+/**
+ * Request that the camera is set up again after a parameter change.  In synchronous
+ * apply mode the camera is set up before returning.  In asynchronous apply mode a new
+ * configuration generation is requested and the apply task sets up the camera later, so
+ * the write returns at once; clients that need the change wait for AndorConfigApplied to
+ * reach AndorConfigRequested, or for AndorConfigBusy to clear.  Called with the port
+ * lock held.
+ */
+asynStatus AndorCCD::requestSetup()
+{
+  int applyMode;
+
+  // While a preset is applied the camera is set up once, after all parameters are written
+  if (mDeferSetup) {
+    mSetupPending = true;
+    return asynSuccess;
+  }
+  mSetupRequested++;
+  setIntegerParam(AndorConfigRequested, mSetupRequested);
+  getIntegerParam(AndorApplyMode, &applyMode);
+  if ((applyMode != AApplyAsync) || !mInitOK) return applySetup();
+  setIntegerParam(AndorConfigBusy, 1);
+  epicsEventSignal(applyEvent);
   return asynSuccess;
 }
 
+/**
+ * Set up the camera with the current parameters, which applies every generation
+ * requested so far.  Called with the port lock held.
+ */
+asynStatus AndorCCD::applySetup()
+{
+  int generation = mSetupRequested;
+  asynStatus status;
+
+  status = setupAcquisition();
+  mSetupApplied = generation;
+  setIntegerParam(AndorConfigApplied, mSetupApplied);
+  setIntegerParam(AndorConfigBusy, mSetupApplied != mSetupRequested);
+  return status;
+}
+
+/**
+ * Apply configuration changes requested in asynchronous apply mode. Meant to be run in
+ * own thread.  Changes requested within mApplySettleTime of each other are applied
+ * together, so a burst of writes sets up the camera once.
+ */
+void AndorCCD::applyTask(void)
+{
+  static const char *functionName = "applyTask";
+
+  printf("%s:%s: Apply thread started...\n", driverName, functionName);
+
+  while (!mExiting) {
+    epicsEventWait(applyEvent);
+    // Wait until no change has been requested for mApplySettleTime
+    while (!mExiting && (epicsEventWaitWithTimeout(applyEvent, mApplySettleTime) == epicsEventWaitOK)) {
+    }
+    if (mExiting) break;
+
+    this->lock();
+    if (mSetupApplied != mSetupRequested) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+        "%s:%s: applying configuration generation %d\n",
+        driverName, functionName, mSetupRequested);
+      if (applySetup() != asynSuccess) {
+        setStringParam(AndorMessage, "Setup acquisition failed");
+      }
+      updateReadoutConfig();
+      callParamCallbacks();
+    }
+    this->unlock();
+  }
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s:%s: Apply thread exiting ...\n",
+      driverName, functionName);
+
+  epicsAtomicIncrIntT(&mExited);
+}
 
 /**
  * Do data readout from the detector. Meant to be run in own thread.
@@ -1550,6 +2083,7 @@ asynStatus AndorCCD::setupAcquisition()
 void AndorCCD::dataTask(void)
 {
   epicsUInt32 status = 0;
+  unsigned int sdkStatus;
   int acquireStatus;
   int bitsPerPixel = 16;
   char *errorString = NULL;
@@ -1561,20 +2095,29 @@ void AndorCCD::dataTask(void)
   epicsInt32 sizeX, sizeY;
   int adShutterMode;
   NDDataType_t dataType;
-  int itemp;
   at_32 firstImage, lastImage;
   at_32 validFirst, validLast;
   size_t dims[2];
   int nDims = 2;
   int i;
+  int delayCalibrate;
+  int ppKey, ppGate;
   epicsTimeStamp startTime;
+  epicsTimeStamp requestTime;
+  epicsTimeStamp stageStart, stageEnd;
   epicsTimeStamp currentTempTime;
   epicsTimeStamp lastTempTime;
   NDArray *pArray;
+  NDArray *pFrame;
+  AndorPipeline::Frame frame;
   int autoSave;
-  int readOutMode;
+  bool published;
   int coolerStatus;
   float temperature;
+  double readoutWait, readoutWaitMax;
+  int recoveryMode;
+  bool draining;
+  epicsTimeStamp lastFrameTime;
   static const char *functionName = "dataTask";
 
   printf("%s:%s: Data thread started...\n", driverName, functionName);
@@ -1597,14 +2140,13 @@ void AndorCCD::dataTask(void)
 
     // Sanity check that main thread thinks we are acquiring data
     if (mAcquiringData) {
-      // Read some parameters
+      // Read some parameters.  The frame size, data type and array callbacks are read
+      // from mReadoutConfig for each frame.
       getIntegerParam(ADShutterMode, &adShutterMode);
-      getIntegerParam(AndorReadOutMode, &readOutMode);
-      getIntegerParam(NDDataType, &itemp); dataType = (NDDataType_t)itemp;
       getIntegerParam(NDAutoSave, &autoSave);
-      getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
-      getIntegerParam(NDArraySizeX, &sizeX);
-      getIntegerParam(NDArraySizeY, &sizeY);
+      getIntegerParam(AndorDelayCalibrate, &delayCalibrate);
+      delayCalibrate = delayCalibrate && (mCapabilities.ulFeatures & AC_FEATURES_METADATA);
+      epicsTimeGetCurrent(&lastFrameTime);
       // Set acquiring to 1
       acquiring = 1;
     } else {
@@ -1615,29 +2157,69 @@ void AndorCCD::dataTask(void)
       acquiring = 0;
     }
 
+    // The port lock is held in this loop except while waiting for and reading frames,
+    // which only take the SDK and configuration locks.  SDK errors are checked once the
+    // port lock has been taken again.
     while ((acquiring) && (!mExiting)) {
+      pArray = NULL;
+      draining = false;
       try {
-        checkStatus(GetStatus(&acquireStatus));
-        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
-          "%s:%s:, GetStatus returned %d\n",
-          driverName, functionName, acquireStatus);
-        if (acquireStatus != DRV_ACQUIRING) break;
-        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
-          "%s:%s:, WaitForAcquisition().\n",
-          driverName, functionName);
         this->unlock();
-        checkStatus(WaitForAcquisition());
+        mSDKLock->lock();
+        sdkStatus = GetStatus(&acquireStatus);
+        mSDKLock->unlock();
         this->lock();
+        checkStatus(sdkStatus);
         asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
-          "%s:%s:, WaitForAcquisition has returned.\n",
-          driverName, functionName);
-        getIntegerParam(ADNumExposuresCounter, &numExposuresCounter);
-        numExposuresCounter++;
-        setIntegerParam(ADNumExposuresCounter, numExposuresCounter);
-        callParamCallbacks();
+          "%s:%s:, GetStatus returned %d\n",
+          driverName, functionName, acquireStatus);
+        // After a buffer overflow or spool error the frames still in the buffer are read,
+        // then the acquisition is restarted if the recovery policy allows it
+        getIntegerParam(AndorRecoveryMode, &recoveryMode);
+        draining = (recoveryMode != ARecoveryOff) &&
+                   ((acquireStatus == (int)ASAcqBuffer) || (acquireStatus == (int)ASSpoolError));
+        if ((acquireStatus != DRV_ACQUIRING) && !draining) break;
+        if (!draining) {
+          asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
+            "%s:%s:, WaitForAcquisition().\n",
+            driverName, functionName);
+          // Frames still in the pipeline are published as they are done
+          sdkStatus = DRV_NO_NEW_DATA;
+          while ((mPipeline->pending() > 0) && mAcquiringData && !mExiting) {
+            this->unlock();
+            sdkStatus = WaitForAcquisitionTimeOut(pipelinePollMs);
+            this->lock();
+            if (sdkStatus != DRV_NO_NEW_DATA) break;
+            flushPipeline(-1, autoSave, false);
+          }
+          if (sdkStatus == DRV_NO_NEW_DATA) {
+            this->unlock();
+            sdkStatus = WaitForAcquisition();
+            this->lock();
+          }
+          checkStatus(sdkStatus);
+          epicsTimeGetCurrent(&lastFrameTime);
+          asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
+            "%s:%s:, WaitForAcquisition has returned.\n",
+            driverName, functionName);
+          getIntegerParam(ADNumExposuresCounter, &numExposuresCounter);
+          numExposuresCounter++;
+          mFlightRecorder->record(AndorFlightRecorder::EventWaitReturned, numExposuresCounter);
+          setIntegerParam(ADNumExposuresCounter, numExposuresCounter);
+          callParamCallbacks();
+        }
         // Is there an image available?
+        this->unlock();
+        mSDKLock->lock();
         status = GetNumberNewImages(&firstImage, &lastImage);
-        if (status != DRV_SUCCESS) continue;
+        mSDKLock->unlock();
+        this->lock();
+        if (status != DRV_SUCCESS) {
+          if (!draining) continue;
+          // Nothing left to read
+          lastImage = firstImage - 1;
+        }
+        mFlightRecorder->record(AndorFlightRecorder::EventFramesAvailable, (int)firstImage, (int)lastImage);
         asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
           "%s:%s:, firstImage=%ld, lastImage=%ld\n",
           driverName, functionName, (long)firstImage, (long)lastImage);
@@ -1649,60 +2231,107 @@ void AndorCCD::dataTask(void)
           getIntegerParam(ADNumImagesCounter, &numImagesCounter);
           numImagesCounter++;
           setIntegerParam(ADNumImagesCounter, numImagesCounter);
+          mMetrics->increment(MetricFrames);
+          published = true;
+          // Read the frame without the port lock
+          this->unlock();
+          mConfigLock->lock();
+          arrayCallbacks = mReadoutConfig.arrayCallbacks;
+          sizeX = mReadoutConfig.sizeX;
+          sizeY = mReadoutConfig.sizeY;
+          dataType = mReadoutConfig.dataType;
+          mConfigLock->unlock();
+          sdkStatus = DRV_SUCCESS;
+          readoutWait = 0.;
+          epicsTimeGetCurrent(&startTime);
           // If array callbacks are enabled then read data into NDArray, do callbacks
           if (arrayCallbacks) {
-            epicsTimeGetCurrent(&startTime);
             // Allocate an NDArray
             dims[0] = sizeX;
             dims[1] = sizeY;
             pArray = this->pNDArrayPool->alloc(nDims, dims, dataType, 0, NULL);
-            // Read the oldest array
-            // Is there still an image available?
-            status = GetNumberNewImages(&firstImage, &lastImage);
-            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
-              "%s:%s:, GetNumberNewImages, status=%d, firstImage=%ld, lastImage=%ld\n", 
-              driverName, functionName, status, (long)firstImage, (long)lastImage);
-            if (dataType == NDUInt32) {
-              asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
-                "%s:%s:, GetImages(%d, %d, %p, %d, %p, %p)\n", 
-                driverName, functionName, i, i, pArray->pData, sizeX*sizeY, &validFirst, &validLast);
-              checkStatus(GetImages(i, i, (at_32*)pArray->pData, 
-                                    sizeX*sizeY, &validFirst, &validLast));
-              setIntegerParam(NDArraySize, sizeX * sizeY * sizeof(epicsUInt32));
-              bitsPerPixel = 32;
-
+            if (pArray) {
+              epicsTimeGetCurrent(&requestTime);
+              mSDKLock->lock();
+              epicsTimeGetCurrent(&stageStart);
+              readoutWait = epicsTimeDiffInSeconds(&stageStart, &requestTime);
+              // Read the oldest array
+              // Is there still an image available?
+              status = GetNumberNewImages(&firstImage, &lastImage);
+              asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                "%s:%s:, GetNumberNewImages, status=%d, firstImage=%ld, lastImage=%ld\n", 
+                driverName, functionName, status, (long)firstImage, (long)lastImage);
+              mFlightRecorder->record(AndorFlightRecorder::EventReadoutStart, i);
+              if (dataType == NDUInt32) {
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
+                  "%s:%s:, GetImages(%d, %d, %p, %d, %p, %p)\n", 
+                  driverName, functionName, i, i, pArray->pData, sizeX*sizeY, &validFirst, &validLast);
+                sdkStatus = GetImages(i, i, (at_32*)pArray->pData, 
+                                      sizeX*sizeY, &validFirst, &validLast);
+                bitsPerPixel = 32;
+              }
+              else if (dataType == NDUInt16) {
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
+                  "%s:%s:, GetImages16(%d, %d, %p, %d, %p, %p)\n", 
+                  driverName, functionName, i, i, pArray->pData, sizeX*sizeY, &validFirst, &validLast);
+                sdkStatus = GetImages16(i, i, (epicsUInt16*)pArray->pData, 
+                                        sizeX*sizeY, &validFirst, &validLast);
+                bitsPerPixel = 16;
+              }
+              mSDKLock->unlock();
+              mFlightRecorder->record(AndorFlightRecorder::EventReadoutEnd, i, sizeX * sizeY);
             }
-            else if (dataType == NDUInt16) {
-              asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
-                "%s:%s:, GetImages16(%d, %d, %p, %d, %p, %p)\n", 
-                driverName, functionName, i, i, pArray->pData, sizeX*sizeY, &validFirst, &validLast);
-              checkStatus(GetImages16(i, i, (epicsUInt16*)pArray->pData, 
-                                      sizeX*sizeY, &validFirst, &validLast));
-              setIntegerParam(NDArraySize, sizeX * sizeY * sizeof(epicsUInt16));
-              bitsPerPixel = 16;
-            }
-            /* Put the frame number and time stamp into the buffer */
-            pArray->uniqueId = imageCounter;
-            pArray->timeStamp = startTime.secPastEpoch + startTime.nsec / 1.e9;
-            updateTimeStamp(&pArray->epicsTS);
-            pArray->uniqueId  = pArray->epicsTS.nsec & 0x1FFFF; // SLAC
+          }
+          this->lock();
+          // Exposures are matched to every frame read, so they stay in step without callbacks
+          if (mExposuresPerFrame > 0) tagExposure(arrayCallbacks ? pArray : NULL, &startTime);
+          if (arrayCallbacks) {
+            if (!pArray) throw std::string("ERROR: Unable to allocate an NDArray.");
+            checkStatus(sdkStatus);
+            setIntegerParam(NDArraySize, sizeX * sizeY * bitsPerPixel / 8);
+            getDoubleParam(AndorLockReadoutWaitMax, &readoutWaitMax);
+            if (readoutWait > readoutWaitMax) setDoubleParam(AndorLockReadoutWaitMax, readoutWait);
+            epicsTimeGetCurrent(&stageStart);
+            mMetrics->observe(MetricStageReadout, epicsTimeDiffInSeconds(&stageStart, &startTime));
 #ifdef NDBitsPerPixelString
             setIntegerParam( NDBitsPerPixel,  bitsPerPixel  );
 #endif
-            /* Get any attributes that have been defined for this driver */        
-            this->getAttributes(pArray->pAttributeList);
-            /* Call the NDArray callback */
-            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
-                 "%s:%s:, calling array callbacks\n", 
-                 driverName, functionName);
-            doCallbacksGenericPointer(pArray, NDArrayData, 0);
-            // Save the current frame for use with the SPE file writer which needs the data
-            if (this->pArrays[0]) this->pArrays[0]->release();
-            this->pArrays[0] = pArray;
+            // The delay is measured to the time the frame was read, before any processing.
+            // The SDK time stamps are indexed from the last restart, like i.
+            if (delayCalibrate) measureDelay(i, &startTime);
+            // The pump-probe gate applies to the frame being read, not to the frame being
+            // processed, which can be several frames behind
+            getIntegerParam(AndorPPKey, &ppKey);
+            if (ppKey == APPKeyGate) {
+              getIntegerParam(AndorPPGate, &ppGate);
+              pArray->pAttributeList->add("PumpProbeGate", "Pump-probe gate when the frame was read",
+                                          NDAttrInt32, &ppGate);
+            }
+            // Frames that go through the pipeline are published by flushPipeline.  Frames
+            // still follow the pipeline after its stages are disabled, so they stay in order.
+            published = false;
+            pFrame = pArray;
+            pArray = NULL;
+            if (mPipeline->active() || (mPipeline->pending() > 0)) {
+              frame.pArray = pFrame;
+              frame.frameIndex = i + mFrameIndexOffset;
+              frame.imageCounter = imageCounter;
+              frame.readoutTime = startTime;
+              if (mPipeline->submit(&frame)) {
+                // The pipeline is full, so wait for its oldest frame to make room
+                flushPipeline(1, autoSave, true);
+                if (mPipeline->submit(&frame)) {
+                  published = publishFrame(pFrame, i + mFrameIndexOffset, imageCounter, &startTime);
+                }
+              }
+            } else {
+              published = publishFrame(pFrame, i + mFrameIndexOffset, imageCounter, &startTime);
+            }
           }
           // Periodically update temperature status
           epicsTimeGetCurrent(&currentTempTime);
           if (epicsTimeDiffInSeconds(&currentTempTime, &lastTempTime) > mTempPollingPeriod) {
+            AndorLock::Guard sdkGuard(mSDKLock);
             // Read cooler status
             checkStatus(IsCoolerOn(&coolerStatus));
             setIntegerParam(AndorCoolerParam, coolerStatus);
@@ -1713,10 +2342,22 @@ void AndorCCD::dataTask(void)
             lastTempTime = currentTempTime;
           }
           // Save data if autosave is enabled
-          if (autoSave) this->saveDataFrame(i);
+          if (autoSave && published) {
+            epicsTimeGetCurrent(&stageStart);
+            this->saveDataFrame(i, imageCounter);
+            epicsTimeGetCurrent(&stageEnd);
+            mMetrics->observe(MetricStageSave, epicsTimeDiffInSeconds(&stageEnd, &stageStart));
+          }
+          if (mFrameStore) updateFrameStoreStatus();
+          updateMetrics();
           callParamCallbacks();
         }
+        // Publish the frames of this batch that are done.  Before a restart all of them
+        // are published, since the frame indices change.
+        flushPipeline(-1, autoSave, draining);
+        if (draining && !recoverAcquisition(acquireStatus, &lastFrameTime)) break;
       } catch (const std::string &e) {
+          if (pArray) pArray->release();
           if (!mExiting)
           {
               asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
@@ -1725,14 +2366,29 @@ void AndorCCD::dataTask(void)
               errorString = const_cast<char *>(e.c_str());
               setStringParam(AndorMessage, errorString);
           }
+          // A frame that cannot be read while draining does not prevent the restart.  The
+          // frames of the stopped series are published before their indices change.
+          if (draining) {
+            if (mPipeline->pending() > 0) flushPipeline(-1, autoSave, true);
+            if (!recoverAcquisition(acquireStatus, &lastFrameTime)) acquiring = 0;
+          }
       }
     }
     
+    // Publish any frames left in the pipeline by an error
+    if (mPipeline->pending() > 0) flushPipeline(-1, autoSave, true);
+    // Publish the cube of an incomplete scan
+    if (mCubeBuilder->cube()) publishCube(true);
+    if (mAFActive) stopAutofocus(AFocusFailed, "Autofocus stopped with acquisition");
+
     // Close the shutter if we are controlling it
     if (adShutterMode == ADShutterModeEPICS) {
       ADDriver::setShutter(ADShutterClosed);
     }
 
+    // Flush and close the frame store
+    closeFrameStore();
+
     // Now clear main thread flag
     mAcquiringData = 0;
     setIntegerParam(ADAcquire, 0);
@@ -1741,15 +2397,217 @@ void AndorCCD::dataTask(void)
     /* Call the callbacks to update any changes */
     callParamCallbacks();
   } // End of loop
-  mExited++;
+  epicsAtomicIncrIntT(&mExited);
   this->unlock();
 }
 
 
+/**
+ * Apply the software processing to a frame and publish it.  Called with the port lock
+ * held, in the order the frames were read.
+ * \param[in] pArray The frame, which is released or kept in pArrays[0].
+ * \param[in] frameIndex Index of the frame in the SDK circular buffer.
+ * \param[in] imageCounter Value of NDArrayCounter for the frame.
+ * \param[in] pReadoutTime Time at which the readout of the frame started.
+ * \return True if the frame was passed to the array callbacks.
+ */
+bool AndorCCD::publishFrame(NDArray *pArray, int frameIndex, int imageCounter,
+                            const epicsTimeStamp *pReadoutTime)
+{
+  epicsTimeStamp stageStart, stageEnd;
+  int timingSource;
+  int cubeMode;
+  bool published = false;
+  static const char *functionName = "publishFrame";
+
+  // Software processing, which may replace the array
+  epicsTimeGetCurrent(&stageStart);
+  pArray = processFrame(pArray, frameIndex, imageCounter);
+  epicsTimeGetCurrent(&stageEnd);
+  mMetrics->observe(MetricStageProcess, epicsTimeDiffInSeconds(&stageEnd, &stageStart));
+  // The autofocus measures every processed frame, whether or not it is published
+  if (pArray && mAFActive) autofocusFrame(pArray, frameIndex);
+  // In event mode frames without events produce no array
+  if (pArray) {
+    /* Put the frame number and time stamp into the buffer */
+    pArray->uniqueId = imageCounter;
+    pArray->timeStamp = pReadoutTime->secPastEpoch + pReadoutTime->nsec / 1.e9;
+    updateTimeStamp(&pArray->epicsTS);
+    if (mDDGActive) tagGate(pArray, frameIndex);
+    getIntegerParam(AndorTimingSource, &timingSource);
+    if (timingSource == ATimingTimeStamp) {
+      pArray->uniqueId  = pArray->epicsTS.nsec & 0x1FFFF; // SLAC
+    } else if (timingSource != ATimingFrameCounter) {
+      tagFrame(pArray, frameIndex, pReadoutTime);
+    }
+    // Frames that do not differ enough from the last published frame are dropped here
+    published = gateFrame(pArray);
+    getIntegerParam(AndorCubeMode, &cubeMode);
+    if (published && cubeMode) {
+      // The frame is copied into the cube, which is published instead
+      this->getAttributes(pArray->pAttributeList);
+      addToCube(pArray);
+      pArray->release();
+      published = false;
+    } else if (published) {
+      /* Get any attributes that have been defined for this driver */
+      this->getAttributes(pArray->pAttributeList);
+      /* Call the NDArray callback */
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+           "%s:%s:, calling array callbacks\n",
+           driverName, functionName);
+      mFlightRecorder->record(AndorFlightRecorder::EventCallbackStart, imageCounter);
+      epicsTimeGetCurrent(&stageStart);
+      doCallbacksGenericPointer(pArray, NDArrayData, 0);
+      epicsTimeGetCurrent(&stageEnd);
+      mFlightRecorder->record(AndorFlightRecorder::EventCallbackEnd, imageCounter);
+      mMetrics->observe(MetricStageCallbacks, epicsTimeDiffInSeconds(&stageEnd, &stageStart));
+      // Save the current frame for use with the SPE file writer which needs the data
+      if (this->pArrays[0]) this->pArrays[0]->release();
+      this->pArrays[0] = pArray;
+    } else {
+      pArray->release();
+    }
+  }
+  mMetrics->increment(published ? MetricFramesPublished : MetricFramesSkipped);
+  return published;
+}
+
+/**
+ * Publish frames that have been through the pipeline, in the order they were read.  The
+ * port lock is released while waiting for a frame.
+ * \param[in] numFrames Number of frames to publish, or -1 for all pending frames.
+ * \param[in] autoSave True to save the frames that are published.
+ * \param[in] wait True to wait for the frames to be done, false to publish only the
+ *            frames that are done already.
+ */
+void AndorCCD::flushPipeline(int numFrames, int autoSave, bool wait)
+{
+  AndorPipeline::Frame frame;
+  epicsTimeStamp stageStart, stageEnd;
+  bool found;
+
+  for (int n=0; ((numFrames < 0) || (n < numFrames)) && (mPipeline->pending() > 0); n++) {
+    if (wait) {
+      this->unlock();
+      found = mPipeline->next(&frame, -1.);
+      this->lock();
+    } else {
+      found = mPipeline->next(&frame, 0.);
+    }
+    if (!found) break;
+    if (publishFrame(frame.pArray, frame.frameIndex, frame.imageCounter, &frame.readoutTime) &&
+        autoSave) {
+      epicsTimeGetCurrent(&stageStart);
+      // The SDK numbers the frames it saves from the last restart
+      this->saveDataFrame(frame.frameIndex - mFrameIndexOffset, frame.imageCounter);
+      epicsTimeGetCurrent(&stageEnd);
+      mMetrics->observe(MetricStageSave, epicsTimeDiffInSeconds(&stageEnd, &stageStart));
+    }
+    updateMetrics();
+    callParamCallbacks();
+  }
+}
+
+
+/**
+ * Restart an acquisition stopped by a circular buffer overflow or a spool error, after the
+ * frames left in the buffer have been read.  The camera keeps its configuration, so it is
+ * only aborted and started again; in ReduceDMA mode the maximum number of images per DMA
+ * transfer is halved first, so the buffer is emptied more often.  A Multiple acquisition
+ * is restarted for the images it still needs.  The SDK numbers the frames of the new
+ * series from 1, so the frames already read are added to mFrameIndexOffset, and the DDG
+ * gate steps are restarted from the frame they reached.  Called from the data task with
+ * the port lock held and the pipeline empty.
+ * \param[in] cameraStatus GetStatus value that stopped the acquisition.
+ * \param[in] pLastFrameTime Time the last frame before the fault was acquired.
+ * \return true if the acquisition was restarted.
+ */
+bool AndorCCD::recoverAcquisition(int cameraStatus, const epicsTimeStamp *pLastFrameTime)
+{
+  int mode, maxRecoveries, count, imageMode, numImages, numImagesCounter;
+  int maxImagesPerDMA, framesLost, totalLost, frameOffset;
+  float exposure, accumulate, kinetic;
+  double secondsPerDMA, gap;
+  epicsTimeStamp now;
+  static const char *functionName = "recoverAcquisition";
+
+  getIntegerParam(AndorRecoveryMode, &mode);
+  getIntegerParam(AndorRecoveryMax, &maxRecoveries);
+  getIntegerParam(AndorRecoveryCount, &count);
+  getIntegerParam(ADImageMode, &imageMode);
+  getIntegerParam(ADNumImages, &numImages);
+  getIntegerParam(ADNumImagesCounter, &numImagesCounter);
+  if ((mode == ARecoveryOff) || !mAcquiringData || mExiting) return false;
+  if ((imageMode != ADImageContinuous) && (imageMode != ADImageMultiple)) return false;
+  if ((imageMode == ADImageMultiple) && (numImagesCounter >= numImages)) return false;
+  if ((maxRecoveries > 0) && (count >= maxRecoveries)) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: acquisition stopped with status %d, %d recoveries already made\n",
+      driverName, functionName, cameraStatus, count);
+    setStringParam(AndorMessage, "Acquisition fault, recovery limit reached.");
+    return false;
+  }
+
+  try {
+    AndorLock::Guard configGuard(mConfigLock);
+    AndorLock::Guard sdkGuard(mSDKLock);
+    // The acquisition has normally stopped already, in which case this fails
+    AbortAcquisition();
+    if (mode == ARecoveryReduceDMA) {
+      getIntegerParam(AndorMaxImagesPerDMA, &maxImagesPerDMA);
+      getDoubleParam(AndorSecondsPerDMA, &secondsPerDMA);
+      if (maxImagesPerDMA > 1) {
+        maxImagesPerDMA /= 2;
+        checkStatus(SetDMAParameters(maxImagesPerDMA, secondsPerDMA));
+        setIntegerParam(AndorMaxImagesPerDMA, maxImagesPerDMA);
+      }
+    }
+    // The frames of the new series follow the frames read so far
+    frameOffset = numImagesCounter;
+    if (imageMode == ADImageMultiple) {
+      checkStatus(SetNumberKinetics(numImages - numImagesCounter));
+      if (mDDGActive) rebaseDDGSteps(frameOffset);
+    }
+    // The exposures of the lost frames must not be matched to the frames after the restart
+    mExposureEvents->reset();
+    // The cycle time of the series, which ADAcquirePeriod does not give when it is 0
+    checkStatus(GetAcquisitionTimings(&exposure, &accumulate, &kinetic));
+    checkStatus(StartAcquisition());
+    mFrameIndexOffset = frameOffset;
+  } catch (const std::string &e) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: %s\n",
+      driverName, functionName, e.c_str());
+    setStringParam(AndorMessage, e.c_str());
+    return false;
+  }
+
+  // Frames that would have been acquired between the last frame and the restart
+  epicsTimeGetCurrent(&now);
+  gap = epicsTimeDiffInSeconds(&now, pLastFrameTime);
+  framesLost = (kinetic > 0.) ? (int)(gap / kinetic) : 0;
+  getIntegerParam(AndorRecoveryFramesLost, &totalLost);
+  setIntegerParam(AndorRecoveryCount, ++count);
+  setDoubleParam(AndorRecoveryGap, gap);
+  setIntegerParam(AndorRecoveryFramesLost, totalLost + framesLost);
+  mFlightRecorder->record(AndorFlightRecorder::EventRecovery, cameraStatus, framesLost);
+  asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+    "%s:%s: acquisition stopped with status %d and was restarted, gap %.3f s, about %d frames lost\n",
+    driverName, functionName, cameraStatus, gap, framesLost);
+  setStringParam(AndorMessage, "Acquisition restarted after a buffer overflow.");
+  callParamCallbacks();
+  return true;
+}
+
+
 /**
  * Save a data frame using the Andor SDK file writing functions.
+ * \param[in] frameNumber Number of the frame in the SDK circular buffer.
+ * \param[in] imageCounter Value of NDArrayCounter for the frame, which is no longer the
+ *            current value when the frame was published from the pipeline.
  */
-void AndorCCD::saveDataFrame(int frameNumber) 
+void AndorCCD::saveDataFrame(int frameNumber, int imageCounter) 
 {
   char *errorString = NULL;
   int fileFormat;
@@ -1762,7 +2620,21 @@ void AndorCCD::saveDataFrame(int frameNumber)
 
   // Fetch the file format
   getIntegerParam(NDFileFormat, &fileFormat);
-      
+
+  // The frame store is a single file per acquisition, opened when acquisition starts
+  if (fileFormat == AFFFrameStore) {
+    try {
+      checkStatus(appendFrameStore(imageCounter));
+    } catch (const std::string &e) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s:%s: %s\n",
+        driverName, functionName, e.c_str());
+      setStringParam(AndorMessage, e.c_str());
+    }
+    return;
+  }
+
+  AndorLock::Guard sdkGuard(mSDKLock);
   this->createFileName(255, fullFileName);
   setStringParam(NDFullFileName, fullFileName);
   asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
@@ -2029,6 +2901,25 @@ done:
 }
 
 
+
+
+
+/**
+ * Copy the parameters used by the readout to mReadoutConfig.  Called with the port lock
+ * held whenever a parameter may have changed.  The frame size is set by setupAcquisition.
+ */
+void AndorCCD::updateReadoutConfig()
+{
+  int arrayCallbacks, dataType;
+
+  getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+  getIntegerParam(NDDataType, &dataType);
+  AndorLock::Guard configGuard(mConfigLock);
+  mReadoutConfig.arrayCallbacks = arrayCallbacks;
+  mReadoutConfig.dataType = (NDDataType_t)dataType;
+}
+
+
 // C utility functions to tie in with EPICS
 
 static void andorStatusTaskC(void *drvPvt)
@@ -2046,6 +2937,30 @@ static void andorDataTaskC(void *drvPvt)
   pPvt->dataTask();
 }
 
+
+static void andorApplyTaskC(void *drvPvt)
+{
+  AndorCCD *pPvt = (AndorCCD *)drvPvt;
+
+  pPvt->applyTask();
+}
+
+
+static void andorExposureTaskC(void *drvPvt)
+{
+  AndorCCD *pPvt = (AndorCCD *)drvPvt;
+
+  pPvt->exposureTask();
+}
+
+
+static void andorFocusTaskC(void *drvPvt)
+{
+  AndorCCD *pPvt = (AndorCCD *)drvPvt;
+
+  pPvt->focusTask();
+}
+
 /** IOC shell configuration command for Andor driver
   * \param[in] portName The name of the asyn port driver to be created.
   * \param[in] installPath The path to the Andor directory containing the detector INI files, etc.
@@ -2098,10 +3013,134 @@ static void configAndorCCDCallFunc(const iocshArgBuf *args)
                    args[4].ival, args[5].ival, args[6].ival, args[7].ival);
 }
 
+/** Add a timing event to an andorCCD driver, for use by timing system software.
+  * \param[in] portName The name of the asyn port of the driver.
+  * \param[in] pTriggerTime Time of the trigger.  NULL means the current time.
+  * \param[in] pulseId Pulse ID of the trigger.
+  */
+int andorCCDTimingEvent(const char *portName, const epicsTimeStamp *pTriggerTime, int pulseId)
+{
+  AndorCCD *pAndorCCD = (AndorCCD *)findAsynPortDriver(portName);
+  epicsTimeStamp now;
+
+  if (!pAndorCCD) {
+    printf("andorCCDTimingEvent: port %s not found\n", portName);
+    return(asynError);
+  }
+  if (!pTriggerTime) {
+    epicsTimeGetCurrent(&now);
+    pTriggerTime = &now;
+  }
+  pAndorCCD->timingEvent(pTriggerTime, pulseId);
+  return(asynSuccess);
+}
+
+/* andorCCDTimingEvent */
+static const iocshArg andorCCDTimingEventArg0 = {"Port name", iocshArgString};
+static const iocshArg andorCCDTimingEventArg1 = {"pulseId", iocshArgInt};
+static const iocshArg * const andorCCDTimingEventArgs[] = {&andorCCDTimingEventArg0,
+                                                           &andorCCDTimingEventArg1};
+
+static const iocshFuncDef timingEventAndorCCD = {"andorCCDTimingEvent", 2, andorCCDTimingEventArgs};
+static void timingEventAndorCCDCallFunc(const iocshArgBuf *args)
+{
+    andorCCDTimingEvent(args[0].sval, NULL, args[1].ival);
+}
+
+/** Print the performance metrics of an andorCCD driver in OpenMetrics text format.
+  * \param[in] portName The name of the asyn port of the driver.
+  */
+int andorCCDMetrics(const char *portName)
+{
+  AndorCCD *pAndorCCD = (AndorCCD *)findAsynPortDriver(portName);
+
+  if (!pAndorCCD) {
+    printf("andorCCDMetrics: port %s not found\n", portName);
+    return(asynError);
+  }
+  pAndorCCD->metrics()->write(stdout);
+  return(asynSuccess);
+}
+
+/** Periodically write the performance metrics of an andorCCD driver to a file.
+  * \param[in] portName The name of the asyn port of the driver.
+  * \param[in] fileName The name of the file, which is replaced on each write.
+  * \param[in] period The time between writes in seconds.  0 stops writing the file.
+  */
+int andorCCDMetricsFile(const char *portName, const char *fileName, double period)
+{
+  AndorCCD *pAndorCCD = (AndorCCD *)findAsynPortDriver(portName);
+
+  if (!pAndorCCD) {
+    printf("andorCCDMetricsFile: port %s not found\n", portName);
+    return(asynError);
+  }
+  if ((period > 0.) && (!fileName || !fileName[0])) {
+    printf("andorCCDMetricsFile: no file name\n");
+    return(asynError);
+  }
+  return pAndorCCD->metrics()->startFile(fileName, period) ? asynError : asynSuccess;
+}
+
+/** Serve the performance metrics of an andorCCD driver over HTTP on 127.0.0.1.
+  * \param[in] portName The name of the asyn port of the driver.
+  * \param[in] tcpPort The TCP port number.
+  */
+int andorCCDMetricsHttp(const char *portName, int tcpPort)
+{
+  AndorCCD *pAndorCCD = (AndorCCD *)findAsynPortDriver(portName);
+
+  if (!pAndorCCD) {
+    printf("andorCCDMetricsHttp: port %s not found\n", portName);
+    return(asynError);
+  }
+  return pAndorCCD->metrics()->startHttp(tcpPort) ? asynError : asynSuccess;
+}
+
+/* andorCCDMetrics */
+static const iocshArg andorCCDMetricsArg0 = {"Port name", iocshArgString};
+static const iocshArg * const andorCCDMetricsArgs[] = {&andorCCDMetricsArg0};
+
+static const iocshFuncDef metricsAndorCCD = {"andorCCDMetrics", 1, andorCCDMetricsArgs};
+static void metricsAndorCCDCallFunc(const iocshArgBuf *args)
+{
+    andorCCDMetrics(args[0].sval);
+}
+
+/* andorCCDMetricsFile */
+static const iocshArg andorCCDMetricsFileArg0 = {"Port name", iocshArgString};
+static const iocshArg andorCCDMetricsFileArg1 = {"fileName", iocshArgString};
+static const iocshArg andorCCDMetricsFileArg2 = {"period", iocshArgDouble};
+static const iocshArg * const andorCCDMetricsFileArgs[] = {&andorCCDMetricsFileArg0,
+                                                           &andorCCDMetricsFileArg1,
+                                                           &andorCCDMetricsFileArg2};
+
+static const iocshFuncDef metricsFileAndorCCD = {"andorCCDMetricsFile", 3, andorCCDMetricsFileArgs};
+static void metricsFileAndorCCDCallFunc(const iocshArgBuf *args)
+{
+    andorCCDMetricsFile(args[0].sval, args[1].sval, args[2].dval);
+}
+
+/* andorCCDMetricsHttp */
+static const iocshArg andorCCDMetricsHttpArg0 = {"Port name", iocshArgString};
+static const iocshArg andorCCDMetricsHttpArg1 = {"tcpPort", iocshArgInt};
+static const iocshArg * const andorCCDMetricsHttpArgs[] = {&andorCCDMetricsHttpArg0,
+                                                           &andorCCDMetricsHttpArg1};
+
+static const iocshFuncDef metricsHttpAndorCCD = {"andorCCDMetricsHttp", 2, andorCCDMetricsHttpArgs};
+static void metricsHttpAndorCCDCallFunc(const iocshArgBuf *args)
+{
+    andorCCDMetricsHttp(args[0].sval, args[1].ival);
+}
+
 static void andorCCDRegister(void)
 {
 
     iocshRegister(&configAndorCCD, configAndorCCDCallFunc);
+    iocshRegister(&timingEventAndorCCD, timingEventAndorCCDCallFunc);
+    iocshRegister(&metricsAndorCCD, metricsAndorCCDCallFunc);
+    iocshRegister(&metricsFileAndorCCD, metricsFileAndorCCDCallFunc);
+    iocshRegister(&metricsHttpAndorCCD, metricsHttpAndorCCDCallFunc);
 }
 
 epicsExportRegistrar(andorCCDRegister);
@@ -18,10 +18,35 @@
 #include "ADDriver.h"
 #include "SPEHeader.h"
 
+class AndorFrameStore;
+class AndorFrameAverager;
+class AndorFrameBinner;
+class AndorFrameGate;
+class AndorEventFinder;
+class AndorBaselineCorrector;
+class AndorTimingTagger;
+class AndorExposureEvents;
+class AndorPipeline;
+class AndorDarkStage;
+class AndorFlatStage;
+class AndorCubeBuilder;
+class AndorFocusSearch;
+class AndorDelayModel;
+class AndorMetrics;
+class AndorFlightRecorder;
+class AndorPresetStore;
+class AndorCommonMode;
+class AndorPeakTracker;
+class AndorPumpProbe;
+class AndorLock;
+
 #define MAX_ENUM_STRING_SIZE 26
 #define MAX_ADC_SPEEDS 16
 #define MAX_PREAMP_GAINS 16
 #define MAX_VS_PERIODS 16
+#define MAX_PRESET_PARAMS 64
+#define MAX_OA_MODES 16
+#define MAX_OA_NAME_SIZE 64
 
 #define AndorCoolerParamString             "ANDOR_COOLER"
 #define AndorTempStatusMessageString       "ANDOR_TEMP_STAT"
@@ -48,6 +73,223 @@
 #define AndorMaxImagesPerDMAString         "ANDOR_DMA_IMAGES"
 #define AndorSecondsPerDMAString           "ANDOR_DMA_SECONDS"
 #define AndorIsolatedCropModeString        "ANDOR_ISOCROP_MODE"
+#define AndorFSPreallocString              "ANDOR_FS_PREALLOC"
+#define AndorFSQueueSizeString             "ANDOR_FS_QUEUE_SIZE"
+#define AndorFSQueueFreeString             "ANDOR_FS_QUEUE_FREE"
+#define AndorFSFramesWrittenString         "ANDOR_FS_FRAMES_WRITTEN"
+#define AndorFSFramesDroppedString         "ANDOR_FS_FRAMES_DROPPED"
+#define AndorFSMBWrittenString             "ANDOR_FS_MB_WRITTEN"
+#define AndorAverageModeString             "ANDOR_AVERAGE_MODE"
+#define AndorAverageFramesString           "ANDOR_AVERAGE_FRAMES"
+#define AndorAverageFactorString           "ANDOR_AVERAGE_FACTOR"
+#define AndorAverageResetString            "ANDOR_AVERAGE_RESET"
+#define AndorAverageCountString            "ANDOR_AVERAGE_COUNT"
+#define AndorAverageHardwareString         "ANDOR_AVERAGE_HARDWARE"
+#define AndorSWBinXString                  "ANDOR_SW_BIN_X"
+#define AndorSWBinYString                  "ANDOR_SW_BIN_Y"
+#define AndorSWBinModeString               "ANDOR_SW_BIN_MODE"
+#define AndorSWBinOutputString             "ANDOR_SW_BIN_OUTPUT"
+#define AndorGateModeString                "ANDOR_GATE_MODE"
+#define AndorGateThresholdString           "ANDOR_GATE_THRESHOLD"
+#define AndorGateStrideString              "ANDOR_GATE_STRIDE"
+#define AndorGateMinXString                "ANDOR_GATE_MIN_X"
+#define AndorGateMinYString                "ANDOR_GATE_MIN_Y"
+#define AndorGateSizeXString               "ANDOR_GATE_SIZE_X"
+#define AndorGateSizeYString               "ANDOR_GATE_SIZE_Y"
+#define AndorGateKeyframeString            "ANDOR_GATE_KEYFRAME"
+#define AndorGateReferenceString           "ANDOR_GATE_REFERENCE"
+#define AndorGateMetricString              "ANDOR_GATE_METRIC"
+#define AndorGatePassedString              "ANDOR_GATE_PASSED"
+#define AndorGateSkippedString             "ANDOR_GATE_SKIPPED"
+#define AndorGatePassRatioString           "ANDOR_GATE_PASS_RATIO"
+#define AndorEventModeString               "ANDOR_EVENT_MODE"
+#define AndorEventThresholdString          "ANDOR_EVENT_THRESHOLD"
+#define AndorEventPedestalString           "ANDOR_EVENT_PEDESTAL"
+#define AndorEventMaxHitsString            "ANDOR_EVENT_MAX_HITS"
+#define AndorEventDenseIntervalString      "ANDOR_EVENT_DENSE_INTERVAL"
+#define AndorEventCountString              "ANDOR_EVENT_COUNT"
+#define AndorEventTotalString              "ANDOR_EVENT_TOTAL"
+#define AndorEventOverflowsString          "ANDOR_EVENT_OVERFLOWS"
+#define AndorNumberPrescansString          "ANDOR_NUMBER_PRESCANS"
+#define AndorBaselineOffsetString          "ANDOR_BASELINE_OFFSET"
+#define AndorBaselineModeString            "ANDOR_BASELINE_MODE"
+#define AndorBaselineColumnsString         "ANDOR_BASELINE_COLUMNS"
+#define AndorBaselineSideString            "ANDOR_BASELINE_SIDE"
+#define AndorBaselineValueString           "ANDOR_BASELINE_VALUE"
+#define AndorBaselineTrendString           "ANDOR_BASELINE_TREND"
+#define AndorTriggerLatencyModeString      "ANDOR_TRIGGER_LATENCY_MODE"
+#define AndorTriggerLatencyString          "ANDOR_TRIGGER_LATENCY"
+#define AndorTimingSourceString            "ANDOR_TIMING_SOURCE"
+#define AndorTimingDelayString             "ANDOR_TIMING_DELAY"
+#define AndorTimingToleranceString         "ANDOR_TIMING_TOLERANCE"
+#define AndorTimingSimRateString           "ANDOR_TIMING_SIM_RATE"
+#define AndorTimingEventString             "ANDOR_TIMING_EVENT"
+#define AndorTimingPulseIdString           "ANDOR_TIMING_PULSE_ID"
+#define AndorTimingErrorString             "ANDOR_TIMING_ERROR"
+#define AndorTimingMatchString             "ANDOR_TIMING_MATCH"
+#define AndorTimingMatchedString           "ANDOR_TIMING_MATCHED"
+#define AndorTimingResyncsString           "ANDOR_TIMING_RESYNCS"
+#define AndorTimingUnmatchedString         "ANDOR_TIMING_UNMATCHED"
+#define AndorTimingOverflowsString         "ANDOR_TIMING_OVERFLOWS"
+#define AndorTimingQueuedString            "ANDOR_TIMING_QUEUED"
+#define AndorDelayCalibrateString          "ANDOR_DELAY_CALIBRATE"
+#define AndorDelayResetString              "ANDOR_DELAY_RESET"
+#define AndorDelayMeasuredString           "ANDOR_DELAY_MEASURED"
+#define AndorDelayResidualString           "ANDOR_DELAY_RESIDUAL"
+#define AndorDelayPredictedString          "ANDOR_DELAY_PREDICTED"
+#define AndorDelayRMSString                "ANDOR_DELAY_RMS"
+#define AndorDelayC0String                 "ANDOR_DELAY_C0"
+#define AndorDelayC1String                 "ANDOR_DELAY_C1"
+#define AndorDelayC2String                 "ANDOR_DELAY_C2"
+#define AndorDelaySamplesString            "ANDOR_DELAY_SAMPLES"
+#define AndorDelayConfigMeanString         "ANDOR_DELAY_CONFIG_MEAN"
+#define AndorDelayConfigStdString          "ANDOR_DELAY_CONFIG_STD"
+#define AndorDelayConfigSamplesString      "ANDOR_DELAY_CONFIG_SAMPLES"
+#define AndorFlightAutoDumpString          "ANDOR_FLIGHT_AUTO_DUMP"
+#define AndorFlightPathString              "ANDOR_FLIGHT_PATH"
+#define AndorFlightDumpString              "ANDOR_FLIGHT_DUMP"
+#define AndorFlightDumpsString             "ANDOR_FLIGHT_DUMPS"
+#define AndorFlightFileString              "ANDOR_FLIGHT_FILE"
+#define AndorPresetNameString              "ANDOR_PRESET_NAME"
+#define AndorPresetSaveString              "ANDOR_PRESET_SAVE"
+#define AndorPresetApplyString             "ANDOR_PRESET_APPLY"
+#define AndorPresetDeleteString            "ANDOR_PRESET_DELETE"
+#define AndorPresetListString              "ANDOR_PRESET_LIST"
+#define AndorPresetChangedString           "ANDOR_PRESET_CHANGED"
+#define AndorPresetFileString              "ANDOR_PRESET_FILE"
+#define AndorOAModeString                  "ANDOR_OA_MODE"
+#define AndorOAApplyString                 "ANDOR_OA_APPLY"
+#define AndorCMModeString                  "ANDOR_CM_MODE"
+#define AndorCMThresholdString             "ANDOR_CM_THRESHOLD"
+#define AndorCMMinPixelsString             "ANDOR_CM_MIN_PIXELS"
+#define AndorCMThreadsString               "ANDOR_CM_THREADS"
+#define AndorCMRowRMSString                "ANDOR_CM_ROW_RMS"
+#define AndorCMColumnRMSString             "ANDOR_CM_COLUMN_RMS"
+#define AndorPeakModeString                "ANDOR_PEAK_MODE"
+#define AndorPeakWindowsString             "ANDOR_PEAK_WINDOWS"
+#define AndorPeakNumWindowsString          "ANDOR_PEAK_NUM_WINDOWS"
+#define AndorPeakMaxIterString             "ANDOR_PEAK_MAX_ITER"
+#define AndorPeakCalibratedString          "ANDOR_PEAK_CALIBRATED"
+#define AndorPeakFailuresString            "ANDOR_PEAK_FAILURES"
+#define AndorPeakPositionString            "ANDOR_PEAK_POSITION"
+#define AndorPeakWidthString               "ANDOR_PEAK_WIDTH"
+#define AndorPeakAmplitudeString           "ANDOR_PEAK_AMPLITUDE"
+#define AndorPeakQualityString             "ANDOR_PEAK_QUALITY"
+#define AndorPeakHistoryWindowString       "ANDOR_PEAK_HISTORY_WINDOW"
+#define AndorPeakHistPositionString        "ANDOR_PEAK_HIST_POSITION"
+#define AndorPeakHistWidthString           "ANDOR_PEAK_HIST_WIDTH"
+#define AndorPeakHistAmplitudeString       "ANDOR_PEAK_HIST_AMPLITUDE"
+#define AndorPeakHistQualityString         "ANDOR_PEAK_HIST_QUALITY"
+#define AndorPeakResetString               "ANDOR_PEAK_RESET"
+#define AndorPPModeString                  "ANDOR_PP_MODE"
+#define AndorPPSeriesLengthString          "ANDOR_PP_SERIES_LENGTH"
+#define AndorPPRepeatsString               "ANDOR_PP_REPEATS"
+#define AndorPPPairsString                 "ANDOR_PP_PAIRS"
+#define AndorPPKeyString                   "ANDOR_PP_KEY"
+#define AndorPPGateString                  "ANDOR_PP_GATE"
+#define AndorPPIndexString                 "ANDOR_PP_INDEX"
+#define AndorPPCountString                 "ANDOR_PP_COUNT"
+#define AndorPPOnCountString               "ANDOR_PP_ON_COUNT"
+#define AndorPPOffCountString              "ANDOR_PP_OFF_COUNT"
+#define AndorPPResetString                 "ANDOR_PP_RESET"
+#define AndorDDGEnableString               "ANDOR_DDG_ENABLE"
+#define AndorDDGGateModeString             "ANDOR_DDG_GATE_MODE"
+#define AndorMCPGainString                 "ANDOR_MCP_GAIN"
+#define AndorDDGDelayString                "ANDOR_DDG_DELAY"
+#define AndorDDGWidthString                "ANDOR_DDG_WIDTH"
+#define AndorDDGStepModeString             "ANDOR_DDG_STEP_MODE"
+#define AndorDDGStepP1String               "ANDOR_DDG_STEP_P1"
+#define AndorDDGStepP2String               "ANDOR_DDG_STEP_P2"
+#define AndorDDGWidthStepModeString        "ANDOR_DDG_WIDTH_STEP_MODE"
+#define AndorDDGWidthStepP1String          "ANDOR_DDG_WIDTH_STEP_P1"
+#define AndorDDGWidthStepP2String          "ANDOR_DDG_WIDTH_STEP_P2"
+#define AndorDDGIOCString                  "ANDOR_DDG_IOC"
+#define AndorDDGIOCFrequencyString         "ANDOR_DDG_IOC_FREQUENCY"
+#define AndorDDGIOCPulsesString            "ANDOR_DDG_IOC_PULSES"
+#define AndorDDGFrameDelayString           "ANDOR_DDG_FRAME_DELAY"
+#define AndorDDGFrameWidthString           "ANDOR_DDG_FRAME_WIDTH"
+#define AndorLockPortHoldMaxString         "ANDOR_LOCK_PORT_HOLD_MAX"
+#define AndorLockSDKHoldMaxString          "ANDOR_LOCK_SDK_HOLD_MAX"
+#define AndorLockConfigHoldMaxString       "ANDOR_LOCK_CONFIG_HOLD_MAX"
+#define AndorLockReadoutWaitMaxString      "ANDOR_LOCK_READOUT_WAIT_MAX"
+#define AndorLockStatsResetString          "ANDOR_LOCK_STATS_RESET"
+#define AndorApplyModeString               "ANDOR_APPLY_MODE"
+#define AndorConfigBusyString              "ANDOR_CONFIG_BUSY"
+#define AndorConfigRequestedString         "ANDOR_CONFIG_REQUESTED"
+#define AndorConfigAppliedString           "ANDOR_CONFIG_APPLIED"
+#define AndorRecoveryModeString            "ANDOR_RECOVERY_MODE"
+#define AndorRecoveryMaxString             "ANDOR_RECOVERY_MAX"
+#define AndorRecoveryCountString           "ANDOR_RECOVERY_COUNT"
+#define AndorRecoveryGapString             "ANDOR_RECOVERY_GAP"
+#define AndorRecoveryFramesLostString      "ANDOR_RECOVERY_FRAMES_LOST"
+#define AndorExposureEventEnableString     "ANDOR_EXPOSURE_EVENT_ENABLE"
+#define AndorExposureEventAvailString      "ANDOR_EXPOSURE_EVENT_AVAIL"
+#define AndorExposureEventPeriodString     "ANDOR_EXPOSURE_EVENT_PERIOD"
+#define AndorExposureStartString           "ANDOR_EXPOSURE_START"
+#define AndorExposureEndString             "ANDOR_EXPOSURE_END"
+#define AndorExposureDurationString        "ANDOR_EXPOSURE_DURATION"
+#define AndorExposureStartsString          "ANDOR_EXPOSURE_STARTS"
+#define AndorExposureEndsString            "ANDOR_EXPOSURE_ENDS"
+#define AndorExposureUnmatchedString       "ANDOR_EXPOSURE_UNMATCHED"
+#define AndorPlanString                    "ANDOR_PLAN"
+#define AndorPlanTestSizeString            "ANDOR_PLAN_TEST_SIZE"
+#define AndorPlanDurationString            "ANDOR_PLAN_DURATION"
+#define AndorPlanFrameRateString           "ANDOR_PLAN_FRAME_RATE"
+#define AndorPlanDataRateString            "ANDOR_PLAN_DATA_RATE"
+#define AndorPlanDiskRateString            "ANDOR_PLAN_DISK_RATE"
+#define AndorPlanDiskFreeString            "ANDOR_PLAN_DISK_FREE"
+#define AndorPlanBufferString              "ANDOR_PLAN_BUFFER"
+#define AndorPlanRunLengthString           "ANDOR_PLAN_RUN_LENGTH"
+#define AndorPlanBottleneckString          "ANDOR_PLAN_BOTTLENECK"
+#define AndorPlanDropsString               "ANDOR_PLAN_DROPS"
+#define AndorSingleTrackCentreString       "ANDOR_SINGLE_TRACK_CENTRE"
+#define AndorSingleTrackHeightString       "ANDOR_SINGLE_TRACK_HEIGHT"
+#define AndorPipeThreadsString             "ANDOR_PIPE_THREADS"
+#define AndorPipeDarkEnableString          "ANDOR_PIPE_DARK_ENABLE"
+#define AndorPipeFlatEnableString          "ANDOR_PIPE_FLAT_ENABLE"
+#define AndorPipeStatsEnableString         "ANDOR_PIPE_STATS_ENABLE"
+#define AndorPipeDarkCaptureString         "ANDOR_PIPE_DARK_CAPTURE"
+#define AndorPipeFlatCaptureString         "ANDOR_PIPE_FLAT_CAPTURE"
+#define AndorPipeDarkValidString           "ANDOR_PIPE_DARK_VALID"
+#define AndorPipeFlatValidString           "ANDOR_PIPE_FLAT_VALID"
+#define AndorPipeDarkTimeString            "ANDOR_PIPE_DARK_TIME"
+#define AndorPipeFlatTimeString            "ANDOR_PIPE_FLAT_TIME"
+#define AndorPipeStatsTimeString           "ANDOR_PIPE_STATS_TIME"
+#define AndorPipePendingString             "ANDOR_PIPE_PENDING"
+#define AndorPipeStealsString              "ANDOR_PIPE_STEALS"
+#define AndorPipeErrorsString              "ANDOR_PIPE_ERRORS"
+#define AndorPipeStatsMinString            "ANDOR_PIPE_STATS_MIN"
+#define AndorPipeStatsMaxString            "ANDOR_PIPE_STATS_MAX"
+#define AndorPipeStatsMeanString           "ANDOR_PIPE_STATS_MEAN"
+#define AndorPipeStatsSigmaString          "ANDOR_PIPE_STATS_SIGMA"
+#define AndorCubeModeString                "ANDOR_CUBE_MODE"
+#define AndorCubeNumScansString            "ANDOR_CUBE_NUM_SCANS"
+#define AndorCubeIndexSourceString         "ANDOR_CUBE_INDEX_SOURCE"
+#define AndorCubePositionString            "ANDOR_CUBE_POSITION"
+#define AndorCubeAttributeString           "ANDOR_CUBE_ATTRIBUTE"
+#define AndorCubePublishPeriodString       "ANDOR_CUBE_PUBLISH_PERIOD"
+#define AndorCubeFilledString              "ANDOR_CUBE_FILLED"
+#define AndorCubeCountString               "ANDOR_CUBE_COUNT"
+#define AndorCubeErrorsString              "ANDOR_CUBE_ERRORS"
+#define AndorCubeSizeXString               "ANDOR_CUBE_SIZE_X"
+#define AndorCubeSizeYString               "ANDOR_CUBE_SIZE_Y"
+#define AndorCubeSizeZString               "ANDOR_CUBE_SIZE_Z"
+#define AndorCubeArraySizeString           "ANDOR_CUBE_ARRAY_SIZE"
+#define AndorAFStartString                 "ANDOR_AF_START"
+#define AndorAFAbortString                 "ANDOR_AF_ABORT"
+#define AndorAFStatusString                "ANDOR_AF_STATUS"
+#define AndorAFRangeString                 "ANDOR_AF_RANGE"
+#define AndorAFCoarseStepString            "ANDOR_AF_COARSE_STEP"
+#define AndorAFMinStepString               "ANDOR_AF_MIN_STEP"
+#define AndorAFSettleString                "ANDOR_AF_SETTLE"
+#define AndorAFFramesString                "ANDOR_AF_FRAMES"
+#define AndorAFPositionString              "ANDOR_AF_POSITION"
+#define AndorAFSharpnessString             "ANDOR_AF_SHARPNESS"
+#define AndorAFBestFocusString             "ANDOR_AF_BEST_FOCUS"
+#define AndorAFBestSharpnessString         "ANDOR_AF_BEST_SHARPNESS"
+#define AndorAFSamplesString               "ANDOR_AF_SAMPLES"
+#define AndorAFTableFileString             "ANDOR_AF_TABLE_FILE"
+#define AndorAFTableSizeString             "ANDOR_AF_TABLE_SIZE"
 
 /**
  * Structure defining an ADC speed for the ADAndor driver.
@@ -96,13 +338,22 @@ class AndorCCD : public ADDriver {
   /* These are the methods that we override from ADDriver */
   virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
   virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
+  virtual asynStatus writeOctet(asynUser *pasynUser, const char *value, size_t nChars,
+                                size_t *nActual);
   virtual void report(FILE *fp, int details);
+  virtual asynStatus lock();
+  virtual asynStatus unlock();
   virtual asynStatus readEnum(asynUser *pasynUser, char *strings[], int values[], int severities[],
                               size_t nElements, size_t *nIn);
 
   // Should be private, but are called from C so must be public
   void statusTask(void);
   void dataTask(void);
+  void applyTask(void);
+  void exposureTask(void);
+  void focusTask(void);
+  void timingEvent(const epicsTimeStamp *pTriggerTime, int pulseId);
+  AndorMetrics *metrics() { return mMetrics; }
 
  protected:
   int AndorCoolerParam;
@@ -131,18 +382,320 @@ class AndorCCD : public ADDriver {
   int AndorMaxImagesPerDMA;
   int AndorSecondsPerDMA;
   int AndorIsolatedCropMode;
+  int AndorFSPrealloc;
+  int AndorFSQueueSize;
+  int AndorFSQueueFree;
+  int AndorFSFramesWritten;
+  int AndorFSFramesDropped;
+  int AndorFSMBWritten;
+  int AndorAverageMode;
+  int AndorAverageFrames;
+  int AndorAverageFactor;
+  int AndorAverageReset;
+  int AndorAverageCount;
+  int AndorAverageHardware;
+  int AndorSWBinX;
+  int AndorSWBinY;
+  int AndorSWBinMode;
+  int AndorSWBinOutput;
+  int AndorGateMode;
+  int AndorGateThreshold;
+  int AndorGateStride;
+  int AndorGateMinX;
+  int AndorGateMinY;
+  int AndorGateSizeX;
+  int AndorGateSizeY;
+  int AndorGateKeyframe;
+  int AndorGateReference;
+  int AndorGateMetric;
+  int AndorGatePassed;
+  int AndorGateSkipped;
+  int AndorGatePassRatio;
+  int AndorEventMode;
+  int AndorEventThreshold;
+  int AndorEventPedestal;
+  int AndorEventMaxHits;
+  int AndorEventDenseInterval;
+  int AndorEventCount;
+  int AndorEventTotal;
+  int AndorEventOverflows;
+  int AndorNumberPrescans;
+  int AndorBaselineOffset;
+  int AndorBaselineMode;
+  int AndorBaselineColumns;
+  int AndorBaselineSide;
+  int AndorBaselineValue;
+  int AndorBaselineTrend;
+  int AndorTriggerLatencyMode;
+  int AndorTriggerLatency;
+  int AndorTimingSource;
+  int AndorTimingDelay;
+  int AndorTimingTolerance;
+  int AndorTimingSimRate;
+  int AndorTimingEvent;
+  int AndorTimingPulseId;
+  int AndorTimingError;
+  int AndorTimingMatch;
+  int AndorTimingMatched;
+  int AndorTimingResyncs;
+  int AndorTimingUnmatched;
+  int AndorTimingOverflows;
+  int AndorTimingQueued;
+  int AndorDelayCalibrate;
+  int AndorDelayReset;
+  int AndorDelayMeasured;
+  int AndorDelayResidual;
+  int AndorDelayPredicted;
+  int AndorDelayRMS;
+  int AndorDelayC0;
+  int AndorDelayC1;
+  int AndorDelayC2;
+  int AndorDelaySamples;
+  int AndorDelayConfigMean;
+  int AndorDelayConfigStd;
+  int AndorDelayConfigSamples;
+  int AndorFlightAutoDump;
+  int AndorFlightPath;
+  int AndorFlightDump;
+  int AndorFlightDumps;
+  int AndorFlightFile;
+  int AndorPresetName;
+  int AndorPresetSave;
+  int AndorPresetApply;
+  int AndorPresetDelete;
+  int AndorPresetList;
+  int AndorPresetChanged;
+  int AndorPresetFile;
+  int AndorOAMode;
+  int AndorOAApply;
+  int AndorCMMode;
+  int AndorCMThreshold;
+  int AndorCMMinPixels;
+  int AndorCMThreads;
+  int AndorCMRowRMS;
+  int AndorCMColumnRMS;
+  int AndorPeakMode;
+  int AndorPeakWindows;
+  int AndorPeakNumWindows;
+  int AndorPeakMaxIter;
+  int AndorPeakCalibrated;
+  int AndorPeakFailures;
+  int AndorPeakPosition;
+  int AndorPeakWidth;
+  int AndorPeakAmplitude;
+  int AndorPeakQuality;
+  int AndorPeakHistoryWindow;
+  int AndorPeakHistPosition;
+  int AndorPeakHistWidth;
+  int AndorPeakHistAmplitude;
+  int AndorPeakHistQuality;
+  int AndorPeakReset;
+  int AndorPPMode;
+  int AndorPPSeriesLength;
+  int AndorPPRepeats;
+  int AndorPPPairs;
+  int AndorPPKey;
+  int AndorPPGate;
+  int AndorPPIndex;
+  int AndorPPCount;
+  int AndorPPOnCount;
+  int AndorPPOffCount;
+  int AndorPPReset;
+  int AndorDDGEnable;
+  int AndorDDGGateMode;
+  int AndorMCPGain;
+  int AndorDDGDelay;
+  int AndorDDGWidth;
+  int AndorDDGStepMode;
+  int AndorDDGStepP1;
+  int AndorDDGStepP2;
+  int AndorDDGWidthStepMode;
+  int AndorDDGWidthStepP1;
+  int AndorDDGWidthStepP2;
+  int AndorDDGIOC;
+  int AndorDDGIOCFrequency;
+  int AndorDDGIOCPulses;
+  int AndorDDGFrameDelay;
+  int AndorDDGFrameWidth;
+  int AndorLockPortHoldMax;
+  int AndorLockSDKHoldMax;
+  int AndorLockConfigHoldMax;
+  int AndorLockReadoutWaitMax;
+  int AndorLockStatsReset;
+  int AndorApplyMode;
+  int AndorConfigBusy;
+  int AndorConfigRequested;
+  int AndorConfigApplied;
+  int AndorRecoveryMode;
+  int AndorRecoveryMax;
+  int AndorRecoveryCount;
+  int AndorRecoveryGap;
+  int AndorRecoveryFramesLost;
+  int AndorExposureEventEnable;
+  int AndorExposureEventAvail;
+  int AndorExposureEventPeriod;
+  int AndorExposureStart;
+  int AndorExposureEnd;
+  int AndorExposureDuration;
+  int AndorExposureStarts;
+  int AndorExposureEnds;
+  int AndorExposureUnmatched;
+  int AndorPlan;
+  int AndorPlanTestSize;
+  int AndorPlanDuration;
+  int AndorPlanFrameRate;
+  int AndorPlanDataRate;
+  int AndorPlanDiskRate;
+  int AndorPlanDiskFree;
+  int AndorPlanBuffer;
+  int AndorPlanRunLength;
+  int AndorPlanBottleneck;
+  int AndorPlanDrops;
+  int AndorSingleTrackCentre;
+  int AndorSingleTrackHeight;
+  int AndorPipeThreads;
+  int AndorPipeDarkEnable;
+  int AndorPipeFlatEnable;
+  int AndorPipeStatsEnable;
+  int AndorPipeDarkCapture;
+  int AndorPipeFlatCapture;
+  int AndorPipeDarkValid;
+  int AndorPipeFlatValid;
+  int AndorPipeDarkTime;
+  int AndorPipeFlatTime;
+  int AndorPipeStatsTime;
+  int AndorPipePending;
+  int AndorPipeSteals;
+  int AndorPipeErrors;
+  int AndorPipeStatsMin;
+  int AndorPipeStatsMax;
+  int AndorPipeStatsMean;
+  int AndorPipeStatsSigma;
+  int AndorCubeMode;
+  int AndorCubeNumScans;
+  int AndorCubeIndexSource;
+  int AndorCubePosition;
+  int AndorCubeAttribute;
+  int AndorCubePublishPeriod;
+  int AndorCubeFilled;
+  int AndorCubeCount;
+  int AndorCubeErrors;
+  int AndorCubeSizeX;
+  int AndorCubeSizeY;
+  int AndorCubeSizeZ;
+  int AndorCubeArraySize;
+  int AndorAFStart;
+  int AndorAFAbort;
+  int AndorAFStatus;
+  int AndorAFRange;
+  int AndorAFCoarseStep;
+  int AndorAFMinStep;
+  int AndorAFSettle;
+  int AndorAFFrames;
+  int AndorAFPosition;
+  int AndorAFSharpness;
+  int AndorAFBestFocus;
+  int AndorAFBestSharpness;
+  int AndorAFSamples;
+  int AndorAFTableFile;
+  int AndorAFTableSize;
 #define LAST_ANDOR_PARAM AndorVerticalShiftAmplitude
 
  private:
 
   unsigned int checkStatus(unsigned int returnStatus);
   asynStatus setupAcquisition();
+  void setupDDG();
   asynStatus setupShutter(int command);
-  void saveDataFrame(int frameNumber);
+  void saveDataFrame(int frameNumber, int imageCounter);
   void setupADCSpeeds();
   void setupPreAmpGains();
   void setupVerticalShiftPeriods();
   unsigned int SaveAsSPE(char *fullFileName);
+  asynStatus openFrameStore();
+  unsigned int appendFrameStore(int imageCounter);
+  void closeFrameStore();
+  void updateFrameStoreStatus();
+  asynStatus setupAveraging(bool live);
+  bool publishFrame(NDArray *pArray, int frameIndex, int imageCounter,
+                    const epicsTimeStamp *pReadoutTime);
+  void flushPipeline(int numFrames, int autoSave, bool wait);
+  void setupPipeline();
+  void updatePipelineStatus();
+  void addToCube(NDArray *pArray);
+  void publishCube(bool final);
+  asynStatus startAutofocus();
+  void moveFocus(int position, bool final);
+  void storeFocus(int focus);
+  void autofocusFrame(NDArray *pArray, int frameIndex);
+  void stopAutofocus(int status, const char *message);
+  NDArray *processFrame(NDArray *pArray, int frameIndex, int imageCounter);
+  NDArray *pumpProbe(NDArray *pArray, int frameIndex);
+  NDArray *findEvents(NDArray *pArray, int imageCounter);
+  void trackPeaks(NDArray *pArray);
+  void loadPeakCalibration(int sizeX);
+  bool gateFrame(NDArray *pArray);
+  void updateGateStatus();
+  void setupTimingSource();
+  void tagFrame(NDArray *pArray, int frameIndex, const epicsTimeStamp *pReadoutTime);
+  void tagGate(NDArray *pArray, int frameIndex);
+  void rebaseDDGSteps(int frameOffset);
+  void setupExposureEvents();
+  void tagExposure(NDArray *pArray, const epicsTimeStamp *pReadoutTime);
+  void measureDelay(int frameIndex, const epicsTimeStamp *pReadoutTime);
+  void updateDelayStatus();
+  void setupMetrics();
+  void dumpFlightRecorder(int reason);
+  void setupPresets();
+  asynStatus savePreset();
+  asynStatus applyPreset();
+  asynStatus deletePreset();
+  void updatePresetList();
+  void writePresetFile();
+  void setupOptAcquire();
+  asynStatus applyOptAcquireMode();
+  void updateMetrics();
+  void updateReadoutConfig();
+  void updateLockStatus();
+  asynStatus requestSetup();
+  asynStatus applySetup();
+  bool recoverAcquisition(int cameraStatus, const epicsTimeStamp *pLastFrameTime);
+  asynStatus planCapacity();
+  // Parameters, objects and write handlers of the features, one andorCCD<Feature>.cpp each
+  int initFrameStore();
+  int initProcessing();
+  void startProcessing();
+  bool writeProcessingInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                            asynStatus *pStatus);
+  bool writeProcessingOctet(int function, const char *value, size_t nChars,
+                            size_t *nActual, asynStatus *pStatus);
+  int initTiming();
+  void startTiming();
+  bool writeTimingInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                        asynStatus *pStatus);
+  bool writeTimingFloat64(int function, epicsFloat64 value, asynStatus *pStatus);
+  int initDDG();
+  bool writeDDGInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                     asynStatus *pStatus);
+  bool writeDDGFloat64(int function, epicsFloat64 value, asynStatus *pStatus);
+  int initPipeline();
+  bool writePipelineInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                          asynStatus *pStatus);
+  int initCube();
+  void startCube();
+  int initAutofocus();
+  bool writeAutofocusInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                           asynStatus *pStatus);
+  bool writeAutofocusOctet(int function, const char *value, size_t nChars,
+                           size_t *nActual, asynStatus *pStatus);
+  int initPresets();
+  bool writePresetsInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                         asynStatus *pStatus);
+  bool writePresetsOctet(int function, const char *value, size_t nChars,
+                         size_t *nActual, asynStatus *pStatus);
+  int initDiagnostics();
+  bool writeDiagnosticsInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                             asynStatus *pStatus);
   /**
    * Additional image mode to those in ADImageMode_t
    */
@@ -208,16 +761,133 @@ class AndorCCD : public ADDriver {
   static const epicsInt32 AFFRAW;
   static const epicsInt32 AFFFITS;
   static const epicsInt32 AFFSPE;
+  static const epicsInt32 AFFFrameStore;
+
+  /**
+   * List of SDK data averaging filter modes
+   */
+  static const epicsInt32 AFilterNoAverage;
+  static const epicsInt32 AFilterRecursiveAverage;
+  static const epicsInt32 AFilterFrameAverage;
+
+  /**
+   * List of trigger latency modes
+   */
+  static const epicsInt32 ALatencyManual;
+  static const epicsInt32 ALatencyLow;
+  static const epicsInt32 ALatencyLowest;
+
+  /**
+   * List of sources for the uniqueId of frames
+   */
+  static const epicsInt32 ATimingTimeStamp;
+  static const epicsInt32 ATimingFrameCounter;
+  static const epicsInt32 ATimingEvents;
+  static const epicsInt32 ATimingSimulated;
+
+  /**
+   * List of ways to tell pump on frames from pump off frames
+   */
+  static const epicsInt32 APPKeyOddOn;
+  static const epicsInt32 APPKeyEvenOn;
+  static const epicsInt32 APPKeyGate;
+
+  /**
+   * List of DDG gate step modes.  Off is SDK step mode 100, the others are the SDK
+   * step mode plus 1.
+   */
+  static const epicsInt32 ADDGStepOff;
+  static const epicsInt32 ADDGStepConstant;
+  static const epicsInt32 ADDGStepExponential;
+  static const epicsInt32 ADDGStepLogarithmic;
+  static const epicsInt32 ADDGStepLinear;
+
+  /**
+   * List of ways configuration changes are applied to the camera
+   */
+  static const epicsInt32 AApplySync;
+  static const epicsInt32 AApplyAsync;
+
+  /**
+   * List of recovery policies after a buffer overflow or spool error
+   */
+  static const epicsInt32 ARecoveryOff;
+  static const epicsInt32 ARecoveryRestart;
+  static const epicsInt32 ARecoveryReduceDMA;
+
+  /**
+   * List of autofocus states
+   */
+  static const epicsInt32 AFocusIdle;
+  static const epicsInt32 AFocusBusy;
+  static const epicsInt32 AFocusDone;
+  static const epicsInt32 AFocusFailed;
+  static const epicsInt32 AFocusAborted;
+
+  /**
+   * Performance metrics.  They are registered in this order when the driver is created, so
+   * the enum values are also the metric ids.
+   */
+  enum {
+    MetricFrames,
+    MetricFramesPublished,
+    MetricFramesSkipped,
+    MetricFramesDropped,
+    MetricStageReadout,
+    MetricStageProcess,
+    MetricStageCallbacks,
+    MetricStageSave,
+    MetricSDKCalls,
+    MetricSDKErrors,
+    MetricFSFramesWritten,
+    MetricFSFramesDropped,
+    MetricFSBytesWritten,
+    MetricFSQueueFree,
+    MetricTimingQueued,
+    MetricTimingUnmatched,
+    MetricTimingOverflows,
+    MetricPoolFreeBuffers,
+    MetricTemperature,
+    MetricAcquiring,
+    MetricLockWaitPort,
+    MetricLockWaitSDK,
+    MetricLockWaitConfig,
+    MetricLockHoldPort,
+    MetricLockHoldSDK,
+    MetricLockHoldConfig,
+    MetricPipeDark,
+    MetricPipeFlat,
+    MetricPipeStats,
+    NumMetrics
+  };
+
+  /**
+   * Stages of the processing pipeline, in the order they are added
+   */
+  enum {
+    PipeStageDark,
+    PipeStageFlat,
+    PipeStageStats,
+    NumPipeStages
+  };
 
   epicsEventId statusEvent;
   epicsEventId dataEvent;
+  epicsEventId applyEvent;
+  epicsEventId exposureEvent;
+  epicsEventId focusEvent;
   double mPollingPeriod;
   double mFastPollingPeriod;
   double mTempPollingPeriod;
+  double mApplySettleTime;
+  // Configuration generations.  Each change that needs setupAcquisition increments
+  // mSetupRequested, and mSetupApplied is the last generation sent to the camera.
+  int mSetupRequested;
+  int mSetupApplied;
   unsigned int mAcquiringData;
   char *mInstallPath;
   bool mExiting;
-  int mExited;
+  int mExited;                 // Threads that have exited, counted with epicsAtomic
 
   /**
    * ADC speed parameters
@@ -239,6 +909,7 @@ class AndorCCD : public ADDriver {
 
   //Shutter control parameters
   float mAcquireTime;
+  float mAcquireTimeActual;
   float mAcquirePeriod;
   float mAccumulatePeriod;
   int mMinShutterOpenTime;
@@ -258,6 +929,127 @@ class AndorCCD : public ADDriver {
   tagCSMAHEAD *mSPEHeader;
   xmlDocPtr mSPEDoc;
 
+  // Append-only frame store, open while acquiring with FileFormat=Frame Store
+  AndorFrameStore *mFrameStore;
+
+  // Frame averaging, done by the SDK when mAverageHardware is set, otherwise by mAverager
+  AndorFrameAverager *mAverager;
+  int mAverageHardware;
+
+  // Software binning, applied to each frame before averaging
+  AndorFrameBinner *mBinner;
+
+  // Change detection gating, decides which frames are published
+  AndorFrameGate *mGate;
+
+  // Sparse event output
+  AndorEventFinder *mEventFinder;
+
+  // Reference column baseline correction, applied to each frame before software binning
+  AndorBaselineCorrector *mBaseline;
+
+  // Row and column common-mode correction, applied after the baseline correction
+  AndorCommonMode *mCommonMode;
+
+  // Spectral peak tracking.  mPeakCalibrationWidth is the spectrum width for which the
+  // Shamrock calibration was last read, 0 to read it again.
+  AndorPeakTracker *mPeakTracker;
+  int mPeakCalibrationWidth;
+
+  // Pump-probe series averaging and on/off differencing, applied before frame averaging
+  AndorPumpProbe *mPumpProbe;
+
+  // True while planCapacity has released the port lock for its write test
+  bool mPlanning;
+
+  // Frames of the acquisition read before the last restart by recoverAcquisition.  The SDK
+  // numbers the frames of a restarted series from 1 again, so this is added to the SDK
+  // index to give the index of the frame in the acquisition.
+  int mFrameIndexOffset;
+
+  // DDG gate times in ns and gate steps of the current acquisition, used to tag frames
+  // with their gate.  Index 0 is the gate delay and index 1 the gate width.
+  bool mDDGActive;
+  double mDDGTime[2];
+  int mDDGStepMode[2];
+  double mDDGStepP1[2];
+  double mDDGStepP2[2];
+
+  // Timing events used to tag frames with pulse IDs
+  AndorTimingTagger *mTimingTagger;
+
+  // Exposure start and end events sampled by exposureTask.  mExposuresPerFrame is the
+  // number of exposures accumulated into each frame, 0 when the events are not used.
+  AndorExposureEvents *mExposureEvents;
+  int mExposuresPerFrame;
+
+  // Processing pipeline run on each frame between readout and processFrame.  The dark
+  // and flat stages are owned by mPipeline.
+  AndorPipeline *mPipeline;
+  AndorDarkStage *mPipeDark;
+  AndorFlatStage *mPipeFlat;
+
+  // Hyperspectral cube being assembled from the frames of a scan.  mCubeUniqueId is the
+  // uniqueId of the last cube array published, partial or final.
+  AndorCubeBuilder *mCubeBuilder;
+  int mCubeUniqueId;
+
+  // Shamrock focus mirror autofocus, run on the frames of a live acquisition.  Frames up to
+  // mAFSkipUntil were exposed while the mirror moved, and it is -1 while the mirror moves.
+  // mAFSum is the sum of the sharpness of the mAFFrames frames measured at the current
+  // position.  focusTask moves the mirror to mAFTarget; mAFMove counts the moves requested,
+  // so a move requested while another runs is not taken for it.
+  AndorFocusSearch *mFocusSearch;
+  bool mAFActive;
+  int mAFSkipUntil;
+  int mAFFrames;
+  double mAFSum;
+  int mAFTarget;
+  bool mAFFinal;
+  int mAFMove;
+
+  // Model of the delay from the end of the exposure to the NDArray time stamp, fitted from
+  // the SDK frame time stamps.  mDelayKey identifies the readout configuration.
+  AndorDelayModel *mDelayModel;
+  int mDelayKey[6];
+  double mDelayNumPixels;
+
+  // Performance counters exported in OpenMetrics text format
+  AndorMetrics *mMetrics;
+
+  // Recent data path events, dumped to a file on acquisition faults
+  AndorFlightRecorder *mFlightRecorder;
+
+  // Named acquisition presets.  mPresetParams are the parameters in a preset, the first
+  // mNumPresetInts of them integers and the rest doubles.  While mDeferSetup is set,
+  // setupAcquisition only sets mSetupPending, so a preset is applied in one pass.
+  AndorPresetStore *mPresets;
+  int mPresetParams[MAX_PRESET_PARAMS];
+  int mNumPresetInts;
+  int mNumPresetParams;
+  bool mDeferSetup;
+  bool mSetupPending;
+
+  // OptAcquire preset modes, mOAModeNames[0] is "None"
+  int mNumOAModes;
+  char mOAModeNames[MAX_OA_MODES][MAX_OA_NAME_SIZE];
+
+  // Locks.  The asyn port lock, timed by mPortLock, protects the parameter library and
+  // everything published through it.  mSDKLock serializes calls to the Andor SDK, and
+  // mConfigLock is held while the camera is being configured and protects mReadoutConfig.
+  // A thread that needs several of them takes them in the order port, config, SDK.  The
+  // readout takes only the SDK and config locks, so parameter writes and callbacks in
+  // other threads do not delay it.
+  AndorLock *mPortLock;
+  AndorLock *mSDKLock;
+  AndorLock *mConfigLock;
+  struct {
+    int arrayCallbacks;
+    int sizeX;
+    int sizeY;
+    NDDataType_t dataType;
+  } mReadoutConfig;
+
   // Camera init status
   bool mInitOK;
 };
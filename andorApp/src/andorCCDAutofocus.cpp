@@ -0,0 +1,370 @@
+/**
+ * Shamrock focus mirror autofocus of the ADAndor driver.
+ */
+
+#include <stdio.h>
+#include <string>
+
+#include <epicsEvent.h>
+#include <epicsAtomic.h>
+
+#include <ADDriver.h>
+
+#ifdef _WIN32
+#include "ATMCD32D.h"
+#else
+#include "atmcdLXd.h"
+#endif
+#include "atspectrograph.h"
+
+#include "andorCCD.h"
+#include "andorAutofocus.h"
+#include "andorLock.h"
+
+static const char *driverName = "andorCCD";
+
+/**
+ * Create the parameters and focus search of the autofocus and set the parameter defaults.
+ */
+int AndorCCD::initAutofocus()
+{
+  int status = asynSuccess;
+
+  createParam(AndorAFStartString,                 asynParamInt32, &AndorAFStart);
+  createParam(AndorAFAbortString,                 asynParamInt32, &AndorAFAbort);
+  createParam(AndorAFStatusString,                asynParamInt32, &AndorAFStatus);
+  createParam(AndorAFRangeString,                 asynParamInt32, &AndorAFRange);
+  createParam(AndorAFCoarseStepString,            asynParamInt32, &AndorAFCoarseStep);
+  createParam(AndorAFMinStepString,               asynParamInt32, &AndorAFMinStep);
+  createParam(AndorAFSettleString,                asynParamInt32, &AndorAFSettle);
+  createParam(AndorAFFramesString,                asynParamInt32, &AndorAFFrames);
+  createParam(AndorAFPositionString,              asynParamInt32, &AndorAFPosition);
+  createParam(AndorAFSharpnessString,             asynParamFloat64, &AndorAFSharpness);
+  createParam(AndorAFBestFocusString,             asynParamInt32, &AndorAFBestFocus);
+  createParam(AndorAFBestSharpnessString,         asynParamFloat64, &AndorAFBestSharpness);
+  createParam(AndorAFSamplesString,               asynParamInt32, &AndorAFSamples);
+  createParam(AndorAFTableFileString,             asynParamOctet, &AndorAFTableFile);
+  createParam(AndorAFTableSizeString,             asynParamInt32, &AndorAFTableSize);
+
+  mFocusSearch = new AndorFocusSearch();
+
+  status |= setIntegerParam(AndorAFStart, 0);
+  status |= setIntegerParam(AndorAFAbort, 0);
+  status |= setIntegerParam(AndorAFStatus, AFocusIdle);
+  status |= setIntegerParam(AndorAFRange, 0);
+  status |= setIntegerParam(AndorAFCoarseStep, 50);
+  status |= setIntegerParam(AndorAFMinStep, 2);
+  status |= setIntegerParam(AndorAFSettle, 1);
+  status |= setIntegerParam(AndorAFFrames, 1);
+  status |= setIntegerParam(AndorAFPosition, 0);
+  status |= setDoubleParam(AndorAFSharpness, 0.);
+  status |= setIntegerParam(AndorAFBestFocus, 0);
+  status |= setDoubleParam(AndorAFBestSharpness, 0.);
+  status |= setIntegerParam(AndorAFSamples, 0);
+  status |= setStringParam(AndorAFTableFile, "");
+  status |= setIntegerParam(AndorAFTableSize, 0);
+  return status;
+}
+
+/**
+ * Called from writeInt32 for every parameter.
+ * Handles the integer parameters of the autofocus.
+ * \param[in] function Parameter being written; its new value is already in the parameter library.
+ * \param[in] value New value.
+ * \param[in] oldValue Value before the write, restored if the write fails.
+ * \param[out] pStatus Status of the write, if it was handled.
+ * \return true if the parameter belongs to the autofocus, false otherwise.
+ */
+bool AndorCCD::writeAutofocusInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                                   asynStatus *pStatus)
+{
+  if (function == AndorAFStart) {
+    *pStatus = value ? startAutofocus() : asynSuccess;
+    setIntegerParam(AndorAFStart, 0);
+  }
+  else if (function == AndorAFAbort) {
+    if (value && mAFActive) stopAutofocus(AFocusAborted, "Autofocus aborted");
+    setIntegerParam(AndorAFAbort, 0);
+    *pStatus = asynSuccess;
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Called from writeOctet for every parameter.  Reads the focus table when
+ * AndorAFTableFile is written.
+ * \param[in] function Parameter being written.
+ * \param[in] value Address of the string to write.
+ * \param[in] nChars Number of characters to write.
+ * \param[out] nActual Number of characters actually written.
+ * \param[out] pStatus Status of the write, if it was handled.
+ * \return true if the parameter belongs to the autofocus, false otherwise.
+ */
+bool AndorCCD::writeAutofocusOctet(int function, const char *value, size_t nChars,
+                                   size_t *nActual, asynStatus *pStatus)
+{
+  char fileName[MAX_FILENAME_LEN];
+  static const char *functionName = "writeAutofocusOctet";
+
+  if (function != AndorAFTableFile) return false;
+  AndorFocusTable *pTable = AndorFocusTable::device(mShamrockId);
+  setStringParam(function, value);
+  getStringParam(AndorAFTableFile, sizeof(fileName), fileName);
+  // A file that does not exist yet is created when the first focus is found
+  if (pTable && fileName[0] && (pTable->read(fileName) == 0)) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s:%s: read %d focus positions from %s\n",
+      driverName, functionName, pTable->size(), fileName);
+  }
+  setIntegerParam(AndorAFTableSize, pTable ? pTable->size() : 0);
+  *nActual = nChars;
+  *pStatus = asynSuccess;
+  return true;
+}
+
+/**
+ * Start a search for the sharpest focus mirror position, measured on the frames of the
+ * current acquisition.  The search range is the whole travel of the mirror, or AndorAFRange
+ * steps either side of its current position.
+ */
+asynStatus AndorCCD::startAutofocus()
+{
+  AndorFocusTable *pTable;
+  int error, numSpectrometers, present, maxSteps, current;
+  int range, coarseStep, minStep, low, high;
+  static const char *functionName = "startAutofocus";
+
+  if (!mAcquiringData) {
+    stopAutofocus(AFocusFailed, "Autofocus needs a running acquisition");
+    return asynError;
+  }
+  error = ATSpectrographGetNumberDevices(&numSpectrometers);
+  if ((error != ATSPECTROGRAPH_SUCCESS) || (mShamrockId < 0) || (mShamrockId > numSpectrometers-1)) {
+    stopAutofocus(AFocusFailed, "Autofocus needs a Shamrock spectrograph");
+    return asynError;
+  }
+  error = ATSpectrographFocusMirrorIsPresent(mShamrockId, &present);
+  if ((error != ATSPECTROGRAPH_SUCCESS) || !present) {
+    stopAutofocus(AFocusFailed, "The Shamrock has no focus mirror");
+    return asynError;
+  }
+  error = ATSpectrographGetFocusMirrorMaxSteps(mShamrockId, &maxSteps);
+  if (error == ATSPECTROGRAPH_SUCCESS) error = ATSpectrographGetFocusMirror(mShamrockId, &current);
+  if (error != ATSPECTROGRAPH_SUCCESS) {
+    stopAutofocus(AFocusFailed, "Unable to read the focus mirror");
+    return asynError;
+  }
+  getIntegerParam(AndorAFRange, &range);
+  getIntegerParam(AndorAFCoarseStep, &coarseStep);
+  getIntegerParam(AndorAFMinStep, &minStep);
+  low = 0;
+  high = maxSteps;
+  if (range > 0) {
+    if (current - range > low) low = current - range;
+    if (current + range < high) high = current + range;
+  }
+  if (mFocusSearch->start(low, high, coarseStep, minStep)) {
+    stopAutofocus(AFocusFailed, "Invalid autofocus range or steps");
+    return asynError;
+  }
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s:%s: searching %d to %d, coarse step %d, minimum step %d\n",
+    driverName, functionName, low, high, coarseStep, minStep);
+  mAFActive = true;
+  pTable = AndorFocusTable::device(mShamrockId);
+  if (pTable) pTable->setSearching(true);
+  setIntegerParam(AndorAFStatus, AFocusBusy);
+  setIntegerParam(AndorAFSamples, 0);
+  setIntegerParam(AndorAFBestFocus, current);
+  setDoubleParam(AndorAFBestSharpness, 0.);
+  moveFocus(mFocusSearch->position(), false);
+  return asynSuccess;
+}
+
+/**
+ * Ask focusTask to move the focus mirror to a position of the autofocus search.  No frame
+ * is measured until the move is done.
+ * \param[in] position Position in steps.
+ * \param[in] final True for the move to the best position, which ends the search.
+ */
+void AndorCCD::moveFocus(int position, bool final)
+{
+  mAFSkipUntil = -1;
+  mAFFrames = 0;
+  mAFSum = 0.;
+  mAFTarget = position;
+  mAFFinal = final;
+  mAFMove++;
+  setIntegerParam(AndorAFPosition, position);
+  epicsEventSignal(focusEvent);
+}
+
+/**
+ * Move the focus mirror for the autofocus. Meant to be run in own thread.  The move is
+ * made without the port lock, so the frames go on being read and published while the
+ * mirror moves.  The frames acquired up to AndorAFSettle frames after the move are not
+ * measured.  The SDK moves the mirror relative to its current position, so the move
+ * holds the mirror lock of the focus table, which the Shamrock driver also takes.
+ */
+void AndorCCD::focusTask(void)
+{
+  AndorFocusTable *pTable;
+  int target, move, error, current, settle;
+  bool final;
+  at_32 numAcquired;
+  static const char *functionName = "focusTask";
+
+  printf("%s:%s: Focus thread started...\n", driverName, functionName);
+
+  while (!mExiting) {
+    epicsEventWait(focusEvent);
+    if (mExiting) break;
+    this->lock();
+    target = mAFTarget;
+    final = mAFFinal;
+    move = mAFMove;
+    if (!mAFActive) {
+      this->unlock();
+      continue;
+    }
+    this->unlock();
+
+    pTable = AndorFocusTable::device(mShamrockId);
+    if (pTable) pTable->lockMirror();
+    error = ATSpectrographGetFocusMirror(mShamrockId, &current);
+    if ((error == ATSPECTROGRAPH_SUCCESS) && (target != current)) {
+      error = ATSpectrographSetFocusMirror(mShamrockId, target - current);
+    }
+    if (pTable) pTable->unlockMirror();
+
+    this->lock();
+    // The search was stopped, or moved on, while the mirror moved
+    if (!mAFActive || (move != mAFMove)) {
+      this->unlock();
+      continue;
+    }
+    if (error != ATSPECTROGRAPH_SUCCESS) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s:%s: error %d moving the focus mirror to %d\n",
+        driverName, functionName, error, target);
+      stopAutofocus(AFocusFailed, "Unable to move the focus mirror");
+    } else if (final) {
+      storeFocus(target);
+      stopAutofocus(AFocusDone, "Autofocus done");
+    } else {
+      getIntegerParam(AndorAFSettle, &settle);
+      try {
+        AndorLock::Guard sdkGuard(mSDKLock);
+        checkStatus(GetTotalNumberImagesAcquired(&numAcquired));
+        mAFSkipUntil = numAcquired + mFrameIndexOffset + settle;
+      } catch (const std::string &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+          "%s:%s: %s\n",
+          driverName, functionName, e.c_str());
+        stopAutofocus(AFocusFailed, "Unable to read the number of frames acquired");
+      }
+    }
+    callParamCallbacks();
+    this->unlock();
+  }
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s:%s: Focus thread exiting ...\n",
+      driverName, functionName);
+
+  epicsAtomicIncrIntT(&mExited);
+}
+
+/**
+ * Measure the sharpness of a frame for the autofocus.  When AndorAFFrames frames have
+ * been measured at a position their mean is reported to the search, and the mirror is
+ * moved to the next position by focusTask.  When the search is done the mirror is moved
+ * to the best position, which focusTask stores in the focus table.
+ * \param[in] pArray The processed frame.
+ * \param[in] frameIndex Index of the frame in the acquisition.
+ */
+void AndorCCD::autofocusFrame(NDArray *pArray, int frameIndex)
+{
+  int numFrames;
+  double sharpness;
+  static const char *functionName = "autofocusFrame";
+
+  if ((mAFSkipUntil < 0) || (frameIndex <= mAFSkipUntil)) return;
+  sharpness = AndorFocusSearch::sharpness(pArray);
+  if (sharpness < 0.) {
+    stopAutofocus(AFocusFailed, "Autofocus needs 1-D or 2-D UInt16, UInt32 or Float32 frames");
+    return;
+  }
+  setDoubleParam(AndorAFSharpness, sharpness);
+  mAFSum += sharpness;
+  getIntegerParam(AndorAFFrames, &numFrames);
+  if (++mAFFrames < numFrames) return;
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s:%s: position=%d, sharpness=%g\n",
+    driverName, functionName, mFocusSearch->position(), mAFSum / mAFFrames);
+  mFocusSearch->report(mAFSum / mAFFrames);
+  setIntegerParam(AndorAFSamples, mFocusSearch->samples());
+  setIntegerParam(AndorAFBestFocus, mFocusSearch->best());
+  setDoubleParam(AndorAFBestSharpness, mFocusSearch->bestSharpness());
+  if (!mFocusSearch->done()) {
+    moveFocus(mFocusSearch->position(), false);
+  } else {
+    moveFocus(mFocusSearch->best(), true);
+  }
+}
+
+/**
+ * Store the focus found by the autofocus in the focus table, for the current grating and
+ * centre wavelength, and write the table to AndorAFTableFile.
+ * \param[in] focus The best focus mirror position.
+ */
+void AndorCCD::storeFocus(int focus)
+{
+  AndorFocusTable *pTable;
+  int grating, error;
+  float wavelength;
+  char fileName[MAX_FILENAME_LEN];
+  static const char *functionName = "storeFocus";
+
+  pTable = AndorFocusTable::device(mShamrockId);
+  error = ATSpectrographGetGrating(mShamrockId, &grating);
+  if (error == ATSPECTROGRAPH_SUCCESS) error = ATSpectrographGetWavelength(mShamrockId, &wavelength);
+  if (pTable && (error == ATSPECTROGRAPH_SUCCESS) && (pTable->store(grating, wavelength, focus) == 0)) {
+    setIntegerParam(AndorAFTableSize, pTable->size());
+    getStringParam(AndorAFTableFile, sizeof(fileName), fileName);
+    if (fileName[0] && pTable->write(fileName)) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s:%s: unable to write the focus table %s\n",
+        driverName, functionName, fileName);
+    }
+  } else {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: unable to store the focus %d in the focus table\n",
+      driverName, functionName, focus);
+  }
+}
+
+/**
+ * End the autofocus.  The focus mirror is left where it is, and a move already started
+ * completes.
+ * \param[in] status The AndorAFStatus at the end.
+ * \param[in] message Message for AndorMessage.
+ */
+void AndorCCD::stopAutofocus(int status, const char *message)
+{
+  AndorFocusTable *pTable;
+  static const char *functionName = "stopAutofocus";
+
+  if (mAFActive) {
+    pTable = AndorFocusTable::device(mShamrockId);
+    if (pTable) pTable->setSearching(false);
+  }
+  mAFActive = false;
+  setIntegerParam(AndorAFStatus, status);
+  setStringParam(AndorMessage, message);
+  asynPrint(pasynUserSelf, (status == AFocusDone) ? ASYN_TRACE_FLOW : ASYN_TRACE_ERROR,
+    "%s:%s: %s\n",
+    driverName, functionName, message);
+}
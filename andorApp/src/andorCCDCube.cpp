@@ -0,0 +1,163 @@
+/**
+ * Hyperspectral cube assembly of the ADAndor driver.
+ */
+
+
+
+#include <epicsTime.h>
+#include <epicsEvent.h>
+
+#include <ADDriver.h>
+
+#ifdef _WIN32
+#include "ATMCD32D.h"
+#else
+#include "atmcdLXd.h"
+#endif
+
+#include "andorCCD.h"
+#include "andorCubeBuilder.h"
+
+static const char *driverName = "andorCCD";
+
+/**
+ * Create the parameters and builder of cube assembly and set the parameter defaults.
+ */
+int AndorCCD::initCube()
+{
+  int status = asynSuccess;
+
+  createParam(AndorCubeModeString,                asynParamInt32, &AndorCubeMode);
+  createParam(AndorCubeNumScansString,            asynParamInt32, &AndorCubeNumScans);
+  createParam(AndorCubeIndexSourceString,         asynParamInt32, &AndorCubeIndexSource);
+  createParam(AndorCubePositionString,            asynParamInt32, &AndorCubePosition);
+  createParam(AndorCubeAttributeString,           asynParamOctet, &AndorCubeAttribute);
+  createParam(AndorCubePublishPeriodString,       asynParamInt32, &AndorCubePublishPeriod);
+  createParam(AndorCubeFilledString,              asynParamInt32, &AndorCubeFilled);
+  createParam(AndorCubeCountString,               asynParamInt32, &AndorCubeCount);
+  createParam(AndorCubeErrorsString,              asynParamInt32, &AndorCubeErrors);
+  createParam(AndorCubeSizeXString,               asynParamInt32, &AndorCubeSizeX);
+  createParam(AndorCubeSizeYString,               asynParamInt32, &AndorCubeSizeY);
+  createParam(AndorCubeSizeZString,               asynParamInt32, &AndorCubeSizeZ);
+  createParam(AndorCubeArraySizeString,           asynParamInt32, &AndorCubeArraySize);
+
+  mCubeBuilder = new AndorCubeBuilder();
+
+  status |= setIntegerParam(AndorCubeMode, 0);
+  status |= setIntegerParam(AndorCubeNumScans, 100);
+  status |= setIntegerParam(AndorCubeIndexSource, AndorCubeBuilder::SourceFrame);
+  status |= setIntegerParam(AndorCubePosition, 0);
+  status |= setStringParam(AndorCubeAttribute, "ScanIndex");
+  status |= setIntegerParam(AndorCubePublishPeriod, 0);
+  status |= setIntegerParam(AndorCubeFilled, 0);
+  status |= setIntegerParam(AndorCubeCount, 0);
+  status |= setIntegerParam(AndorCubeErrors, 0);
+  status |= setIntegerParam(AndorCubeSizeX, 0);
+  status |= setIntegerParam(AndorCubeSizeY, 0);
+  status |= setIntegerParam(AndorCubeSizeZ, 0);
+  status |= setIntegerParam(AndorCubeArraySize, 0);
+  return status;
+}
+
+/**
+ * Prepare cube assembly for a new acquisition, which starts a new cube.
+ */
+void AndorCCD::startCube()
+{
+  mCubeBuilder->reset();
+  setIntegerParam(AndorCubeFilled, 0);
+  setIntegerParam(AndorCubeCount, 0);
+  setIntegerParam(AndorCubeErrors, 0);
+}
+
+/**
+ * Copy a frame into the cube at its scan index, and publish the cube when it is complete
+ * or every AndorCubePublishPeriod frames.
+ * \param[in] pArray The frame.  It is not released.
+ */
+void AndorCCD::addToCube(NDArray *pArray)
+{
+  int numScans, source, index, period, errors;
+  char attributeName[256];
+  NDAttribute *pAttribute;
+  static const char *functionName = "addToCube";
+
+  getIntegerParam(AndorCubeNumScans, &numScans);
+  getIntegerParam(AndorCubeIndexSource, &source);
+  getIntegerParam(AndorCubePublishPeriod, &period);
+  if (source == AndorCubeBuilder::SourceParameter) {
+    getIntegerParam(AndorCubePosition, &index);
+  } else if (source == AndorCubeBuilder::SourceAttribute) {
+    getStringParam(AndorCubeAttribute, sizeof(attributeName), attributeName);
+    pAttribute = pArray->pAttributeList->find(attributeName);
+    if (!pAttribute || (pAttribute->getValue(NDAttrInt32, &index) != 0)) index = -1;
+  } else {
+    index = mCubeBuilder->frames();
+  }
+  if (mCubeBuilder->insert(pArray, index, numScans, this->pNDArrayPool)) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: unable to add the frame at scan index %d to the cube\n",
+      driverName, functionName, index);
+    getIntegerParam(AndorCubeErrors, &errors);
+    setIntegerParam(AndorCubeErrors, errors + 1);
+    return;
+  }
+  setIntegerParam(AndorCubeFilled, mCubeBuilder->filled());
+  if (mCubeBuilder->complete()) {
+    publishCube(true);
+  } else if ((period > 0) && (mCubeBuilder->frames() % period == 0)) {
+    publishCube(false);
+  }
+}
+
+/**
+ * Publish the cube.  A partial cube is a copy, so the cube can be filled while plugins
+ * still hold the copy.  The final cube is the cube itself, and the next frame starts a
+ * new cube.  The CubeFilled and CubeComplete attributes tell partial and incomplete cubes
+ * apart, and CubeNumber groups the partial cubes with their final cube.
+ * \param[in] final True to publish the cube for the last time.
+ */
+void AndorCCD::publishCube(bool final)
+{
+  NDArray *pCube;
+  NDArrayInfo arrayInfo;
+  int filled, complete, count, cubeNumber;
+  epicsTimeStamp now;
+  static const char *functionName = "publishCube";
+
+  filled = mCubeBuilder->filled();
+  complete = mCubeBuilder->complete() ? 1 : 0;
+  if (final) {
+    pCube = mCubeBuilder->take();
+  } else {
+    pCube = this->pNDArrayPool->copy(mCubeBuilder->cube(), NULL, true);
+  }
+  if (!pCube) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: unable to allocate a copy of the cube\n",
+      driverName, functionName);
+    return;
+  }
+  getIntegerParam(AndorCubeCount, &count);
+  epicsTimeGetCurrent(&now);
+  cubeNumber = count + 1;
+  pCube->uniqueId = ++mCubeUniqueId;
+  pCube->timeStamp = now.secPastEpoch + now.nsec / 1.e9;
+  updateTimeStamp(&pCube->epicsTS);
+  this->getAttributes(pCube->pAttributeList);
+  pCube->pAttributeList->add("CubeFilled", "Planes of the cube filled", NDAttrInt32, &filled);
+  pCube->pAttributeList->add("CubeComplete", "1 if all planes of the cube are filled", NDAttrInt32, &complete);
+  pCube->pAttributeList->add("CubeNumber", "Final cube the array belongs to", NDAttrInt32, &cubeNumber);
+  // NDArraySize and NDArraySizeX, Y and Z stay those of the frames
+  pCube->getInfo(&arrayInfo);
+  setIntegerParam(AndorCubeArraySize, (int)arrayInfo.totalBytes);
+  setIntegerParam(AndorCubeSizeX, (int)pCube->dims[0].size);
+  setIntegerParam(AndorCubeSizeY, (int)pCube->dims[1].size);
+  setIntegerParam(AndorCubeSizeZ, (int)pCube->dims[2].size);
+  doCallbacksGenericPointer(pCube, NDArrayData, 0);
+  pCube->release();
+  if (final) {
+    setIntegerParam(AndorCubeCount, count + 1);
+    setIntegerParam(AndorCubeFilled, 0);
+  }
+}
@@ -0,0 +1,281 @@
+/**
+ * Digital delay generator control of intensified cameras for the ADAndor driver.
+ */
+
+#include <math.h>
+#include <string>
+
+#include <epicsEvent.h>
+
+#include <ADDriver.h>
+
+#ifdef _WIN32
+#include "ATMCD32D.h"
+#else
+#include "atmcdLXd.h"
+#endif
+
+#include "andorCCD.h"
+
+static const char *driverName = "andorCCD";
+
+/**
+ * Create the parameters of the digital delay generator and set their defaults.
+ */
+int AndorCCD::initDDG()
+{
+  int status = asynSuccess;
+
+  createParam(AndorDDGEnableString,               asynParamInt32, &AndorDDGEnable);
+  createParam(AndorDDGGateModeString,             asynParamInt32, &AndorDDGGateMode);
+  createParam(AndorMCPGainString,                 asynParamInt32, &AndorMCPGain);
+  createParam(AndorDDGDelayString,                asynParamFloat64, &AndorDDGDelay);
+  createParam(AndorDDGWidthString,                asynParamFloat64, &AndorDDGWidth);
+  createParam(AndorDDGStepModeString,             asynParamInt32, &AndorDDGStepMode);
+  createParam(AndorDDGStepP1String,               asynParamFloat64, &AndorDDGStepP1);
+  createParam(AndorDDGStepP2String,               asynParamFloat64, &AndorDDGStepP2);
+  createParam(AndorDDGWidthStepModeString,        asynParamInt32, &AndorDDGWidthStepMode);
+  createParam(AndorDDGWidthStepP1String,          asynParamFloat64, &AndorDDGWidthStepP1);
+  createParam(AndorDDGWidthStepP2String,          asynParamFloat64, &AndorDDGWidthStepP2);
+  createParam(AndorDDGIOCString,                  asynParamInt32, &AndorDDGIOC);
+  createParam(AndorDDGIOCFrequencyString,         asynParamFloat64, &AndorDDGIOCFrequency);
+  createParam(AndorDDGIOCPulsesString,            asynParamInt32, &AndorDDGIOCPulses);
+  createParam(AndorDDGFrameDelayString,           asynParamFloat64, &AndorDDGFrameDelay);
+  createParam(AndorDDGFrameWidthString,           asynParamFloat64, &AndorDDGFrameWidth);
+
+  status |= setIntegerParam(AndorDDGEnable, 0);
+  status |= setIntegerParam(AndorDDGGateMode, AT_GATEMODE_DDG);
+  status |= setIntegerParam(AndorMCPGain, 0);
+  status |= setDoubleParam(AndorDDGDelay, 0.0);
+  status |= setDoubleParam(AndorDDGWidth, 0.0);
+  status |= setIntegerParam(AndorDDGStepMode, ADDGStepOff);
+  status |= setDoubleParam(AndorDDGStepP1, 0.0);
+  status |= setDoubleParam(AndorDDGStepP2, 0.0);
+  status |= setIntegerParam(AndorDDGWidthStepMode, ADDGStepOff);
+  status |= setDoubleParam(AndorDDGWidthStepP1, 0.0);
+  status |= setDoubleParam(AndorDDGWidthStepP2, 0.0);
+  status |= setIntegerParam(AndorDDGIOC, 0);
+  status |= setDoubleParam(AndorDDGIOCFrequency, 0.0);
+  status |= setIntegerParam(AndorDDGIOCPulses, 0);
+  status |= setDoubleParam(AndorDDGFrameDelay, 0.0);
+  status |= setDoubleParam(AndorDDGFrameWidth, 0.0);
+  return status;
+}
+
+/**
+ * Called from writeInt32 for every parameter.
+ * Handles the integer parameters of the digital delay generator.
+ * \param[in] function Parameter being written; its new value is already in the parameter library.
+ * \param[in] value New value.
+ * \param[in] oldValue Value before the write, restored if the write fails.
+ * \param[out] pStatus Status of the write, if it was handled.
+ * \return true if the parameter belongs to the delay generator, false otherwise.
+ */
+bool AndorCCD::writeDDGInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                             asynStatus *pStatus)
+{
+  if ((function == AndorDDGEnable)       || (function == AndorDDGGateMode) ||
+      (function == AndorMCPGain)         || (function == AndorDDGStepMode) ||
+      (function == AndorDDGWidthStepMode) || (function == AndorDDGIOC)) {
+    *pStatus = requestSetup();
+    if (*pStatus != asynSuccess) setIntegerParam(function, oldValue);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Called from writeFloat64 for every parameter.
+ * Handles the float parameters of the digital delay generator.
+ * \param[in] function Parameter being written; its new value is already in the parameter library.
+ * \param[in] value New value.
+ * \param[out] pStatus Status of the write, if it was handled.
+ * \return true if the parameter belongs to the delay generator, false otherwise.
+ */
+bool AndorCCD::writeDDGFloat64(int function, epicsFloat64 value, asynStatus *pStatus)
+{
+  if ((function == AndorDDGDelay)       || (function == AndorDDGWidth)       ||
+      (function == AndorDDGStepP1)      || (function == AndorDDGStepP2)      ||
+      (function == AndorDDGWidthStepP1) || (function == AndorDDGWidthStepP2) ||
+      (function == AndorDDGIOCFrequency)) {
+    *pStatus = requestSetup();
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Set up the gating of intensified cameras: the gate mode, MCP gain, DDG gate times,
+ * gate steps and integrate on chip.  Each setting is only sent if the camera has it.
+ * Gate steps are only used in Multiple image mode, where the whole scan is one kinetic
+ * series.  Called from setupAcquisition, SDK errors are thrown.
+ */
+void AndorCCD::setupDDG()
+{
+  int gateMode, mcpGain, mcpLow, mcpHigh, imageMode, ioc, iocPulses;
+  double iocFrequency, sdkP1, sdkP2;
+  at_u64 delayAct, widthAct;
+  const int stepModeParams[2] = {AndorDDGStepMode, AndorDDGWidthStepMode};
+  const int stepP1Params[2] = {AndorDDGStepP1, AndorDDGWidthStepP1};
+  const int stepP2Params[2] = {AndorDDGStepP2, AndorDDGWidthStepP2};
+  const unsigned int stepFunctions[2] = {AC_SETFUNCTION_GATEDELAYSTEP, AC_SETFUNCTION_GATEWIDTHSTEP};
+  static const char *functionName = "setupDDG";
+  int enable;
+
+  mDDGActive = false;
+  // The camera keeps the gating set up by other software unless the driver is enabled to
+  // control it, since the parameter defaults would otherwise replace it
+  getIntegerParam(AndorDDGEnable, &enable);
+  if (!enable) return;
+  if (mCapabilities.ulSetFunctions & AC_SETFUNCTION_GATEMODE) {
+    getIntegerParam(AndorDDGGateMode, &gateMode);
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s:%s:, SetGateMode(%d)\n",
+      driverName, functionName, gateMode);
+    checkStatus(SetGateMode(gateMode));
+  }
+  if (mCapabilities.ulSetFunctions & AC_SETFUNCTION_MCPGAIN) {
+    checkStatus(GetMCPGainRange(&mcpLow, &mcpHigh));
+    getIntegerParam(AndorMCPGain, &mcpGain);
+    if (mcpGain < mcpLow) mcpGain = mcpLow;
+    if (mcpGain > mcpHigh) mcpGain = mcpHigh;
+    setIntegerParam(AndorMCPGain, mcpGain);
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s:%s:, SetMCPGain(%d)\n",
+      driverName, functionName, mcpGain);
+    checkStatus(SetMCPGain(mcpGain));
+  }
+  if (!(mCapabilities.ulSetFunctions & AC_SETFUNCTION_DDGTIMES)) return;
+
+  // The driver uses ns, the SDK ps
+  getDoubleParam(AndorDDGDelay, &mDDGTime[0]);
+  getDoubleParam(AndorDDGWidth, &mDDGTime[1]);
+  if (mDDGTime[0] < 0.) mDDGTime[0] = 0.;
+  if (mDDGTime[1] < 0.) mDDGTime[1] = 0.;
+  asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s:%s:, SetDDGGateTime(%.0f, %.0f)\n",
+    driverName, functionName, mDDGTime[0] * 1000., mDDGTime[1] * 1000.);
+  checkStatus(SetDDGGateTime((at_u64)(mDDGTime[0] * 1000. + 0.5), (at_u64)(mDDGTime[1] * 1000. + 0.5)));
+  checkStatus(GetDDGGateTime(&delayAct, &widthAct));
+  mDDGTime[0] = delayAct / 1000.;
+  mDDGTime[1] = widthAct / 1000.;
+  setDoubleParam(AndorDDGDelay, mDDGTime[0]);
+  setDoubleParam(AndorDDGWidth, mDDGTime[1]);
+
+  getIntegerParam(ADImageMode, &imageMode);
+  for (int i=0; i<2; i++) {
+    getIntegerParam(stepModeParams[i], &mDDGStepMode[i]);
+    getDoubleParam(stepP1Params[i], &mDDGStepP1[i]);
+    getDoubleParam(stepP2Params[i], &mDDGStepP2[i]);
+    if (!(mCapabilities.ulSetFunctions & stepFunctions[i])) {
+      mDDGStepMode[i] = ADDGStepOff;
+      continue;
+    }
+    if ((imageMode != ADImageMultiple) || (mDDGStepMode[i] < ADDGStepConstant) ||
+        (mDDGStepMode[i] > ADDGStepLinear)) {
+      mDDGStepMode[i] = ADDGStepOff;
+    }
+    if (mDDGStepMode[i] == ADDGStepOff) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+        "%s:%s:, SetDDG%sStepMode(100)\n",
+        driverName, functionName, i ? "Width" : "");
+      checkStatus(i ? SetDDGWidthStepMode(100) : SetDDGStepMode(100));
+      continue;
+    }
+    // p1 is always a time, p2 only in linear mode
+    sdkP1 = mDDGStepP1[i] * 1000.;
+    sdkP2 = (mDDGStepMode[i] == ADDGStepLinear) ? mDDGStepP2[i] * 1000. : mDDGStepP2[i];
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s:%s:, SetDDG%sStepCoefficients(%d, %f, %f)\n",
+      driverName, functionName, i ? "Width" : "", mDDGStepMode[i] - 1, sdkP1, sdkP2);
+    if (i) {
+      checkStatus(SetDDGWidthStepCoefficients(mDDGStepMode[i] - 1, sdkP1, sdkP2));
+      checkStatus(SetDDGWidthStepMode(mDDGStepMode[i] - 1));
+    } else {
+      checkStatus(SetDDGStepCoefficients(mDDGStepMode[i] - 1, sdkP1, sdkP2));
+      checkStatus(SetDDGStepMode(mDDGStepMode[i] - 1));
+    }
+  }
+
+  if (mCapabilities.ulSetFunctions & AC_SETFUNCTION_IOC) {
+    getIntegerParam(AndorDDGIOC, &ioc);
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s:%s:, SetDDGIOC(%d)\n",
+      driverName, functionName, ioc);
+    checkStatus(SetDDGIOC(ioc));
+    iocPulses = 0;
+    if (ioc) {
+      getDoubleParam(AndorDDGIOCFrequency, &iocFrequency);
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+        "%s:%s:, SetDDGIOCFrequency(%f)\n",
+        driverName, functionName, iocFrequency);
+      checkStatus(SetDDGIOCFrequency(iocFrequency));
+      checkStatus(GetDDGIOCPulses(&iocPulses));
+    }
+    setIntegerParam(AndorDDGIOCPulses, iocPulses);
+  }
+  mDDGActive = true;
+}
+
+/**
+ * Add the GateDelay and GateWidth attributes, in ns, to a frame of an intensified camera.
+ * \param[in] pArray The frame.
+ * \param[in] frameIndex Index of the frame in the kinetic series, from 1.
+ */
+void AndorCCD::tagGate(NDArray *pArray, int frameIndex)
+{
+  double gate[2], p1, p2;
+  double n = frameIndex;
+
+  // The step functions of SetDDGStepCoefficients, n counts from 1
+  for (int i=0; i<2; i++) {
+    p1 = mDDGStepP1[i];
+    p2 = mDDGStepP2[i];
+    gate[i] = mDDGTime[i];
+    if (mDDGStepMode[i] == ADDGStepConstant)         gate[i] += p1 * (n - 1.);
+    else if (mDDGStepMode[i] == ADDGStepExponential) gate[i] += p1 * exp(p2 * n);
+    else if (mDDGStepMode[i] == ADDGStepLogarithmic) gate[i] += (p2 * n > 0.) ? p1 * log(p2 * n) : 0.;
+    else if (mDDGStepMode[i] == ADDGStepLinear)      gate[i] += p1 + p2 * n;
+  }
+  pArray->pAttributeList->add("GateDelay", "DDG gate delay (ns)", NDAttrFloat64, &gate[0]);
+  pArray->pAttributeList->add("GateWidth", "DDG gate width (ns)", NDAttrFloat64, &gate[1]);
+  setDoubleParam(AndorDDGFrameDelay, gate[0]);
+  setDoubleParam(AndorDDGFrameWidth, gate[1]);
+}
+
+/**
+ * Restart the DDG gate steps of a Multiple acquisition at a frame of the scan, so the
+ * frames of a series restarted by recoverAcquisition keep the gates they would have had.
+ * The SDK steps count from the first frame of the series, so the gate of the first frame
+ * is moved, or the exponential factor scaled.  mDDGTime and the step parameters keep the
+ * values of the whole scan, which tagGate uses with the index in the acquisition.  A
+ * logarithmic step cannot be restarted.  Called with the SDK lock held, SDK errors are
+ * thrown.
+ * \param[in] frameOffset Number of frames of the scan already acquired.
+ */
+void AndorCCD::rebaseDDGSteps(int frameOffset)
+{
+  double gate[2], p1[2];
+  double n = frameOffset;
+  static const char *functionName = "rebaseDDGSteps";
+
+  for (int i=0; i<2; i++) {
+    gate[i] = mDDGTime[i];
+    p1[i] = mDDGStepP1[i];
+    if (mDDGStepMode[i] == ADDGStepConstant)         gate[i] += mDDGStepP1[i] * n;
+    else if (mDDGStepMode[i] == ADDGStepExponential) p1[i] *= exp(mDDGStepP2[i] * n);
+    else if (mDDGStepMode[i] == ADDGStepLinear)      gate[i] += mDDGStepP2[i] * n;
+    else if (mDDGStepMode[i] == ADDGStepLogarithmic) {
+      throw std::string("ERROR: a logarithmic DDG gate step cannot be restarted.");
+    }
+  }
+  asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s:%s:, SetDDGGateTime(%.0f, %.0f) at frame %d\n",
+    driverName, functionName, gate[0] * 1000., gate[1] * 1000., frameOffset);
+  checkStatus(SetDDGGateTime((at_u64)(gate[0] * 1000. + 0.5), (at_u64)(gate[1] * 1000. + 0.5)));
+  for (int i=0; i<2; i++) {
+    if (mDDGStepMode[i] != ADDGStepExponential) continue;
+    if (i) checkStatus(SetDDGWidthStepCoefficients(mDDGStepMode[i] - 1, p1[i] * 1000., mDDGStepP2[i]));
+    else   checkStatus(SetDDGStepCoefficients(mDDGStepMode[i] - 1, p1[i] * 1000., mDDGStepP2[i]));
+  }
+}
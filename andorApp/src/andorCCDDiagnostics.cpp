@@ -0,0 +1,411 @@
+/**
+ * Diagnostics of the ADAndor driver: performance metrics, lock statistics, the
+ * flight recorder and run capacity planning.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include <epicsTime.h>
+#include <epicsEvent.h>
+#include <epicsString.h>
+
+#include <ADDriver.h>
+
+#ifdef _WIN32
+#include "ATMCD32D.h"
+#else
+#include "atmcdLXd.h"
+#endif
+
+#include "andorCCD.h"
+#include "andorFrameAverager.h"
+#include "andorFrameBinner.h"
+#include "andorBaselineCorrector.h"
+#include "andorTimingTagger.h"
+#include "andorCapacityPlanner.h"
+#include "andorMetrics.h"
+#include "andorFlightRecorder.h"
+#include "andorPumpProbe.h"
+#include "andorLock.h"
+
+static const char *driverName = "andorCCD";
+
+/**
+ * Create the parameters, metrics and flight recorder of diagnostics and set the parameter
+ * defaults.
+ */
+int AndorCCD::initDiagnostics()
+{
+  int status = asynSuccess;
+
+  createParam(AndorFlightAutoDumpString,          asynParamInt32, &AndorFlightAutoDump);
+  createParam(AndorFlightPathString,              asynParamOctet, &AndorFlightPath);
+  createParam(AndorFlightDumpString,              asynParamInt32, &AndorFlightDump);
+  createParam(AndorFlightDumpsString,             asynParamInt32, &AndorFlightDumps);
+  createParam(AndorFlightFileString,              asynParamOctet, &AndorFlightFile);
+  createParam(AndorLockPortHoldMaxString,         asynParamFloat64, &AndorLockPortHoldMax);
+  createParam(AndorLockSDKHoldMaxString,          asynParamFloat64, &AndorLockSDKHoldMax);
+  createParam(AndorLockConfigHoldMaxString,       asynParamFloat64, &AndorLockConfigHoldMax);
+  createParam(AndorLockReadoutWaitMaxString,      asynParamFloat64, &AndorLockReadoutWaitMax);
+  createParam(AndorLockStatsResetString,          asynParamInt32, &AndorLockStatsReset);
+  createParam(AndorPlanString,                    asynParamInt32, &AndorPlan);
+  createParam(AndorPlanTestSizeString,            asynParamInt32, &AndorPlanTestSize);
+  createParam(AndorPlanDurationString,          asynParamFloat64, &AndorPlanDuration);
+  createParam(AndorPlanFrameRateString,         asynParamFloat64, &AndorPlanFrameRate);
+  createParam(AndorPlanDataRateString,          asynParamFloat64, &AndorPlanDataRate);
+  createParam(AndorPlanDiskRateString,          asynParamFloat64, &AndorPlanDiskRate);
+  createParam(AndorPlanDiskFreeString,          asynParamFloat64, &AndorPlanDiskFree);
+  createParam(AndorPlanBufferString,            asynParamFloat64, &AndorPlanBuffer);
+  createParam(AndorPlanRunLengthString,         asynParamFloat64, &AndorPlanRunLength);
+  createParam(AndorPlanBottleneckString,          asynParamInt32, &AndorPlanBottleneck);
+  createParam(AndorPlanDropsString,               asynParamInt32, &AndorPlanDrops);
+
+  setupMetrics();
+  mFlightRecorder = new AndorFlightRecorder();
+
+  status |= setIntegerParam(AndorFlightAutoDump, 1);
+  status |= setStringParam(AndorFlightPath, "");
+  status |= setIntegerParam(AndorFlightDump, 0);
+  status |= setIntegerParam(AndorFlightDumps, 0);
+  status |= setStringParam(AndorFlightFile, "");
+  status |= setDoubleParam(AndorLockPortHoldMax, 0.0);
+  status |= setDoubleParam(AndorLockSDKHoldMax, 0.0);
+  status |= setDoubleParam(AndorLockConfigHoldMax, 0.0);
+  status |= setDoubleParam(AndorLockReadoutWaitMax, 0.0);
+  status |= setIntegerParam(AndorLockStatsReset, 0);
+  status |= setIntegerParam(AndorPlan, 0);
+  status |= setIntegerParam(AndorPlanTestSize, 64);
+  status |= setDoubleParam(AndorPlanDuration, 3600.0);
+  status |= setDoubleParam(AndorPlanFrameRate, 0.0);
+  status |= setDoubleParam(AndorPlanDataRate, 0.0);
+  status |= setDoubleParam(AndorPlanDiskRate, 0.0);
+  status |= setDoubleParam(AndorPlanDiskFree, 0.0);
+  status |= setDoubleParam(AndorPlanBuffer, 0.0);
+  status |= setDoubleParam(AndorPlanRunLength, 0.0);
+  status |= setIntegerParam(AndorPlanBottleneck, AndorCapacityPlanner::BottleneckNone);
+  status |= setIntegerParam(AndorPlanDrops, 0);
+  return status;
+}
+
+/**
+ * Called from writeInt32 for every parameter.
+ * Handles the integer parameters of diagnostics.
+ * \param[in] function Parameter being written; its new value is already in the parameter library.
+ * \param[in] value New value.
+ * \param[in] oldValue Value before the write, restored if the write fails.
+ * \param[out] pStatus Status of the write, if it was handled.
+ * \return true if the parameter belongs to diagnostics, false otherwise.
+ */
+bool AndorCCD::writeDiagnosticsInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                                     asynStatus *pStatus)
+{
+  *pStatus = asynSuccess;
+  if (function == AndorLockStatsReset) {
+    if (value) {
+      mPortLock->resetStats();
+      mSDKLock->resetStats();
+      mConfigLock->resetStats();
+      setDoubleParam(AndorLockReadoutWaitMax, 0.0);
+      updateLockStatus();
+    }
+    setIntegerParam(AndorLockStatsReset, 0);
+  }
+  else if (function == AndorPlan) {
+    if (value) *pStatus = planCapacity();
+    setIntegerParam(AndorPlan, 0);
+  }
+  else if (function == AndorFlightDump) {
+    if (value) dumpFlightRecorder(0);
+    setIntegerParam(AndorFlightDump, 0);
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Create the metrics registry and register the driver's metrics.
+ */
+void AndorCCD::setupMetrics()
+{
+  static const struct {
+    const char *name;
+    const char *help;
+    int type;
+    const char *label;
+    const char *labelValue;
+  } metricDefinitions[NumMetrics] = {
+    {"andor_frames", "Frames read from the camera", AndorMetrics::TypeCounter, NULL, NULL},
+    {"andor_frames_published", "Frames passed to array callbacks", AndorMetrics::TypeCounter, NULL, NULL},
+    {"andor_frames_skipped", "Frames read but not published, by the gate, event mode or cube assembly", AndorMetrics::TypeCounter, NULL, NULL},
+    {"andor_frames_dropped", "Frames lost because no NDArray could be allocated for the output", AndorMetrics::TypeCounter, NULL, NULL},
+    {"andor_stage_seconds", "Time spent in each stage of frame handling", AndorMetrics::TypeSummary, "stage", "readout"},
+    {"andor_stage_seconds", "Time spent in each stage of frame handling", AndorMetrics::TypeSummary, "stage", "process"},
+    {"andor_stage_seconds", "Time spent in each stage of frame handling", AndorMetrics::TypeSummary, "stage", "callbacks"},
+    {"andor_stage_seconds", "Time spent in each stage of frame handling", AndorMetrics::TypeSummary, "stage", "save"},
+    {"andor_sdk_calls", "Andor SDK calls checked by the driver", AndorMetrics::TypeCounter, NULL, NULL},
+    {"andor_sdk_errors", "Andor SDK calls that returned an error", AndorMetrics::TypeCounter, NULL, NULL},
+    {"andor_frame_store_frames_written", "Frames written by the frame store", AndorMetrics::TypeCounter, NULL, NULL},
+    {"andor_frame_store_frames_dropped", "Frames dropped because the frame store queue was full", AndorMetrics::TypeCounter, NULL, NULL},
+    {"andor_frame_store_bytes_written", "Bytes written by the frame store", AndorMetrics::TypeCounter, NULL, NULL},
+    {"andor_frame_store_queue_free", "Free entries in the frame store queue", AndorMetrics::TypeGauge, NULL, NULL},
+    {"andor_timing_queued", "Timing events waiting to be matched to frames", AndorMetrics::TypeGauge, NULL, NULL},
+    {"andor_timing_unmatched", "Frames without a matching timing event", AndorMetrics::TypeCounter, NULL, NULL},
+    {"andor_timing_overflows", "Timing events discarded because the queue was full", AndorMetrics::TypeCounter, NULL, NULL},
+    {"andor_pool_free_buffers", "Free NDArray buffers in the driver's pool", AndorMetrics::TypeGauge, NULL, NULL},
+    {"andor_temperature_celsius", "Detector temperature", AndorMetrics::TypeGauge, NULL, NULL},
+    {"andor_acquiring", "1 while acquiring", AndorMetrics::TypeGauge, NULL, NULL},
+    {"andor_lock_wait_seconds", "Time spent waiting for each driver lock", AndorMetrics::TypeSummary, "lock", "port"},
+    {"andor_lock_wait_seconds", "Time spent waiting for each driver lock", AndorMetrics::TypeSummary, "lock", "sdk"},
+    {"andor_lock_wait_seconds", "Time spent waiting for each driver lock", AndorMetrics::TypeSummary, "lock", "config"},
+    {"andor_lock_hold_seconds", "Time each driver lock was held", AndorMetrics::TypeSummary, "lock", "port"},
+    {"andor_lock_hold_seconds", "Time each driver lock was held", AndorMetrics::TypeSummary, "lock", "sdk"},
+    {"andor_lock_hold_seconds", "Time each driver lock was held", AndorMetrics::TypeSummary, "lock", "config"},
+    {"andor_pipeline_stage_seconds", "Time spent in each stage of the processing pipeline", AndorMetrics::TypeSummary, "stage", "dark"},
+    {"andor_pipeline_stage_seconds", "Time spent in each stage of the processing pipeline", AndorMetrics::TypeSummary, "stage", "flat"},
+    {"andor_pipeline_stage_seconds", "Time spent in each stage of the processing pipeline", AndorMetrics::TypeSummary, "stage", "stats"}
+  };
+
+  mMetrics = new AndorMetrics(portName);
+  for (int i=0; i<NumMetrics; i++) {
+    mMetrics->add(metricDefinitions[i].name, metricDefinitions[i].help, metricDefinitions[i].type,
+                  metricDefinitions[i].label, metricDefinitions[i].labelValue);
+  }
+  mTimingTagger->setMetrics(mMetrics, MetricTimingUnmatched, MetricTimingOverflows);
+}
+
+/**
+ * Update the metrics that are sampled rather than counted.  Called for each frame and
+ * on each status poll.
+ */
+void AndorCCD::updateMetrics()
+{
+  int queueFree, queued;
+  double temperature;
+
+  getIntegerParam(AndorFSQueueFree, &queueFree);
+  getIntegerParam(AndorTimingQueued, &queued);
+  getDoubleParam(ADTemperatureActual, &temperature);
+  mMetrics->set(MetricFSQueueFree, queueFree);
+  mMetrics->set(MetricTimingQueued, queued);
+  mMetrics->set(MetricPoolFreeBuffers, this->pNDArrayPool->getNumFree());
+  mMetrics->set(MetricTemperature, temperature);
+  mMetrics->set(MetricAcquiring, mAcquiringData ? 1. : 0.);
+  updateLockStatus();
+  updatePipelineStatus();
+}
+
+/**
+ * Publish the lock statistics as parameters and metrics.  The longest hold of the port
+ * lock does not include the hold in progress.
+ */
+void AndorCCD::updateLockStatus()
+{
+  AndorLock *locks[3] = {mPortLock, mSDKLock, mConfigLock};
+  const int holdMaxParams[3] = {AndorLockPortHoldMax, AndorLockSDKHoldMax, AndorLockConfigHoldMax};
+  AndorLock::Stats stats;
+
+  for (int i=0; i<3; i++) {
+    locks[i]->getStats(&stats);
+    setDoubleParam(holdMaxParams[i], stats.holdMax);
+    mMetrics->setSummary(MetricLockWaitPort + i, stats.waitTotal, stats.count);
+    mMetrics->setSummary(MetricLockHoldPort + i, stats.holdTotal, stats.count);
+  }
+}
+
+/**
+ * Write the flight recorder to a new file in AndorFlightPath, named from the port name
+ * and the current time.  Called with the port lock held; the ring is copied under the lock
+ * and the lock is released while the file is written.
+ * \param[in] reason Camera status that caused the dump, 0 for a manual dump.
+ */
+void AndorCCD::dumpFlightRecorder(int reason)
+{
+  static const char *functionName = "dumpFlightRecorder";
+  const char **names;
+  const char *name;
+  AndorFlightEntry *pEntries;
+  char path[MAX_FILENAME_LEN];
+  char timeString[64];
+  char fileName[MAX_FILENAME_LEN];
+  epicsTimeStamp now;
+  int numNames, numDumps, status;
+  size_t numEntries, len;
+  const char *separator = "";
+
+  // Parameter names, so the decoder can show which parameters were changed.  The names are
+  // owned by the parameter library and stay valid after the lock is released.
+  for (numNames=0; getParamName(numNames, &name) == asynSuccess; numNames++) {}
+  names = (const char **)calloc(numNames ? numNames : 1, sizeof(*names));
+  if (!names) return;
+  for (int i=0; i<numNames; i++) getParamName(i, &names[i]);
+  getStringParam(AndorFlightPath, sizeof(path), path);
+  len = strlen(path);
+  if (len && (path[len-1] != '/') && (path[len-1] != '\\')) separator = "/";
+  epicsTimeGetCurrent(&now);
+  epicsTimeToStrftime(timeString, sizeof(timeString), "%Y%m%dT%H%M%S", &now);
+  if (epicsSnprintf(fileName, sizeof(fileName), "%s%sandorFlight_%s_%s.bin",
+                    path, separator, portName, timeString) >= (int)sizeof(fileName)) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: flight recorder path %s is too long\n",
+      driverName, functionName, path);
+    free(names);
+    return;
+  }
+  pEntries = mFlightRecorder->snapshot(&numEntries);
+  if (!pEntries) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: unable to copy the flight recorder\n",
+      driverName, functionName);
+    free(names);
+    return;
+  }
+  // The file is written without the port lock, so a slow disk does not stall the driver
+  this->unlock();
+  status = AndorFlightRecorder::write(fileName, reason, pEntries, numEntries, names, numNames);
+  this->lock();
+  free(pEntries);
+  free(names);
+  if (status != 0) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: unable to write flight recorder to %s\n",
+      driverName, functionName, fileName);
+    return;
+  }
+  asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
+    "%s:%s: flight recorder written to %s\n",
+    driverName, functionName, fileName);
+  getIntegerParam(AndorFlightDumps, &numDumps);
+  setIntegerParam(AndorFlightDumps, numDumps + 1);
+  setStringParam(AndorFlightFile, fileName);
+}
+
+/**
+ * Plan a run with the current settings.  The frame size and rate of the camera are
+ * compared with the memory that can hold frames (the SDK circular buffer and the free
+ * part of the NDArray pool) and with the write rate and free space of NDFilePath, which
+ * are measured with a short write test.  The test runs without the port lock.  The
+ * planned length of a Continuous run is ANDOR_PLAN_DURATION.
+ */
+asynStatus AndorCCD::planCapacity()
+{
+  AndorCapacityPlanner::Inputs inputs;
+  AndorCapacityPlanner::Plan plan;
+  char filePath[MAX_FILENAME_LEN];
+  float exposure, accumulate, kinetic;
+  at_32 bufferFrames;
+  int imageMode, numImages, testSize, sizeX, sizeY, status, bytesPerPixel;
+  int baselineMode, baselineColumns, swBinX, swBinY, ppMode;
+  NDDataType_t dataType;
+  size_t poolMax, poolUsed;
+  double period;
+  const double MB = 1024. * 1024.;
+  static const char *functionName = "planCapacity";
+
+  if (mAcquiringData) {
+    setStringParam(AndorMessage, "Cannot plan a run while acquiring.");
+    return asynError;
+  }
+  if (mPlanning) {
+    setStringParam(AndorMessage, "A run is already being planned.");
+    return asynError;
+  }
+  // Plan with the settings the camera will actually use
+  if ((mSetupApplied != mSetupRequested) && (applySetup() != asynSuccess)) {
+    setStringParam(AndorMessage, "Setup acquisition failed");
+    return asynError;
+  }
+  try {
+    AndorLock::Guard sdkGuard(mSDKLock);
+    checkStatus(GetAcquisitionTimings(&exposure, &accumulate, &kinetic));
+    checkStatus(GetSizeOfCircularBuffer(&bufferFrames));
+  } catch (const std::string &e) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: %s\n",
+      driverName, functionName, e.c_str());
+    setStringParam(AndorMessage, e.c_str());
+    return asynError;
+  }
+
+  mConfigLock->lock();
+  sizeX = mReadoutConfig.sizeX;
+  sizeY = mReadoutConfig.sizeY;
+  dataType = mReadoutConfig.dataType;
+  mConfigLock->unlock();
+  // The frames written are those published by processFrame, which can be smaller than the
+  // frames read, or Float32.  Event lists are counted as full frames.
+  bytesPerPixel = (dataType == NDUInt32) ? 4 : 2;
+  getIntegerParam(AndorBaselineMode, &baselineMode);
+  getIntegerParam(AndorBaselineColumns, &baselineColumns);
+  if ((baselineMode != AndorBaselineCorrector::ModeOff) && (baselineColumns < sizeX)) {
+    sizeX -= baselineColumns;
+  }
+  getIntegerParam(AndorSWBinX, &swBinX);
+  getIntegerParam(AndorSWBinY, &swBinY);
+  // As AndorFrameBinner::process, which limits the binning to the frame
+  if (swBinX > sizeX) swBinX = sizeX;
+  if (swBinY > sizeY) swBinY = sizeY;
+  if ((swBinX > 0) && (swBinY > 0) && (swBinX * swBinY > 1)) {
+    sizeX /= swBinX;
+    sizeY /= swBinY;
+    bytesPerPixel = 4;
+  }
+  getIntegerParam(AndorPPMode, &ppMode);
+  if ((ppMode != AndorPumpProbe::ModeOff) ||
+      (mAverager->mode() != AndorFrameAverager::ModeNone)) {
+    bytesPerPixel = 4;
+  }
+  inputs.frameBytes = (double)sizeX * sizeY * bytesPerPixel;
+  period = (kinetic > 0.f) ? kinetic : ((accumulate > 0.f) ? accumulate : exposure);
+  inputs.frameRate = (period > 0.) ? 1. / period : 0.;
+  getIntegerParam(ADImageMode, &imageMode);
+  getIntegerParam(ADNumImages, &numImages);
+  if (imageMode == ADImageContinuous) {
+    getDoubleParam(AndorPlanDuration, &inputs.plannedLength);
+  } else {
+    inputs.plannedLength = ((imageMode == ADImageSingle) ? 1 : numImages) * period;
+  }
+  // A pool without a memory limit is not counted, it is limited by the host instead
+  poolMax = this->pNDArrayPool->getMaxMemory();
+  poolUsed = this->pNDArrayPool->getMemorySize();
+  inputs.bufferBytes = bufferFrames * inputs.frameBytes;
+  if (poolMax > poolUsed) inputs.bufferBytes += (double)(poolMax - poolUsed);
+
+  getStringParam(NDFilePath, sizeof(filePath), filePath);
+  getIntegerParam(AndorPlanTestSize, &testSize);
+  if (testSize < 1) testSize = 1;
+  // Acquisitions are not started while the port lock is released
+  mPlanning = true;
+  this->unlock();
+  status = AndorCapacityPlanner::measureDisk(filePath, (size_t)testSize * 1024 * 1024,
+                                             &inputs.diskRate, &inputs.diskFreeBytes);
+  this->lock();
+  mPlanning = false;
+  if (status) {
+    setIntegerParam(AndorPlanBottleneck, AndorCapacityPlanner::BottleneckNone);
+    setStringParam(AndorMessage, "Unable to test writing to the file path.");
+    return asynError;
+  }
+  setDoubleParam(AndorPlanFrameRate, inputs.frameRate);
+  setDoubleParam(AndorPlanDiskRate, inputs.diskRate / MB);
+  setDoubleParam(AndorPlanDiskFree, inputs.diskFreeBytes / MB);
+  setDoubleParam(AndorPlanBuffer, inputs.bufferBytes / MB);
+  if (AndorCapacityPlanner::plan(&inputs, &plan)) {
+    setIntegerParam(AndorPlanBottleneck, AndorCapacityPlanner::BottleneckNone);
+    setStringParam(AndorMessage, "Unable to plan, the frame size or rate is 0.");
+    return asynError;
+  }
+  setDoubleParam(AndorPlanDataRate, plan.dataRate / MB);
+  setDoubleParam(AndorPlanRunLength, plan.runLength);
+  setIntegerParam(AndorPlanBottleneck, plan.bottleneck);
+  setIntegerParam(AndorPlanDrops, plan.drops ? 1 : 0);
+  setStringParam(AndorMessage, plan.drops ? "Planned run will drop frames." : "Planned run fits.");
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s:%s: %.1f MB/s from the camera, %.1f MB/s to %s, run length %.1f s, bottleneck %d\n",
+    driverName, functionName, plan.dataRate / MB, inputs.diskRate / MB, filePath,
+    plan.runLength, plan.bottleneck);
+  return asynSuccess;
+}
@@ -0,0 +1,125 @@
+/**
+ * Frame store output of the ADAndor driver.
+ */
+
+
+
+#include <epicsEvent.h>
+
+#include <ADDriver.h>
+
+#ifdef _WIN32
+#include "ATMCD32D.h"
+#else
+#include "atmcdLXd.h"
+#endif
+
+#include "andorCCD.h"
+#include "andorFrameStore.h"
+
+static const char *driverName = "andorCCD";
+
+/**
+ * Create the parameters of the frame store and set their defaults.
+ */
+int AndorCCD::initFrameStore()
+{
+  int status = asynSuccess;
+
+  createParam(AndorFSPreallocString,              asynParamInt32, &AndorFSPrealloc);
+  createParam(AndorFSQueueSizeString,             asynParamInt32, &AndorFSQueueSize);
+  createParam(AndorFSQueueFreeString,             asynParamInt32, &AndorFSQueueFree);
+  createParam(AndorFSFramesWrittenString,         asynParamInt32, &AndorFSFramesWritten);
+  createParam(AndorFSFramesDroppedString,         asynParamInt32, &AndorFSFramesDropped);
+  createParam(AndorFSMBWrittenString,             asynParamFloat64, &AndorFSMBWritten);
+
+  status |= setIntegerParam(AndorFSPrealloc, 1024);
+  status |= setIntegerParam(AndorFSQueueSize, 100);
+  status |= setIntegerParam(AndorFSQueueFree, 0);
+  status |= setIntegerParam(AndorFSFramesWritten, 0);
+  status |= setIntegerParam(AndorFSFramesDropped, 0);
+  status |= setDoubleParam(AndorFSMBWritten, 0.);
+  return status;
+}
+
+/**
+ * Create the frame store for this acquisition.  The data file name is built from
+ * FilePath, FileName, FileNumber and FileTemplate in the usual way.
+ */
+asynStatus AndorCCD::openFrameStore()
+{
+  char fullFileName[MAX_FILENAME_LEN];
+  int preallocMB;
+  int queueSize;
+  static const char *functionName = "openFrameStore";
+
+  closeFrameStore();
+  this->createFileName(MAX_FILENAME_LEN, fullFileName);
+  setStringParam(NDFullFileName, fullFileName);
+  getIntegerParam(AndorFSPrealloc, &preallocMB);
+  getIntegerParam(AndorFSQueueSize, &queueSize);
+  asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s:%s:, opening frame store %s, prealloc=%d MB, queueSize=%d\n",
+    driverName, functionName, fullFileName, preallocMB, queueSize);
+  mFrameStore = new AndorFrameStore(fullFileName, (size_t)preallocMB * 1024 * 1024, queueSize);
+  if (!mFrameStore->isOpen()) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s::%s error opening frame store %s\n",
+      driverName, functionName, fullFileName);
+    delete mFrameStore;
+    mFrameStore = 0;
+    return asynError;
+  }
+  // The counters of a new file start from 0
+  setIntegerParam(AndorFSFramesWritten, 0);
+  setIntegerParam(AndorFSFramesDropped, 0);
+  setDoubleParam(AndorFSMBWritten, 0.);
+  mFrameStore->setMetrics(mMetrics, MetricFSFramesWritten, MetricFSFramesDropped,
+                          MetricFSBytesWritten);
+  updateFrameStoreStatus();
+  return asynSuccess;
+}
+
+/**
+ * Queue the current frame for the frame store writer thread.  Like SaveAsSPE this
+ * uses the most recent array, so it requires ArrayCallbacks to be enabled.
+ * \param[in] imageCounter Value of NDArrayCounter for the frame, stored as its frame number.
+ */
+unsigned int AndorCCD::appendFrameStore(int imageCounter)
+{
+  NDArray *pArray = this->pArrays[0];
+
+  if (!mFrameStore) return DRV_NOT_INITIALIZED;
+  if (!pArray) return DRV_NO_NEW_DATA;
+  // ADAcquireTime can be written after the acquisition was set up, so the exposure read back
+  // from the SDK by setupAcquisition is used.
+  // A full queue drops the frame; that is counted by the frame store, not treated as an error
+  mFrameStore->append(pArray, imageCounter, mAcquireTimeActual);
+  return DRV_SUCCESS;
+}
+
+/**
+ * Write out any queued frames and close the frame store.
+ */
+void AndorCCD::closeFrameStore()
+{
+  if (!mFrameStore) return;
+  mFrameStore->close();
+  updateFrameStoreStatus();
+  delete mFrameStore;
+  mFrameStore = 0;
+}
+
+void AndorCCD::updateFrameStoreStatus()
+{
+  epicsInt64 framesWritten, framesDropped;
+  double bytesWritten;
+  int queueFree;
+
+  if (!mFrameStore) return;
+  mFrameStore->getStats(&framesWritten, &framesDropped, &bytesWritten, &queueFree);
+  setIntegerParam(AndorFSFramesWritten, (int)framesWritten);
+  setIntegerParam(AndorFSFramesDropped, (int)framesDropped);
+  setDoubleParam(AndorFSMBWritten, bytesWritten / (1024. * 1024.));
+  setIntegerParam(AndorFSQueueFree, queueFree);
+}
@@ -0,0 +1,159 @@
+/**
+ * In-driver processing pipeline of the ADAndor driver.
+ */
+
+
+
+#include <epicsEvent.h>
+
+#include <ADDriver.h>
+
+#ifdef _WIN32
+#include "ATMCD32D.h"
+#else
+#include "atmcdLXd.h"
+#endif
+
+#include "andorCCD.h"
+#include "andorPipeline.h"
+#include "andorMetrics.h"
+
+static const char *driverName = "andorCCD";
+
+/**
+ * Create the parameters and stages of the processing pipeline and set the parameter defaults.
+ */
+int AndorCCD::initPipeline()
+{
+  int status = asynSuccess;
+
+  createParam(AndorPipeThreadsString,             asynParamInt32, &AndorPipeThreads);
+  createParam(AndorPipeDarkEnableString,          asynParamInt32, &AndorPipeDarkEnable);
+  createParam(AndorPipeFlatEnableString,          asynParamInt32, &AndorPipeFlatEnable);
+  createParam(AndorPipeStatsEnableString,         asynParamInt32, &AndorPipeStatsEnable);
+  createParam(AndorPipeDarkCaptureString,         asynParamInt32, &AndorPipeDarkCapture);
+  createParam(AndorPipeFlatCaptureString,         asynParamInt32, &AndorPipeFlatCapture);
+  createParam(AndorPipeDarkValidString,           asynParamInt32, &AndorPipeDarkValid);
+  createParam(AndorPipeFlatValidString,           asynParamInt32, &AndorPipeFlatValid);
+  createParam(AndorPipeDarkTimeString,          asynParamFloat64, &AndorPipeDarkTime);
+  createParam(AndorPipeFlatTimeString,          asynParamFloat64, &AndorPipeFlatTime);
+  createParam(AndorPipeStatsTimeString,         asynParamFloat64, &AndorPipeStatsTime);
+  createParam(AndorPipePendingString,             asynParamInt32, &AndorPipePending);
+  createParam(AndorPipeStealsString,              asynParamInt32, &AndorPipeSteals);
+  createParam(AndorPipeErrorsString,              asynParamInt32, &AndorPipeErrors);
+  createParam(AndorPipeStatsMinString,          asynParamFloat64, &AndorPipeStatsMin);
+  createParam(AndorPipeStatsMaxString,          asynParamFloat64, &AndorPipeStatsMax);
+  createParam(AndorPipeStatsMeanString,         asynParamFloat64, &AndorPipeStatsMean);
+  createParam(AndorPipeStatsSigmaString,        asynParamFloat64, &AndorPipeStatsSigma);
+
+  mPipeline = new AndorPipeline();
+  mPipeDark = new AndorDarkStage();
+  mPipeFlat = new AndorFlatStage();
+  mPipeline->addStage(mPipeDark);
+  mPipeline->addStage(mPipeFlat);
+  mPipeline->addStage(new AndorStatsStage());
+
+  status |= setIntegerParam(AndorPipeThreads, 2);
+  status |= setIntegerParam(AndorPipeDarkEnable, 0);
+  status |= setIntegerParam(AndorPipeFlatEnable, 0);
+  status |= setIntegerParam(AndorPipeStatsEnable, 0);
+  status |= setIntegerParam(AndorPipeDarkCapture, 0);
+  status |= setIntegerParam(AndorPipeFlatCapture, 0);
+  status |= setIntegerParam(AndorPipeDarkValid, 0);
+  status |= setIntegerParam(AndorPipeFlatValid, 0);
+  status |= setDoubleParam(AndorPipeDarkTime, 0.0);
+  status |= setDoubleParam(AndorPipeFlatTime, 0.0);
+  status |= setDoubleParam(AndorPipeStatsTime, 0.0);
+  status |= setIntegerParam(AndorPipePending, 0);
+  status |= setIntegerParam(AndorPipeSteals, 0);
+  status |= setIntegerParam(AndorPipeErrors, 0);
+  status |= setDoubleParam(AndorPipeStatsMin, 0.0);
+  status |= setDoubleParam(AndorPipeStatsMax, 0.0);
+  status |= setDoubleParam(AndorPipeStatsMean, 0.0);
+  status |= setDoubleParam(AndorPipeStatsSigma, 0.0);
+  return status;
+}
+
+/**
+ * Called from writeInt32 for every parameter.
+ * Handles the integer parameters of the processing pipeline.
+ * \param[in] function Parameter being written; its new value is already in the parameter library.
+ * \param[in] value New value.
+ * \param[in] oldValue Value before the write, restored if the write fails.
+ * \param[out] pStatus Status of the write, if it was handled.
+ * \return true if the parameter belongs to the pipeline, false otherwise.
+ */
+bool AndorCCD::writePipelineInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                                  asynStatus *pStatus)
+{
+  if (function == AndorPipeDarkEnable) {
+    mPipeline->setEnabled(PipeStageDark, value != 0);
+  }
+  else if (function == AndorPipeFlatEnable) {
+    mPipeline->setEnabled(PipeStageFlat, value != 0);
+  }
+  else if (function == AndorPipeStatsEnable) {
+    mPipeline->setEnabled(PipeStageStats, value != 0);
+  }
+  else if (function == AndorPipeDarkCapture) {
+    if (value) mPipeDark->capture();
+    setIntegerParam(AndorPipeDarkCapture, 0);
+  }
+  else if (function == AndorPipeFlatCapture) {
+    if (value) mPipeFlat->capture();
+    setIntegerParam(AndorPipeFlatCapture, 0);
+  }
+  else {
+    return false;
+  }
+  *pStatus = asynSuccess;
+  return true;
+}
+
+/**
+ * Start the pipeline workers for an acquisition and reset the pipeline statistics.
+ * Called when acquisition starts, when no frames are in the pipeline.
+ */
+void AndorCCD::setupPipeline()
+{
+  int numThreads;
+
+  getIntegerParam(AndorPipeThreads, &numThreads);
+  numThreads = mPipeline->setThreads(numThreads);
+  setIntegerParam(AndorPipeThreads, numThreads);
+  mPipeline->resetStats();
+  updatePipelineStatus();
+}
+
+/**
+ * Publish the pipeline statistics as parameters and metrics.  The stage times are the
+ * mean seconds per frame since acquisition started.
+ */
+void AndorCCD::updatePipelineStatus()
+{
+  const int timeParams[NumPipeStages] = {AndorPipeDarkTime, AndorPipeFlatTime, AndorPipeStatsTime};
+  const char *statsNames[4] = {"StatsMin", "StatsMax", "StatsMean", "StatsSigma"};
+  const int statsParams[4] = {AndorPipeStatsMin, AndorPipeStatsMax, AndorPipeStatsMean, AndorPipeStatsSigma};
+  AndorPipeline::StageStats stats;
+  NDArray *pArray = this->pArrays[0];
+  NDAttribute *pAttribute;
+  int errors = 0;
+  double value;
+
+  for (int i=0; i<NumPipeStages; i++) {
+    mPipeline->getStats(i, &stats);
+    setDoubleParam(timeParams[i], stats.count ? stats.total / stats.count : 0.);
+    mMetrics->setSummary(MetricPipeDark + i, stats.total, stats.count);
+    errors += (int)stats.errors;
+  }
+  setIntegerParam(AndorPipeErrors, errors);
+  setIntegerParam(AndorPipeSteals, (int)mPipeline->steals());
+  setIntegerParam(AndorPipePending, mPipeline->pending());
+  setIntegerParam(AndorPipeDarkValid, mPipeDark->valid() ? 1 : 0);
+  setIntegerParam(AndorPipeFlatValid, mPipeFlat->valid() ? 1 : 0);
+  // The statistics of the last published frame
+  for (int i=0; (i<4) && pArray; i++) {
+    pAttribute = pArray->pAttributeList->find(statsNames[i]);
+    if (pAttribute && (pAttribute->getValue(NDAttrFloat64, &value) == 0)) setDoubleParam(statsParams[i], value);
+  }
+}
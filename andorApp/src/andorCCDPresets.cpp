@@ -0,0 +1,443 @@
+/**
+ * Acquisition presets and OptAcquire modes of the ADAndor driver.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include <epicsEvent.h>
+#include <epicsString.h>
+
+#include <ADDriver.h>
+
+#ifdef _WIN32
+#include "ATMCD32D.h"
+#else
+#include "atmcdLXd.h"
+#endif
+
+#include "andorCCD.h"
+#include "andorPresets.h"
+#include "andorLock.h"
+
+static const char *driverName = "andorCCD";
+
+/**
+ * Create the parameters and preset store of presets and OptAcquire modes and set the
+ * parameter defaults.
+ */
+int AndorCCD::initPresets()
+{
+  int status = asynSuccess;
+
+  createParam(AndorPresetNameString,              asynParamOctet, &AndorPresetName);
+  createParam(AndorPresetSaveString,              asynParamInt32, &AndorPresetSave);
+  createParam(AndorPresetApplyString,             asynParamInt32, &AndorPresetApply);
+  createParam(AndorPresetDeleteString,            asynParamInt32, &AndorPresetDelete);
+  createParam(AndorPresetListString,              asynParamOctet, &AndorPresetList);
+  createParam(AndorPresetChangedString,           asynParamInt32, &AndorPresetChanged);
+  createParam(AndorPresetFileString,              asynParamOctet, &AndorPresetFile);
+  createParam(AndorOAModeString,                  asynParamInt32, &AndorOAMode);
+  createParam(AndorOAApplyString,                 asynParamInt32, &AndorOAApply);
+
+  setupPresets();
+
+  status |= setStringParam(AndorPresetName, "");
+  status |= setIntegerParam(AndorPresetSave, 0);
+  status |= setIntegerParam(AndorPresetApply, 0);
+  status |= setIntegerParam(AndorPresetDelete, 0);
+  status |= setStringParam(AndorPresetList, "");
+  status |= setIntegerParam(AndorPresetChanged, 0);
+  status |= setStringParam(AndorPresetFile, "");
+  status |= setIntegerParam(AndorOAMode, 0);
+  status |= setIntegerParam(AndorOAApply, 0);
+  return status;
+}
+
+/**
+ * Called from writeInt32 for every parameter.
+ * Handles the integer parameters of presets and OptAcquire modes.
+ * \param[in] function Parameter being written; its new value is already in the parameter library.
+ * \param[in] value New value.
+ * \param[in] oldValue Value before the write, restored if the write fails.
+ * \param[out] pStatus Status of the write, if it was handled.
+ * \return true if the parameter belongs to presets, false otherwise.
+ */
+bool AndorCCD::writePresetsInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                                 asynStatus *pStatus)
+{
+  *pStatus = asynSuccess;
+  if (function == AndorPresetSave) {
+    if (value) *pStatus = savePreset();
+    setIntegerParam(AndorPresetSave, 0);
+  }
+  else if (function == AndorPresetApply) {
+    if (value) *pStatus = applyPreset();
+    setIntegerParam(AndorPresetApply, 0);
+  }
+  else if (function == AndorPresetDelete) {
+    if (value) *pStatus = deletePreset();
+    setIntegerParam(AndorPresetDelete, 0);
+  }
+  else if (function == AndorOAApply) {
+    if (value) *pStatus = applyOptAcquireMode();
+    setIntegerParam(AndorOAApply, 0);
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Called from writeOctet for every parameter.  Reads the presets when
+ * AndorPresetFile is written.
+ * \param[in] function Parameter being written.
+ * \param[in] value Address of the string to write.
+ * \param[in] nChars Number of characters to write.
+ * \param[out] nActual Number of characters actually written.
+ * \param[out] pStatus Status of the write, if it was handled.
+ * \return true if the parameter belongs to presets, false otherwise.
+ */
+bool AndorCCD::writePresetsOctet(int function, const char *value, size_t nChars,
+                                 size_t *nActual, asynStatus *pStatus)
+{
+  char fileName[MAX_FILENAME_LEN];
+  static const char *functionName = "writePresetsOctet";
+
+  if (function != AndorPresetFile) return false;
+  setStringParam(function, value);
+  getStringParam(AndorPresetFile, sizeof(fileName), fileName);
+  // A file that does not exist yet is created by the first save
+  if (fileName[0] && (mPresets->read(fileName) == 0)) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s:%s: read %d presets from %s\n",
+      driverName, functionName, mPresets->numPresets(), fileName);
+  }
+  updatePresetList();
+  *nActual = nChars;
+  *pStatus = asynSuccess;
+  return true;
+}
+
+/**
+ * Create the preset store and the list of parameters in a preset.
+ */
+void AndorCCD::setupPresets()
+{
+  // Parameters are applied in this order.  AndorAdcSpeed must come before AndorPreAmpGain,
+  // because the gains that are available depend on the ADC speed.
+  const int intParams[] = {
+    ADImageMode, ADNumExposures, ADNumImages, ADTriggerMode, AndorReadOutMode,
+    ADBinX, ADBinY, ADMinX, ADMinY, ADSizeX, ADSizeY, ADReverseX, ADReverseY,
+    AndorAdcSpeed, AndorPreAmpGain, AndorEmGainMode, AndorEmGainAdvanced, AndorEmGain,
+    AndorFrameTransferMode, AndorKeepClean, AndorFastExtTrigger,
+    AndorVerticalShiftPeriod, AndorVerticalShiftAmplitude, AndorMaxImagesPerDMA,
+    AndorIsolatedCropMode, AndorHighCapacity, AndorBaselineClamp, AndorNumberPrescans,
+    AndorBaselineOffset, AndorTriggerLatencyMode, ADShutterMode, AndorShutterMode,
+    AndorShutterExTTL, NDDataType, AndorDDGEnable, AndorDDGGateMode, AndorMCPGain,
+    AndorDDGStepMode, AndorDDGWidthStepMode, AndorDDGIOC, AndorSingleTrackCentre,
+    AndorSingleTrackHeight
+  };
+  const int doubleParams[] = {
+    ADAcquireTime, ADAcquirePeriod, AndorAccumulatePeriod, AndorSecondsPerDMA,
+    ADShutterOpenDelay, ADShutterCloseDelay, AndorDDGDelay, AndorDDGWidth, AndorDDGStepP1,
+    AndorDDGStepP2, AndorDDGWidthStepP1, AndorDDGWidthStepP2, AndorDDGIOCFrequency
+  };
+  int i;
+
+  mPresets = new AndorPresetStore();
+  mNumPresetParams = 0;
+  for (i=0; i<(int)(sizeof(intParams)/sizeof(intParams[0])); i++) {
+    mPresetParams[mNumPresetParams++] = intParams[i];
+  }
+  mNumPresetInts = mNumPresetParams;
+  for (i=0; i<(int)(sizeof(doubleParams)/sizeof(doubleParams[0])); i++) {
+    mPresetParams[mNumPresetParams++] = doubleParams[i];
+  }
+}
+
+/**
+ * Save the current values of the preset parameters as the preset named AndorPresetName.
+ */
+asynStatus AndorCCD::savePreset()
+{
+  AndorPresetStore::Value values[MAX_PRESET_PARAMS];
+  char name[AndorPresetStore::NameSize];
+  const char *paramName;
+  int i, ivalue;
+
+  getStringParam(AndorPresetName, sizeof(name), name);
+  if (!name[0]) {
+    setStringParam(AndorMessage, "No preset name.");
+    return asynError;
+  }
+  memset(values, 0, sizeof(values));
+  for (i=0; i<mNumPresetParams; i++) {
+    getParamName(mPresetParams[i], &paramName);
+    strncpy(values[i].param, paramName, sizeof(values[i].param) - 1);
+    if (i < mNumPresetInts) {
+      getIntegerParam(mPresetParams[i], &ivalue);
+      values[i].value = ivalue;
+    } else {
+      getDoubleParam(mPresetParams[i], &values[i].value);
+    }
+  }
+  if (mPresets->save(name, values, mNumPresetParams) != 0) {
+    setStringParam(AndorMessage, "Too many presets.");
+    return asynError;
+  }
+  writePresetFile();
+  updatePresetList();
+  return asynSuccess;
+}
+
+/**
+ * Apply the preset named AndorPresetName.  Only the parameters whose values differ are
+ * written, through writeInt32 and writeFloat64 so that settings outside setupAcquisition
+ * (shutter, data type) are also pushed to the camera, and setupAcquisition is only run
+ * once, after all the parameters have been written.  That run sends every acquisition
+ * setting to the SDK, not only the changed ones: the SDK v2 settings depend on each other
+ * (the read and acquisition modes decide which of the others apply), so they are always
+ * set together, as for a single parameter change.
+ */
+asynStatus AndorCCD::applyPreset()
+{
+  const AndorPresetStore::Preset *pPreset;
+  const AndorPresetStore::Value *pValue;
+  char name[AndorPresetStore::NameSize];
+  const char *paramName;
+  int i, ivalue, savedReason, numChanged = 0;
+  double dvalue;
+  asynStatus status = asynSuccess;
+  static const char *functionName = "applyPreset";
+
+  getStringParam(AndorPresetName, sizeof(name), name);
+  pPreset = mPresets->find(name);
+  if (!pPreset) {
+    setStringParam(AndorMessage, "Preset not found.");
+    return asynError;
+  }
+  if (mAcquiringData) {
+    setStringParam(AndorMessage, "Cannot apply a preset while acquiring.");
+    return asynError;
+  }
+  savedReason = pasynUserSelf->reason;
+  mDeferSetup = true;
+  mSetupPending = false;
+  for (i=0; i<mNumPresetParams; i++) {
+    getParamName(mPresetParams[i], &paramName);
+    pValue = AndorPresetStore::findValue(pPreset, paramName);
+    if (!pValue) continue;
+    pasynUserSelf->reason = mPresetParams[i];
+    if (i < mNumPresetInts) {
+      getIntegerParam(mPresetParams[i], &ivalue);
+      if (ivalue == (int)pValue->value) continue;
+      if (writeInt32(pasynUserSelf, (epicsInt32)pValue->value) != asynSuccess) status = asynError;
+    } else {
+      getDoubleParam(mPresetParams[i], &dvalue);
+      if (AndorPresetStore::sameValue(dvalue, pValue->value)) continue;
+      if (writeFloat64(pasynUserSelf, pValue->value) != asynSuccess) status = asynError;
+    }
+    numChanged++;
+  }
+  pasynUserSelf->reason = savedReason;
+  mDeferSetup = false;
+  if (mSetupPending) {
+    mSetupPending = false;
+    if (requestSetup() != asynSuccess) status = asynError;
+  }
+  setIntegerParam(AndorPresetChanged, numChanged);
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s:%s: preset %s changed %d parameters\n",
+    driverName, functionName, name, numChanged);
+  if (status != asynSuccess) setStringParam(AndorMessage, "Error applying preset.");
+  return status;
+}
+
+/**
+ * Delete the preset named AndorPresetName.
+ */
+asynStatus AndorCCD::deletePreset()
+{
+  char name[AndorPresetStore::NameSize];
+
+  getStringParam(AndorPresetName, sizeof(name), name);
+  if (mPresets->remove(name) != 0) {
+    setStringParam(AndorMessage, "Preset not found.");
+    return asynError;
+  }
+  writePresetFile();
+  updatePresetList();
+  return asynSuccess;
+}
+
+void AndorCCD::updatePresetList()
+{
+  char list[1024];
+
+  mPresets->list(list, sizeof(list));
+  setStringParam(AndorPresetList, list);
+}
+
+/**
+ * Write the presets to AndorPresetFile, if it is set.
+ */
+void AndorCCD::writePresetFile()
+{
+  char fileName[MAX_FILENAME_LEN];
+  static const char *functionName = "writePresetFile";
+
+  getStringParam(AndorPresetFile, sizeof(fileName), fileName);
+  if (!fileName[0]) return;
+  if (mPresets->write(fileName) != 0) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: unable to write presets to %s\n",
+      driverName, functionName, fileName);
+    setStringParam(AndorMessage, "Unable to write preset file.");
+  }
+}
+
+/**
+ * Read the names of the OptAcquire preset modes, on cameras that support them, and
+ * build the AndorOAMode enum.
+ */
+void AndorCCD::setupOptAcquire()
+{
+  unsigned int numModes = 0;
+  char *pNames = NULL, *pName, *pComma;
+  char enumStrings[MAX_OA_MODES][MAX_ENUM_STRING_SIZE];
+  char *pEnumStrings[MAX_OA_MODES];
+  int enumValues[MAX_OA_MODES];
+  int enumSeverities[MAX_OA_MODES];
+  int i;
+  static const char *functionName = "setupOptAcquire";
+
+  strcpy(mOAModeNames[0], "None");
+  mNumOAModes = 1;
+  if (mCapabilities.ulFeatures & AC_FEATURES_OPTACQUIRE) {
+    try {
+      // Only the preset modes supplied with the SDK are used, so there is no user mode file
+      checkStatus(OA_Initialize(NULL, 0));
+      checkStatus(OA_GetNumberOfPreSetModes(&numModes));
+      if (numModes > 0) {
+        pNames = (char *)calloc(numModes + 1, 256);
+        checkStatus(OA_GetPreSetModeNames(pNames));
+        // The names are separated by commas
+        for (pName=pNames; pName && *pName && (mNumOAModes < MAX_OA_MODES); pName=pComma) {
+          pComma = strchr(pName, ',');
+          if (pComma) *pComma++ = 0;
+          while (*pName == ' ') pName++;
+          if (!*pName) continue;
+          epicsSnprintf(mOAModeNames[mNumOAModes++], MAX_OA_NAME_SIZE, "%s", pName);
+        }
+      }
+    } catch (const std::string &e) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s:%s: %s\n",
+        driverName, functionName, e.c_str());
+    }
+    free(pNames);
+  }
+  for (i=0; i<mNumOAModes; i++) {
+    epicsSnprintf(enumStrings[i], MAX_ENUM_STRING_SIZE, "%s", mOAModeNames[i]);
+    pEnumStrings[i] = enumStrings[i];
+    enumValues[i] = i;
+    enumSeverities[i] = 0;
+  }
+  doCallbacksEnum(pEnumStrings, enumValues, enumSeverities, mNumOAModes, AndorOAMode, 0);
+}
+
+/**
+ * Enable the OptAcquire mode selected by AndorOAMode, which sets up the camera in one
+ * SDK call, and read the mode's settings back into the driver parameters so that they
+ * are kept by the next setupAcquisition.
+ */
+asynStatus AndorCCD::applyOptAcquireMode()
+{
+  // OptAcquire parameters with the same meaning as a driver parameter
+  const struct {
+    const char *name;
+    int param;
+  } intParams[] = {
+    {"ReadMode",            AndorReadOutMode},
+    {"NumberAccumulations", ADNumExposures},
+    {"NumberKinetics",      ADNumImages},
+    {"TriggerMode",         ADTriggerMode},
+    {"EMGainMode",          AndorEmGainMode},
+    {"EMGain",              AndorEmGain},
+    {"FrameTransfer",       AndorFrameTransferMode},
+    {"PreAmpGain",          AndorPreAmpGain},
+    {"VSSpeed",             AndorVerticalShiftPeriod},
+    {"VSAmplitude",         AndorVerticalShiftAmplitude},
+    {"BaselineClamp",       AndorBaselineClamp}
+  };
+  int mode, ivalue, i, adc = -1, amp = -1, hsSpeed;
+  float fvalue;
+  const char *pMode;
+  static const char *functionName = "applyOptAcquireMode";
+
+  getIntegerParam(AndorOAMode, &mode);
+  if ((mode <= 0) || (mode >= mNumOAModes)) {
+    setStringParam(AndorMessage, "No OptAcquire mode selected.");
+    return asynError;
+  }
+  if (mAcquiringData) {
+    setStringParam(AndorMessage, "Cannot change OptAcquire mode while acquiring.");
+    return asynError;
+  }
+  AndorLock::Guard sdkGuard(mSDKLock);
+  pMode = mOAModeNames[mode];
+  try {
+    checkStatus(OA_EnableMode(pMode));
+  } catch (const std::string &e) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: %s\n",
+      driverName, functionName, e.c_str());
+    return asynError;
+  }
+
+  // Parameters that are not part of the mode return an error and are left unchanged
+  for (i=0; i<(int)(sizeof(intParams)/sizeof(intParams[0])); i++) {
+    if (OA_GetInt(pMode, intParams[i].name, &ivalue) == DRV_SUCCESS) {
+      setIntegerParam(intParams[i].param, ivalue);
+    }
+  }
+  if (OA_GetInt(pMode, "AcquisitionMode", &ivalue) == DRV_SUCCESS) {
+    if (ivalue == (int)AASingle) setIntegerParam(ADImageMode, ADImageSingle);
+    else if (ivalue == (int)AAKinetics) setIntegerParam(ADImageMode, ADImageMultiple);
+    else if (ivalue == (int)AARunTillAbort) setIntegerParam(ADImageMode, ADImageContinuous);
+    else if (ivalue == (int)AAFastKinetics) setIntegerParam(ADImageMode, AImageFastKinetics);
+  }
+  if (OA_GetFloat(pMode, "ExposureTime", &fvalue) == DRV_SUCCESS) {
+    mAcquireTime = fvalue;
+    setDoubleParam(ADAcquireTime, fvalue);
+  }
+  if (OA_GetFloat(pMode, "KineticCycleTime", &fvalue) == DRV_SUCCESS) {
+    mAcquirePeriod = fvalue;
+    setDoubleParam(ADAcquirePeriod, fvalue);
+  }
+  if (OA_GetFloat(pMode, "AccumulateCycleTime", &fvalue) == DRV_SUCCESS) {
+    mAccumulatePeriod = fvalue;
+    setDoubleParam(AndorAccumulatePeriod, fvalue);
+  }
+  // The driver selects the ADC channel, amplifier and horizontal shift speed together
+  if (OA_GetInt(pMode, "HSSpeed", &hsSpeed) == DRV_SUCCESS) {
+    if (OA_GetInt(pMode, "ADChannel", &ivalue) == DRV_SUCCESS) adc = ivalue;
+    if (OA_GetInt(pMode, "OutputAmplifier", &ivalue) == DRV_SUCCESS) amp = ivalue;
+    for (i=0; i<mNumADCSpeeds; i++) {
+      if ((mADCSpeeds[i].HSSpeedIndex == hsSpeed) &&
+          ((adc < 0) || (mADCSpeeds[i].ADCIndex == adc)) &&
+          ((amp < 0) || (mADCSpeeds[i].AmpIndex == amp))) {
+        setIntegerParam(AndorAdcSpeed, mADCSpeeds[i].EnumValue);
+        setupPreAmpGains();
+        break;
+      }
+    }
+  }
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s:%s: enabled OptAcquire mode %s\n",
+    driverName, functionName, pMode);
+  return asynSuccess;
+}
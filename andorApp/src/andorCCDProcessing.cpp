@@ -0,0 +1,646 @@
+/**
+ * Software frame processing of the ADAndor driver: baseline and common-mode
+ * correction, software binning, pump-probe, averaging, change gating, sparse event
+ * output and spectral peak tracking.
+ */
+
+#include <stdlib.h>
+#include <string>
+
+#include <epicsEvent.h>
+
+#include <ADDriver.h>
+
+#ifdef _WIN32
+#include "ATMCD32D.h"
+#else
+#include "atmcdLXd.h"
+#endif
+#include "atspectrograph.h"
+
+#include "andorCCD.h"
+#include "andorFrameAverager.h"
+#include "andorFrameBinner.h"
+#include "andorFrameGate.h"
+#include "andorEventFinder.h"
+#include "andorBaselineCorrector.h"
+#include "andorMetrics.h"
+#include "andorCommonMode.h"
+#include "andorPeakTracker.h"
+#include "andorPumpProbe.h"
+#include "andorLock.h"
+
+static const char *driverName = "andorCCD";
+
+/**
+ * Create the parameters and objects of the frame processing features and set the
+ * parameter defaults.
+ */
+int AndorCCD::initProcessing()
+{
+  int status = asynSuccess;
+
+  createParam(AndorAverageModeString,             asynParamInt32, &AndorAverageMode);
+  createParam(AndorAverageFramesString,           asynParamInt32, &AndorAverageFrames);
+  createParam(AndorAverageFactorString,           asynParamInt32, &AndorAverageFactor);
+  createParam(AndorAverageResetString,            asynParamInt32, &AndorAverageReset);
+  createParam(AndorAverageCountString,            asynParamInt32, &AndorAverageCount);
+  createParam(AndorAverageHardwareString,         asynParamInt32, &AndorAverageHardware);
+  createParam(AndorSWBinXString,                  asynParamInt32, &AndorSWBinX);
+  createParam(AndorSWBinYString,                  asynParamInt32, &AndorSWBinY);
+  createParam(AndorSWBinModeString,               asynParamInt32, &AndorSWBinMode);
+  createParam(AndorSWBinOutputString,             asynParamInt32, &AndorSWBinOutput);
+  createParam(AndorGateModeString,                asynParamInt32, &AndorGateMode);
+  createParam(AndorGateThresholdString,           asynParamFloat64, &AndorGateThreshold);
+  createParam(AndorGateStrideString,              asynParamInt32, &AndorGateStride);
+  createParam(AndorGateMinXString,                asynParamInt32, &AndorGateMinX);
+  createParam(AndorGateMinYString,                asynParamInt32, &AndorGateMinY);
+  createParam(AndorGateSizeXString,               asynParamInt32, &AndorGateSizeX);
+  createParam(AndorGateSizeYString,               asynParamInt32, &AndorGateSizeY);
+  createParam(AndorGateKeyframeString,            asynParamInt32, &AndorGateKeyframe);
+  createParam(AndorGateReferenceString,           asynParamInt32, &AndorGateReference);
+  createParam(AndorGateMetricString,              asynParamFloat64, &AndorGateMetric);
+  createParam(AndorGatePassedString,              asynParamInt32, &AndorGatePassed);
+  createParam(AndorGateSkippedString,             asynParamInt32, &AndorGateSkipped);
+  createParam(AndorGatePassRatioString,           asynParamFloat64, &AndorGatePassRatio);
+  createParam(AndorEventModeString,               asynParamInt32, &AndorEventMode);
+  createParam(AndorEventThresholdString,          asynParamFloat64, &AndorEventThreshold);
+  createParam(AndorEventPedestalString,           asynParamFloat64, &AndorEventPedestal);
+  createParam(AndorEventMaxHitsString,            asynParamInt32, &AndorEventMaxHits);
+  createParam(AndorEventDenseIntervalString,      asynParamInt32, &AndorEventDenseInterval);
+  createParam(AndorEventCountString,              asynParamInt32, &AndorEventCount);
+  createParam(AndorEventTotalString,              asynParamInt32, &AndorEventTotal);
+  createParam(AndorEventOverflowsString,          asynParamInt32, &AndorEventOverflows);
+  createParam(AndorBaselineModeString,            asynParamInt32, &AndorBaselineMode);
+  createParam(AndorBaselineColumnsString,         asynParamInt32, &AndorBaselineColumns);
+  createParam(AndorBaselineSideString,            asynParamInt32, &AndorBaselineSide);
+  createParam(AndorBaselineValueString,           asynParamFloat64, &AndorBaselineValue);
+  createParam(AndorBaselineTrendString,           asynParamFloat64Array, &AndorBaselineTrend);
+  createParam(AndorCMModeString,                  asynParamInt32, &AndorCMMode);
+  createParam(AndorCMThresholdString,             asynParamFloat64, &AndorCMThreshold);
+  createParam(AndorCMMinPixelsString,             asynParamInt32, &AndorCMMinPixels);
+  createParam(AndorCMThreadsString,               asynParamInt32, &AndorCMThreads);
+  createParam(AndorCMRowRMSString,                asynParamFloat64, &AndorCMRowRMS);
+  createParam(AndorCMColumnRMSString,             asynParamFloat64, &AndorCMColumnRMS);
+  createParam(AndorPeakModeString,                asynParamInt32, &AndorPeakMode);
+  createParam(AndorPeakWindowsString,             asynParamOctet, &AndorPeakWindows);
+  createParam(AndorPeakNumWindowsString,          asynParamInt32, &AndorPeakNumWindows);
+  createParam(AndorPeakMaxIterString,             asynParamInt32, &AndorPeakMaxIter);
+  createParam(AndorPeakCalibratedString,          asynParamInt32, &AndorPeakCalibrated);
+  createParam(AndorPeakFailuresString,            asynParamInt32, &AndorPeakFailures);
+  createParam(AndorPeakPositionString,            asynParamFloat64Array, &AndorPeakPosition);
+  createParam(AndorPeakWidthString,               asynParamFloat64Array, &AndorPeakWidth);
+  createParam(AndorPeakAmplitudeString,           asynParamFloat64Array, &AndorPeakAmplitude);
+  createParam(AndorPeakQualityString,             asynParamFloat64Array, &AndorPeakQuality);
+  createParam(AndorPeakHistoryWindowString,       asynParamInt32, &AndorPeakHistoryWindow);
+  createParam(AndorPeakHistPositionString,        asynParamFloat64Array, &AndorPeakHistPosition);
+  createParam(AndorPeakHistWidthString,           asynParamFloat64Array, &AndorPeakHistWidth);
+  createParam(AndorPeakHistAmplitudeString,       asynParamFloat64Array, &AndorPeakHistAmplitude);
+  createParam(AndorPeakHistQualityString,         asynParamFloat64Array, &AndorPeakHistQuality);
+  createParam(AndorPeakResetString,               asynParamInt32, &AndorPeakReset);
+  createParam(AndorPPModeString,                  asynParamInt32, &AndorPPMode);
+  createParam(AndorPPSeriesLengthString,          asynParamInt32, &AndorPPSeriesLength);
+  createParam(AndorPPRepeatsString,               asynParamInt32, &AndorPPRepeats);
+  createParam(AndorPPPairsString,                 asynParamInt32, &AndorPPPairs);
+  createParam(AndorPPKeyString,                   asynParamInt32, &AndorPPKey);
+  createParam(AndorPPGateString,                  asynParamInt32, &AndorPPGate);
+  createParam(AndorPPIndexString,                 asynParamInt32, &AndorPPIndex);
+  createParam(AndorPPCountString,                 asynParamInt32, &AndorPPCount);
+  createParam(AndorPPOnCountString,               asynParamInt32, &AndorPPOnCount);
+  createParam(AndorPPOffCountString,              asynParamInt32, &AndorPPOffCount);
+  createParam(AndorPPResetString,                 asynParamInt32, &AndorPPReset);
+
+  mAverager = new AndorFrameAverager();
+  mBinner = new AndorFrameBinner();
+  mGate = new AndorFrameGate();
+  mEventFinder = new AndorEventFinder();
+  mBaseline = new AndorBaselineCorrector();
+  mCommonMode = new AndorCommonMode();
+  mPeakTracker = new AndorPeakTracker();
+  mPumpProbe = new AndorPumpProbe();
+
+  status |= setIntegerParam(AndorAverageMode, AndorFrameAverager::ModeNone);
+  status |= setIntegerParam(AndorAverageFrames, 10);
+  status |= setIntegerParam(AndorAverageFactor, 10);
+  status |= setIntegerParam(AndorAverageCount, 0);
+  status |= setIntegerParam(AndorAverageHardware, 0);
+  status |= setIntegerParam(AndorSWBinX, 1);
+  status |= setIntegerParam(AndorSWBinY, 1);
+  status |= setIntegerParam(AndorSWBinMode, AndorFrameBinner::ModeSum);
+  status |= setIntegerParam(AndorSWBinOutput, AndorFrameBinner::OutputUInt32);
+  status |= setIntegerParam(AndorGateMode, AndorFrameGate::ModeOff);
+  status |= setDoubleParam(AndorGateThreshold, 1.0);
+  status |= setIntegerParam(AndorGateStride, 4);
+  status |= setIntegerParam(AndorGateMinX, 0);
+  status |= setIntegerParam(AndorGateMinY, 0);
+  status |= setIntegerParam(AndorGateSizeX, 0);
+  status |= setIntegerParam(AndorGateSizeY, 0);
+  status |= setIntegerParam(AndorGateKeyframe, 100);
+  status |= setDoubleParam(AndorGateMetric, 0.);
+  status |= setIntegerParam(AndorGatePassed, 0);
+  status |= setIntegerParam(AndorGateSkipped, 0);
+  status |= setDoubleParam(AndorGatePassRatio, 100.);
+  status |= setIntegerParam(AndorEventMode, 0);
+  status |= setDoubleParam(AndorEventThreshold, 1000.);
+  status |= setDoubleParam(AndorEventPedestal, 0.);
+  status |= setIntegerParam(AndorEventMaxHits, 100000);
+  status |= setIntegerParam(AndorEventDenseInterval, 0);
+  status |= setIntegerParam(AndorEventCount, 0);
+  status |= setIntegerParam(AndorEventTotal, 0);
+  status |= setIntegerParam(AndorEventOverflows, 0);
+  status |= setIntegerParam(AndorBaselineMode, AndorBaselineCorrector::ModeOff);
+  status |= setIntegerParam(AndorBaselineColumns, 0);
+  status |= setIntegerParam(AndorBaselineSide, AndorBaselineCorrector::SideLeft);
+  status |= setDoubleParam(AndorBaselineValue, 0.0);
+  status |= setIntegerParam(AndorCMMode, AndorCommonMode::ModeOff);
+  status |= setDoubleParam(AndorCMThreshold, 0.0);
+  status |= setIntegerParam(AndorCMMinPixels, 16);
+  status |= setIntegerParam(AndorCMThreads, 4);
+  status |= setDoubleParam(AndorCMRowRMS, 0.0);
+  status |= setDoubleParam(AndorCMColumnRMS, 0.0);
+  status |= setIntegerParam(AndorPeakMode, AndorPeakTracker::ModeOff);
+  status |= setStringParam(AndorPeakWindows, "");
+  status |= setIntegerParam(AndorPeakNumWindows, 0);
+  status |= setIntegerParam(AndorPeakMaxIter, 10);
+  status |= setIntegerParam(AndorPeakCalibrated, 0);
+  status |= setIntegerParam(AndorPeakFailures, 0);
+  status |= setIntegerParam(AndorPeakHistoryWindow, 0);
+  status |= setIntegerParam(AndorPeakReset, 0);
+  status |= setIntegerParam(AndorPPMode, AndorPumpProbe::ModeOff);
+  status |= setIntegerParam(AndorPPSeriesLength, 0);
+  status |= setIntegerParam(AndorPPRepeats, 0);
+  status |= setIntegerParam(AndorPPPairs, 1);
+  status |= setIntegerParam(AndorPPKey, APPKeyOddOn);
+  status |= setIntegerParam(AndorPPGate, 0);
+  status |= setIntegerParam(AndorPPIndex, 0);
+  status |= setIntegerParam(AndorPPCount, 0);
+  status |= setIntegerParam(AndorPPOnCount, 0);
+  status |= setIntegerParam(AndorPPOffCount, 0);
+  status |= setIntegerParam(AndorPPReset, 0);
+  return status;
+}
+
+
+/**
+ * Prepare the frame processing for a new acquisition.  Each acquisition starts a new
+ * average, new gating statistics and new event, baseline and peak histories.
+ */
+void AndorCCD::startProcessing()
+{
+  mAverager->reset();
+  setIntegerParam(AndorAverageCount, 0);
+  mGate->resetStats();
+  updateGateStatus();
+  setIntegerParam(AndorEventTotal, 0);
+  setIntegerParam(AndorEventOverflows, 0);
+  mBaseline->resetTrend();
+  mPeakTracker->resetHistory();
+  mPeakCalibrationWidth = 0;
+  setIntegerParam(AndorPeakFailures, 0);
+}
+
+/**
+ * Called from writeInt32 for every parameter.
+ * Handles the integer parameters of the frame processing features.
+ * \param[in] function Parameter being written; its new value is already in the parameter library.
+ * \param[in] value New value.
+ * \param[in] oldValue Value before the write, restored if the write fails.
+ * \param[out] pStatus Status of the write, if it was handled.
+ * \return true if the parameter belongs to the frame processing, false otherwise.
+ */
+bool AndorCCD::writeProcessingInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                                    asynStatus *pStatus)
+{
+  if ((function == AndorAverageMode) || (function == AndorAverageFrames) ||
+      (function == AndorAverageFactor)) {
+    *pStatus = setupAveraging(mAcquiringData != 0);
+    if (*pStatus != asynSuccess) setIntegerParam(function, oldValue);
+  }
+  else if ((function == AndorSWBinX) || (function == AndorSWBinY)) {
+    if (value < 1) setIntegerParam(function, 1);
+  }
+  else if (function == AndorPPReset) {
+    if (value) {
+      mPumpProbe->reset();
+      setIntegerParam(AndorPPCount, 0);
+      setIntegerParam(AndorPPOnCount, 0);
+      setIntegerParam(AndorPPOffCount, 0);
+    }
+    setIntegerParam(AndorPPReset, 0);
+  }
+  else if (function == AndorPeakReset) {
+    if (value) {
+      mPeakTracker->resetHistory();
+      setIntegerParam(AndorPeakFailures, 0);
+    }
+    setIntegerParam(AndorPeakReset, 0);
+  }
+  else if (function == AndorGateReference) {
+    if (value) mGate->captureReference();
+    setIntegerParam(AndorGateReference, 0);
+  }
+  else if (function == AndorAverageReset) {
+    if (value) mAverager->reset();
+    setIntegerParam(AndorAverageReset, 0);
+    setIntegerParam(AndorAverageCount, mAverager->count());
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Called from writeOctet for every parameter.  Sets the peak tracking windows.
+ * \param[in] function Parameter being written.
+ * \param[in] value Address of the string to write.
+ * \param[in] nChars Number of characters to write.
+ * \param[out] nActual Number of characters actually written.
+ * \param[out] pStatus Status of the write, if it was handled.
+ * \return true if the parameter belongs to the frame processing, false otherwise.
+ */
+bool AndorCCD::writeProcessingOctet(int function, const char *value, size_t nChars,
+                                    size_t *nActual, asynStatus *pStatus)
+{
+  static const char *functionName = "writeProcessingOctet";
+
+  if (function != AndorPeakWindows) return false;
+  // The string is used as is, so it must be terminated
+  std::string spec(value, nChars);
+  int numWindows = mPeakTracker->setWindows(spec.c_str());
+  if (numWindows < 0) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: invalid peak windows \"%s\"\n",
+      driverName, functionName, spec.c_str());
+    *nActual = 0;
+    *pStatus = asynError;
+    return true;
+  }
+  setStringParam(function, spec.c_str());
+  setIntegerParam(AndorPeakNumWindows, numWindows);
+  *nActual = nChars;
+  *pStatus = asynSuccess;
+  return true;
+}
+
+/**
+ * Select SDK or software frame averaging.  The SDK data averaging filters are used
+ * when the camera accepts them, but they only apply to Multiple and Continuous image
+ * modes; otherwise the driver averages in software.
+ * \param[in] live True if called during acquisition.  The SDK filters cannot be changed
+ *            then, so only the software averager is reconfigured.
+ */
+asynStatus AndorCCD::setupAveraging(bool live)
+{
+  int averageMode, averageFrames, averageFactor;
+  int imageMode;
+  int hardware = 0;
+  unsigned int sdkStatus;
+  static const char *functionName = "setupAveraging";
+
+  if (!mInitOK) {
+    return asynDisabled;
+  }
+  AndorLock::Guard sdkGuard(mSDKLock);
+  getIntegerParam(AndorAverageMode, &averageMode);
+  getIntegerParam(AndorAverageFrames, &averageFrames);
+  if (averageFrames < 1) {
+    averageFrames = 1;
+    setIntegerParam(AndorAverageFrames, averageFrames);
+  }
+  getIntegerParam(AndorAverageFactor, &averageFactor);
+  if (averageFactor < 1) {
+    averageFactor = 1;
+    setIntegerParam(AndorAverageFactor, averageFactor);
+  }
+  getIntegerParam(ADImageMode, &imageMode);
+
+  if (live) {
+    // Changes to the SDK filter take effect on the next acquisition
+    if (!mAverageHardware) {
+      mAverager->configure(averageMode, averageFrames, averageFactor);
+      setIntegerParam(AndorAverageCount, mAverager->count());
+    }
+    return asynSuccess;
+  }
+
+  if ((averageMode != AndorFrameAverager::ModeNone) &&
+      ((imageMode == ADImageMultiple) || (imageMode == ADImageContinuous))) {
+    if (averageMode == AndorFrameAverager::ModeRolling) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+        "%s:%s:, Filter_SetDataAveragingMode(%d), Filter_SetAveragingFrameCount(%d)\n",
+        driverName, functionName, AFilterFrameAverage, averageFrames);
+      sdkStatus = Filter_SetDataAveragingMode(AFilterFrameAverage);
+      if (sdkStatus == DRV_SUCCESS) sdkStatus = Filter_SetAveragingFrameCount(averageFrames);
+    } else {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+        "%s:%s:, Filter_SetDataAveragingMode(%d), Filter_SetAveragingFactor(%d)\n",
+        driverName, functionName, AFilterRecursiveAverage, averageFactor);
+      sdkStatus = Filter_SetDataAveragingMode(AFilterRecursiveAverage);
+      if (sdkStatus == DRV_SUCCESS) sdkStatus = Filter_SetAveragingFactor(averageFactor);
+    }
+    hardware = (sdkStatus == DRV_SUCCESS);
+  }
+  if (!hardware) {
+    // Not all cameras have the filters, so failing to turn them off is not an error
+    Filter_SetDataAveragingMode(AFilterNoAverage);
+  }
+  mAverageHardware = hardware;
+  mAverager->configure(hardware ? (int)AndorFrameAverager::ModeNone : averageMode,
+                       averageFrames, averageFactor);
+  setIntegerParam(AndorAverageHardware, hardware);
+  setIntegerParam(AndorAverageCount, mAverager->count());
+  return asynSuccess;
+}
+
+/**
+ * Apply the software processing to a frame read from the SDK.
+ * \param[in] pArray Frame read from the SDK.
+ * \param[in] frameIndex Index of the frame in the SDK circular buffer, which counts from 1
+ *            at the start of the acquisition.
+ * \param[in] imageCounter Value of NDArrayCounter for the frame.
+ * \return The processed frame, or NULL if there is nothing to publish.  If it is not
+ *         pArray, pArray has been released.
+ */
+NDArray *AndorCCD::processFrame(NDArray *pArray, int frameIndex, int imageCounter)
+{
+  NDArray *pOut;
+  NDArrayInfo arrayInfo;
+  int swBinX, swBinY, swBinMode, swBinOutput;
+  int eventMode;
+  int baselineMode, baselineColumns, baselineSide;
+  int cmMode, cmMinPixels, cmThreads;
+  int peakMode;
+  int ppMode;
+  double cmThreshold;
+  static const char *functionName = "processFrame";
+
+  getIntegerParam(AndorBaselineMode, &baselineMode);
+  if (baselineMode != AndorBaselineCorrector::ModeOff) {
+    getIntegerParam(AndorBaselineColumns, &baselineColumns);
+    getIntegerParam(AndorBaselineSide, &baselineSide);
+    if (mBaseline->process(pArray, baselineMode, baselineColumns, baselineSide)) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s:%s: baseline correction failed\n",
+        driverName, functionName);
+    } else {
+      setDoubleParam(AndorBaselineValue, mBaseline->baseline());
+      doCallbacksFloat64Array((epicsFloat64 *)mBaseline->trend(), mBaseline->trendCount(),
+                              AndorBaselineTrend, 0);
+    }
+  }
+  getIntegerParam(AndorCMMode, &cmMode);
+  if (cmMode != AndorCommonMode::ModeOff) {
+    getDoubleParam(AndorCMThreshold, &cmThreshold);
+    getIntegerParam(AndorCMMinPixels, &cmMinPixels);
+    getIntegerParam(AndorCMThreads, &cmThreads);
+    if (mCommonMode->process(pArray, cmMode, cmThreshold, cmMinPixels, cmThreads)) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s:%s: common-mode correction failed\n",
+        driverName, functionName);
+    } else {
+      setDoubleParam(AndorCMRowRMS, mCommonMode->rowRMS());
+      setDoubleParam(AndorCMColumnRMS, mCommonMode->columnRMS());
+    }
+  }
+  getIntegerParam(AndorPeakMode, &peakMode);
+  if (peakMode != AndorPeakTracker::ModeOff) trackPeaks(pArray);
+  getIntegerParam(AndorSWBinX, &swBinX);
+  getIntegerParam(AndorSWBinY, &swBinY);
+  if (swBinX * swBinY > 1) {
+    getIntegerParam(AndorSWBinMode, &swBinMode);
+    getIntegerParam(AndorSWBinOutput, &swBinOutput);
+    if (mBinner->process(pArray, swBinX, swBinY, swBinMode, swBinOutput)) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s:%s: software binning failed\n",
+        driverName, functionName);
+    }
+  }
+  getIntegerParam(AndorPPMode, &ppMode);
+  if (ppMode != AndorPumpProbe::ModeOff) {
+    pArray = pumpProbe(pArray, frameIndex);
+    if (!pArray) return NULL;
+  }
+  if (mAverager->mode() != AndorFrameAverager::ModeNone) {
+    pOut = mAverager->process(pArray, this->pNDArrayPool);
+    if (pOut) {
+      pArray->release();
+      pArray = pOut;
+    }
+    setIntegerParam(AndorAverageCount, mAverager->count());
+  }
+  getIntegerParam(AndorEventMode, &eventMode);
+  if (eventMode) {
+    pArray = findEvents(pArray, imageCounter);
+    if (!pArray) return NULL;
+  }
+  pArray->getInfo(&arrayInfo);
+  setIntegerParam(NDArraySize, (int)arrayInfo.totalBytes);
+  setIntegerParam(NDArraySizeX, (int)arrayInfo.xSize);
+  setIntegerParam(NDArraySizeY, (int)arrayInfo.ySize);
+  return pArray;
+}
+
+/**
+ * Track the spectral peaks of a spectrum and publish the results.  The Shamrock
+ * calibration is read for the first spectrum of each width.
+ * \param[in] pArray The spectrum, after the baseline and common-mode corrections.
+ */
+void AndorCCD::trackPeaks(NDArray *pArray)
+{
+  int peakMode, maxIterations, historyWindow, failures, itemp;
+  int numWindows = mPeakTracker->numWindows();
+  size_t historyCount;
+  static const char *functionName = "trackPeaks";
+
+  if ((int)pArray->dims[0].size != mPeakCalibrationWidth) {
+    loadPeakCalibration((int)pArray->dims[0].size);
+  }
+  getIntegerParam(AndorPeakMode, &peakMode);
+  getIntegerParam(AndorPeakMaxIter, &maxIterations);
+  failures = mPeakTracker->process(pArray, peakMode, maxIterations);
+  if (failures < 0) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: peak tracking needs a single spectrum\n",
+      driverName, functionName);
+    return;
+  }
+  if (failures > 0) {
+    getIntegerParam(AndorPeakFailures, &itemp);
+    setIntegerParam(AndorPeakFailures, itemp + failures);
+  }
+  doCallbacksFloat64Array((epicsFloat64 *)mPeakTracker->latest(AndorPeakTracker::ResultPosition),
+                          numWindows, AndorPeakPosition, 0);
+  doCallbacksFloat64Array((epicsFloat64 *)mPeakTracker->latest(AndorPeakTracker::ResultWidth),
+                          numWindows, AndorPeakWidth, 0);
+  doCallbacksFloat64Array((epicsFloat64 *)mPeakTracker->latest(AndorPeakTracker::ResultAmplitude),
+                          numWindows, AndorPeakAmplitude, 0);
+  doCallbacksFloat64Array((epicsFloat64 *)mPeakTracker->latest(AndorPeakTracker::ResultQuality),
+                          numWindows, AndorPeakQuality, 0);
+  getIntegerParam(AndorPeakHistoryWindow, &historyWindow);
+  if ((historyWindow < 0) || (historyWindow >= numWindows)) return;
+  historyCount = mPeakTracker->historyCount();
+  doCallbacksFloat64Array((epicsFloat64 *)mPeakTracker->history(historyWindow, AndorPeakTracker::ResultPosition),
+                          historyCount, AndorPeakHistPosition, 0);
+  doCallbacksFloat64Array((epicsFloat64 *)mPeakTracker->history(historyWindow, AndorPeakTracker::ResultWidth),
+                          historyCount, AndorPeakHistWidth, 0);
+  doCallbacksFloat64Array((epicsFloat64 *)mPeakTracker->history(historyWindow, AndorPeakTracker::ResultAmplitude),
+                          historyCount, AndorPeakHistAmplitude, 0);
+  doCallbacksFloat64Array((epicsFloat64 *)mPeakTracker->history(historyWindow, AndorPeakTracker::ResultQuality),
+                          historyCount, AndorPeakHistQuality, 0);
+}
+
+/**
+ * Read the Shamrock wavelength calibration for spectra of sizeX pixels.  Without a
+ * Shamrock the peak positions are reported in pixels.
+ */
+void AndorCCD::loadPeakCalibration(int sizeX)
+{
+  int error, numSpectrometers;
+  float *calibration;
+  static const char *functionName = "loadPeakCalibration";
+
+  mPeakCalibrationWidth = sizeX;
+  mPeakTracker->setCalibration(NULL, 0);
+  setIntegerParam(AndorPeakCalibrated, 0);
+  error = ATSpectrographGetNumberDevices(&numSpectrometers);
+  if ((error != ATSPECTROGRAPH_SUCCESS) || (mShamrockId < 0) || (mShamrockId > numSpectrometers-1)) return;
+  calibration = (float *)calloc(sizeX, sizeof(float));
+  if (!calibration) return;
+  error = ATSpectrographGetCalibration(mShamrockId, calibration, sizeX);
+  if (error == ATSPECTROGRAPH_SUCCESS) {
+    mPeakTracker->setCalibration(calibration, sizeX);
+    setIntegerParam(AndorPeakCalibrated, 1);
+  } else {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s::%s error reading Shamrock spectrometer calibration\n",
+      driverName, functionName);
+  }
+  free(calibration);
+}
+
+/**
+ * Add a frame to the pump-probe series means or on/off means.  Only the results are
+ * published, so the frame is always released.
+ * \param[in] pArray The processed frame.
+ * \param[in] frameIndex Index of the frame in the acquisition, from 1.
+ * \return The series mean or on - off difference if one is complete, otherwise NULL.
+ */
+NDArray *AndorCCD::pumpProbe(NDArray *pArray, int frameIndex)
+{
+  int ppMode, seriesLength, repeats, pairs, key, gate, itemp;
+  bool on;
+  NDArray *pOut;
+  NDAttribute *pAttr;
+
+  getIntegerParam(AndorPPMode, &ppMode);
+  getIntegerParam(AndorPPSeriesLength, &seriesLength);
+  if (seriesLength < 1) getIntegerParam(ADNumImages, &seriesLength);
+  getIntegerParam(AndorPPRepeats, &repeats);
+  getIntegerParam(AndorPPPairs, &pairs);
+  mPumpProbe->configure(ppMode, seriesLength, repeats, pairs);
+  getIntegerParam(AndorPPKey, &key);
+  if (key == APPKeyGate) {
+    // The gate was latched when the frame was read; frames may be processed much later
+    pAttr = pArray->pAttributeList->find("PumpProbeGate");
+    if (!pAttr || (pAttr->getValue(NDAttrInt32, &gate) != asynSuccess)) {
+      getIntegerParam(AndorPPGate, &gate);
+    }
+    on = (gate != 0);
+  } else {
+    on = ((frameIndex & 1) == ((key == APPKeyOddOn) ? 1 : 0));
+  }
+  pOut = mPumpProbe->process(pArray, this->pNDArrayPool, frameIndex, on);
+  pArray->release();
+  if (ppMode == AndorPumpProbe::ModeSeries) {
+    setIntegerParam(AndorPPIndex, mPumpProbe->index());
+    setIntegerParam(AndorPPCount, mPumpProbe->count());
+    if (pOut) {
+      itemp = mPumpProbe->index();
+      pOut->pAttributeList->add("PumpProbeIndex", "Index of the frame in the series", NDAttrInt32, &itemp);
+      itemp = mPumpProbe->count();
+      pOut->pAttributeList->add("PumpProbeRepeats", "Number of series averaged", NDAttrInt32, &itemp);
+    }
+  } else {
+    setIntegerParam(AndorPPOnCount, mPumpProbe->onCount());
+    setIntegerParam(AndorPPOffCount, mPumpProbe->offCount());
+  }
+  return pOut;
+}
+
+/**
+ * Replace a frame with its sparse event list.  Every AndorEventDenseInterval'th frame,
+ * and any frame with too many hits to be sparse, is published unchanged instead.
+ * \param[in] pArray The processed frame.
+ * \param[in] imageCounter Value of NDArrayCounter for the frame.
+ * \return The event list, the unchanged frame, or NULL if the frame had no events.
+ */
+NDArray *AndorCCD::findEvents(NDArray *pArray, int imageCounter)
+{
+  static const char *functionName = "findEvents";
+  int denseInterval, maxHits, count, itemp;
+  double threshold, pedestal;
+  NDArray *pEvents;
+
+  getIntegerParam(AndorEventDenseInterval, &denseInterval);
+  if ((denseInterval > 0) && ((imageCounter % denseInterval) == 0)) return pArray;
+  getDoubleParam(AndorEventThreshold, &threshold);
+  getDoubleParam(AndorEventPedestal, &pedestal);
+  getIntegerParam(AndorEventMaxHits, &maxHits);
+  count = mEventFinder->find(pArray, threshold, pedestal, maxHits);
+  if (count < 0) {
+    getIntegerParam(AndorEventOverflows, &itemp);
+    setIntegerParam(AndorEventOverflows, itemp + 1);
+    setIntegerParam(AndorEventCount, 0);
+    return pArray;
+  }
+  setIntegerParam(AndorEventCount, count);
+  getIntegerParam(AndorEventTotal, &itemp);
+  setIntegerParam(AndorEventTotal, itemp + count);
+  pEvents = mEventFinder->makeEventArray(this->pNDArrayPool, imageCounter);
+  if (!pEvents && (count > 0)) {
+    mMetrics->increment(MetricFramesDropped);
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: unable to allocate the event list for frame %d, %d events dropped\n",
+      driverName, functionName, imageCounter, count);
+  }
+  pArray->release();
+  return pEvents;
+}
+
+/**
+ * Decide whether a frame is published, using the change detection gate.
+ * \param[in] pArray The processed frame.
+ * \return true if the frame should be passed to the array callbacks and saved.
+ */
+bool AndorCCD::gateFrame(NDArray *pArray)
+{
+  int gateMode, stride, minX, minY, sizeX, sizeY, keyframe;
+  double threshold;
+  bool pass;
+
+  getIntegerParam(AndorGateMode, &gateMode);
+  if ((gateMode == AndorFrameGate::ModeOff) && (mGate->mode() == AndorFrameGate::ModeOff)) return true;
+  getIntegerParam(AndorGateStride, &stride);
+  getIntegerParam(AndorGateMinX, &minX);
+  getIntegerParam(AndorGateMinY, &minY);
+  getIntegerParam(AndorGateSizeX, &sizeX);
+  getIntegerParam(AndorGateSizeY, &sizeY);
+  getIntegerParam(AndorGateKeyframe, &keyframe);
+  getDoubleParam(AndorGateThreshold, &threshold);
+  mGate->configure(gateMode, stride, minX, minY, sizeX, sizeY);
+  pass = mGate->process(pArray, threshold, keyframe);
+  updateGateStatus();
+  return pass;
+}
+
+void AndorCCD::updateGateStatus()
+{
+  epicsInt64 passed = mGate->passed();
+  epicsInt64 skipped = mGate->skipped();
+
+  setDoubleParam(AndorGateMetric, mGate->metric());
+  setIntegerParam(AndorGatePassed, (int)passed);
+  setIntegerParam(AndorGateSkipped, (int)skipped);
+  setDoubleParam(AndorGatePassRatio, (passed + skipped) ? 100. * passed / (passed + skipped) : 100.);
+}
@@ -0,0 +1,421 @@
+/**
+ * Frame timing for the ADAndor driver: timing event tags, exposure start and end
+ * events and the readout delay model.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsTime.h>
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsAtomic.h>
+
+#include <ADDriver.h>
+
+#ifdef _WIN32
+#include "ATMCD32D.h"
+#else
+#include "atmcdLXd.h"
+#endif
+
+#include "andorCCD.h"
+#include "andorTimingTagger.h"
+#include "andorExposureEvents.h"
+#include "andorDelayModel.h"
+#include "andorLock.h"
+
+static const char *driverName = "andorCCD";
+
+/**
+ * Create the parameters and objects of frame timing and set the parameter defaults.
+ * AndorExposureEventAvail is set by the constructor once the camera capabilities are known.
+ */
+int AndorCCD::initTiming()
+{
+  int status = asynSuccess;
+
+  createParam(AndorTriggerLatencyModeString,      asynParamInt32, &AndorTriggerLatencyMode);
+  createParam(AndorTriggerLatencyString,          asynParamFloat64, &AndorTriggerLatency);
+  createParam(AndorTimingSourceString,            asynParamInt32, &AndorTimingSource);
+  createParam(AndorTimingDelayString,             asynParamFloat64, &AndorTimingDelay);
+  createParam(AndorTimingToleranceString,         asynParamFloat64, &AndorTimingTolerance);
+  createParam(AndorTimingSimRateString,           asynParamFloat64, &AndorTimingSimRate);
+  createParam(AndorTimingEventString,             asynParamInt32, &AndorTimingEvent);
+  createParam(AndorTimingPulseIdString,           asynParamInt32, &AndorTimingPulseId);
+  createParam(AndorTimingErrorString,             asynParamFloat64, &AndorTimingError);
+  createParam(AndorTimingMatchString,             asynParamInt32, &AndorTimingMatch);
+  createParam(AndorTimingMatchedString,           asynParamInt32, &AndorTimingMatched);
+  createParam(AndorTimingResyncsString,           asynParamInt32, &AndorTimingResyncs);
+  createParam(AndorTimingUnmatchedString,         asynParamInt32, &AndorTimingUnmatched);
+  createParam(AndorTimingOverflowsString,         asynParamInt32, &AndorTimingOverflows);
+  createParam(AndorTimingQueuedString,            asynParamInt32, &AndorTimingQueued);
+  createParam(AndorDelayCalibrateString,          asynParamInt32, &AndorDelayCalibrate);
+  createParam(AndorDelayResetString,              asynParamInt32, &AndorDelayReset);
+  createParam(AndorDelayMeasuredString,           asynParamFloat64, &AndorDelayMeasured);
+  createParam(AndorDelayResidualString,           asynParamFloat64, &AndorDelayResidual);
+  createParam(AndorDelayPredictedString,          asynParamFloat64, &AndorDelayPredicted);
+  createParam(AndorDelayRMSString,                asynParamFloat64, &AndorDelayRMS);
+  createParam(AndorDelayC0String,                 asynParamFloat64, &AndorDelayC0);
+  createParam(AndorDelayC1String,                 asynParamFloat64, &AndorDelayC1);
+  createParam(AndorDelayC2String,                 asynParamFloat64, &AndorDelayC2);
+  createParam(AndorDelaySamplesString,            asynParamInt32, &AndorDelaySamples);
+  createParam(AndorDelayConfigMeanString,         asynParamFloat64, &AndorDelayConfigMean);
+  createParam(AndorDelayConfigStdString,          asynParamFloat64, &AndorDelayConfigStd);
+  createParam(AndorDelayConfigSamplesString,      asynParamInt32, &AndorDelayConfigSamples);
+  createParam(AndorExposureEventEnableString,     asynParamInt32, &AndorExposureEventEnable);
+  createParam(AndorExposureEventAvailString,      asynParamInt32, &AndorExposureEventAvail);
+  createParam(AndorExposureEventPeriodString,   asynParamFloat64, &AndorExposureEventPeriod);
+  createParam(AndorExposureStartString,         asynParamFloat64, &AndorExposureStart);
+  createParam(AndorExposureEndString,           asynParamFloat64, &AndorExposureEnd);
+  createParam(AndorExposureDurationString,      asynParamFloat64, &AndorExposureDuration);
+  createParam(AndorExposureStartsString,          asynParamInt32, &AndorExposureStarts);
+  createParam(AndorExposureEndsString,            asynParamInt32, &AndorExposureEnds);
+  createParam(AndorExposureUnmatchedString,       asynParamInt32, &AndorExposureUnmatched);
+
+  mTimingTagger = new AndorTimingTagger();
+  mExposureEvents = new AndorExposureEvents();
+  mDelayModel = new AndorDelayModel();
+  memset(mDelayKey, 0, sizeof(mDelayKey));
+
+  status |= setIntegerParam(AndorTriggerLatencyMode, ALatencyManual);
+  status |= setDoubleParam(AndorTriggerLatency, 0.0);
+  status |= setIntegerParam(AndorTimingSource, ATimingTimeStamp);
+  status |= setDoubleParam(AndorTimingDelay, 0.0);
+  status |= setDoubleParam(AndorTimingTolerance, 0.001);
+  status |= setDoubleParam(AndorTimingSimRate, 10.0);
+  status |= setIntegerParam(AndorTimingPulseId, 0);
+  status |= setDoubleParam(AndorTimingError, 0.0);
+  status |= setIntegerParam(AndorTimingMatch, AndorTimingTagger::MatchNone);
+  status |= setIntegerParam(AndorTimingMatched, 0);
+  status |= setIntegerParam(AndorTimingResyncs, 0);
+  status |= setIntegerParam(AndorTimingUnmatched, 0);
+  status |= setIntegerParam(AndorTimingOverflows, 0);
+  status |= setIntegerParam(AndorTimingQueued, 0);
+  status |= setIntegerParam(AndorDelayCalibrate, 0);
+  status |= setIntegerParam(AndorDelayReset, 0);
+  status |= setDoubleParam(AndorDelayMeasured, 0.0);
+  status |= setDoubleParam(AndorDelayResidual, 0.0);
+  status |= setIntegerParam(AndorDelaySamples, 0);
+  status |= setIntegerParam(AndorExposureEventEnable, 0);
+  status |= setDoubleParam(AndorExposureEventPeriod, 0.01);
+  status |= setDoubleParam(AndorExposureStart, 0.0);
+  status |= setDoubleParam(AndorExposureEnd, 0.0);
+  status |= setDoubleParam(AndorExposureDuration, 0.0);
+  status |= setIntegerParam(AndorExposureStarts, 0);
+  status |= setIntegerParam(AndorExposureEnds, 0);
+  status |= setIntegerParam(AndorExposureUnmatched, 0);
+  return status;
+}
+
+
+/**
+ * Prepare frame timing for a new acquisition.  Timing events queued before the
+ * acquisition are discarded and the exposure events are enabled if requested.
+ */
+void AndorCCD::startTiming()
+{
+  mTimingTagger->reset();
+  setIntegerParam(AndorTimingMatched, 0);
+  setIntegerParam(AndorTimingResyncs, 0);
+  setIntegerParam(AndorTimingUnmatched, 0);
+  setIntegerParam(AndorTimingOverflows, 0);
+  setupExposureEvents();
+}
+
+/**
+ * Called from writeInt32 for every parameter.
+ * Handles the integer parameters of frame timing.
+ * \param[in] function Parameter being written; its new value is already in the parameter library.
+ * \param[in] value New value.
+ * \param[in] oldValue Value before the write, restored if the write fails.
+ * \param[out] pStatus Status of the write, if it was handled.
+ * \return true if the parameter belongs to frame timing, false otherwise.
+ */
+bool AndorCCD::writeTimingInt32(int function, epicsInt32 value, epicsInt32 oldValue,
+                                asynStatus *pStatus)
+{
+  if ((function == AndorTriggerLatencyMode) || (function == AndorDelayCalibrate)) {
+    *pStatus = requestSetup();
+    if (*pStatus != asynSuccess) setIntegerParam(function, oldValue);
+  }
+  else if (function == AndorTimingSource) {
+    setupTimingSource();
+  }
+  else if (function == AndorTimingEvent) {
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    mTimingTagger->push(&now, value);
+  }
+  else if (function == AndorDelayReset) {
+    if (value) {
+      mDelayModel->reset();
+      updateDelayStatus();
+    }
+    setIntegerParam(AndorDelayReset, 0);
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Called from writeFloat64 for every parameter.
+ * Handles the float parameters of frame timing.
+ * \param[in] function Parameter being written; its new value is already in the parameter library.
+ * \param[in] value New value.
+ * \param[out] pStatus Status of the write, if it was handled.
+ * \return true if the parameter belongs to frame timing, false otherwise.
+ */
+bool AndorCCD::writeTimingFloat64(int function, epicsFloat64 value, asynStatus *pStatus)
+{
+  if (function != AndorTimingSimRate) return false;
+  setupTimingSource();
+  *pStatus = asynSuccess;
+  return true;
+}
+
+/**
+ * Time stamp the start and end of exposures. Meant to be run in own thread.  While an
+ * acquisition with exposure events is running, the camera's exposure state is sampled
+ * every ANDOR_EXPOSURE_EVENT_PERIOD seconds.  Each sample takes the SDK lock, so it can
+ * wait for the readout of a frame; the time stamp is taken before the lock, when the sample
+ * was due.  Event times are quantised to the period and an exposure shorter than it can
+ * be missed.  Only the changes of state take the port lock, to publish them.  The period
+ * trades time resolution against SDK lock traffic: every sample competes with the data
+ * thread's readouts and with parameter writes for the lock, so the default is 10 ms
+ * rather than the 1 ms the operating system could schedule.
+ */
+void AndorCCD::exposureTask(void)
+{
+  at_u32 cameraStatus;
+  unsigned int sdkStatus;
+  epicsTimeStamp now;
+  double period, time, start;
+  int edge;
+  epicsInt64 starts, ends, unmatched;
+  static const char *functionName = "exposureTask";
+
+  printf("%s:%s: Exposure event thread started...\n", driverName, functionName);
+
+  while (!mExiting) {
+    epicsEventWait(exposureEvent);
+    if (mExiting) break;
+    this->lock();
+    getDoubleParam(AndorExposureEventPeriod, &period);
+    this->unlock();
+
+    while (mAcquiringData && (mExposuresPerFrame > 0) && !mExiting) {
+      epicsTimeGetCurrent(&now);
+      mSDKLock->lock();
+      sdkStatus = GetCameraEventStatus(&cameraStatus);
+      mSDKLock->unlock();
+      edge = AndorExposureEvents::EdgeNone;
+      // 1 after a Fire pulse up event, 0 after a Fire pulse down event
+      if (sdkStatus == DRV_SUCCESS) edge = mExposureEvents->sample(cameraStatus != 0, &now);
+      if (edge != AndorExposureEvents::EdgeNone) {
+        time = now.secPastEpoch + now.nsec / 1.e9;
+        this->lock();
+        mExposureEvents->getStats(&starts, &ends, &unmatched);
+        if (edge == AndorExposureEvents::EdgeStart) {
+          setDoubleParam(AndorExposureStart, time);
+          setIntegerParam(AndorExposureStarts, (int)starts);
+        } else {
+          getDoubleParam(AndorExposureStart, &start);
+          setDoubleParam(AndorExposureEnd, time);
+          setDoubleParam(AndorExposureDuration, time - start);
+          setIntegerParam(AndorExposureEnds, (int)ends);
+        }
+        callParamCallbacks();
+        this->unlock();
+      }
+      epicsThreadSleep(period);
+    }
+  }
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s:%s: Exposure event thread exiting ...\n",
+      driverName, functionName);
+
+  epicsAtomicIncrIntT(&mExited);
+}
+
+/**
+ * Measure the delay from the end of the exposure to the time a frame was read, and add it
+ * to the delay model.  The frame metadata gives the time the acquisition started, as host
+ * local time with millisecond resolution, and the time from then to the start of the
+ * exposure; with an external trigger the start is the first trigger, so the wait for the
+ * trigger is not part of the delay.
+ * \param[in] frameIndex Index of the frame in the SDK circular buffer.
+ * \param[in] pReadoutTime Time the frame was read, taken before any processing.
+ */
+void AndorCCD::measureDelay(int frameIndex, const epicsTimeStamp *pReadoutTime)
+{
+  SYSTEMTIME timeOfStart;
+  float timeFromStart;
+  struct tm tmStart;
+  epicsTimeStamp exposureEnd;
+  double readOutTime, delay;
+  unsigned int sdkStatus;
+
+  mSDKLock->lock();
+  sdkStatus = GetMetaDataInfo(&timeOfStart, &timeFromStart, frameIndex);
+  mSDKLock->unlock();
+  if (sdkStatus != DRV_SUCCESS) return;
+  memset(&tmStart, 0, sizeof(tmStart));
+  tmStart.tm_year = timeOfStart.wYear - 1900;
+  tmStart.tm_mon = timeOfStart.wMonth - 1;
+  tmStart.tm_mday = timeOfStart.wDay;
+  tmStart.tm_hour = timeOfStart.wHour;
+  tmStart.tm_min = timeOfStart.wMinute;
+  tmStart.tm_sec = timeOfStart.wSecond;
+  tmStart.tm_isdst = -1;
+  if (epicsTimeFromTM(&exposureEnd, &tmStart, timeOfStart.wMilliseconds * 1000000UL) != epicsTimeOK) return;
+  epicsTimeAddSeconds(&exposureEnd, timeFromStart * 1e-3 + mAcquireTimeActual);
+  getDoubleParam(AndorReadOutTime, &readOutTime);
+  delay = epicsTimeDiffInSeconds(pReadoutTime, &exposureEnd);
+  mDelayModel->addSample(mDelayKey, readOutTime, mDelayNumPixels, delay);
+  setDoubleParam(AndorDelayMeasured, delay);
+  setDoubleParam(AndorDelayResidual, delay - mDelayModel->predict(readOutTime, mDelayNumPixels));
+  updateDelayStatus();
+}
+
+/**
+ * Publish the delay model coefficients, and the predicted delay and measured delay
+ * statistics for the current readout configuration.
+ */
+void AndorCCD::updateDelayStatus()
+{
+  const double *coef = mDelayModel->coefficients();
+  double readOutTime, mean = 0., stdDev = 0.;
+  epicsInt64 numSamples = 0;
+
+  getDoubleParam(AndorReadOutTime, &readOutTime);
+  setDoubleParam(AndorDelayPredicted, mDelayModel->predict(readOutTime, mDelayNumPixels));
+  setDoubleParam(AndorDelayRMS, mDelayModel->rmsResidual());
+  setDoubleParam(AndorDelayC0, coef[0]);
+  setDoubleParam(AndorDelayC1, coef[1]);
+  setDoubleParam(AndorDelayC2, coef[2]);
+  setIntegerParam(AndorDelaySamples, (int)mDelayModel->numSamples());
+  mDelayModel->configStats(mDelayKey, &mean, &stdDev, &numSamples);
+  setDoubleParam(AndorDelayConfigMean, mean);
+  setDoubleParam(AndorDelayConfigStd, stdDev);
+  setIntegerParam(AndorDelayConfigSamples, (int)numSamples);
+}
+
+/**
+ * Start or stop the simulated timing event source to match AndorTimingSource.
+ */
+void AndorCCD::setupTimingSource()
+{
+  int timingSource;
+  double simRate;
+
+  getIntegerParam(AndorTimingSource, &timingSource);
+  getDoubleParam(AndorTimingSimRate, &simRate);
+  if (timingSource == ATimingSimulated) {
+    mTimingTagger->startSimulation(simRate, 1);
+  } else {
+    mTimingTagger->stopSimulation();
+  }
+}
+
+/**
+ * Add a timing event from the timing system.  Can be called from any thread.
+ * \param[in] pTriggerTime Time of the trigger.
+ * \param[in] pulseId Pulse ID of the trigger.
+ */
+void AndorCCD::timingEvent(const epicsTimeStamp *pTriggerTime, int pulseId)
+{
+  mTimingTagger->push(pTriggerTime, pulseId);
+}
+
+/**
+ * Set the uniqueId of a frame to the pulse ID of its trigger, and add the PulseID and
+ * TimingMatch attributes.  Frames without a matching timing event keep their frame number.
+ * \param[in] pArray The frame.
+ * \param[in] frameIndex Index of the frame in the SDK circular buffer, which counts from 1
+ *            at the start of the acquisition.
+ * \param[in] pReadoutTime Time the frame was read out.
+ */
+void AndorCCD::tagFrame(NDArray *pArray, int frameIndex, const epicsTimeStamp *pReadoutTime)
+{
+  double delay, tolerance, error = 0.;
+  int pulseId = 0, match;
+  epicsInt64 matched, resyncs, unmatched, overflows;
+  int queued;
+
+  getDoubleParam(AndorTimingDelay, &delay);
+  getDoubleParam(AndorTimingTolerance, &tolerance);
+  match = mTimingTagger->match(frameIndex, pReadoutTime, delay, tolerance, &pulseId, &error);
+  if (match != AndorTimingTagger::MatchNone) {
+    pArray->uniqueId = pulseId;
+    setIntegerParam(AndorTimingPulseId, pulseId);
+    setDoubleParam(AndorTimingError, error);
+    pArray->pAttributeList->add("PulseID", "Pulse ID of the trigger", NDAttrInt32, &pulseId);
+  }
+  pArray->pAttributeList->add("TimingMatch", "Timing event match (0=none, 1=counter, 2=resync)",
+                              NDAttrInt32, &match);
+  setIntegerParam(AndorTimingMatch, match);
+  mTimingTagger->getStats(&matched, &resyncs, &unmatched, &overflows, &queued);
+  setIntegerParam(AndorTimingMatched, (int)matched);
+  setIntegerParam(AndorTimingResyncs, (int)resyncs);
+  setIntegerParam(AndorTimingUnmatched, (int)unmatched);
+  setIntegerParam(AndorTimingOverflows, (int)overflows);
+  setIntegerParam(AndorTimingQueued, queued);
+}
+
+/**
+ * Enable the exposure events at the start of an acquisition if they are requested and
+ * the camera has them, and wake the exposure event task.  Called with the SDK lock held.
+ */
+void AndorCCD::setupExposureEvents()
+{
+  int enable, available, imageMode, numExposures;
+  static const char *functionName = "setupExposureEvents";
+
+  getIntegerParam(AndorExposureEventEnable, &enable);
+  getIntegerParam(AndorExposureEventAvail, &available);
+  getIntegerParam(ADImageMode, &imageMode);
+  getIntegerParam(ADNumExposures, &numExposures);
+  mExposureEvents->reset();
+  setIntegerParam(AndorExposureStarts, 0);
+  setIntegerParam(AndorExposureEnds, 0);
+  setIntegerParam(AndorExposureUnmatched, 0);
+  mExposuresPerFrame = 0;
+  if (!enable || !available) return;
+
+  // The frames of a fast kinetics series share one exposure, so they are not tagged
+  if (imageMode == AImageFastKinetics) return;
+  mExposuresPerFrame = (imageMode == ADImageContinuous) ? 1 : numExposures;
+  asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+            "%s:%s:, SetCameraStatusEnable(3)\n",
+            driverName, functionName);
+  // Bit 0 enables the Fire pulse down events and bit 1 the Fire pulse up events
+  checkStatus(SetCameraStatusEnable(3));
+  epicsEventSignal(exposureEvent);
+}
+
+/**
+ * Match a frame to its exposures and add the ExposureStart and ExposureEnd attributes,
+ * in seconds since the EPICS epoch.
+ * \param[in] pArray The frame, or NULL if array callbacks are disabled.
+ * \param[in] pReadoutTime Time at which the readout of the frame started.
+ */
+void AndorCCD::tagExposure(NDArray *pArray, const epicsTimeStamp *pReadoutTime)
+{
+  AndorExposureEvents::Exposure exposure;
+  double start, end;
+  epicsInt64 starts, ends, unmatched;
+
+  if ((mExposureEvents->match(mExposuresPerFrame, pReadoutTime, &exposure) > 0) && pArray) {
+    start = exposure.start.secPastEpoch + exposure.start.nsec / 1.e9;
+    end = exposure.end.secPastEpoch + exposure.end.nsec / 1.e9;
+    pArray->pAttributeList->add("ExposureStart", "Start of the exposure (s since EPICS epoch)",
+                                NDAttrFloat64, &start);
+    pArray->pAttributeList->add("ExposureEnd", "End of the exposure (s since EPICS epoch)",
+                                NDAttrFloat64, &end);
+  }
+  mExposureEvents->getStats(&starts, &ends, &unmatched);
+  setIntegerParam(AndorExposureUnmatched, (int)unmatched);
+}
@@ -0,0 +1,151 @@
+/**
+ * Run capacity planning for the ADAndor driver.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <epicsTime.h>
+#include <epicsStdio.h>
+
+#include "andorCapacityPlanner.h"
+
+static const char *driverName = "andorCapacityPlanner";
+
+#define TEST_FILE_NAME  "andorPlanTest.tmp"
+#define TEST_CHUNK_SIZE (1024 * 1024)
+
+/** Works out the sustainable run length and the bottleneck.
+  * \param[in] pInputs The frame size and rate, the planned run length, and the measured
+  *            memory and disk capacity.
+  * \param[out] pPlan The plan.
+  * \return 0 on success, -1 if the frame size or rate is not positive. */
+int AndorCapacityPlanner::plan(const Inputs *pInputs, Plan *pPlan)
+{
+  double deficit, bufferTime, diskTime;
+
+  memset(pPlan, 0, sizeof(*pPlan));
+  if ((pInputs->frameBytes <= 0.) || (pInputs->frameRate <= 0.)) return -1;
+  pPlan->dataRate = pInputs->frameBytes * pInputs->frameRate;
+  if (pInputs->diskRate >= pPlan->dataRate) {
+    // The disk keeps up, so the run lasts until it is full
+    pPlan->runLength = pInputs->diskFreeBytes / pPlan->dataRate;
+    pPlan->bottleneck = BottleneckDiskSpace;
+  } else {
+    // Memory absorbs the difference between the camera and the disk until it is full
+    deficit = pPlan->dataRate - pInputs->diskRate;
+    bufferTime = pInputs->bufferBytes / deficit;
+    diskTime = (pInputs->diskRate > 0.) ? pInputs->diskFreeBytes / pInputs->diskRate : bufferTime;
+    if (bufferTime <= diskTime) {
+      pPlan->runLength = bufferTime;
+      pPlan->bottleneck = BottleneckDiskSpeed;
+    } else {
+      pPlan->runLength = diskTime;
+      pPlan->bottleneck = BottleneckDiskSpace;
+    }
+  }
+  pPlan->drops = pInputs->plannedLength > pPlan->runLength;
+  return 0;
+}
+
+/** Measures the write rate and free space of a directory.  A test file is written with
+  * large sequential writes, flushed to the disk, timed and deleted.
+  * \param[in] directory The output directory.
+  * \param[in] testBytes Size of the test file.
+  * \param[out] pRate Write rate in bytes per second.
+  * \param[out] pFreeBytes Free space available to the caller in bytes.
+  * \return 0 on success, -1 on error. */
+int AndorCapacityPlanner::measureDisk(const char *directory, size_t testBytes, double *pRate,
+                                      double *pFreeBytes)
+{
+  char fileName[1024];
+  size_t len, written = 0, chunk;
+  char *buffer;
+  epicsTimeStamp start, end;
+  double elapsed;
+  int fd, status = 0;
+  static const char *functionName = "measureDisk";
+
+  len = strlen(directory);
+  if ((len > 0) && ((directory[len-1] == '/') || (directory[len-1] == '\\')))
+    epicsSnprintf(fileName, sizeof(fileName), "%s%s", directory, TEST_FILE_NAME);
+  else
+    epicsSnprintf(fileName, sizeof(fileName), "%s/%s", directory, TEST_FILE_NAME);
+  buffer = (char *)malloc(TEST_CHUNK_SIZE);
+  if (!buffer) return -1;
+  // Frame data does not compress well, so the test data should not either
+  for (size_t i=0; i<TEST_CHUNK_SIZE; i++) buffer[i] = (char)(rand() & 0xFF);
+
+#ifdef _WIN32
+  fd = _open(fileName, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY | _O_SEQUENTIAL,
+             _S_IREAD | _S_IWRITE);
+#else
+  fd = ::open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+  if (fd < 0) {
+    printf("%s:%s: error opening test file %s error=%s\n",
+           driverName, functionName, fileName, strerror(errno));
+    free(buffer);
+    return -1;
+  }
+  epicsTimeGetCurrent(&start);
+  while (written < testBytes) {
+    chunk = testBytes - written;
+    if (chunk > TEST_CHUNK_SIZE) chunk = TEST_CHUNK_SIZE;
+#ifdef _WIN32
+    int n = _write(fd, buffer, (unsigned int)chunk);
+#else
+    ssize_t n = ::write(fd, buffer, chunk);
+#endif
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      printf("%s:%s: write error=%s\n", driverName, functionName, strerror(errno));
+      status = -1;
+      break;
+    }
+    written += n;
+  }
+  // The rate must include getting the data onto the disk, not only into the page cache
+#ifdef _WIN32
+  if ((status == 0) && (_commit(fd) != 0)) status = -1;
+  _close(fd);
+#else
+  if ((status == 0) && (fsync(fd) != 0)) status = -1;
+  ::close(fd);
+#endif
+  epicsTimeGetCurrent(&end);
+  remove(fileName);
+  free(buffer);
+  if (status) return status;
+  elapsed = epicsTimeDiffInSeconds(&end, &start);
+  *pRate = (elapsed > 0.) ? written / elapsed : 0.;
+
+#ifdef _WIN32
+  ULARGE_INTEGER freeBytes;
+  if (!GetDiskFreeSpaceExA(directory, &freeBytes, NULL, NULL)) return -1;
+  *pFreeBytes = (double)freeBytes.QuadPart;
+#else
+  struct statvfs fs;
+  if (statvfs(directory, &fs) != 0) {
+    printf("%s:%s: statvfs error=%s\n", driverName, functionName, strerror(errno));
+    return -1;
+  }
+  *pFreeBytes = (double)fs.f_bavail * (double)fs.f_frsize;
+#endif
+  return 0;
+}
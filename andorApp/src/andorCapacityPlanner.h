@@ -0,0 +1,47 @@
+/**
+ * Run capacity planning for the ADAndor driver.
+ *
+ * Estimates whether an acquisition can run for its planned length without dropping
+ * frames.  The camera produces data at the frame size times the frame rate.  Frames are
+ * written to the output directory at the rate measured by a short write test; while the
+ * disk is slower than the camera the difference is held in memory, in the SDK circular
+ * buffer and the free part of the NDArray pool, until those are full.  The run also ends
+ * when the disk is full.  The sustainable run length is the shorter of the two times, and
+ * the stage that sets it is the bottleneck.
+ */
+
+#ifndef ANDORCAPACITYPLANNER_H
+#define ANDORCAPACITYPLANNER_H
+
+#include <stddef.h>
+
+class AndorCapacityPlanner {
+ public:
+  enum {
+    BottleneckNone = 0,       // Not planned, or the plan failed
+    BottleneckDiskSpace = 1,  // The disk fills before memory does
+    BottleneckDiskSpeed = 2   // Memory fills because the disk is slower than the camera
+  };
+
+  typedef struct {
+    double frameBytes;
+    double frameRate;         // Frames per second
+    double plannedLength;     // Seconds
+    double bufferBytes;       // Memory available to hold frames the disk has not taken
+    double diskRate;          // Bytes per second
+    double diskFreeBytes;
+  } Inputs;
+
+  typedef struct {
+    double dataRate;          // Bytes per second
+    double runLength;         // Sustainable run length in seconds
+    int bottleneck;
+    bool drops;               // True if the planned run is longer than runLength
+  } Plan;
+
+  static int plan(const Inputs *pInputs, Plan *pPlan);
+  static int measureDisk(const char *directory, size_t testBytes, double *pRate,
+                         double *pFreeBytes);
+};
+
+#endif //ANDORCAPACITYPLANNER_H
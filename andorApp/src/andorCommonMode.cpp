@@ -0,0 +1,337 @@
+/**
+ * Row and column common-mode correction for the ADAndor driver.
+ *
+ * The low-signal pixels of a row or column are selected without branches, by always
+ * storing each pixel and only advancing the output when it is below the threshold, so
+ * the selection loops vectorize.  Columns are gathered in blocks of ColumnBlock, reading
+ * each row contiguously, so the column statistics do not stride through the frame one
+ * column at a time.  The row and column offsets are both estimated from the raw frame,
+ * the column offsets after removing the row offsets, and then subtracted in one pass.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include <algorithm>
+
+#include <epicsThread.h>
+#include <epicsStdio.h>
+
+#include "andorCommonMode.h"
+
+static const char *driverName = "andorCommonMode";
+
+// Number of columns gathered together by a worker
+static const size_t ColumnBlock = 32;
+
+// Frames smaller than this are processed by the calling thread only
+static const size_t MinParallelPixels = 256 * 1024;
+
+AndorCommonMode::AndorCommonMode()
+  : mNumWorkers(1), mNumThreads(1), mExiting(false), mPhase(PhaseRows), mpData(0),
+    mDataType(NDUInt16), mSizeX(0), mSizeY(0), mThreshold(FLT_MAX), mMinPixels(1),
+    mRowOffset(0), mColumnOffset(0), mMaxRows(0), mMaxColumns(0),
+    mRowRMS(0.), mColumnRMS(0.)
+{
+  memset(mWorkers, 0, sizeof(mWorkers));
+  mWorkers[0].pOwner = this;
+}
+
+AndorCommonMode::~AndorCommonMode()
+{
+  mExiting = true;
+  for (int i=1; i<mNumWorkers; i++) {
+    epicsEventSignal(mWorkers[i].startEvent);
+    epicsEventWait(mWorkers[i].doneEvent);
+    epicsEventDestroy(mWorkers[i].startEvent);
+    epicsEventDestroy(mWorkers[i].doneEvent);
+  }
+  for (int i=0; i<mNumWorkers; i++) free(mWorkers[i].pScratch);
+  free(mRowOffset);
+  free(mColumnOffset);
+}
+
+void AndorCommonMode::workerTaskC(void *drvPvt)
+{
+  Worker *pWorker = (Worker *)drvPvt;
+  pWorker->pOwner->workerTask(pWorker);
+}
+
+/** Runs one share of each phase, until the corrector is destroyed. */
+void AndorCommonMode::workerTask(Worker *pWorker)
+{
+  while (1) {
+    epicsEventMustWait(pWorker->startEvent);
+    if (mExiting) break;
+    runPhase(pWorker);
+    epicsEventSignal(pWorker->doneEvent);
+  }
+  epicsEventSignal(pWorker->doneEvent);
+}
+
+/** Creates worker threads until numThreads workers exist.
+  * \return false if a thread could not be created; the existing workers are still used. */
+bool AndorCommonMode::startWorkers(int numThreads)
+{
+  char name[32];
+
+  while (mNumWorkers < numThreads) {
+    Worker *pWorker = &mWorkers[mNumWorkers];
+    pWorker->pOwner = this;
+    pWorker->startEvent = epicsEventCreate(epicsEventEmpty);
+    pWorker->doneEvent = epicsEventCreate(epicsEventEmpty);
+    epicsSnprintf(name, sizeof(name), "AndorCommonMode%d", mNumWorkers);
+    if (!pWorker->startEvent || !pWorker->doneEvent ||
+        (epicsThreadCreate(name, epicsThreadPriorityMedium,
+                           epicsThreadGetStackSize(epicsThreadStackSmall),
+                           (EPICSTHREADFUNC)workerTaskC, pWorker) == NULL)) {
+      printf("%s:startWorkers: unable to create worker %d\n", driverName, mNumWorkers);
+      if (pWorker->startEvent) epicsEventDestroy(pWorker->startEvent);
+      if (pWorker->doneEvent) epicsEventDestroy(pWorker->doneEvent);
+      memset(pWorker, 0, sizeof(*pWorker));
+      return false;
+    }
+    mNumWorkers++;
+  }
+  return true;
+}
+
+/** Returns the median of n values.  The values are reordered. */
+epicsFloat32 AndorCommonMode::median(epicsFloat32 *pValues, size_t n)
+{
+  std::nth_element(pValues, pValues + n/2, pValues + n);
+  epicsFloat32 upper = pValues[n/2];
+  if (n & 1) return upper;
+  epicsFloat32 lower = *std::max_element(pValues, pValues + n/2);
+  return 0.5f * (lower + upper);
+}
+
+/** Estimates the median of the low-signal pixels of rows [begin, end). */
+template <typename epicsType>
+void AndorCommonMode::rows(Worker *pWorker)
+{
+  const epicsType *pData = (const epicsType *)mpData;
+  epicsFloat32 *pScratch = pWorker->pScratch;
+  epicsFloat32 threshold = mThreshold;
+
+  for (size_t y=pWorker->begin; y<pWorker->end; y++) {
+    const epicsType *pRow = pData + y * mSizeX;
+    size_t n = 0;
+    for (size_t x=0; x<mSizeX; x++) {
+      epicsFloat32 value = (epicsFloat32)pRow[x];
+      pScratch[n] = value;
+      n += (value <= threshold);
+    }
+    mRowOffset[y] = (n >= mMinPixels) ? median(pScratch, n) : NAN;
+  }
+}
+
+/** Estimates the median of the low-signal pixels of columns [begin, end), after
+  * removing the row offsets. */
+template <typename epicsType>
+void AndorCommonMode::columns(Worker *pWorker)
+{
+  const epicsType *pData = (const epicsType *)mpData;
+  epicsFloat32 *pScratch = pWorker->pScratch;
+  epicsFloat32 threshold = mThreshold;
+  size_t count[ColumnBlock];
+
+  for (size_t x0=pWorker->begin; x0<pWorker->end; x0+=ColumnBlock) {
+    size_t width = std::min(ColumnBlock, pWorker->end - x0);
+    for (size_t c=0; c<width; c++) count[c] = 0;
+    for (size_t y=0; y<mSizeY; y++) {
+      const epicsType *pRow = pData + y * mSizeX + x0;
+      epicsFloat32 rowOffset = mRowOffset[y];
+      for (size_t c=0; c<width; c++) {
+        epicsFloat32 value = (epicsFloat32)pRow[c];
+        pScratch[c * mSizeY + count[c]] = value - rowOffset;
+        count[c] += (value <= threshold);
+      }
+    }
+    for (size_t c=0; c<width; c++) {
+      mColumnOffset[x0 + c] = (count[c] >= mMinPixels) ?
+                              median(pScratch + c * mSizeY, count[c]) : NAN;
+    }
+  }
+}
+
+/** Subtracts the row and column offsets from rows [begin, end).  Integer pixels are
+  * rounded and clipped to [0, maxValue]. */
+template <typename epicsType>
+void AndorCommonMode::subtract(Worker *pWorker, epicsFloat32 maxValue)
+{
+  epicsType *pData = (epicsType *)mpData;
+  const epicsFloat32 *pColumnOffset = mColumnOffset;
+
+  for (size_t y=pWorker->begin; y<pWorker->end; y++) {
+    epicsType *pRow = pData + y * mSizeX;
+    epicsFloat32 rowOffset = mRowOffset[y];
+    if (maxValue > 0) {
+      for (size_t x=0; x<mSizeX; x++) {
+        epicsFloat32 value = (epicsFloat32)pRow[x] - rowOffset - pColumnOffset[x] + 0.5f;
+        value = std::min(std::max(value, 0.f), maxValue);
+        pRow[x] = (epicsType)value;
+      }
+    } else {
+      for (size_t x=0; x<mSizeX; x++) {
+        pRow[x] = (epicsType)(pRow[x] - rowOffset - pColumnOffset[x]);
+      }
+    }
+  }
+}
+
+void AndorCommonMode::runPhase(Worker *pWorker)
+{
+  switch (mPhase) {
+    case PhaseRows:
+      switch (mDataType) {
+        case NDUInt16: rows<epicsUInt16>(pWorker); break;
+        case NDUInt32: rows<epicsUInt32>(pWorker); break;
+        default:       rows<epicsFloat32>(pWorker); break;
+      }
+      break;
+    case PhaseColumns:
+      switch (mDataType) {
+        case NDUInt16: columns<epicsUInt16>(pWorker); break;
+        case NDUInt32: columns<epicsUInt32>(pWorker); break;
+        default:       columns<epicsFloat32>(pWorker); break;
+      }
+      break;
+    default:
+      switch (mDataType) {
+        case NDUInt16: subtract<epicsUInt16>(pWorker, 65535.f); break;
+        case NDUInt32: subtract<epicsUInt32>(pWorker, 4294967040.f); break;
+        default:       subtract<epicsFloat32>(pWorker, 0.f); break;
+      }
+      break;
+  }
+}
+
+/** Splits [0, count) between the workers and runs a phase.  Worker 0 is the calling
+  * thread, which returns when all the workers are done. */
+void AndorCommonMode::runParallel(int phase, size_t count)
+{
+  int numThreads = mNumThreads;
+  size_t share;
+
+  if ((size_t)numThreads > count) numThreads = (int)count;
+  if (numThreads < 1) numThreads = 1;
+  share = (count + numThreads - 1) / numThreads;
+  // Keep the column blocks of each worker whole
+  if (phase == PhaseColumns) share = (share + ColumnBlock - 1) / ColumnBlock * ColumnBlock;
+  mPhase = phase;
+  for (int i=0; i<numThreads; i++) {
+    mWorkers[i].begin = std::min(count, i * share);
+    mWorkers[i].end = std::min(count, (i + 1) * share);
+  }
+  for (int i=1; i<numThreads; i++) epicsEventSignal(mWorkers[i].startEvent);
+  runPhase(&mWorkers[0]);
+  for (int i=1; i<numThreads; i++) epicsEventMustWait(mWorkers[i].doneEvent);
+}
+
+/** Converts the medians of the rows or columns to offsets from their median, and
+  * returns the RMS of the offsets.  Rows or columns without a median get no offset. */
+double AndorCommonMode::finishOffsets(epicsFloat32 *pOffsets, size_t count)
+{
+  epicsFloat32 *pValid = mWorkers[0].pScratch;
+  epicsFloat32 reference;
+  double sum = 0.;
+  size_t n = 0;
+
+  for (size_t i=0; i<count; i++) {
+    if (!isnan(pOffsets[i])) pValid[n++] = pOffsets[i];
+  }
+  if (n == 0) {
+    for (size_t i=0; i<count; i++) pOffsets[i] = 0.f;
+    return 0.;
+  }
+  reference = median(pValid, n);
+  for (size_t i=0; i<count; i++) {
+    pOffsets[i] = isnan(pOffsets[i]) ? 0.f : pOffsets[i] - reference;
+    sum += (double)pOffsets[i] * pOffsets[i];
+  }
+  return sqrt(sum / count);
+}
+
+/** Removes the row and/or column common-mode offsets from a frame in place.
+  * \param[in,out] pArray 2-D UInt16, UInt32 or Float32 frame.
+  * \param[in] mode ModeRow, ModeColumn or ModeRowColumn.  With ModeOff the frame is not changed.
+  * \param[in] threshold Pixels above this value are signal and are not used to estimate
+  *            the offsets.  0 or less uses all pixels.
+  * \param[in] minPixels Minimum number of low-signal pixels needed to correct a row or column.
+  * \param[in] numThreads Number of threads, including the calling thread, for large frames.
+  * \return 0 on success, -1 if the array is not a supported 2-D frame or memory could not
+  *         be allocated. */
+int AndorCommonMode::process(NDArray *pArray, int mode, double threshold, int minPixels,
+                             int numThreads)
+{
+  size_t scratchSize;
+  bool doRows, doColumns;
+
+  if (mode == ModeOff) return 0;
+  if ((pArray->dataType != NDUInt16) && (pArray->dataType != NDUInt32) &&
+      (pArray->dataType != NDFloat32)) return -1;
+  if ((pArray->ndims < 2) || (pArray->dims[0].size < 1) || (pArray->dims[1].size < 1)) return -1;
+  mpData = pArray->pData;
+  mDataType = pArray->dataType;
+  mSizeX = pArray->dims[0].size;
+  mSizeY = pArray->dims[1].size;
+  mThreshold = (threshold > 0) ? (epicsFloat32)threshold : FLT_MAX;
+  mMinPixels = (minPixels > 1) ? minPixels : 1;
+  doRows = (mode == ModeRow) || (mode == ModeRowColumn);
+  doColumns = (mode == ModeColumn) || (mode == ModeRowColumn);
+
+  if (numThreads > MaxThreads) numThreads = MaxThreads;
+  if ((numThreads < 1) || (mSizeX * mSizeY < MinParallelPixels)) numThreads = 1;
+  if (!startWorkers(numThreads)) numThreads = mNumWorkers;
+  mNumThreads = numThreads;
+
+  if (mSizeY > mMaxRows) {
+    free(mRowOffset);
+    mRowOffset = (epicsFloat32 *)malloc(mSizeY * sizeof(epicsFloat32));
+    mMaxRows = mRowOffset ? mSizeY : 0;
+  }
+  if (mSizeX > mMaxColumns) {
+    free(mColumnOffset);
+    mColumnOffset = (epicsFloat32 *)malloc(mSizeX * sizeof(epicsFloat32));
+    mMaxColumns = mColumnOffset ? mSizeX : 0;
+  }
+  scratchSize = std::max(std::max(mSizeX, mSizeY), doColumns ? ColumnBlock * mSizeY : 0);
+  for (int i=0; i<numThreads; i++) {
+    Worker *pWorker = &mWorkers[i];
+    if (scratchSize > pWorker->scratchSize) {
+      free(pWorker->pScratch);
+      pWorker->pScratch = (epicsFloat32 *)malloc(scratchSize * sizeof(epicsFloat32));
+      pWorker->scratchSize = pWorker->pScratch ? scratchSize : 0;
+    }
+    if (!pWorker->pScratch) {
+      printf("%s:process: unable to allocate %lu scratch pixels\n", driverName, (unsigned long)scratchSize);
+      return -1;
+    }
+  }
+  if (!mRowOffset || !mColumnOffset) {
+    printf("%s:process: unable to allocate offsets for %lux%lu frame\n", driverName,
+           (unsigned long)mSizeX, (unsigned long)mSizeY);
+    return -1;
+  }
+
+  mRowRMS = 0.;
+  mColumnRMS = 0.;
+  if (doRows) {
+    runParallel(PhaseRows, mSizeY);
+    mRowRMS = finishOffsets(mRowOffset, mSizeY);
+  } else {
+    for (size_t y=0; y<mSizeY; y++) mRowOffset[y] = 0.f;
+  }
+  if (doColumns) {
+    runParallel(PhaseColumns, mSizeX);
+    mColumnRMS = finishOffsets(mColumnOffset, mSizeX);
+  } else {
+    for (size_t x=0; x<mSizeX; x++) mColumnOffset[x] = 0.f;
+  }
+  runParallel(PhaseSubtract, mSizeY);
+  return 0;
+}
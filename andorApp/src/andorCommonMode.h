@@ -0,0 +1,93 @@
+/**
+ * Row and column common-mode correction for the ADAndor driver.
+ *
+ * At high EM gain frames show row to row banding from the readout electronics and
+ * column structure from clock induced charge.  The offset of each row (ModeRow), each
+ * column (ModeColumn) or both (ModeRowColumn) is estimated as the median of its
+ * low-signal pixels, relative to the median over all rows or columns, and subtracted
+ * from the frame in place.  Pixels above the threshold are signal and are not used;
+ * rows and columns with too few low-signal pixels are not corrected.
+ *
+ * Large frames are split across a pool of worker threads, by rows for the row offsets
+ * and the subtraction and by columns for the column offsets.
+ */
+
+#ifndef ANDORCOMMONMODE_H
+#define ANDORCOMMONMODE_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+#include <epicsEvent.h>
+
+#include "NDArray.h"
+
+class AndorCommonMode {
+ public:
+  enum {
+    ModeOff = 0,
+    ModeRow = 1,
+    ModeColumn = 2,
+    ModeRowColumn = 3
+  };
+  enum {
+    MaxThreads = 16
+  };
+
+  AndorCommonMode();
+  ~AndorCommonMode();
+  int process(NDArray *pArray, int mode, double threshold, int minPixels, int numThreads);
+  double rowRMS() const { return mRowRMS; }
+  double columnRMS() const { return mColumnRMS; }
+
+ private:
+  enum {
+    PhaseRows = 0,
+    PhaseColumns = 1,
+    PhaseSubtract = 2
+  };
+
+  typedef struct {
+    AndorCommonMode *pOwner;
+    epicsEventId startEvent;
+    epicsEventId doneEvent;
+    size_t begin;
+    size_t end;
+    epicsFloat32 *pScratch;
+    size_t scratchSize;
+  } Worker;
+
+  template <typename epicsType> void rows(Worker *pWorker);
+  template <typename epicsType> void columns(Worker *pWorker);
+  template <typename epicsType> void subtract(Worker *pWorker, epicsFloat32 maxValue);
+  void runPhase(Worker *pWorker);
+  void runParallel(int phase, size_t count);
+  bool startWorkers(int numThreads);
+  double finishOffsets(epicsFloat32 *pOffsets, size_t count);
+  static epicsFloat32 median(epicsFloat32 *pValues, size_t n);
+  static void workerTaskC(void *drvPvt);
+  void workerTask(Worker *pWorker);
+
+  Worker mWorkers[MaxThreads];
+  int mNumWorkers;             // Workers with a scratch buffer, worker 0 is the calling thread
+  int mNumThreads;             // Workers used for the current frame
+  bool mExiting;
+
+  // The frame being processed, read by the workers
+  int mPhase;
+  void *mpData;
+  NDDataType_t mDataType;
+  size_t mSizeX;
+  size_t mSizeY;
+  epicsFloat32 mThreshold;
+  size_t mMinPixels;
+
+  epicsFloat32 *mRowOffset;    // Offset of each row, NaN if it has too few low-signal pixels
+  epicsFloat32 *mColumnOffset; // Offset of each column
+  size_t mMaxRows;
+  size_t mMaxColumns;
+  double mRowRMS;
+  double mColumnRMS;
+};
+
+#endif //ANDORCOMMONMODE_H
@@ -0,0 +1,101 @@
+/**
+ * Hyperspectral cube assembly for the ADAndor driver.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "andorCubeBuilder.h"
+
+static const char *driverName = "andorCubeBuilder";
+
+AndorCubeBuilder::AndorCubeBuilder()
+  : mCube(0), mNumScans(0), mPlaneBytes(0), mPlaneFilled(0), mFrames(0), mFilled(0)
+{
+}
+
+AndorCubeBuilder::~AndorCubeBuilder()
+{
+  reset();
+}
+
+/** Discards the cube being filled. */
+void AndorCubeBuilder::reset()
+{
+  if (mCube) mCube->release();
+  free(mPlaneFilled);
+  mCube = 0;
+  mPlaneFilled = 0;
+  mNumScans = 0;
+  mPlaneBytes = 0;
+  mFrames = 0;
+  mFilled = 0;
+}
+
+/** Copies a frame into a plane of the cube, allocating the cube if there is none.  A
+  * plane that is already filled is overwritten.
+  * \param[in] pFrame 2-D frame.  It is not modified or released.
+  * \param[in] index Plane of the cube, from 0 to numScans-1.
+  * \param[in] numScans Number of planes of a new cube.  Ignored if the cube exists.
+  * \param[in] pPool Pool from which the cube is allocated.
+  * \return 0 on success, -1 if the index is out of range, the frame does not have the
+  *         shape and type of the cube, or the cube could not be allocated.  A cube of
+  *         INT_MAX bytes or more is not allocated, since its size is published in an
+  *         int. */
+int AndorCubeBuilder::insert(NDArray *pFrame, int index, int numScans, NDArrayPool *pPool)
+{
+  NDArrayInfo arrayInfo;
+  size_t dims[3];
+
+  if (pFrame->ndims != 2) return -1;
+  pFrame->getInfo(&arrayInfo);
+  if (!mCube) {
+    if (numScans < 1) return -1;
+    if ((arrayInfo.totalBytes == 0) || (arrayInfo.totalBytes >= INT_MAX / (size_t)numScans)) {
+      printf("%s:insert: a cube of %d planes of %lu bytes is too large\n",
+             driverName, numScans, (unsigned long)arrayInfo.totalBytes);
+      return -1;
+    }
+    dims[0] = pFrame->dims[0].size;
+    dims[1] = pFrame->dims[1].size;
+    dims[2] = numScans;
+    mCube = pPool->alloc(3, dims, pFrame->dataType, 0, NULL);
+    mPlaneFilled = (char *)calloc(numScans, 1);
+    if (!mCube || !mPlaneFilled) {
+      printf("%s:insert: unable to allocate a cube of %d planes of %lu bytes\n",
+             driverName, numScans, (unsigned long)arrayInfo.totalBytes);
+      reset();
+      return -1;
+    }
+    mCube->dims[0].binning = pFrame->dims[0].binning;
+    mCube->dims[1].binning = pFrame->dims[1].binning;
+    memset(mCube->pData, 0, arrayInfo.totalBytes * numScans);
+    mNumScans = numScans;
+    mPlaneBytes = arrayInfo.totalBytes;
+  }
+  if ((index < 0) || (index >= mNumScans)) return -1;
+  if ((pFrame->dataType != mCube->dataType) || (arrayInfo.totalBytes != mPlaneBytes) ||
+      (pFrame->dims[0].size != mCube->dims[0].size) ||
+      (pFrame->dims[1].size != mCube->dims[1].size)) return -1;
+  memcpy((char *)mCube->pData + index * mPlaneBytes, pFrame->pData, mPlaneBytes);
+  if (!mPlaneFilled[index]) {
+    mPlaneFilled[index] = 1;
+    mFilled++;
+  }
+  mFrames++;
+  return 0;
+}
+
+/** Returns the cube and starts a new one with the next frame.  The caller owns the
+  * cube.
+  * \return The cube, or NULL if there is none. */
+NDArray *AndorCubeBuilder::take()
+{
+  NDArray *pCube = mCube;
+
+  mCube = 0;
+  reset();
+  return pCube;
+}
@@ -0,0 +1,48 @@
+/**
+ * Hyperspectral cube assembly for the ADAndor driver.
+ *
+ * Builds a 3-D array from the frames of a pushbroom or wavelength scan.  Each frame is
+ * copied into the plane of the cube given by its scan index, so the cube has dimensions
+ * (frame x, frame y, scan).  For spectra read in FVB or Single Track the frame y size is
+ * 1; for a spectral line imaged through the slit, x is the wavelength and y the position
+ * along the slit.  The cube is allocated from the NDArray pool when its first frame
+ * arrives, with the shape and type of that frame, and is not reallocated while it is
+ * filled.  Planes that have not been filled are 0.
+ */
+
+#ifndef ANDORCUBEBUILDER_H
+#define ANDORCUBEBUILDER_H
+
+#include <stddef.h>
+
+#include "NDArray.h"
+
+class AndorCubeBuilder {
+ public:
+  enum {
+    SourceFrame = 0,          // Scan index is the number of frames already in the cube
+    SourceParameter = 1,      // Scan index is written by the scan to a parameter
+    SourceAttribute = 2       // Scan index is read from an attribute of the frame
+  };
+
+  AndorCubeBuilder();
+  ~AndorCubeBuilder();
+  void reset();
+  int insert(NDArray *pFrame, int index, int numScans, NDArrayPool *pPool);
+  NDArray *take();
+  NDArray *cube() const { return mCube; }
+  int frames() const { return mFrames; }
+  int filled() const { return mFilled; }
+  int numScans() const { return mNumScans; }
+  bool complete() const { return mCube && (mFilled == mNumScans); }
+
+ private:
+  NDArray *mCube;
+  int mNumScans;
+  size_t mPlaneBytes;
+  char *mPlaneFilled;       // One flag per plane
+  int mFrames;              // Frames inserted, including frames that refilled a plane
+  int mFilled;              // Planes filled
+};
+
+#endif //ANDORCUBEBUILDER_H
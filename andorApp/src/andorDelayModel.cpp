@@ -0,0 +1,160 @@
+/**
+ * Online model of the delay from the end of an exposure to the NDArray time stamp.
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "andorDelayModel.h"
+
+AndorDelayModel::AndorDelayModel()
+{
+  // Pixel counts are fitted in megapixels so that all terms are of similar size
+  mScale[0] = 1.;
+  mScale[1] = 1.;
+  mScale[2] = 1e-6;
+  reset();
+}
+
+/** Discards all samples. */
+void AndorDelayModel::reset()
+{
+  memset(mXtX, 0, sizeof(mXtX));
+  memset(mXty, 0, sizeof(mXty));
+  memset(mCoef, 0, sizeof(mCoef));
+  mYty = 0.;
+  mRms = 0.;
+  mNumSamples = 0;
+  mNumConfigs = 0;
+}
+
+/** Adds a measured delay and updates the fit.
+  * \param[in] key KeySize integers identifying the readout configuration.
+  * \param[in] readOutTime SDK readout time in seconds.
+  * \param[in] numPixels Number of pixels transferred.
+  * \param[in] delay Measured delay in seconds. */
+void AndorDelayModel::addSample(const int *key, double readOutTime, double numPixels, double delay)
+{
+  double x[NumTerms];
+  ConfigStats *pConfig;
+  int i, j, oldest = 0;
+
+  x[0] = mScale[0];
+  x[1] = readOutTime * mScale[1];
+  x[2] = numPixels * mScale[2];
+  for (i=0; i<NumTerms; i++) {
+    for (j=0; j<NumTerms; j++) mXtX[i][j] += x[i] * x[j];
+    mXty[i] += x[i] * delay;
+  }
+  mYty += delay * delay;
+  mNumSamples++;
+  fit();
+
+  // Per configuration statistics, replacing the least recently used configuration when full
+  pConfig = (ConfigStats *)findConfig(key);
+  if (!pConfig) {
+    if (mNumConfigs < MaxConfigs) {
+      pConfig = &mConfigs[mNumConfigs++];
+    } else {
+      for (i=1; i<MaxConfigs; i++) {
+        if (mConfigs[i].lastUsed < mConfigs[oldest].lastUsed) oldest = i;
+      }
+      pConfig = &mConfigs[oldest];
+    }
+    memcpy(pConfig->key, key, sizeof(pConfig->key));
+    pConfig->n = 0;
+    pConfig->mean = 0.;
+    pConfig->m2 = 0.;
+  }
+  // Welford's update
+  pConfig->n++;
+  double diff = delay - pConfig->mean;
+  pConfig->mean += diff / pConfig->n;
+  pConfig->m2 += diff * (delay - pConfig->mean);
+  pConfig->lastUsed = mNumSamples;
+}
+
+/** Solves the normal equations by Gaussian elimination.  A term whose pivot vanishes
+  * relative to its diagonal cannot be separated from the earlier terms with the samples
+  * so far, so it is removed and the system is solved again without it. */
+void AndorDelayModel::fit()
+{
+  bool active[NumTerms];
+  double a[NumTerms][NumTerms+1];
+  int idx[NumTerms];
+  int n, i, j, k;
+  bool solved = false;
+  double coef[NumTerms], sum;
+
+  for (i=0; i<NumTerms; i++) {
+    active[i] = true;
+    mCoef[i] = 0.;
+  }
+  while (!solved) {
+    n = 0;
+    for (i=0; i<NumTerms; i++) if (active[i]) idx[n++] = i;
+    if (n == 0) break;
+    for (i=0; i<n; i++) {
+      for (j=0; j<n; j++) a[i][j] = mXtX[idx[i]][idx[j]];
+      a[i][n] = mXty[idx[i]];
+    }
+    solved = true;
+    for (k=0; k<n; k++) {
+      if (!(a[k][k] > 1e-8 * mXtX[idx[k]][idx[k]]) || (mXtX[idx[k]][idx[k]] <= 0.)) {
+        active[idx[k]] = false;
+        solved = false;
+        break;
+      }
+      // The normal equations are symmetric positive semi-definite, so no pivoting is needed
+      for (i=k+1; i<n; i++) {
+        double factor = a[i][k] / a[k][k];
+        for (j=k; j<=n; j++) a[i][j] -= factor * a[k][j];
+      }
+    }
+    if (!solved) continue;
+    for (k=n-1; k>=0; k--) {
+      sum = a[k][n];
+      for (j=k+1; j<n; j++) sum -= a[k][j] * coef[j];
+      coef[k] = sum / a[k][k];
+    }
+    for (i=0; i<n; i++) mCoef[idx[i]] = coef[i];
+  }
+
+  // Residual sum of squares = yty - 2 c.Xty + c.XtX.c
+  sum = mYty;
+  for (i=0; i<NumTerms; i++) {
+    sum -= 2. * mCoef[i] * mXty[i];
+    for (j=0; j<NumTerms; j++) sum += mCoef[i] * mXtX[i][j] * mCoef[j];
+  }
+  mRms = (mNumSamples > 0 && sum > 0.) ? sqrt(sum / mNumSamples) : 0.;
+  // Return the coefficients in unscaled units
+  for (i=0; i<NumTerms; i++) mCoef[i] *= mScale[i];
+}
+
+/** Returns the predicted delay.  With no samples this is the readout time. */
+double AndorDelayModel::predict(double readOutTime, double numPixels) const
+{
+  if (mNumSamples == 0) return readOutTime;
+  return mCoef[0] + mCoef[1] * readOutTime + mCoef[2] * numPixels;
+}
+
+const AndorDelayModel::ConfigStats *AndorDelayModel::findConfig(const int *key) const
+{
+  for (int i=0; i<mNumConfigs; i++) {
+    if (memcmp(mConfigs[i].key, key, sizeof(mConfigs[i].key)) == 0) return &mConfigs[i];
+  }
+  return NULL;
+}
+
+/** Returns the statistics of the measured delay for a readout configuration.
+  * \return false if there are no samples for the configuration. */
+bool AndorDelayModel::configStats(const int *key, double *mean, double *stdDev, epicsInt64 *numSamples) const
+{
+  const ConfigStats *pConfig = findConfig(key);
+
+  if (!pConfig) return false;
+  *mean = pConfig->mean;
+  *stdDev = (pConfig->n > 1) ? sqrt(pConfig->m2 / (pConfig->n - 1)) : 0.;
+  *numSamples = pConfig->n;
+  return true;
+}
@@ -0,0 +1,63 @@
+/**
+ * Online model of the delay from the end of an exposure to the NDArray time stamp.
+ *
+ * The delay is fitted by linear least squares as
+ *   delay = c0 + c1 * readOutTime + c2 * numPixels
+ * where readOutTime is the SDK readout time and numPixels is the number of pixels
+ * transferred.  The sums of the normal equations are accumulated as samples arrive, so
+ * the fit can be updated after every frame at a fixed cost.  Coefficients that the
+ * samples so far cannot determine, for example c2 while only one image size has been
+ * used, are held at 0.  The mean and standard deviation of the delay are also kept for
+ * each readout configuration.
+ */
+
+#ifndef ANDORDELAYMODEL_H
+#define ANDORDELAYMODEL_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+class AndorDelayModel {
+ public:
+  enum {
+    NumTerms = 3,
+    KeySize = 6,
+    MaxConfigs = 64
+  };
+
+  AndorDelayModel();
+  void reset();
+  void addSample(const int *key, double readOutTime, double numPixels, double delay);
+  double predict(double readOutTime, double numPixels) const;
+  const double *coefficients() const { return mCoef; }
+  double rmsResidual() const { return mRms; }
+  epicsInt64 numSamples() const { return mNumSamples; }
+  bool configStats(const int *key, double *mean, double *stdDev, epicsInt64 *numSamples) const;
+
+ private:
+  typedef struct {
+    int key[KeySize];
+    epicsInt64 n;
+    double mean;
+    double m2;
+    epicsInt64 lastUsed;
+  } ConfigStats;
+
+  void fit();
+  const ConfigStats *findConfig(const int *key) const;
+
+  // Normal equations: mXtX * c = mXty
+  double mXtX[NumTerms][NumTerms];
+  double mXty[NumTerms];
+  double mYty;
+  // Scale of each term, so the normal equations are well conditioned
+  double mScale[NumTerms];
+  double mCoef[NumTerms];
+  double mRms;
+  epicsInt64 mNumSamples;
+  ConfigStats mConfigs[MaxConfigs];
+  int mNumConfigs;
+};
+
+#endif //ANDORDELAYMODEL_H
@@ -0,0 +1,242 @@
+/**
+ * Sparse event extraction for the ADAndor driver.
+ *
+ * Each row is compared with the threshold into a byte mask in one contiguous loop that
+ * the compiler vectorizes; the mask is then scanned 8 bytes at a time, so the cost of
+ * background pixels is small.  Hits are joined into clusters with a union-find forest,
+ * using label buffers for only the current and previous rows, so no full frame label
+ * image has to be cleared for every frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "andorEventFinder.h"
+
+static const char *driverName = "andorEventFinder";
+
+AndorEventFinder::AndorEventFinder()
+  : mSizeX(0), mMaxHits(0), mMask(0), mPrevLabels(0), mCurLabels(0),
+    mHits(0), mParent(0), mClusterIndex(0), mClusters(0),
+    mNumHits(0), mNumClusters(0)
+{
+}
+
+AndorEventFinder::~AndorEventFinder()
+{
+  free(mMask);
+  free(mPrevLabels);
+  free(mCurLabels);
+  free(mHits);
+  free(mParent);
+  free(mClusterIndex);
+  free(mClusters);
+}
+
+int AndorEventFinder::allocate(size_t sizeX, size_t maxHits)
+{
+  if (sizeX > mSizeX) {
+    free(mMask);
+    free(mPrevLabels);
+    free(mCurLabels);
+    // The mask is padded so it can be scanned 8 bytes at a time
+    mMask = (epicsUInt8 *)calloc(sizeX + 8, 1);
+    mPrevLabels = (epicsInt32 *)malloc(sizeX * sizeof(epicsInt32));
+    mCurLabels = (epicsInt32 *)malloc(sizeX * sizeof(epicsInt32));
+    mSizeX = sizeX;
+    if (!mMask || !mPrevLabels || !mCurLabels) {
+      printf("%s:allocate: unable to allocate row buffers\n", driverName);
+      mSizeX = 0;
+      return -1;
+    }
+  }
+  // findHits relies on the label buffers being -1 except for hits in the current and previous rows
+  for (size_t x=0; x<sizeX; x++) {
+    mPrevLabels[x] = -1;
+    mCurLabels[x] = -1;
+  }
+  if (maxHits > mMaxHits) {
+    free(mHits);
+    free(mParent);
+    free(mClusterIndex);
+    free(mClusters);
+    mHits = (Hit *)malloc(maxHits * sizeof(Hit));
+    mParent = (epicsInt32 *)malloc(maxHits * sizeof(epicsInt32));
+    mClusterIndex = (epicsInt32 *)malloc(maxHits * sizeof(epicsInt32));
+    mClusters = (Cluster *)malloc(maxHits * sizeof(Cluster));
+    mMaxHits = maxHits;
+    if (!mHits || !mParent || !mClusterIndex || !mClusters) {
+      printf("%s:allocate: unable to allocate %lu hits\n", driverName, (unsigned long)maxHits);
+      mMaxHits = 0;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int AndorEventFinder::findRoot(int i)
+{
+  while (mParent[i] != i) {
+    // Path halving
+    mParent[i] = mParent[mParent[i]];
+    i = mParent[i];
+  }
+  return i;
+}
+
+void AndorEventFinder::merge(int a, int b)
+{
+  a = findRoot(a);
+  b = findRoot(b);
+  if (a == b) return;
+  // The lower index becomes the root, so clusters are numbered in raster order of their first pixel
+  if (a < b) mParent[b] = a;
+  else       mParent[a] = b;
+}
+
+template <typename epicsType>
+int AndorEventFinder::findHits(const epicsType *pData, size_t sizeX, size_t sizeY,
+                               double threshold, double pedestal, size_t maxHits)
+{
+  size_t prevStart = 0, prevEnd = 0;
+
+  mNumHits = 0;
+
+  for (size_t y=0; y<sizeY; y++) {
+    const epicsType *pRow = pData + y * sizeX;
+    epicsUInt8 *pMask = mMask;
+    size_t curStart = mNumHits;
+
+    for (size_t x=0; x<sizeX; x++) pMask[x] = ((double)pRow[x] > threshold);
+    for (size_t x0=0; x0<sizeX; x0+=8) {
+      epicsUInt64 word;
+      memcpy(&word, pMask + x0, sizeof(word));
+      if (!word) continue;
+      size_t x1 = (x0 + 8 < sizeX) ? x0 + 8 : sizeX;
+      for (size_t x=x0; x<x1; x++) {
+        if (!pMask[x]) continue;
+        if (mNumHits >= maxHits) return -1;
+        int i = (int)mNumHits++;
+        mHits[i].x = (epicsInt32)x;
+        mHits[i].y = (epicsInt32)y;
+        mHits[i].value = (double)pRow[x] - pedestal;
+        mParent[i] = i;
+        mCurLabels[x] = i;
+        if ((x > 0) && (mCurLabels[x-1] >= 0)) merge(i, mCurLabels[x-1]);
+        if (prevEnd > prevStart) {
+          if ((x > 0) && (mPrevLabels[x-1] >= 0)) merge(i, mPrevLabels[x-1]);
+          if (mPrevLabels[x] >= 0) merge(i, mPrevLabels[x]);
+          if ((x + 1 < sizeX) && (mPrevLabels[x+1] >= 0)) merge(i, mPrevLabels[x+1]);
+        }
+      }
+    }
+    // Clear the labels of the previous row and make the current row the previous one
+    for (size_t k=prevStart; k<prevEnd; k++) mPrevLabels[mHits[k].x] = -1;
+    epicsInt32 *pTemp = mPrevLabels;
+    mPrevLabels = mCurLabels;
+    mCurLabels = pTemp;
+    prevStart = curStart;
+    prevEnd = mNumHits;
+  }
+  return 0;
+}
+
+void AndorEventFinder::buildClusters()
+{
+  mNumClusters = 0;
+  for (size_t i=0; i<mNumHits; i++) {
+    Hit *pHit = &mHits[i];
+    int root = findRoot((int)i);
+    Cluster *pCluster;
+    if (root == (int)i) {
+      mClusterIndex[i] = (epicsInt32)mNumClusters;
+      pCluster = &mClusters[mNumClusters++];
+      memset(pCluster, 0, sizeof(*pCluster));
+      pCluster->maxValue = pHit->value;
+      pCluster->maxX = pHit->x;
+      pCluster->maxY = pHit->y;
+    } else {
+      // Roots always have a lower index, so they have been assigned already
+      pCluster = &mClusters[mClusterIndex[root]];
+    }
+    pCluster->sum += pHit->value;
+    pCluster->sumX += pHit->value * pHit->x;
+    pCluster->sumY += pHit->value * pHit->y;
+    pCluster->numPixels++;
+    if (pHit->value > pCluster->maxValue) {
+      pCluster->maxValue = pHit->value;
+      pCluster->maxX = pHit->x;
+      pCluster->maxY = pHit->y;
+    }
+  }
+}
+
+/** Finds the events in a frame.
+  * \param[in] pArray 2-D UInt16, UInt32 or Float32 frame, or a 1-D spectrum.
+  * \param[in] threshold Pixels with values above threshold are hits.
+  * \param[in] pedestal Value subtracted from hits before summing and computing centroids.
+  * \param[in] maxHits Maximum number of hits.  Frames with more hits are not sparse.
+  * \return The number of events, or -1 if the frame had more than maxHits hits, the array
+  *         type is not supported or memory could not be allocated. */
+int AndorEventFinder::find(NDArray *pArray, double threshold, double pedestal, int maxHits)
+{
+  size_t sizeX, sizeY;
+  int status;
+
+  mNumHits = 0;
+  mNumClusters = 0;
+  if ((pArray->dataType != NDUInt16) && (pArray->dataType != NDUInt32) &&
+      (pArray->dataType != NDFloat32)) return -1;
+  if (maxHits < 1) maxHits = 1;
+  sizeX = pArray->dims[0].size;
+  sizeY = (pArray->ndims > 1) ? pArray->dims[1].size : 1;
+  if (allocate(sizeX, maxHits)) return -1;
+
+  switch (pArray->dataType) {
+    case NDUInt16:
+      status = findHits((epicsUInt16 *)pArray->pData, sizeX, sizeY, threshold, pedestal, maxHits);
+      break;
+    case NDUInt32:
+      status = findHits((epicsUInt32 *)pArray->pData, sizeX, sizeY, threshold, pedestal, maxHits);
+      break;
+    default:
+      status = findHits((epicsFloat32 *)pArray->pData, sizeX, sizeY, threshold, pedestal, maxHits);
+      break;
+  }
+  if (status) {
+    mNumHits = 0;
+    return -1;
+  }
+  buildClusters();
+  return (int)mNumClusters;
+}
+
+/** Returns the events found by the last call to find() as a 1-D NDFloat64 array.
+  * \param[in] pPool Pool to allocate the array from.
+  * \param[in] frameNumber Value for the frame field of each event.
+  * \return The array, or NULL if there are no events or the pool is exhausted. */
+NDArray *AndorEventFinder::makeEventArray(NDArrayPool *pPool, double frameNumber)
+{
+  size_t dims[1];
+  NDArray *pArray;
+  epicsFloat64 *pOut;
+
+  if (mNumClusters == 0) return NULL;
+  dims[0] = mNumClusters * NumFields;
+  pArray = pPool->alloc(1, dims, NDFloat64, 0, NULL);
+  if (!pArray) return NULL;
+  pOut = (epicsFloat64 *)pArray->pData;
+  for (size_t i=0; i<mNumClusters; i++) {
+    Cluster *pCluster = &mClusters[i];
+    *pOut++ = pCluster->maxX;
+    *pOut++ = pCluster->maxY;
+    *pOut++ = pCluster->sum;
+    *pOut++ = frameNumber;
+    // Clusters with no signal above the pedestal have no meaningful weighted centroid
+    *pOut++ = (pCluster->sum > 0) ? pCluster->sumX / pCluster->sum : pCluster->maxX;
+    *pOut++ = (pCluster->sum > 0) ? pCluster->sumY / pCluster->sum : pCluster->maxY;
+    *pOut++ = pCluster->numPixels;
+  }
+  return pArray;
+}
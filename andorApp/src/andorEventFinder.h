@@ -0,0 +1,74 @@
+/**
+ * Sparse event extraction for the ADAndor driver.
+ *
+ * For low occupancy photon and X-ray counting most pixels are background.  The event
+ * finder thresholds a frame, groups the pixels above threshold into 8-connected clusters,
+ * and describes each cluster with one event.  The events are returned as a 1-D
+ * NDFloat64 array with AndorEventFinder::NumFields values per event:
+ *   x, y      Pixel with the largest value in the cluster
+ *   value     Sum of (pixel - pedestal) over the cluster
+ *   frame     Frame number
+ *   cx, cy    Centroid of the cluster weighted by (pixel - pedestal)
+ *   npix      Number of pixels in the cluster
+ * so the output size scales with the number of hits rather than the sensor size.
+ */
+
+#ifndef ANDOREVENTFINDER_H
+#define ANDOREVENTFINDER_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#include "NDArray.h"
+
+class AndorEventFinder {
+ public:
+  enum {
+    NumFields = 7
+  };
+
+  AndorEventFinder();
+  ~AndorEventFinder();
+  int find(NDArray *pArray, double threshold, double pedestal, int maxHits);
+  NDArray *makeEventArray(NDArrayPool *pPool, double frameNumber);
+  size_t numEvents() const { return mNumClusters; }
+
+ private:
+  typedef struct {
+    epicsInt32 x;
+    epicsInt32 y;
+    epicsFloat64 value;
+  } Hit;
+
+  typedef struct {
+    epicsFloat64 sum;
+    epicsFloat64 sumX;
+    epicsFloat64 sumY;
+    epicsFloat64 maxValue;
+    epicsInt32 maxX;
+    epicsInt32 maxY;
+    epicsInt32 numPixels;
+  } Cluster;
+
+  template <typename epicsType> int findHits(const epicsType *pData, size_t sizeX, size_t sizeY,
+                                             double threshold, double pedestal, size_t maxHits);
+  int allocate(size_t sizeX, size_t maxHits);
+  int findRoot(int i);
+  void merge(int a, int b);
+  void buildClusters();
+
+  size_t mSizeX;
+  size_t mMaxHits;
+  epicsUInt8 *mMask;        // One row of threshold results
+  epicsInt32 *mPrevLabels;  // Hit index of each pixel in the previous row, -1 if none
+  epicsInt32 *mCurLabels;   // Hit index of each pixel in the current row, -1 if none
+  Hit *mHits;
+  epicsInt32 *mParent;      // Union-find forest over mHits
+  epicsInt32 *mClusterIndex;
+  Cluster *mClusters;
+  size_t mNumHits;
+  size_t mNumClusters;
+};
+
+#endif //ANDOREVENTFINDER_H
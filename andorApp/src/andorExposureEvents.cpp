@@ -0,0 +1,106 @@
+/**
+ * Exposure start and end events for the ADAndor driver.
+ */
+
+#include <string.h>
+
+#include "andorExposureEvents.h"
+
+AndorExposureEvents::AndorExposureEvents()
+  : mExposing(false), mHead(0), mCount(0), mStarts(0), mEnds(0), mUnmatched(0)
+{
+  mLock = epicsMutexMustCreate();
+  memset(&mStart, 0, sizeof(mStart));
+}
+
+AndorExposureEvents::~AndorExposureEvents()
+{
+  epicsMutexDestroy(mLock);
+}
+
+/** Discards all exposures and statistics.  Called at the start of each acquisition and
+  * when an acquisition is restarted, since the frames of queued exposures may be lost. */
+void AndorExposureEvents::reset()
+{
+  epicsMutexLock(mLock);
+  mExposing = false;
+  mHead = 0;
+  mCount = 0;
+  mStarts = 0;
+  mEnds = 0;
+  mUnmatched = 0;
+  epicsMutexUnlock(mLock);
+}
+
+/** Passes a sample of the camera's exposure state.  If the queue of completed exposures
+  * is full the oldest one is discarded.
+  * \param[in] exposing True if the camera reported that it is exposing.
+  * \param[in] pTime Time of the sample.
+  * \return EdgeStart or EdgeEnd if the state changed, otherwise EdgeNone. */
+int AndorExposureEvents::sample(bool exposing, const epicsTimeStamp *pTime)
+{
+  int edge = EdgeNone;
+  Exposure *pExposure;
+
+  epicsMutexLock(mLock);
+  if (exposing && !mExposing) {
+    mStart = *pTime;
+    mStarts++;
+    edge = EdgeStart;
+  } else if (!exposing && mExposing) {
+    if (mCount == QueueSize) {
+      mHead = (mHead + 1) % QueueSize;
+      mCount--;
+    }
+    pExposure = &mQueue[(mHead + mCount) % QueueSize];
+    pExposure->start = mStart;
+    pExposure->end = *pTime;
+    mCount++;
+    mEnds++;
+    edge = EdgeEnd;
+  }
+  mExposing = exposing;
+  epicsMutexUnlock(mLock);
+  return edge;
+}
+
+/** Removes the exposures of a frame from the queue.  The frame takes the oldest queued
+  * exposures that ended before it was read out, up to the number of exposures per frame.
+  * Exposures are matched in order, so an exposure the sampling missed leaves its frame
+  * with fewer exposures rather than shifting the later frames.
+  * \param[in] count Number of exposures accumulated into the frame.
+  * \param[in] pReadoutTime Time at which the readout of the frame started.
+  * \param[out] pExposure Start of the first and end of the last exposure of the frame.
+  * \return Number of exposures matched, 0 if none. */
+int AndorExposureEvents::match(int count, const epicsTimeStamp *pReadoutTime, Exposure *pExposure)
+{
+  int matched = 0;
+  Exposure *pOldest;
+
+  epicsMutexLock(mLock);
+  while ((matched < count) && (mCount > 0)) {
+    pOldest = &mQueue[mHead];
+    if (epicsTimeDiffInSeconds(&pOldest->end, pReadoutTime) > 0.) break;
+    if (matched == 0) pExposure->start = pOldest->start;
+    pExposure->end = pOldest->end;
+    mHead = (mHead + 1) % QueueSize;
+    mCount--;
+    matched++;
+  }
+  if (matched == 0) mUnmatched++;
+  epicsMutexUnlock(mLock);
+  return matched;
+}
+
+/** Returns the statistics since the last reset.
+  * \param[out] starts Number of exposure starts seen.
+  * \param[out] ends Number of exposure ends seen.
+  * \param[out] unmatched Number of frames without a matching exposure. */
+void AndorExposureEvents::getStats(epicsInt64 *starts, epicsInt64 *ends, epicsInt64 *unmatched)
+{
+  epicsMutexLock(mLock);
+  *starts = mStarts;
+  *ends = mEnds;
+  *unmatched = mUnmatched;
+  epicsMutexUnlock(mLock);
+}
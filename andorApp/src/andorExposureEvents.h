@@ -0,0 +1,57 @@
+/**
+ * Exposure start and end events for the ADAndor driver.
+ *
+ * Cameras with the start and end of exposure event features report whether they are
+ * exposing through GetCameraEventStatus.  The driver samples that state in its own
+ * thread and passes each sample here.  A change from not exposing to exposing is the
+ * start of an exposure and the change back is its end; both are time stamped with the
+ * time of the sample that saw them.  Completed exposures are queued in order until the
+ * frames they belong to are read out, so the frames can be tagged with the times at
+ * which their exposures started and ended.
+ */
+
+#ifndef ANDOREXPOSUREEVENTS_H
+#define ANDOREXPOSUREEVENTS_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include <epicsMutex.h>
+
+class AndorExposureEvents {
+ public:
+  enum {
+    EdgeNone = 0,
+    EdgeStart = 1,
+    EdgeEnd = 2
+  };
+  enum {
+    QueueSize = 1024
+  };
+
+  typedef struct {
+    epicsTimeStamp start;
+    epicsTimeStamp end;
+  } Exposure;
+
+  AndorExposureEvents();
+  ~AndorExposureEvents();
+  void reset();
+  int sample(bool exposing, const epicsTimeStamp *pTime);
+  int match(int count, const epicsTimeStamp *pReadoutTime, Exposure *pExposure);
+  void getStats(epicsInt64 *starts, epicsInt64 *ends, epicsInt64 *unmatched);
+
+ private:
+  epicsMutexId mLock;
+  bool mExposing;
+  epicsTimeStamp mStart;     // Start of the exposure in progress
+  Exposure mQueue[QueueSize];
+  size_t mHead;              // Index of the oldest completed exposure
+  size_t mCount;             // Number of completed exposures in the queue
+  epicsInt64 mStarts;
+  epicsInt64 mEnds;
+  epicsInt64 mUnmatched;
+};
+
+#endif //ANDOREXPOSUREEVENTS_H
@@ -0,0 +1,134 @@
+/**
+ * Command line tool to render an ADAndor flight recorder dump as a timeline.
+ *
+ * Usage:
+ *   andorFlightDecode dumpFile
+ *
+ * Each event is printed with its time relative to the dump and the time since the
+ * previous event, in milliseconds.  Readout and callback end events also show the time
+ * since the matching start event.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <epicsTime.h>
+
+#include "andorFlightRecorder.h"
+
+static double toSeconds(epicsUInt32 sec, epicsUInt32 nsec)
+{
+  return sec + nsec / 1.e9;
+}
+
+int main(int argc, char *argv[])
+{
+  AndorFlightHeader header;
+  AndorFlightEntry *pEntries;
+  char *names = NULL;
+  char timeString[64];
+  epicsTimeStamp dumpTime;
+  double dumpSeconds, t, previous = 0., readoutStart = 0., callbackStart = 0.;
+  FILE *fp;
+  epicsUInt32 i;
+
+  if (argc != 2) {
+    printf("Usage: andorFlightDecode dumpFile\n");
+    return 1;
+  }
+  fp = fopen(argv[1], "rb");
+  if (!fp) {
+    printf("Unable to open %s\n", argv[1]);
+    return 1;
+  }
+  if ((fread(&header, sizeof(header), 1, fp) != 1) ||
+      (memcmp(header.magic, ANDOR_FLIGHT_MAGIC, sizeof(header.magic)) != 0) ||
+      (header.version != ANDOR_FLIGHT_VERSION) || (header.entrySize != sizeof(AndorFlightEntry))) {
+    printf("%s is not a flight recorder dump\n", argv[1]);
+    fclose(fp);
+    return 1;
+  }
+  pEntries = (AndorFlightEntry *)malloc((header.numEntries + 1) * sizeof(AndorFlightEntry));
+  names = (char *)calloc(header.numNames + 1, ANDOR_FLIGHT_NAME_SIZE);
+  if (!pEntries || !names ||
+      (fread(pEntries, sizeof(AndorFlightEntry), header.numEntries, fp) != header.numEntries) ||
+      (fread(names, ANDOR_FLIGHT_NAME_SIZE, header.numNames, fp) != header.numNames)) {
+    printf("%s is truncated\n", argv[1]);
+    fclose(fp);
+    return 1;
+  }
+  fclose(fp);
+
+  dumpTime.secPastEpoch = header.dumpSec;
+  dumpTime.nsec = header.dumpNsec;
+  epicsTimeToStrftime(timeString, sizeof(timeString), "%Y/%m/%d %H:%M:%S.%06f", &dumpTime);
+  dumpSeconds = toSeconds(header.dumpSec, header.dumpNsec);
+  printf("Dumped %s, %s, %u events\n", timeString,
+         header.reason ? "acquisition fault" : "on request", header.numEntries);
+  if (header.reason) printf("Fault status %u\n", header.reason);
+  printf("%12s %10s  %-17s %s\n", "time (ms)", "delta (ms)", "event", "details");
+
+  for (i=0; i<header.numEntries; i++) {
+    const AndorFlightEntry *pEntry = &pEntries[i];
+    char details[128];
+
+    t = toSeconds(pEntry->tsSec, pEntry->tsNsec);
+    if (i == 0) previous = t;
+    if ((i > 0) && (pEntry->sequence != pEntries[i-1].sequence + 1)) {
+      printf("  ... %llu events lost\n",
+             (unsigned long long)(pEntry->sequence - pEntries[i-1].sequence - 1));
+    }
+    details[0] = 0;
+    switch (pEntry->type) {
+      case AndorFlightRecorder::EventWaitReturned:
+        sprintf(details, "exposure %d", pEntry->arg1);
+        break;
+      case AndorFlightRecorder::EventFramesAvailable:
+        sprintf(details, "images %d to %d", pEntry->arg1, pEntry->arg2);
+        break;
+      case AndorFlightRecorder::EventReadoutStart:
+        readoutStart = t;
+        sprintf(details, "image %d", pEntry->arg1);
+        break;
+      case AndorFlightRecorder::EventReadoutEnd:
+        sprintf(details, "image %d, %d pixels, %.3f ms", pEntry->arg1, pEntry->arg2,
+                (t - readoutStart) * 1e3);
+        break;
+      case AndorFlightRecorder::EventCallbackStart:
+        callbackStart = t;
+        sprintf(details, "array %d", pEntry->arg1);
+        break;
+      case AndorFlightRecorder::EventCallbackEnd:
+        sprintf(details, "array %d, %.3f ms", pEntry->arg1, (t - callbackStart) * 1e3);
+        break;
+      case AndorFlightRecorder::EventParamChange:
+        if ((pEntry->arg1 >= 0) && ((epicsUInt32)pEntry->arg1 < header.numNames) &&
+            names[pEntry->arg1 * ANDOR_FLIGHT_NAME_SIZE]) {
+          sprintf(details, "%.63s = %d", &names[pEntry->arg1 * ANDOR_FLIGHT_NAME_SIZE], pEntry->arg2);
+        } else {
+          sprintf(details, "parameter %d = %d", pEntry->arg1, pEntry->arg2);
+        }
+        break;
+      case AndorFlightRecorder::EventSetupEnd:
+        strcpy(details, pEntry->arg1 ? "failed" : "OK");
+        break;
+      case AndorFlightRecorder::EventSDKError:
+      case AndorFlightRecorder::EventStatus:
+      case AndorFlightRecorder::EventFault:
+        sprintf(details, "%d", pEntry->arg1);
+        break;
+      case AndorFlightRecorder::EventRecovery:
+        sprintf(details, "status %d, about %d frames lost", pEntry->arg1, pEntry->arg2);
+        break;
+      default:
+        break;
+    }
+    printf("%12.3f %10.3f  %-17s %s\n", (t - dumpSeconds) * 1e3, (t - previous) * 1e3,
+           AndorFlightRecorder::eventName(pEntry->type), details);
+    previous = t;
+  }
+  free(pEntries);
+  free(names);
+  return 0;
+}
@@ -0,0 +1,174 @@
+/**
+ * Flight recorder for the ADAndor driver.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <epicsTime.h>
+#include <epicsAtomic.h>
+
+#include "andorFlightRecorder.h"
+
+static const char *driverName = "andorFlightRecorder";
+
+static const char *eventNames[AndorFlightRecorder::NumEventTypes] = {
+  "unknown",
+  "wait returned",
+  "frames available",
+  "readout start",
+  "readout end",
+  "callback start",
+  "callback end",
+  "parameter change",
+  "setup start",
+  "setup end",
+  "SDK error",
+  "status",
+  "fault",
+  "recovery"
+};
+
+AndorFlightRecorder::AndorFlightRecorder()
+  : mNext(0), mFrozen(0)
+{
+  mEntries = (AndorFlightEntry *)calloc(NumEntries, sizeof(AndorFlightEntry));
+}
+
+AndorFlightRecorder::~AndorFlightRecorder()
+{
+  free(mEntries);
+}
+
+/** Records an event.  This can be called from any thread and never blocks.  Events are
+  * discarded while the ring is frozen by dump(). */
+void AndorFlightRecorder::record(int type, int arg1, int arg2)
+{
+  AndorFlightEntry *pEntry;
+  epicsTimeStamp now;
+  size_t sequence;
+
+  if (!mEntries || epicsAtomicGetIntT(&mFrozen)) return;
+  epicsTimeGetCurrent(&now);
+  sequence = epicsAtomicIncrSizeT(&mNext);
+  pEntry = &mEntries[(sequence - 1) & (NumEntries - 1)];
+  // Invalidate the slot while it is written, so a reader never sees a mix of two events
+  pEntry->sequence = 0;
+  epicsAtomicWriteMemoryBarrier();
+  pEntry->tsSec = now.secPastEpoch;
+  pEntry->tsNsec = now.nsec;
+  pEntry->type = type;
+  pEntry->arg1 = arg1;
+  pEntry->arg2 = arg2;
+  epicsAtomicWriteMemoryBarrier();
+  pEntry->sequence = sequence;
+}
+
+/** Freezes the ring, copies it and writes it to a dump file.  Recording resumes as soon
+  * as the ring has been copied.
+  * \param[in] fileName Name of the dump file.
+  * \param[in] reason Status that caused the dump, 0 for a manual dump.
+  * \param[in] names Parameter names for EventParamChange entries, indexed by parameter.
+  * \param[in] numNames Number of parameter names.
+  * \return 0 on success, -1 if the file could not be written or a dump is in progress. */
+int AndorFlightRecorder::dump(const char *fileName, int reason, const char * const *names, int numNames)
+{
+  AndorFlightEntry *pCopy;
+  size_t numCopied;
+  int status;
+
+  pCopy = snapshot(&numCopied);
+  if (!pCopy) return -1;
+  status = write(fileName, reason, pCopy, numCopied, names, numNames);
+  free(pCopy);
+  return status;
+}
+
+/** Freezes the ring and copies the valid entries, oldest first.  Recording resumes as
+  * soon as the ring has been copied.
+  * \param[out] pNumEntries Number of entries copied.
+  * \return The copy, to be freed by the caller, or NULL if it could not be allocated or
+  *         another snapshot is in progress. */
+AndorFlightEntry *AndorFlightRecorder::snapshot(size_t *pNumEntries)
+{
+  AndorFlightEntry *pCopy;
+  size_t next, first, sequence, numCopied = 0;
+
+  *pNumEntries = 0;
+  if (!mEntries) return NULL;
+  if (epicsAtomicCmpAndSwapIntT(&mFrozen, 0, 1) != 0) return NULL;
+  pCopy = (AndorFlightEntry *)malloc(NumEntries * sizeof(AndorFlightEntry));
+  if (pCopy) {
+    next = epicsAtomicGetSizeT(&mNext);
+    first = (next > NumEntries) ? next - NumEntries + 1 : 1;
+    epicsAtomicReadMemoryBarrier();
+    for (sequence=first; sequence<=next; sequence++) {
+      const AndorFlightEntry *pEntry = &mEntries[(sequence - 1) & (NumEntries - 1)];
+      if (pEntry->sequence != sequence) continue;
+      pCopy[numCopied] = *pEntry;
+      epicsAtomicReadMemoryBarrier();
+      // Skip an entry that was being rewritten while it was copied
+      if (pEntry->sequence != sequence) continue;
+      numCopied++;
+    }
+  }
+  epicsAtomicSetIntT(&mFrozen, 0);
+  *pNumEntries = numCopied;
+  return pCopy;
+}
+
+/** Writes a dump file.
+  * \param[in] fileName Name of the dump file.
+  * \param[in] reason Status that caused the dump, 0 for a manual dump.
+  * \param[in] pEntries Entries from snapshot().
+  * \param[in] numEntries Number of entries.
+  * \param[in] names Parameter names for EventParamChange entries, indexed by parameter.
+  * \param[in] numNames Number of parameter names.
+  * \return 0 on success, -1 if the file could not be written. */
+int AndorFlightRecorder::write(const char *fileName, int reason, const AndorFlightEntry *pEntries,
+                               size_t numEntries, const char * const *names, int numNames)
+{
+  static const char *functionName = "write";
+  AndorFlightHeader header;
+  epicsTimeStamp now;
+  char name[ANDOR_FLIGHT_NAME_SIZE];
+  FILE *fp;
+  int status = 0;
+
+  epicsTimeGetCurrent(&now);
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ANDOR_FLIGHT_MAGIC, sizeof(header.magic));
+  header.version = ANDOR_FLIGHT_VERSION;
+  header.entrySize = sizeof(AndorFlightEntry);
+  header.numEntries = (epicsUInt32)numEntries;
+  header.numNames = (numNames > 0) ? numNames : 0;
+  header.reason = reason;
+  header.dumpSec = now.secPastEpoch;
+  header.dumpNsec = now.nsec;
+  fp = fopen(fileName, "wb");
+  if (!fp) {
+    printf("%s:%s: unable to open %s\n", driverName, functionName, fileName);
+    return -1;
+  }
+  if ((fwrite(&header, sizeof(header), 1, fp) != 1) ||
+      (numEntries && (fwrite(pEntries, sizeof(AndorFlightEntry), numEntries, fp) != numEntries))) {
+    status = -1;
+  }
+  for (int i=0; (i<numNames) && (status == 0); i++) {
+    memset(name, 0, sizeof(name));
+    if (names[i]) strncpy(name, names[i], sizeof(name) - 1);
+    if (fwrite(name, sizeof(name), 1, fp) != 1) status = -1;
+  }
+  if (fclose(fp) || status) {
+    printf("%s:%s: error writing %s\n", driverName, functionName, fileName);
+    status = -1;
+  }
+  return status;
+}
+
+const char *AndorFlightRecorder::eventName(int type)
+{
+  if ((type <= 0) || (type >= NumEventTypes)) return eventNames[0];
+  return eventNames[type];
+}
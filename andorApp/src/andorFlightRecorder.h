@@ -0,0 +1,96 @@
+/**
+ * Flight recorder for the ADAndor driver.
+ *
+ * The driver threads record small fixed-size events (acquisition wait returned, frames
+ * available, readout and callback start and end, parameter changes, SDK errors and so
+ * on) in a ring of the most recent NumEntries events.  Recording is lock-free: a writer
+ * claims a slot with an atomic increment, fills it in and then publishes it by writing
+ * its sequence number, so the data path is never blocked by the recorder.
+ *
+ * When the driver detects an acquisition fault the ring is frozen and copied (snapshot),
+ * and the copy is written to a binary dump file (write), so the file I/O can be done
+ * without holding any driver lock.  The file can be rendered as a timeline with the
+ * andorFlightDecode tool.  The dump file is an AndorFlightHeader, numEntries
+ * AndorFlightEntry records in the order they were recorded, and numNames parameter names
+ * of ANDOR_FLIGHT_NAME_SIZE characters, indexed by the asyn parameter index in
+ * EventParamChange entries.
+ */
+
+#ifndef ANDORFLIGHTRECORDER_H
+#define ANDORFLIGHTRECORDER_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#define ANDOR_FLIGHT_MAGIC      "ANDORFR1"
+#define ANDOR_FLIGHT_VERSION    1
+#define ANDOR_FLIGHT_NAME_SIZE  64
+
+/**
+ * Header at the start of a dump file.
+ */
+typedef struct {
+  char magic[8];            /**< ANDOR_FLIGHT_MAGIC, not null terminated */
+  epicsUInt32 version;      /**< ANDOR_FLIGHT_VERSION */
+  epicsUInt32 entrySize;    /**< sizeof(AndorFlightEntry) */
+  epicsUInt32 numEntries;   /**< Number of entries in the file */
+  epicsUInt32 numNames;     /**< Number of parameter names after the entries */
+  epicsUInt32 reason;       /**< Status that caused the dump, 0 for a manual dump */
+  epicsUInt32 dumpSec;      /**< Time of the dump, epicsTimeStamp secPastEpoch */
+  epicsUInt32 dumpNsec;     /**< Time of the dump, epicsTimeStamp nsec */
+  epicsUInt32 reserved[3];
+} AndorFlightHeader;
+
+/**
+ * One recorded event; 32 bytes, naturally aligned.
+ */
+typedef struct {
+  epicsUInt64 sequence;     /**< 1 for the first event recorded, 0 while being written */
+  epicsUInt32 tsSec;        /**< Time of the event, epicsTimeStamp secPastEpoch */
+  epicsUInt32 tsNsec;       /**< Time of the event, epicsTimeStamp nsec */
+  epicsUInt32 type;         /**< AndorFlightRecorder event type */
+  epicsInt32 arg1;          /**< Event arguments, see the event types */
+  epicsInt32 arg2;
+  epicsUInt32 reserved;
+} AndorFlightEntry;
+
+class AndorFlightRecorder {
+ public:
+  enum {
+    EventWaitReturned = 1,  // WaitForAcquisition returned, arg1 = exposure counter
+    EventFramesAvailable,   // GetNumberNewImages, arg1 = first, arg2 = last image
+    EventReadoutStart,      // arg1 = image index
+    EventReadoutEnd,        // arg1 = image index, arg2 = number of pixels
+    EventCallbackStart,     // Array callbacks, arg1 = array counter
+    EventCallbackEnd,       // arg1 = array counter
+    EventParamChange,       // writeInt32, arg1 = parameter index, arg2 = value
+    EventSetupStart,        // setupAcquisition called
+    EventSetupEnd,          // setupAcquisition returned, arg1 = 0 on success
+    EventSDKError,          // arg1 = SDK return code
+    EventStatus,            // Camera status changed, arg1 = GetStatus value
+    EventFault,             // Acquisition fault detected, arg1 = GetStatus value
+    EventRecovery,          // Acquisition restarted after a fault, arg1 = GetStatus value,
+                            // arg2 = estimated frames lost
+    NumEventTypes
+  };
+  enum {
+    NumEntries = 16384      // Must be a power of 2
+  };
+
+  AndorFlightRecorder();
+  ~AndorFlightRecorder();
+  void record(int type, int arg1 = 0, int arg2 = 0);
+  int dump(const char *fileName, int reason, const char * const *names, int numNames);
+  AndorFlightEntry *snapshot(size_t *pNumEntries);
+  static int write(const char *fileName, int reason, const AndorFlightEntry *pEntries,
+                   size_t numEntries, const char * const *names, int numNames);
+  static const char *eventName(int type);
+
+ private:
+  AndorFlightEntry *mEntries;
+  size_t mNext;             // Sequence number of the most recently claimed entry
+  int mFrozen;
+};
+
+#endif //ANDORFLIGHTRECORDER_H
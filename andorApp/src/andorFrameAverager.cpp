@@ -0,0 +1,188 @@
+/**
+ * Software frame averaging for the ADAndor driver.
+ *
+ * The per-pixel update loops are written as simple loops over contiguous arrays with
+ * no dependencies between pixels, so the compiler vectorizes them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "andorFrameAverager.h"
+
+static const char *driverName = "andorFrameAverager";
+
+const size_t AndorFrameAverager::MaxHistoryBytes = 512 * 1024 * 1024;
+
+AndorFrameAverager::AndorFrameAverager()
+  : mMode(ModeNone), mNumFrames(1), mWindow(1), mFactor(1), mCount(0),
+    mNDims(0), mDataType(NDUInt16), mNElements(0), mBytesPerFrame(0),
+    mHistory(0), mHistoryIndex(0), mSum(0), mAverage(0)
+{
+  memset(mDims, 0, sizeof(mDims));
+}
+
+AndorFrameAverager::~AndorFrameAverager()
+{
+  freeBuffers();
+}
+
+void AndorFrameAverager::freeBuffers()
+{
+  free(mHistory);
+  free(mSum);
+  free(mAverage);
+  mHistory = 0;
+  mSum = 0;
+  mAverage = 0;
+  mNDims = 0;
+  mNElements = 0;
+  mCount = 0;
+}
+
+/** Sets the averaging mode.  The average restarts if anything changed.
+  * \param[in] mode ModeNone, ModeRolling or ModeExponential.
+  * \param[in] numFrames Window length for ModeRolling.
+  * \param[in] factor Averaging factor N for ModeExponential; each new frame has weight 1/N. */
+void AndorFrameAverager::configure(int mode, int numFrames, int factor)
+{
+  if (numFrames < 1) numFrames = 1;
+  if (factor < 1) factor = 1;
+  if ((mode == mMode) && (numFrames == mNumFrames) && (factor == mFactor)) return;
+  mMode = mode;
+  mNumFrames = numFrames;
+  mFactor = factor;
+  freeBuffers();
+}
+
+/** Discards the frames averaged so far. */
+void AndorFrameAverager::reset()
+{
+  mCount = 0;
+  mHistoryIndex = 0;
+  if (mHistory) memset(mHistory, 0, mBytesPerFrame * mWindow);
+  if (mSum) memset(mSum, 0, mNElements * sizeof(epicsFloat64));
+}
+
+int AndorFrameAverager::allocate(NDArray *pIn, size_t nElements)
+{
+  NDArrayInfo arrayInfo;
+
+  freeBuffers();
+  pIn->getInfo(&arrayInfo);
+  mBytesPerFrame = arrayInfo.totalBytes;
+  if (mMode == ModeRolling) {
+    mWindow = mNumFrames;
+    if ((size_t)mWindow > MaxHistoryBytes / mBytesPerFrame) {
+      mWindow = (int)(MaxHistoryBytes / mBytesPerFrame);
+      if (mWindow < 1) mWindow = 1;
+      printf("%s:allocate: rolling average of %d frames of %lu bytes limited to %d frames\n",
+             driverName, mNumFrames, (unsigned long)mBytesPerFrame, mWindow);
+    }
+    // The history starts zeroed, so subtracting the oldest frame is a no-op until the window is full
+    mHistory = (char *)calloc(mWindow, mBytesPerFrame);
+    mSum = (epicsFloat64 *)calloc(nElements, sizeof(epicsFloat64));
+    if (!mHistory || !mSum) {
+      printf("%s:allocate: unable to allocate %d frame rolling average of %lu bytes per frame\n",
+             driverName, mWindow, (unsigned long)mBytesPerFrame);
+      freeBuffers();
+      return -1;
+    }
+  } else {
+    mAverage = (epicsFloat32 *)calloc(nElements, sizeof(epicsFloat32));
+    if (!mAverage) {
+      printf("%s:allocate: unable to allocate exponential average\n", driverName);
+      return -1;
+    }
+  }
+  mNDims = pIn->ndims;
+  for (int i=0; i<mNDims; i++) mDims[i] = pIn->dims[i].size;
+  mDataType = pIn->dataType;
+  mNElements = nElements;
+  mHistoryIndex = 0;
+  mCount = 0;
+  return 0;
+}
+
+template <typename epicsType>
+void AndorFrameAverager::rollingUpdate(const epicsType *pIn, epicsFloat32 *pOut)
+{
+  epicsType *pOldest = (epicsType *)(mHistory + mHistoryIndex * mBytesPerFrame);
+  epicsFloat64 *pSum = mSum;
+  size_t n = mNElements;
+  double scale;
+
+  if (mCount < mWindow) mCount++;
+  scale = 1.0 / mCount;
+  // Integer frames are summed exactly in double precision, so the sum never drifts.
+  // Float32 frames (e.g. after software binning) can drift by a few ulps over very long runs.
+  for (size_t i=0; i<n; i++) {
+    epicsFloat64 sum = pSum[i] + (epicsFloat64)pIn[i] - (epicsFloat64)pOldest[i];
+    pSum[i] = sum;
+    pOldest[i] = pIn[i];
+    pOut[i] = (epicsFloat32)(sum * scale);
+  }
+  if (++mHistoryIndex >= mWindow) mHistoryIndex = 0;
+}
+
+template <typename epicsType>
+void AndorFrameAverager::exponentialUpdate(const epicsType *pIn, epicsFloat32 *pOut)
+{
+  epicsFloat32 *pAverage = mAverage;
+  size_t n = mNElements;
+  epicsFloat32 alpha;
+
+  if (mCount < mFactor) mCount++;
+  alpha = 1.0f / mCount;
+  for (size_t i=0; i<n; i++) {
+    epicsFloat32 average = pAverage[i] + ((epicsFloat32)pIn[i] - pAverage[i]) * alpha;
+    pAverage[i] = average;
+    pOut[i] = average;
+  }
+}
+
+/** Adds a frame to the average.
+  * \param[in] pIn UInt16, UInt32 or Float32 frame.  It is not modified or released.
+  * \param[in] pPool Pool from which the output array is allocated.
+  * \return A new NDFloat32 array holding the current average, or NULL if the mode is
+  *         ModeNone, the input type is not supported or memory could not be allocated. */
+NDArray *AndorFrameAverager::process(NDArray *pIn, NDArrayPool *pPool)
+{
+  NDArrayInfo arrayInfo;
+  NDArray *pOut;
+  size_t dims[ND_ARRAY_MAX_DIMS];
+  bool sameShape;
+  int i;
+
+  if (mMode == ModeNone) return NULL;
+  if ((pIn->dataType != NDUInt16) && (pIn->dataType != NDUInt32) && (pIn->dataType != NDFloat32)) return NULL;
+  pIn->getInfo(&arrayInfo);
+  sameShape = (mNElements > 0) && (pIn->ndims == mNDims) && (pIn->dataType == mDataType);
+  for (i=0; sameShape && (i<mNDims); i++) {
+    if (pIn->dims[i].size != mDims[i]) sameShape = false;
+  }
+  if (!sameShape) {
+    if (allocate(pIn, arrayInfo.nElements)) return NULL;
+  }
+  for (i=0; i<pIn->ndims; i++) dims[i] = pIn->dims[i].size;
+  pOut = pPool->alloc(pIn->ndims, dims, NDFloat32, 0, NULL);
+  if (!pOut) return NULL;
+  for (i=0; i<pIn->ndims; i++) pOut->dims[i].binning = pIn->dims[i].binning;
+
+  switch (pIn->dataType) {
+    case NDUInt16:
+      if (mMode == ModeRolling) rollingUpdate((epicsUInt16 *)pIn->pData, (epicsFloat32 *)pOut->pData);
+      else                      exponentialUpdate((epicsUInt16 *)pIn->pData, (epicsFloat32 *)pOut->pData);
+      break;
+    case NDUInt32:
+      if (mMode == ModeRolling) rollingUpdate((epicsUInt32 *)pIn->pData, (epicsFloat32 *)pOut->pData);
+      else                      exponentialUpdate((epicsUInt32 *)pIn->pData, (epicsFloat32 *)pOut->pData);
+      break;
+    default:
+      if (mMode == ModeRolling) rollingUpdate((epicsFloat32 *)pIn->pData, (epicsFloat32 *)pOut->pData);
+      else                      exponentialUpdate((epicsFloat32 *)pIn->pData, (epicsFloat32 *)pOut->pData);
+      break;
+  }
+  return pOut;
+}
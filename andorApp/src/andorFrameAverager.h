@@ -0,0 +1,68 @@
+/**
+ * Software frame averaging for the ADAndor driver.
+ *
+ * Used when the camera cannot do the averaging itself with the SDK data averaging
+ * filters.  Two modes are supported, both for 2-D images and for 1-D (FVB) spectra:
+ *   - Rolling: the mean of the last N frames.  A running sum is kept, so each frame
+ *     costs one add and one subtract per pixel regardless of N.  The last N frames are
+ *     kept, so N is limited to the frames that fit in MaxHistoryBytes.
+ *   - Exponential: avg += (frame - avg) / N, i.e. the same recursive filter as the SDK.
+ *     Until N frames have been seen the plain mean is used so the output settles quickly.
+ * The output is always NDFloat32.
+ */
+
+#ifndef ANDORFRAMEAVERAGER_H
+#define ANDORFRAMEAVERAGER_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#include "NDArray.h"
+
+class AndorFrameAverager {
+ public:
+  enum {
+    ModeNone = 0,
+    ModeRolling = 1,
+    ModeExponential = 2
+  };
+
+  // Memory for the rolling average history
+  static const size_t MaxHistoryBytes;
+
+  AndorFrameAverager();
+  ~AndorFrameAverager();
+  void configure(int mode, int numFrames, int factor);
+  void reset();
+  NDArray *process(NDArray *pIn, NDArrayPool *pPool);
+  int mode() const { return mMode; }
+  int count() const { return mCount; }
+  int window() const { return mWindow; }
+
+ private:
+  int allocate(NDArray *pIn, size_t nElements);
+  void freeBuffers();
+  template <typename epicsType> void rollingUpdate(const epicsType *pIn, epicsFloat32 *pOut);
+  template <typename epicsType> void exponentialUpdate(const epicsType *pIn, epicsFloat32 *pOut);
+
+  int mMode;
+  int mNumFrames;
+  int mWindow;              // Rolling: mNumFrames, limited by MaxHistoryBytes
+  int mFactor;
+  int mCount;
+
+  // Shape of the frames being averaged; a change of shape or type restarts the average
+  int mNDims;
+  size_t mDims[ND_ARRAY_MAX_DIMS];
+  NDDataType_t mDataType;
+  size_t mNElements;
+  size_t mBytesPerFrame;
+
+  char *mHistory;           // Rolling: ring of the last mNumFrames input frames
+  int mHistoryIndex;
+  epicsFloat64 *mSum;       // Rolling: sum of the frames in mHistory
+  epicsFloat32 *mAverage;   // Exponential: current average
+};
+
+#endif //ANDORFRAMEAVERAGER_H
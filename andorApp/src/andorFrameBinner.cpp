@@ -0,0 +1,139 @@
+/**
+ * Software binning for the ADAndor driver.
+ *
+ * Each output row is made by first summing binY input rows into a row buffer, which is
+ * a contiguous loop that the compiler vectorizes, and then summing binX adjacent
+ * elements of the row buffer.  Output row n is only written after input rows
+ * n*binY ... (n+1)*binY-1 have been read, and since binX*binY >= 2 and the output
+ * elements are at most twice the size of the input elements, it never overwrites
+ * input that has not been read yet.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "andorFrameBinner.h"
+
+static const char *driverName = "andorFrameBinner";
+
+AndorFrameBinner::AndorFrameBinner()
+  : mRowSum(0), mRowSumBytes(0)
+{
+}
+
+AndorFrameBinner::~AndorFrameBinner()
+{
+  free(mRowSum);
+}
+
+template <typename epicsOutType, typename epicsAccType>
+static inline epicsOutType binValue(epicsAccType sum, epicsAccType, double scale)
+{
+  return (epicsOutType)(sum * scale);
+}
+
+template <>
+inline epicsUInt32 binValue<epicsUInt32, epicsUInt32>(epicsUInt32 sum, epicsUInt32 count, double scale)
+{
+  return (scale == 1.) ? sum : (sum + count/2) / count;
+}
+
+template <>
+inline epicsUInt32 binValue<epicsUInt32, epicsUInt64>(epicsUInt64 sum, epicsUInt64 count, double scale)
+{
+  if (scale != 1.) sum = (sum + count/2) / count;
+  // Saturate rather than wrap
+  return (sum > 0xFFFFFFFFu) ? 0xFFFFFFFFu : (epicsUInt32)sum;
+}
+
+template <typename epicsInType, typename epicsAccType, typename epicsOutType>
+void AndorFrameBinner::binFrame(void *pData, size_t sizeX, size_t sizeY, int binX, int binY, int mode)
+{
+  const epicsInType *pIn = (const epicsInType *)pData;
+  epicsOutType *pOut = (epicsOutType *)pData;
+  epicsAccType *pRowSum = (epicsAccType *)mRowSum;
+  size_t outX = sizeX / binX;
+  size_t outY = sizeY / binY;
+  epicsAccType count = (epicsAccType)binX * binY;
+  double scale = (mode == ModeMean) ? 1. / (double)count : 1.;
+
+  for (size_t oy=0; oy<outY; oy++) {
+    const epicsInType *pRow = pIn + oy * binY * sizeX;
+    for (size_t x=0; x<sizeX; x++) pRowSum[x] = pRow[x];
+    for (int k=1; k<binY; k++) {
+      pRow += sizeX;
+      for (size_t x=0; x<sizeX; x++) pRowSum[x] += pRow[x];
+    }
+    epicsOutType *pOutRow = pOut + oy * outX;
+    if (binX == 1) {
+      for (size_t ox=0; ox<outX; ox++) {
+        pOutRow[ox] = binValue<epicsOutType, epicsAccType>(pRowSum[ox], count, scale);
+      }
+    } else {
+      for (size_t ox=0; ox<outX; ox++) {
+        const epicsAccType *pSum = pRowSum + ox * binX;
+        epicsAccType sum = 0;
+        for (int k=0; k<binX; k++) sum += pSum[k];
+        pOutRow[ox] = binValue<epicsOutType, epicsAccType>(sum, count, scale);
+      }
+    }
+  }
+}
+
+/** Bins a frame in place.
+  * \param[in,out] pArray 2-D UInt16 or UInt32 array just read from the camera.  Its dimensions,
+  *                data type and binning are updated.
+  * \param[in] binX Binning in X; limited to the array width.
+  * \param[in] binY Binning in Y; limited to the array height, so it is ignored for FVB spectra.
+  * \param[in] mode ModeSum or ModeMean.
+  * \param[in] output OutputUInt32 or OutputFloat32.
+  * \return 0 if the array was binned or no binning was requested, -1 if the array type is not supported
+  *         or memory could not be allocated. */
+int AndorFrameBinner::process(NDArray *pArray, int binX, int binY, int mode, int output)
+{
+  size_t sizeX, sizeY, rowSumBytes;
+  bool wide;
+
+  if (pArray->ndims != 2) return -1;
+  sizeX = pArray->dims[0].size;
+  sizeY = pArray->dims[1].size;
+  if (binX < 1) binX = 1;
+  if (binY < 1) binY = 1;
+  if ((size_t)binX > sizeX) binX = (int)sizeX;
+  if ((size_t)binY > sizeY) binY = (int)sizeY;
+  if (binX * binY < 2) return 0;
+  if ((pArray->dataType != NDUInt16) && (pArray->dataType != NDUInt32)) return -1;
+
+  // 16-bit input cannot overflow a 32-bit accumulator for any practical binning
+  wide = (pArray->dataType == NDUInt32) && (output == OutputUInt32);
+  rowSumBytes = sizeX * (wide ? sizeof(epicsUInt64) : (output == OutputFloat32) ? sizeof(epicsFloat64) : sizeof(epicsUInt32));
+  if (rowSumBytes > mRowSumBytes) {
+    free(mRowSum);
+    mRowSum = malloc(rowSumBytes);
+    mRowSumBytes = mRowSum ? rowSumBytes : 0;
+    if (!mRowSum) {
+      printf("%s:process: unable to allocate row buffer\n", driverName);
+      return -1;
+    }
+  }
+
+  if (output == OutputFloat32) {
+    if (pArray->dataType == NDUInt16)
+      binFrame<epicsUInt16, epicsFloat64, epicsFloat32>(pArray->pData, sizeX, sizeY, binX, binY, mode);
+    else
+      binFrame<epicsUInt32, epicsFloat64, epicsFloat32>(pArray->pData, sizeX, sizeY, binX, binY, mode);
+    pArray->dataType = NDFloat32;
+  } else {
+    if (pArray->dataType == NDUInt16)
+      binFrame<epicsUInt16, epicsUInt32, epicsUInt32>(pArray->pData, sizeX, sizeY, binX, binY, mode);
+    else
+      binFrame<epicsUInt32, epicsUInt64, epicsUInt32>(pArray->pData, sizeX, sizeY, binX, binY, mode);
+    pArray->dataType = NDUInt32;
+  }
+  pArray->dims[0].size = sizeX / binX;
+  pArray->dims[1].size = sizeY / binY;
+  pArray->dims[0].binning *= binX;
+  pArray->dims[1].binning *= binY;
+  return 0;
+}
@@ -0,0 +1,43 @@
+/**
+ * Software binning for the ADAndor driver.
+ *
+ * Hardware binning sums charge in the serial register and output node, which saturate
+ * on bright signals.  Binning in software after readout cannot saturate below 32 bits.
+ * The binning is done in place in the array that was just read out: the output is
+ * 32-bit, but it has at most half as many pixels as the input, so it always fits.
+ * Software binning is applied on top of any hardware binning, so the two can be combined.
+ */
+
+#ifndef ANDORFRAMEBINNER_H
+#define ANDORFRAMEBINNER_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#include "NDArray.h"
+
+class AndorFrameBinner {
+ public:
+  enum {
+    ModeSum = 0,
+    ModeMean = 1
+  };
+  enum {
+    OutputUInt32 = 0,
+    OutputFloat32 = 1
+  };
+
+  AndorFrameBinner();
+  ~AndorFrameBinner();
+  int process(NDArray *pArray, int binX, int binY, int mode, int output);
+
+ private:
+  template <typename epicsInType, typename epicsAccType, typename epicsOutType>
+  void binFrame(void *pData, size_t sizeX, size_t sizeY, int binX, int binY, int mode);
+
+  void *mRowSum;            // Sum of binY input rows, one element per input column
+  size_t mRowSumBytes;
+};
+
+#endif //ANDORFRAMEBINNER_H
@@ -0,0 +1,238 @@
+/**
+ * Change detection gating for the ADAndor driver.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "andorFrameGate.h"
+
+static const char *driverName = "andorFrameGate";
+
+AndorFrameGate::AndorFrameGate()
+  : mMode(ModeOff), mStride(1), mMinX(0), mMinY(0), mSizeX(0), mSizeY(0),
+    mCurrent(0), mCompare(0), mNumSamples(0), mMaxSamples(0),
+    mCompareValid(false), mCaptureReference(false),
+    mArraySizeX(0), mArraySizeY(0), mDataType(NDUInt16),
+    mMetric(0.), mSinceLastPassed(0), mPassed(0), mSkipped(0)
+{
+}
+
+AndorFrameGate::~AndorFrameGate()
+{
+  free(mCurrent);
+  free(mCompare);
+}
+
+void AndorFrameGate::invalidate()
+{
+  mCompareValid = false;
+  mSinceLastPassed = 0;
+}
+
+/** Sets the gating mode and the pixels that are compared.  The comparison frame is
+  * discarded if anything changed, so the next frame is always published.
+  * \param[in] mode ModeOff, ModePrevious or ModeReference.
+  * \param[in] stride Only every stride'th pixel in X and Y is compared.
+  * \param[in] minX, minY, sizeX, sizeY Region compared, in array pixels.  A size of 0 means up to the edge of the array. */
+void AndorFrameGate::configure(int mode, int stride, int minX, int minY, int sizeX, int sizeY)
+{
+  if (stride < 1) stride = 1;
+  if (minX < 0) minX = 0;
+  if (minY < 0) minY = 0;
+  if (sizeX < 0) sizeX = 0;
+  if (sizeY < 0) sizeY = 0;
+  if ((mode == mMode) && (stride == mStride) && (minX == mMinX) && (minY == mMinY) &&
+      (sizeX == mSizeX) && (sizeY == mSizeY)) return;
+  // Switching to reference mode captures a new reference
+  if ((mode == ModeReference) && (mMode != ModeReference)) mCaptureReference = true;
+  mMode = mode;
+  mStride = stride;
+  mMinX = minX;
+  mMinY = minY;
+  mSizeX = sizeX;
+  mSizeY = sizeY;
+  invalidate();
+}
+
+/** Makes the next frame the reference frame for ModeReference. */
+void AndorFrameGate::captureReference()
+{
+  mCaptureReference = true;
+}
+
+void AndorFrameGate::resetStats()
+{
+  mPassed = 0;
+  mSkipped = 0;
+  mMetric = 0.;
+  mSinceLastPassed = 0;
+}
+
+template <typename epicsType>
+void AndorFrameGate::gather(const epicsType *pData, size_t arraySizeX)
+{
+  size_t endX = mMinX + ((mSizeX > 0) ? (size_t)mSizeX : mArraySizeX);
+  size_t endY = mMinY + ((mSizeY > 0) ? (size_t)mSizeY : mArraySizeY);
+  epicsType *pOut = (epicsType *)mCurrent;
+
+  if (endX > mArraySizeX) endX = mArraySizeX;
+  if (endY > mArraySizeY) endY = mArraySizeY;
+  for (size_t y=mMinY; y<endY; y+=mStride) {
+    const epicsType *pRow = pData + y * arraySizeX;
+    if (mStride == 1) {
+      memcpy(pOut, pRow + mMinX, (endX - mMinX) * sizeof(epicsType));
+      pOut += endX - mMinX;
+    } else {
+      for (size_t x=mMinX; x<endX; x+=mStride) *pOut++ = pRow[x];
+    }
+  }
+  mNumSamples = pOut - (epicsType *)mCurrent;
+}
+
+// Sums in 32 bits over blocks of this many 16-bit differences, which cannot overflow
+static const size_t UInt16BlockSize = 65536;
+
+static double sumAbsDiff16(const epicsUInt16 *pA, const epicsUInt16 *pB, size_t n)
+{
+  epicsUInt64 total = 0;
+  epicsUInt32 block;
+  epicsInt32 diff;
+  size_t i, end;
+
+  for (i=0; i<n; i=end) {
+    end = (n - i > UInt16BlockSize) ? i + UInt16BlockSize : n;
+    block = 0;
+    for (size_t j=i; j<end; j++) {
+      diff = (epicsInt32)pA[j] - (epicsInt32)pB[j];
+      block += (diff < 0) ? -diff : diff;
+    }
+    total += block;
+  }
+  return (double)total;
+}
+
+static double sumAbsDiff32(const epicsUInt32 *pA, const epicsUInt32 *pB, size_t n)
+{
+  epicsUInt64 total = 0;
+
+  for (size_t i=0; i<n; i++) total += (pA[i] > pB[i]) ? pA[i] - pB[i] : pB[i] - pA[i];
+  return (double)total;
+}
+
+static double sumAbsDiffFloat(const epicsFloat32 *pA, const epicsFloat32 *pB, size_t n)
+{
+  double total = 0.;
+
+  for (size_t i=0; i<n; i++) total += fabsf(pA[i] - pB[i]);
+  return total;
+}
+
+double AndorFrameGate::sumAbsDiff() const
+{
+  switch (mDataType) {
+    case NDUInt16:
+      return sumAbsDiff16((const epicsUInt16 *)mCurrent, (const epicsUInt16 *)mCompare, mNumSamples);
+    case NDUInt32:
+      return sumAbsDiff32((const epicsUInt32 *)mCurrent, (const epicsUInt32 *)mCompare, mNumSamples);
+    default:
+      return sumAbsDiffFloat((const epicsFloat32 *)mCurrent, (const epicsFloat32 *)mCompare, mNumSamples);
+  }
+}
+
+/** Copies the sampled pixels of a frame into mCurrent.
+  * \return 0 on success, -1 if the array type is not supported, the region is empty
+  *         or memory could not be allocated. */
+int AndorFrameGate::sample(NDArray *pArray)
+{
+  size_t sizeX = pArray->dims[0].size;
+  size_t sizeY = (pArray->ndims > 1) ? pArray->dims[1].size : 1;
+  size_t nX, nY, maxSamples, sampleBytes;
+
+  if ((pArray->dataType != NDUInt16) && (pArray->dataType != NDUInt32) &&
+      (pArray->dataType != NDFloat32)) return -1;
+  if (((size_t)mMinX >= sizeX) || ((size_t)mMinY >= sizeY)) return -1;
+  if ((sizeX != mArraySizeX) || (sizeY != mArraySizeY) || (pArray->dataType != mDataType)) {
+    mArraySizeX = sizeX;
+    mArraySizeY = sizeY;
+    mDataType = pArray->dataType;
+    invalidate();
+  }
+  nX = (sizeX - mMinX + mStride - 1) / mStride;
+  nY = (sizeY - mMinY + mStride - 1) / mStride;
+  maxSamples = nX * nY;
+  // Buffers are sized for 4-byte samples, so a change of type does not reallocate them
+  sampleBytes = sizeof(epicsUInt32);
+  if (maxSamples > mMaxSamples) {
+    free(mCurrent);
+    free(mCompare);
+    mCurrent = malloc(maxSamples * sampleBytes);
+    mCompare = malloc(maxSamples * sampleBytes);
+    mMaxSamples = maxSamples;
+    invalidate();
+    if (!mCurrent || !mCompare) {
+      printf("%s:sample: unable to allocate %lu samples\n", driverName, (unsigned long)maxSamples);
+      free(mCurrent);
+      free(mCompare);
+      mCurrent = mCompare = 0;
+      mMaxSamples = 0;
+      return -1;
+    }
+  }
+  switch (pArray->dataType) {
+    case NDUInt16: gather((epicsUInt16 *)pArray->pData, sizeX); break;
+    case NDUInt32: gather((epicsUInt32 *)pArray->pData, sizeX); break;
+    default:       gather((epicsFloat32 *)pArray->pData, sizeX); break;
+  }
+  return (mNumSamples > 0) ? 0 : -1;
+}
+
+/** Decides whether a frame should be published.
+  * \param[in] pArray The frame.
+  * \param[in] threshold Frames are published when the mean absolute difference per sampled
+  *            pixel is at least threshold.
+  * \param[in] keyframeInterval If > 0, a frame is always published when the previous
+  *            keyframeInterval-1 frames were skipped.
+  * \return true if the frame should be published. */
+bool AndorFrameGate::process(NDArray *pArray, double threshold, int keyframeInterval)
+{
+  void *pTemp;
+  bool pass;
+
+  if (mMode == ModeOff) {
+    mPassed++;
+    return true;
+  }
+  if (sample(pArray)) {
+    // Frames that cannot be compared are always published
+    mPassed++;
+    return true;
+  }
+  if (!mCompareValid || mCaptureReference) {
+    pTemp = mCompare; mCompare = mCurrent; mCurrent = pTemp;
+    mCompareValid = true;
+    mCaptureReference = false;
+    mMetric = 0.;
+    mSinceLastPassed = 0;
+    mPassed++;
+    return true;
+  }
+
+  mMetric = sumAbsDiff() / mNumSamples;
+
+  pass = (mMetric >= threshold) ||
+         ((keyframeInterval > 0) && (mSinceLastPassed + 1 >= keyframeInterval));
+  if (pass) {
+    mPassed++;
+    mSinceLastPassed = 0;
+    if (mMode == ModePrevious) {
+      pTemp = mCompare; mCompare = mCurrent; mCurrent = pTemp;
+    }
+  } else {
+    mSkipped++;
+    mSinceLastPassed++;
+  }
+  return pass;
+}
@@ -0,0 +1,68 @@
+/**
+ * Change detection gating for the ADAndor driver.
+ *
+ * Decides whether a frame differs enough from a comparison frame to be worth publishing.
+ * The comparison frame is either the last published frame or a reference frame captured
+ * on request.  The metric is the mean absolute difference over a subsampled grid of
+ * pixels inside a region of interest.  Only the sampled pixels of the comparison frame
+ * are kept, in the data type of the frame, so the comparison needs little memory and is
+ * a contiguous loop.  For integer frames the differences are summed in integers, which
+ * the compiler can vectorise.
+ */
+
+#ifndef ANDORFRAMEGATE_H
+#define ANDORFRAMEGATE_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#include "NDArray.h"
+
+class AndorFrameGate {
+ public:
+  enum {
+    ModeOff = 0,
+    ModePrevious = 1,
+    ModeReference = 2
+  };
+
+  AndorFrameGate();
+  ~AndorFrameGate();
+  void configure(int mode, int stride, int minX, int minY, int sizeX, int sizeY);
+  void captureReference();
+  void resetStats();
+  bool process(NDArray *pArray, double threshold, int keyframeInterval);
+  int mode() const { return mMode; }
+  double metric() const { return mMetric; }
+  epicsInt64 passed() const { return mPassed; }
+  epicsInt64 skipped() const { return mSkipped; }
+
+ private:
+  int sample(NDArray *pArray);
+  template <typename epicsType> void gather(const epicsType *pData, size_t arraySizeX);
+  double sumAbsDiff() const;
+  void invalidate();
+
+  int mMode;
+  int mStride;
+  int mMinX, mMinY, mSizeX, mSizeY;
+
+  // Sampled pixels of the current and comparison frames, in the data type of the frame
+  void *mCurrent;
+  void *mCompare;
+  size_t mNumSamples;
+  size_t mMaxSamples;
+  bool mCompareValid;
+  bool mCaptureReference;
+  // Shape of the frame the comparison samples were taken from
+  size_t mArraySizeX, mArraySizeY;
+  NDDataType_t mDataType;
+
+  double mMetric;
+  int mSinceLastPassed;
+  epicsInt64 mPassed;
+  epicsInt64 mSkipped;
+};
+
+#endif //ANDORFRAMEGATE_H
@@ -0,0 +1,350 @@
+/**
+ * Writer for the ADAndor append-only frame store.
+ *
+ * Frames are queued by the driver's data task and written by a dedicated thread.
+ * The thread copies frames into a large staging buffer and writes the buffer out
+ * in one call, so the disk sees large sequential writes regardless of frame size.
+ * Index entries are only written once the frame data they point to has been written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsMessageQueue.h>
+#include <NDArray.h>
+
+#include "andorFrameStore.h"
+#include "andorMetrics.h"
+
+#define STAGING_SIZE (8*1024*1024)
+#define MIN_PREALLOC (STAGING_SIZE)
+#define MAX_PENDING_ENTRIES 4096
+
+static const char *driverName = "andorFrameStore";
+
+static void writerTaskC(void *drvPvt)
+{
+  AndorFrameStore *pStore = (AndorFrameStore *)drvPvt;
+
+  pStore->writerTask();
+}
+
+/** Creates the data and index files and starts the writer thread.
+  * \param[in] dataFileName Name of the data file.  The index file is dataFileName + ANDOR_FRAME_STORE_INDEX_EXT.
+  * \param[in] preallocBytes Size by which the data file is grown each time it fills up.
+  * \param[in] queueSize Maximum number of frames waiting to be written.  Frames appended
+  *            while the queue is full are dropped and counted. */
+AndorFrameStore::AndorFrameStore(const char *dataFileName, size_t preallocBytes, int queueSize)
+  : mFd(-1), mIndexFp(0), mQueue(0), mQueueSize(queueSize), mWriterDoneEvent(0),
+    mPreallocBytes(preallocBytes), mAllocated(0), mWriteOffset(0),
+    mStaging(0), mStagingSize(STAGING_SIZE), mStagingUsed(0),
+    mPendingEntries(0), mNumPending(0), mMaxPending(0),
+    mFramesWritten(0), mFramesDropped(0), mBytesWritten(0.), mWriteError(false),
+    mMetrics(0), mFramesWrittenId(-1), mFramesDroppedId(-1), mBytesWrittenId(-1)
+{
+  char indexFileName[ANDOR_FRAME_STORE_MAX_NAME];
+  AndorFrameIndexHeader header;
+  static const char *functionName = "AndorFrameStore";
+
+  mStatsLock = epicsMutexMustCreate();
+  if (mPreallocBytes < MIN_PREALLOC) mPreallocBytes = MIN_PREALLOC;
+  if (mQueueSize < 1) mQueueSize = 1;
+
+  if (strlen(dataFileName) + strlen(ANDOR_FRAME_STORE_INDEX_EXT) >= sizeof(indexFileName)) {
+    printf("%s:%s: file name too long %s\n", driverName, functionName, dataFileName);
+    return;
+  }
+  strcpy(indexFileName, dataFileName);
+  strcat(indexFileName, ANDOR_FRAME_STORE_INDEX_EXT);
+
+  mIndexFp = fopen(indexFileName, "wb");
+  if (!mIndexFp) {
+    printf("%s:%s: error opening index file %s error=%s\n",
+           driverName, functionName, indexFileName, strerror(errno));
+    return;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ANDOR_FRAME_STORE_MAGIC, sizeof(header.magic));
+  header.version = ANDOR_FRAME_STORE_VERSION;
+  header.entrySize = sizeof(AndorFrameIndexEntry);
+  if (fwrite(&header, sizeof(header), 1, mIndexFp) != 1) {
+    printf("%s:%s: error writing index header\n", driverName, functionName);
+    fclose(mIndexFp);
+    mIndexFp = 0;
+    return;
+  }
+  fflush(mIndexFp);
+
+#ifdef _WIN32
+  mFd = _open(dataFileName, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY | _O_SEQUENTIAL,
+              _S_IREAD | _S_IWRITE);
+#else
+  mFd = ::open(dataFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+  if (mFd < 0) {
+    printf("%s:%s: error opening data file %s error=%s\n",
+           driverName, functionName, dataFileName, strerror(errno));
+    fclose(mIndexFp);
+    mIndexFp = 0;
+    return;
+  }
+  if (reserveSpace(mPreallocBytes)) {
+    printf("%s:%s: warning, unable to preallocate %lu bytes for %s\n",
+           driverName, functionName, (unsigned long)mPreallocBytes, dataFileName);
+  }
+
+  mStaging = (char *)malloc(mStagingSize);
+  mMaxPending = MAX_PENDING_ENTRIES;
+  mPendingEntries = (AndorFrameIndexEntry *)calloc(mMaxPending, sizeof(AndorFrameIndexEntry));
+  mQueue = epicsMessageQueueCreate(mQueueSize + 1, sizeof(QueueElement));
+  mWriterDoneEvent = epicsEventMustCreate(epicsEventEmpty);
+  if (!mStaging || !mPendingEntries || !mQueue ||
+      (epicsThreadCreate("AndorFrameStore", epicsThreadPriorityMedium,
+                         epicsThreadGetStackSize(epicsThreadStackMedium),
+                         (EPICSTHREADFUNC)writerTaskC, this) == NULL)) {
+    printf("%s:%s: unable to create writer\n", driverName, functionName);
+#ifdef _WIN32
+    _close(mFd);
+#else
+    ::close(mFd);
+#endif
+    mFd = -1;
+    fclose(mIndexFp);
+    mIndexFp = 0;
+  }
+}
+
+AndorFrameStore::~AndorFrameStore()
+{
+  close();
+  if (mQueue) epicsMessageQueueDestroy(mQueue);
+  if (mWriterDoneEvent) epicsEventDestroy(mWriterDoneEvent);
+  epicsMutexDestroy(mStatsLock);
+  free(mStaging);
+  free(mPendingEntries);
+}
+
+/** Queues a frame for writing.  The array is reserved here and released by the writer thread.
+  * \return 0 if the frame was queued, -1 if it was dropped. */
+int AndorFrameStore::append(NDArray *pArray, epicsInt64 frameNumber, double exposure)
+{
+  QueueElement element;
+
+  if (!isOpen() || !pArray) return -1;
+  element.pArray = pArray;
+  element.frameNumber = frameNumber;
+  element.exposure = exposure;
+  pArray->reserve();
+  if (epicsMessageQueueTrySend(mQueue, &element, sizeof(element)) != 0) {
+    pArray->release();
+    count(0, 1, 0);
+    return -1;
+  }
+  return 0;
+}
+
+/** Writes out all queued frames, stops the writer thread and trims the data file to its
+  * final size. */
+void AndorFrameStore::close()
+{
+  QueueElement element;
+
+  if (!isOpen()) return;
+  // A NULL array tells the writer thread to flush and exit
+  element.pArray = 0;
+  epicsMessageQueueSend(mQueue, &element, sizeof(element));
+  epicsEventMustWait(mWriterDoneEvent);
+#ifdef _WIN32
+  _chsize_s(mFd, (__int64)mWriteOffset);
+  _close(mFd);
+#else
+  if (ftruncate(mFd, (off_t)mWriteOffset) != 0) {
+    printf("%s:close: error truncating data file error=%s\n", driverName, strerror(errno));
+  }
+  ::close(mFd);
+#endif
+  mFd = -1;
+  fclose(mIndexFp);
+  mIndexFp = 0;
+}
+
+void AndorFrameStore::getStats(epicsInt64 *framesWritten, epicsInt64 *framesDropped,
+                               double *bytesWritten, int *queueFree)
+{
+  epicsMutexLock(mStatsLock);
+  *framesWritten = mFramesWritten;
+  *framesDropped = mFramesDropped;
+  *bytesWritten = mBytesWritten;
+  epicsMutexUnlock(mStatsLock);
+  *queueFree = mQueue ? mQueueSize - epicsMessageQueuePending(mQueue) : 0;
+}
+
+/** Counts the frames written and dropped in a set of metrics as well as in the store.
+  * Called before the first frame is appended. */
+void AndorFrameStore::setMetrics(AndorMetrics *pMetrics, int framesWrittenId,
+                                 int framesDroppedId, int bytesWrittenId)
+{
+  mMetrics = pMetrics;
+  mFramesWrittenId = framesWrittenId;
+  mFramesDroppedId = framesDroppedId;
+  mBytesWrittenId = bytesWrittenId;
+}
+
+void AndorFrameStore::count(epicsInt64 framesWritten, epicsInt64 framesDropped,
+                            size_t bytesWritten)
+{
+  epicsMutexLock(mStatsLock);
+  mFramesWritten += framesWritten;
+  mFramesDropped += framesDropped;
+  mBytesWritten += bytesWritten;
+  epicsMutexUnlock(mStatsLock);
+  if (!mMetrics) return;
+  if (framesWritten) mMetrics->increment(mFramesWrittenId, (size_t)framesWritten);
+  if (framesDropped) mMetrics->increment(mFramesDroppedId, (size_t)framesDropped);
+  if (bytesWritten) mMetrics->increment(mBytesWrittenId, bytesWritten);
+}
+
+/** Makes sure the data file is allocated at least up to endOffset, growing it in
+  * multiples of the preallocation size so that the file system can keep it contiguous. */
+int AndorFrameStore::reserveSpace(epicsUInt64 endOffset)
+{
+  epicsUInt64 newSize;
+
+  if (endOffset <= mAllocated) return 0;
+  newSize = mAllocated;
+  while (newSize < endOffset) newSize += mPreallocBytes;
+#ifdef _WIN32
+  if (_chsize_s(mFd, (__int64)newSize) != 0) return -1;
+#else
+  if (posix_fallocate(mFd, (off_t)mAllocated, (off_t)(newSize - mAllocated)) != 0) return -1;
+#endif
+  mAllocated = newSize;
+  return 0;
+}
+
+int AndorFrameStore::writeFully(const void *pData, size_t nBytes)
+{
+  const char *p = (const char *)pData;
+
+  if (mWriteError) return -1;
+  // Failing to extend the preallocation is not fatal, the write will just be slower
+  reserveSpace(mWriteOffset + nBytes);
+  while (nBytes > 0) {
+#ifdef _WIN32
+    int n = _write(mFd, p, (unsigned int)nBytes);
+#else
+    ssize_t n = ::write(mFd, p, nBytes);
+#endif
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      printf("%s:writeFully: write error=%s\n", driverName, strerror(errno));
+      mWriteError = true;
+      return -1;
+    }
+    p += n;
+    nBytes -= n;
+    mWriteOffset += n;
+  }
+  return 0;
+}
+
+/** Writes the staging buffer to the data file, then the index entries of the frames it contained. */
+int AndorFrameStore::flushStaging()
+{
+  int status = 0;
+  size_t numWritten = mNumPending;
+  size_t bytes = mStagingUsed;
+
+  if (mStagingUsed > 0) {
+    status = writeFully(mStaging, mStagingUsed);
+    mStagingUsed = 0;
+  }
+  if (mNumPending > 0) {
+    if (status == 0) {
+      if (fwrite(mPendingEntries, sizeof(AndorFrameIndexEntry), mNumPending, mIndexFp) != mNumPending) {
+        status = -1;
+      }
+      fflush(mIndexFp);
+    }
+    mNumPending = 0;
+  }
+  if (status == 0) {
+    count(numWritten, 0, bytes);
+  } else {
+    count(0, numWritten, 0);
+  }
+  return status;
+}
+
+void AndorFrameStore::writeFrame(QueueElement *pElement)
+{
+  NDArray *pArray = pElement->pArray;
+  NDArrayInfo arrayInfo;
+  AndorFrameIndexEntry *pEntry;
+
+  pArray->getInfo(&arrayInfo);
+  if ((mStagingUsed + arrayInfo.totalBytes > mStagingSize) || (mNumPending >= mMaxPending)) {
+    flushStaging();
+  }
+  pEntry = &mPendingEntries[mNumPending++];
+  memset(pEntry, 0, sizeof(*pEntry));
+  pEntry->offset = mWriteOffset + mStagingUsed;
+  pEntry->frameNumber = pElement->frameNumber;
+  pEntry->timeStamp = pArray->timeStamp;
+  pEntry->exposure = pElement->exposure;
+  pEntry->tsSec = pArray->epicsTS.secPastEpoch;
+  pEntry->tsNsec = pArray->epicsTS.nsec;
+  pEntry->size = (epicsUInt32)arrayInfo.totalBytes;
+  pEntry->checksum = andorFrameStoreChecksum(pArray->pData, arrayInfo.totalBytes);
+  pEntry->dataType = pArray->dataType;
+  pEntry->sizeX = (epicsUInt32)arrayInfo.xSize;
+  pEntry->sizeY = (epicsUInt32)arrayInfo.ySize;
+  if (arrayInfo.totalBytes > mStagingSize) {
+    // Too large to stage, write it directly (the staging buffer is empty at this point)
+    int status = writeFully(pArray->pData, arrayInfo.totalBytes);
+    pArray->release();
+    if (status != 0) {
+      mNumPending--;
+      count(0, 1, 0);
+      return;
+    }
+    count(0, 0, arrayInfo.totalBytes);
+    flushStaging();
+    return;
+  }
+  memcpy(mStaging + mStagingUsed, pArray->pData, arrayInfo.totalBytes);
+  mStagingUsed += arrayInfo.totalBytes;
+  pArray->release();
+}
+
+/** Writer thread.  Stages queued frames and flushes whenever the staging buffer is full
+  * or there is nothing more to write. */
+void AndorFrameStore::writerTask()
+{
+  QueueElement element;
+
+  while (1) {
+    if (epicsMessageQueueReceive(mQueue, &element, sizeof(element)) < 0) continue;
+    if (!element.pArray) break;
+    writeFrame(&element);
+    if (epicsMessageQueuePending(mQueue) == 0) flushStaging();
+  }
+  flushStaging();
+  epicsEventSignal(mWriterDoneEvent);
+}
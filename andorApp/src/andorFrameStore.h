@@ -0,0 +1,161 @@
+/**
+ * Append-only indexed frame store for the ADAndor driver.
+ *
+ * A frame store is a pair of files:
+ *   - a data file holding the raw frame bytes back to back.  It is preallocated in
+ *     large chunks and written with large sequential writes from a dedicated thread.
+ *   - a sidecar index file (data file name + ".idx") holding one fixed size
+ *     AndorFrameIndexEntry per frame, so any frame can be located in constant time.
+ *
+ * The writer (AndorFrameStore) is only used by the driver.  The reader
+ * (AndorFrameStoreReader) memory maps both files and has no dependency on
+ * ADCore, so it can also be used by offline and replay tools.
+ */
+
+#ifndef ANDORFRAMESTORE_H
+#define ANDORFRAMESTORE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <epicsTypes.h>
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsMessageQueue.h>
+
+#define ANDOR_FRAME_STORE_MAGIC      "ANDORFS1"
+#define ANDOR_FRAME_STORE_VERSION    1
+#define ANDOR_FRAME_STORE_INDEX_EXT  ".idx"
+#define ANDOR_FRAME_STORE_MAX_NAME   1024
+
+/**
+ * Header at the start of the index file.
+ */
+typedef struct {
+  char magic[8];            /**< ANDOR_FRAME_STORE_MAGIC, not null terminated */
+  epicsUInt32 version;      /**< ANDOR_FRAME_STORE_VERSION */
+  epicsUInt32 entrySize;    /**< sizeof(AndorFrameIndexEntry) */
+  epicsUInt32 reserved[4];
+} AndorFrameIndexHeader;
+
+/**
+ * One index entry per frame; 64 bytes, naturally aligned.
+ */
+typedef struct {
+  epicsUInt64 offset;       /**< Byte offset of the frame in the data file */
+  epicsInt64  frameNumber;  /**< Driver image counter */
+  epicsFloat64 timeStamp;   /**< NDArray timeStamp (seconds) */
+  epicsFloat64 exposure;    /**< Exposure time read back from the SDK (seconds) */
+  epicsUInt32 tsSec;        /**< NDArray epicsTS.secPastEpoch */
+  epicsUInt32 tsNsec;       /**< NDArray epicsTS.nsec */
+  epicsUInt32 size;         /**< Frame size in bytes */
+  epicsUInt32 checksum;     /**< CRC-32 of the frame bytes */
+  epicsUInt32 dataType;     /**< NDDataType_t of the frame */
+  epicsUInt32 sizeX;
+  epicsUInt32 sizeY;
+  epicsUInt32 reserved;
+} AndorFrameIndexEntry;
+
+epicsUInt32 andorFrameStoreChecksum(const void *pData, size_t nBytes);
+
+/**
+ * Read-only view of a frame store.  Both files are memory mapped so entry(i), frameData() and
+ * findFrame(frameNumber) return pointers into the mapping without any I/O.
+ */
+class AndorFrameStoreReader {
+ public:
+  AndorFrameStoreReader();
+  ~AndorFrameStoreReader();
+  int open(const char *dataFileName);
+  void close();
+  size_t numFrames() const { return mNumFrames; }
+  const AndorFrameIndexEntry *entry(size_t index) const;
+  const AndorFrameIndexEntry *findFrame(epicsInt64 frameNumber) const;
+  const void *frameData(const AndorFrameIndexEntry *pEntry) const;
+  bool verify(const AndorFrameIndexEntry *pEntry) const;
+
+ private:
+  struct Mapping {
+    void *pBase;
+    size_t size;
+#ifdef _WIN32
+    void *hFile;
+    void *hMapping;
+#endif
+  };
+  static int mapFile(const char *fileName, Mapping *pMap);
+  static void unmapFile(Mapping *pMap);
+  Mapping mData;
+  Mapping mIndex;
+  const AndorFrameIndexEntry *mEntries;
+  size_t mNumFrames;
+  bool mSorted;
+};
+
+class NDArray;
+class AndorMetrics;
+
+/**
+ * Append-only writer.  append() only queues the NDArray; a writer thread copies
+ * queued frames into a large staging buffer and writes it out sequentially.
+ */
+class AndorFrameStore {
+ public:
+  AndorFrameStore(const char *dataFileName, size_t preallocBytes, int queueSize);
+  ~AndorFrameStore();
+  bool isOpen() const { return mFd >= 0; }
+  int append(NDArray *pArray, epicsInt64 frameNumber, double exposure);
+  void close();
+  void getStats(epicsInt64 *framesWritten, epicsInt64 *framesDropped,
+                double *bytesWritten, int *queueFree);
+  void setMetrics(AndorMetrics *pMetrics, int framesWrittenId, int framesDroppedId,
+                  int bytesWrittenId);
+
+  // Should be private, but is called from C so must be public
+  void writerTask();
+
+ private:
+  typedef struct {
+    NDArray *pArray;
+    epicsInt64 frameNumber;
+    double exposure;
+  } QueueElement;
+
+  int reserveSpace(epicsUInt64 endOffset);
+  int writeFully(const void *pData, size_t nBytes);
+  int flushStaging();
+  void writeFrame(QueueElement *pElement);
+  void count(epicsInt64 framesWritten, epicsInt64 framesDropped, size_t bytesWritten);
+
+  int mFd;
+  FILE *mIndexFp;
+  epicsMessageQueueId mQueue;
+  int mQueueSize;
+  epicsEventId mWriterDoneEvent;
+  epicsMutexId mStatsLock;
+
+  size_t mPreallocBytes;
+  epicsUInt64 mAllocated;
+  epicsUInt64 mWriteOffset;
+
+  char *mStaging;
+  size_t mStagingSize;
+  size_t mStagingUsed;
+  AndorFrameIndexEntry *mPendingEntries;
+  size_t mNumPending;
+  size_t mMaxPending;
+
+  epicsInt64 mFramesWritten;
+  epicsInt64 mFramesDropped;
+  double mBytesWritten;
+  bool mWriteError;
+
+  // Counters since the IOC started, updated as frames are written or dropped
+  AndorMetrics *mMetrics;
+  int mFramesWrittenId;
+  int mFramesDroppedId;
+  int mBytesWrittenId;
+};
+
+#endif //ANDORFRAMESTORE_H
@@ -0,0 +1,86 @@
+/**
+ * Command line tool to list, verify and extract frames from an ADAndor frame store.
+ *
+ * Usage:
+ *   andorFrameStoreInfo dataFile                 List all frames
+ *   andorFrameStoreInfo dataFile -v              Verify the checksum of every frame
+ *   andorFrameStoreInfo dataFile -x frame out    Write the raw data of one frame to a file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "andorFrameStore.h"
+
+static void usage()
+{
+  printf("Usage: andorFrameStoreInfo dataFile [-v | -x frameNumber outputFile]\n");
+}
+
+int main(int argc, char *argv[])
+{
+  AndorFrameStoreReader reader;
+  const AndorFrameIndexEntry *pEntry;
+  size_t i;
+
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+  if (reader.open(argv[1]) != 0) {
+    printf("Unable to open frame store %s\n", argv[1]);
+    return 1;
+  }
+
+  if ((argc == 3) && (strcmp(argv[2], "-v") == 0)) {
+    size_t numBad = 0;
+    for (i=0; i<reader.numFrames(); i++) {
+      pEntry = reader.entry(i);
+      if (!reader.verify(pEntry)) {
+        printf("Frame %lld at offset %llu: checksum error\n",
+               (long long)pEntry->frameNumber, (unsigned long long)pEntry->offset);
+        numBad++;
+      }
+    }
+    printf("%lu frames, %lu checksum errors\n", (unsigned long)reader.numFrames(), (unsigned long)numBad);
+    return numBad ? 2 : 0;
+  }
+
+  if ((argc == 5) && (strcmp(argv[2], "-x") == 0)) {
+    FILE *fp;
+    const void *pData;
+    pEntry = reader.findFrame(atoll(argv[3]));
+    pData = reader.frameData(pEntry);
+    if (!pData) {
+      printf("Frame %s not found\n", argv[3]);
+      return 1;
+    }
+    fp = fopen(argv[4], "wb");
+    if (!fp || (fwrite(pData, pEntry->size, 1, fp) != 1)) {
+      printf("Error writing %s\n", argv[4]);
+      if (fp) fclose(fp);
+      return 1;
+    }
+    fclose(fp);
+    printf("Wrote frame %lld (%u x %u, dataType=%u, %u bytes) to %s\n",
+           (long long)pEntry->frameNumber, pEntry->sizeX, pEntry->sizeY,
+           pEntry->dataType, pEntry->size, argv[4]);
+    return 0;
+  }
+
+  if (argc != 2) {
+    usage();
+    return 1;
+  }
+  printf("%12s %14s %10s %10s %8s %6s %6s %10s %18s\n",
+         "Frame", "Offset", "Size", "Checksum", "DataType", "SizeX", "SizeY", "Exposure", "TimeStamp");
+  for (i=0; i<reader.numFrames(); i++) {
+    pEntry = reader.entry(i);
+    printf("%12lld %14llu %10u   %08X %8u %6u %6u %10.6f %18.6f\n",
+           (long long)pEntry->frameNumber, (unsigned long long)pEntry->offset, pEntry->size,
+           pEntry->checksum, pEntry->dataType, pEntry->sizeX, pEntry->sizeY,
+           pEntry->exposure, pEntry->timeStamp);
+  }
+  return 0;
+}
@@ -0,0 +1,228 @@
+/**
+ * Memory mapped reader for the ADAndor append-only frame store.
+ *
+ * This file deliberately depends only on EPICS base so that it can be linked
+ * into offline tools as well as into the driver.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsThread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "andorFrameStore.h"
+
+static epicsUInt32 crcTable[256];
+static epicsThreadOnceId crcTableOnce = EPICS_THREAD_ONCE_INIT;
+
+static void crcTableInit(void *)
+{
+  for (epicsUInt32 n=0; n<256; n++) {
+    epicsUInt32 c = n;
+    for (int k=0; k<8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : (c >> 1);
+    crcTable[n] = c;
+  }
+}
+
+/**
+ * CRC-32 (IEEE 802.3, reflected, polynomial 0xEDB88320) of a block of memory.
+ * The writer thread and readers may call this concurrently, so the table is built once
+ * with epicsThreadOnce.
+ */
+epicsUInt32 andorFrameStoreChecksum(const void *pData, size_t nBytes)
+{
+  const unsigned char *p = (const unsigned char *)pData;
+  epicsUInt32 crc = 0xFFFFFFFF;
+  size_t i;
+
+  epicsThreadOnce(&crcTableOnce, crcTableInit, 0);
+  for (i=0; i<nBytes; i++) {
+    crc = crcTable[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+AndorFrameStoreReader::AndorFrameStoreReader()
+  : mEntries(0), mNumFrames(0), mSorted(true)
+{
+  memset(&mData, 0, sizeof(mData));
+  memset(&mIndex, 0, sizeof(mIndex));
+}
+
+AndorFrameStoreReader::~AndorFrameStoreReader()
+{
+  close();
+}
+
+int AndorFrameStoreReader::mapFile(const char *fileName, Mapping *pMap)
+{
+  memset(pMap, 0, sizeof(*pMap));
+#ifdef _WIN32
+  LARGE_INTEGER size;
+  HANDLE hFile = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (hFile == INVALID_HANDLE_VALUE) return -1;
+  if (!GetFileSizeEx(hFile, &size)) {
+    CloseHandle(hFile);
+    return -1;
+  }
+  pMap->hFile = hFile;
+  pMap->size = (size_t)size.QuadPart;
+  if (pMap->size == 0) return 0;
+  pMap->hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!pMap->hMapping) {
+    unmapFile(pMap);
+    return -1;
+  }
+  pMap->pBase = MapViewOfFile(pMap->hMapping, FILE_MAP_READ, 0, 0, 0);
+  if (!pMap->pBase) {
+    unmapFile(pMap);
+    return -1;
+  }
+#else
+  struct stat st;
+  int fd = ::open(fileName, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  pMap->size = (size_t)st.st_size;
+  if (pMap->size > 0) {
+    void *pBase = mmap(0, pMap->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (pBase == MAP_FAILED) {
+      ::close(fd);
+      return -1;
+    }
+    pMap->pBase = pBase;
+  }
+  // The mapping stays valid after the descriptor is closed
+  ::close(fd);
+#endif
+  return 0;
+}
+
+void AndorFrameStoreReader::unmapFile(Mapping *pMap)
+{
+#ifdef _WIN32
+  if (pMap->pBase) UnmapViewOfFile(pMap->pBase);
+  if (pMap->hMapping) CloseHandle(pMap->hMapping);
+  if (pMap->hFile) CloseHandle(pMap->hFile);
+#else
+  if (pMap->pBase) munmap(pMap->pBase, pMap->size);
+#endif
+  memset(pMap, 0, sizeof(*pMap));
+}
+
+/** Opens a frame store for reading.
+  * \param[in] dataFileName Name of the data file; the index is dataFileName + ANDOR_FRAME_STORE_INDEX_EXT.
+  * \return 0 on success, -1 if either file cannot be mapped or the index header is invalid. */
+int AndorFrameStoreReader::open(const char *dataFileName)
+{
+  char indexFileName[ANDOR_FRAME_STORE_MAX_NAME];
+  const AndorFrameIndexHeader *pHeader;
+
+  close();
+  if (strlen(dataFileName) + strlen(ANDOR_FRAME_STORE_INDEX_EXT) >= sizeof(indexFileName)) return -1;
+  strcpy(indexFileName, dataFileName);
+  strcat(indexFileName, ANDOR_FRAME_STORE_INDEX_EXT);
+
+  if (mapFile(dataFileName, &mData) != 0) return -1;
+  if (mapFile(indexFileName, &mIndex) != 0) {
+    close();
+    return -1;
+  }
+  if (mIndex.size < sizeof(AndorFrameIndexHeader)) {
+    close();
+    return -1;
+  }
+  pHeader = (const AndorFrameIndexHeader *)mIndex.pBase;
+  if ((memcmp(pHeader->magic, ANDOR_FRAME_STORE_MAGIC, sizeof(pHeader->magic)) != 0) ||
+      (pHeader->version != ANDOR_FRAME_STORE_VERSION) ||
+      (pHeader->entrySize != sizeof(AndorFrameIndexEntry))) {
+    close();
+    return -1;
+  }
+  mEntries = (const AndorFrameIndexEntry *)(pHeader + 1);
+  // A partially written trailing entry (e.g. after a crash) is ignored
+  mNumFrames = (mIndex.size - sizeof(AndorFrameIndexHeader)) / sizeof(AndorFrameIndexEntry);
+  // Frame numbers go backwards if the array counter was reset while the file was open
+  mSorted = true;
+  for (size_t i=1; i<mNumFrames; i++) {
+    if (mEntries[i].frameNumber < mEntries[i-1].frameNumber) {
+      mSorted = false;
+      break;
+    }
+  }
+  return 0;
+}
+
+void AndorFrameStoreReader::close()
+{
+  unmapFile(&mData);
+  unmapFile(&mIndex);
+  mEntries = 0;
+  mNumFrames = 0;
+  mSorted = true;
+}
+
+const AndorFrameIndexEntry *AndorFrameStoreReader::entry(size_t index) const
+{
+  if (index >= mNumFrames) return 0;
+  return &mEntries[index];
+}
+
+/** Finds the entry for a frame number.
+  * Frame numbers normally increase by one, so the entry is first looked up directly from
+  * its distance to the first frame; a binary search is only needed if frames were dropped.
+  * If the frame numbers are not sorted the index is scanned and the first match returned. */
+const AndorFrameIndexEntry *AndorFrameStoreReader::findFrame(epicsInt64 frameNumber) const
+{
+  size_t low, high;
+
+  if (mNumFrames == 0) return 0;
+  epicsInt64 guess = frameNumber - mEntries[0].frameNumber;
+  if ((guess >= 0) && ((size_t)guess < mNumFrames) &&
+      (mEntries[guess].frameNumber == frameNumber)) {
+    return &mEntries[guess];
+  }
+  if (!mSorted) {
+    for (size_t i=0; i<mNumFrames; i++) {
+      if (mEntries[i].frameNumber == frameNumber) return &mEntries[i];
+    }
+    return 0;
+  }
+  low = 0;
+  high = mNumFrames;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (mEntries[mid].frameNumber < frameNumber) low = mid + 1;
+    else high = mid;
+  }
+  if ((low < mNumFrames) && (mEntries[low].frameNumber == frameNumber)) return &mEntries[low];
+  return 0;
+}
+
+const void *AndorFrameStoreReader::frameData(const AndorFrameIndexEntry *pEntry) const
+{
+  if (!pEntry || !mData.pBase) return 0;
+  if (pEntry->offset + pEntry->size > mData.size) return 0;
+  return (const char *)mData.pBase + pEntry->offset;
+}
+
+bool AndorFrameStoreReader::verify(const AndorFrameIndexEntry *pEntry) const
+{
+  const void *pData = frameData(pEntry);
+  if (!pData) return false;
+  return andorFrameStoreChecksum(pData, pEntry->size) == pEntry->checksum;
+}
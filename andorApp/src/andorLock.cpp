@@ -0,0 +1,88 @@
+/**
+ * Timed locks for the ADAndor driver.
+ */
+
+#include <string.h>
+
+#include "andorLock.h"
+
+/** Constructor.
+  * \param[in] name Name of the lock, used in metrics labels.  The string must remain valid
+  *            for the life of the object.
+  * \param[in] ownMutex If false the lock only keeps statistics for a mutex owned by the
+  *            caller, and lock() and unlock() must not be used. */
+AndorLock::AndorLock(const char *name, bool ownMutex)
+  : mName(name), mMutex(0), mDepth(0)
+{
+  if (ownMutex) mMutex = epicsMutexMustCreate();
+  mStatsLock = epicsMutexMustCreate();
+  memset(&mHoldStart, 0, sizeof(mHoldStart));
+  memset(&mStats, 0, sizeof(mStats));
+}
+
+AndorLock::~AndorLock()
+{
+  if (mMutex) epicsMutexDestroy(mMutex);
+  epicsMutexDestroy(mStatsLock);
+}
+
+void AndorLock::lock()
+{
+  epicsTimeStamp requested;
+
+  epicsTimeGetCurrent(&requested);
+  epicsMutexLock(mMutex);
+  acquired(&requested);
+}
+
+void AndorLock::unlock()
+{
+  releasing();
+  epicsMutexUnlock(mMutex);
+}
+
+/** Records that the calling thread has locked the mutex.
+  * \param[in] pRequested Time at which the thread asked for the mutex. */
+void AndorLock::acquired(const epicsTimeStamp *pRequested)
+{
+  double wait;
+
+  if (mDepth++ > 0) return;
+  epicsTimeGetCurrent(&mHoldStart);
+  wait = epicsTimeDiffInSeconds(&mHoldStart, pRequested);
+  epicsMutexLock(mStatsLock);
+  mStats.waitTotal += wait;
+  if (wait > mStats.waitMax) mStats.waitMax = wait;
+  epicsMutexUnlock(mStatsLock);
+}
+
+/** Records that the calling thread is about to unlock the mutex. */
+void AndorLock::releasing()
+{
+  epicsTimeStamp now;
+  double hold;
+
+  if (--mDepth > 0) return;
+  epicsTimeGetCurrent(&now);
+  hold = epicsTimeDiffInSeconds(&now, &mHoldStart);
+  epicsMutexLock(mStatsLock);
+  mStats.count++;
+  mStats.holdTotal += hold;
+  if (hold > mStats.holdMax) mStats.holdMax = hold;
+  epicsMutexUnlock(mStatsLock);
+}
+
+/** Copies the statistics.  A hold in progress is not included. */
+void AndorLock::getStats(Stats *pStats)
+{
+  epicsMutexLock(mStatsLock);
+  *pStats = mStats;
+  epicsMutexUnlock(mStatsLock);
+}
+
+void AndorLock::resetStats()
+{
+  epicsMutexLock(mStatsLock);
+  memset(&mStats, 0, sizeof(mStats));
+  epicsMutexUnlock(mStatsLock);
+}
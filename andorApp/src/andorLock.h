@@ -0,0 +1,67 @@
+/**
+ * Timed locks for the ADAndor driver.
+ *
+ * An AndorLock is a recursive mutex that keeps statistics of how long its users wait
+ * for it and how long they hold it.  Only the outermost lock and unlock of a thread are
+ * timed, so nested locking by the owner does not count as extra holds.  The statistics
+ * have their own short lock, so they can be read and reset while the mutex itself is
+ * held by another thread, for example during a long SDK call.
+ *
+ * An AndorLock can also time a mutex it does not own, such as the asyn port lock: the
+ * owner of that mutex calls acquired() after locking it and releasing() before
+ * unlocking it.
+ */
+
+#ifndef ANDORLOCK_H
+#define ANDORLOCK_H
+
+#include <epicsTypes.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+
+class AndorLock {
+ public:
+  typedef struct {
+    epicsUInt32 count;     // Number of completed holds
+    double waitTotal;      // Seconds
+    double waitMax;
+    double holdTotal;
+    double holdMax;
+  } Stats;
+
+  /** Locks an AndorLock for the life of the guard. */
+  class Guard {
+   public:
+    explicit Guard(AndorLock *pLock) : mLock(pLock) { mLock->lock(); }
+    ~Guard() { mLock->unlock(); }
+   private:
+    Guard(const Guard &);
+    Guard &operator=(const Guard &);
+    AndorLock *mLock;
+  };
+
+  AndorLock(const char *name, bool ownMutex = true);
+  ~AndorLock();
+  void lock();
+  void unlock();
+  void acquired(const epicsTimeStamp *pRequested);
+  void releasing();
+  void getStats(Stats *pStats);
+  void resetStats();
+  const char *name() const { return mName; }
+
+ private:
+  AndorLock(const AndorLock &);
+  AndorLock &operator=(const AndorLock &);
+
+  const char *mName;
+  epicsMutexId mMutex;          // NULL when timing a mutex owned by someone else
+  // Only changed by the thread holding the mutex
+  int mDepth;
+  epicsTimeStamp mHoldStart;
+  // Protected by mStatsLock
+  epicsMutexId mStatsLock;
+  Stats mStats;
+};
+
+#endif //ANDORLOCK_H
@@ -0,0 +1,384 @@
+/**
+ * Performance metrics for the ADAndor driver, exported in OpenMetrics text format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <epicsThread.h>
+#include <epicsString.h>
+#include <epicsStdio.h>
+#include <epicsAtomic.h>
+
+#include "andorMetrics.h"
+
+static const char *driverName = "andorMetrics";
+
+static const char *typeNames[] = {"counter", "gauge", "summary"};
+
+const double AndorMetrics::HttpTimeout = 2.;
+
+// Time between checks for a stop request while the HTTP server waits for a connection
+static const double HttpPollPeriod = 1.;
+
+AndorMetrics::AndorMetrics(const char *portName)
+  : mNumMetrics(0), mFileName(0), mFilePeriod(0.), mFileRunning(false), mFileStop(false),
+    mHttpSocket(INVALID_SOCKET), mHttpStop(false)
+{
+  mPortName = epicsStrDup(portName);
+  mLock = epicsMutexMustCreate();
+  mFileWakeEvent = epicsEventMustCreate(epicsEventEmpty);
+  mFileDoneEvent = epicsEventMustCreate(epicsEventEmpty);
+  mHttpDoneEvent = epicsEventMustCreate(epicsEventEmpty);
+}
+
+AndorMetrics::~AndorMetrics()
+{
+  stop();
+  epicsEventDestroy(mFileWakeEvent);
+  epicsEventDestroy(mFileDoneEvent);
+  epicsEventDestroy(mHttpDoneEvent);
+  epicsMutexDestroy(mLock);
+  free(mFileName);
+  free(mPortName);
+}
+
+/** Registers a metric.  The strings must remain valid for the life of the object.
+  * \param[in] name Metric family name, without the _total suffix of counters.
+  * \param[in] help Description of the metric family.
+  * \param[in] type TypeCounter, TypeGauge or TypeSummary.
+  * \param[in] label Name of an additional label, or NULL.
+  * \param[in] labelValue Value of the additional label.
+  * \return The metric id, or -1 if the registry is full. */
+int AndorMetrics::add(const char *name, const char *help, int type, const char *label,
+                      const char *labelValue)
+{
+  Metric *pMetric;
+  int id;
+
+  epicsMutexLock(mLock);
+  if (mNumMetrics == MaxMetrics) {
+    epicsMutexUnlock(mLock);
+    printf("%s:add: too many metrics, %s not added\n", driverName, name);
+    return -1;
+  }
+  id = mNumMetrics++;
+  pMetric = &mMetrics[id];
+  pMetric->name = name;
+  pMetric->help = help;
+  pMetric->type = type;
+  pMetric->label = label;
+  pMetric->labelValue = labelValue;
+  pMetric->value = 0.;
+  pMetric->count = 0;
+  pMetric->events = 0;
+  pMetric->sumMicroseconds = 0;
+  epicsMutexUnlock(mLock);
+  return id;
+}
+
+/** Sets the value of a gauge. */
+void AndorMetrics::set(int id, double value)
+{
+  if ((id < 0) || (id >= mNumMetrics)) return;
+  epicsMutexLock(mLock);
+  mMetrics[id].value = value;
+  epicsMutexUnlock(mLock);
+}
+
+/** Adds to the value of a counter.  Takes no lock. */
+void AndorMetrics::increment(int id, size_t delta)
+{
+  if ((id < 0) || (id >= mNumMetrics)) return;
+  epicsAtomicAddSizeT(&mMetrics[id].events, delta);
+}
+
+/** Sets the sum and count of a summary that is accumulated elsewhere. */
+void AndorMetrics::setSummary(int id, double sum, epicsInt64 count)
+{
+  if ((id < 0) || (id >= mNumMetrics)) return;
+  epicsMutexLock(mLock);
+  mMetrics[id].value = sum;
+  mMetrics[id].count = count;
+  epicsMutexUnlock(mLock);
+}
+
+/** Adds an observation to a summary.  Takes no lock.
+  * \param[in] seconds The observed time, which is rounded to microseconds. */
+void AndorMetrics::observe(int id, double seconds)
+{
+  if ((id < 0) || (id >= mNumMetrics)) return;
+  epicsAtomicIncrSizeT(&mMetrics[id].events);
+  if (seconds > 0.) epicsAtomicAddSizeT(&mMetrics[id].sumMicroseconds, (size_t)(seconds * 1.e6 + 0.5));
+}
+
+static void append(char *buffer, size_t size, size_t *pPos, const char *format, ...)
+{
+  va_list args;
+  int n;
+
+  va_start(args, format);
+  n = vsnprintf(buffer + ((*pPos < size) ? *pPos : size), (*pPos < size) ? size - *pPos : 0,
+                format, args);
+  va_end(args);
+  if (n > 0) *pPos += n;
+}
+
+/** Formats all metrics in OpenMetrics text format.
+  * \return The length of the text.  If this is not less than size the text was truncated. */
+size_t AndorMetrics::format(char *buffer, size_t size)
+{
+  const Metric *pMetric;
+  char labels[256];
+  size_t pos = 0;
+  size_t events;
+
+  if (size > 0) buffer[0] = 0;
+  epicsMutexLock(mLock);
+  for (int i=0; i<mNumMetrics; i++) {
+    pMetric = &mMetrics[i];
+    if ((i == 0) || strcmp(pMetric->name, mMetrics[i-1].name)) {
+      append(buffer, size, &pos, "# TYPE %s %s\n", pMetric->name, typeNames[pMetric->type]);
+      append(buffer, size, &pos, "# HELP %s %s\n", pMetric->name, pMetric->help);
+    }
+    if (pMetric->label) {
+      epicsSnprintf(labels, sizeof(labels), "{port=\"%s\",%s=\"%s\"}",
+                    mPortName, pMetric->label, pMetric->labelValue);
+    } else {
+      epicsSnprintf(labels, sizeof(labels), "{port=\"%s\"}", mPortName);
+    }
+    events = epicsAtomicGetSizeT(&pMetric->events);
+    switch (pMetric->type) {
+      case TypeCounter:
+        append(buffer, size, &pos, "%s_total%s %lu\n", pMetric->name, labels,
+               (unsigned long)events);
+        break;
+      case TypeSummary:
+        append(buffer, size, &pos, "%s_count%s %lld\n", pMetric->name, labels,
+               (long long)pMetric->count + (long long)events);
+        append(buffer, size, &pos, "%s_sum%s %.15g\n", pMetric->name, labels,
+               pMetric->value + epicsAtomicGetSizeT(&pMetric->sumMicroseconds) / 1.e6);
+        break;
+      default:
+        append(buffer, size, &pos, "%s%s %.15g\n", pMetric->name, labels, pMetric->value);
+        break;
+    }
+  }
+  epicsMutexUnlock(mLock);
+  append(buffer, size, &pos, "# EOF\n");
+  return pos;
+}
+
+/** Formats all metrics into a buffer allocated with malloc, which the caller frees. */
+char *AndorMetrics::formatAll(size_t *pLength)
+{
+  size_t size = 8192, length;
+  char *buffer;
+
+  while (1) {
+    buffer = (char *)malloc(size);
+    if (!buffer) return NULL;
+    length = format(buffer, size);
+    if (length < size) break;
+    free(buffer);
+    size = length + 1024;
+  }
+  *pLength = length;
+  return buffer;
+}
+
+/** Writes all metrics in OpenMetrics text format. */
+void AndorMetrics::write(FILE *fp)
+{
+  size_t length;
+  char *buffer = formatAll(&length);
+
+  if (!buffer) return;
+  fwrite(buffer, 1, length, fp);
+  free(buffer);
+}
+
+/** Starts a thread that periodically rewrites a file with the metrics, or changes the
+  * file and period of a running thread.
+  * \param[in] fileName Name of the file.  It is written to fileName.tmp and then renamed.
+  * \param[in] period Time between writes in seconds.  0 or less stops the thread. */
+int AndorMetrics::startFile(const char *fileName, double period)
+{
+  if (mFileRunning) {
+    mFileStop = true;
+    epicsEventSignal(mFileWakeEvent);
+    epicsEventMustWait(mFileDoneEvent);
+    mFileRunning = false;
+  }
+  if (period <= 0.) return 0;
+  free(mFileName);
+  mFileName = epicsStrDup(fileName);
+  mFilePeriod = period;
+  mFileStop = false;
+  mFileRunning = true;
+  if (epicsThreadCreate("AndorMetricsFile", epicsThreadPriorityLow,
+                        epicsThreadGetStackSize(epicsThreadStackSmall),
+                        (EPICSTHREADFUNC)fileTaskC, this) == NULL) {
+    printf("%s:startFile: unable to create file thread\n", driverName);
+    mFileRunning = false;
+    return -1;
+  }
+  return 0;
+}
+
+void AndorMetrics::fileTaskC(void *drvPvt)
+{
+  AndorMetrics *pMetrics = (AndorMetrics *)drvPvt;
+
+  pMetrics->fileTask();
+}
+
+void AndorMetrics::fileTask()
+{
+  static const char *functionName = "fileTask";
+  char tempName[512];
+  FILE *fp;
+  bool stop;
+
+  epicsSnprintf(tempName, sizeof(tempName), "%s.tmp", mFileName);
+  do {
+    // Write once more when stopped, so the file holds the final values
+    stop = (epicsEventWaitWithTimeout(mFileWakeEvent, mFilePeriod) == epicsEventWaitOK) && mFileStop;
+    fp = fopen(tempName, "w");
+    if (!fp) {
+      printf("%s:%s: unable to open %s\n", driverName, functionName, tempName);
+      continue;
+    }
+    write(fp);
+    fclose(fp);
+#ifdef _WIN32
+    // rename does not replace an existing file on Windows
+    remove(mFileName);
+#endif
+    if (rename(tempName, mFileName)) {
+      printf("%s:%s: unable to rename %s to %s\n", driverName, functionName, tempName, mFileName);
+    }
+  } while (!stop);
+  epicsEventSignal(mFileDoneEvent);
+}
+
+/** Starts a minimal HTTP server on the loopback interface that returns the metrics for
+  * any GET request, or moves a running server to another port.
+  * \param[in] tcpPort TCP port number.  0 stops the server. */
+int AndorMetrics::startHttp(int tcpPort)
+{
+  static const char *functionName = "startHttp";
+  osiSockAddr addr;
+
+  stopHttp();
+  if (tcpPort <= 0) return 0;
+  if (!osiSockAttach()) {
+    printf("%s:%s: unable to initialize sockets\n", driverName, functionName);
+    return -1;
+  }
+  mHttpSocket = epicsSocketCreate(AF_INET, SOCK_STREAM, 0);
+  if (mHttpSocket == INVALID_SOCKET) {
+    printf("%s:%s: unable to create socket\n", driverName, functionName);
+    return -1;
+  }
+  epicsSocketEnableAddressReuseDuringTimeWaitState(mHttpSocket);
+  memset(&addr, 0, sizeof(addr));
+  addr.ia.sin_family = AF_INET;
+  addr.ia.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.ia.sin_port = htons((unsigned short)tcpPort);
+  if (bind(mHttpSocket, &addr.sa, sizeof(addr.ia)) || listen(mHttpSocket, 5)) {
+    printf("%s:%s: unable to listen on 127.0.0.1:%d\n", driverName, functionName, tcpPort);
+    epicsSocketDestroy(mHttpSocket);
+    mHttpSocket = INVALID_SOCKET;
+    return -1;
+  }
+  mHttpStop = false;
+  if (epicsThreadCreate("AndorMetricsHttp", epicsThreadPriorityLow,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        (EPICSTHREADFUNC)httpTaskC, this) == NULL) {
+    printf("%s:%s: unable to create HTTP thread\n", driverName, functionName);
+    epicsSocketDestroy(mHttpSocket);
+    mHttpSocket = INVALID_SOCKET;
+    return -1;
+  }
+  return 0;
+}
+
+void AndorMetrics::httpTaskC(void *drvPvt)
+{
+  AndorMetrics *pMetrics = (AndorMetrics *)drvPvt;
+
+  pMetrics->httpTask();
+}
+
+/** Waits until a socket can be read, or a connection accepted.
+  * \return True if the socket is readable, false on timeout or error. */
+bool AndorMetrics::waitReadable(SOCKET sock, double timeout)
+{
+  fd_set readSet;
+  struct timeval tv;
+
+  FD_ZERO(&readSet);
+  FD_SET(sock, &readSet);
+  tv.tv_sec = (long)timeout;
+  tv.tv_usec = (long)((timeout - tv.tv_sec) * 1.e6);
+  return select((int)sock + 1, &readSet, NULL, NULL, &tv) > 0;
+}
+
+void AndorMetrics::httpTask()
+{
+  static const char *notAllowed =
+    "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  char request[1024], header[256];
+  char *body;
+  size_t length;
+  SOCKET client;
+  int n;
+
+  while (!mHttpStop) {
+    if (!waitReadable(mHttpSocket, HttpPollPeriod)) continue;
+    client = accept(mHttpSocket, NULL, NULL);
+    if (client == INVALID_SOCKET) continue;
+    // Only the request line matters; the rest of the request is ignored.  A client that
+    // sends nothing is dropped, so it cannot block the server.
+    n = waitReadable(client, HttpTimeout) ? recv(client, request, sizeof(request) - 1, 0) : 0;
+    if (n > 0) {
+      request[n] = 0;
+      if (strncmp(request, "GET ", 4) == 0) {
+        body = formatAll(&length);
+        if (body) {
+          epicsSnprintf(header, sizeof(header),
+                        "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                        "Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)length);
+          send(client, header, strlen(header), 0);
+          send(client, body, length, 0);
+          free(body);
+        }
+      } else {
+        send(client, notAllowed, strlen(notAllowed), 0);
+      }
+    }
+    epicsSocketDestroy(client);
+  }
+  epicsEventSignal(mHttpDoneEvent);
+}
+
+/** Stops the HTTP server and closes its socket. */
+void AndorMetrics::stopHttp()
+{
+  if (mHttpSocket == INVALID_SOCKET) return;
+  mHttpStop = true;
+  epicsEventMustWait(mHttpDoneEvent);
+  epicsSocketDestroy(mHttpSocket);
+  mHttpSocket = INVALID_SOCKET;
+}
+
+/** Stops the file thread after a final write, and the HTTP server. */
+void AndorMetrics::stop()
+{
+  startFile(NULL, 0.);
+  stopHttp();
+}
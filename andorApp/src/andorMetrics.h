@@ -0,0 +1,96 @@
+/**
+ * Performance metrics for the ADAndor driver, exported in OpenMetrics text format.
+ *
+ * Metrics are registered once with a name, help text, type and an optional label, and
+ * are then updated by the driver threads.  Metrics registered consecutively with the
+ * same name form one metric family, for example one summary with a "stage" label for
+ * each processing stage.  Counters and summary observations are updated with atomic
+ * operations, so counting on the hot paths, such as each SDK call, takes no lock.
+ * Summary sums are kept in microseconds.  Counters are size_t, so on 32-bit IOCs a
+ * byte counter wraps at 4 GB, which scrapers treat as a counter reset.  Gauges and
+ * summaries accumulated elsewhere are set under a mutex.  Every sample carries a "port"
+ * label with the asyn port name, so metrics from several cameras can be scraped into one
+ * dashboard.
+ *
+ * The metrics can be exported by the andorCCDMetrics iocsh command, periodically to a
+ * file (written to a temporary file and renamed, so readers never see a partial file),
+ * and by a minimal HTTP server that only listens on the loopback interface.  The server
+ * handles one connection at a time, and drops a client that does not send its request
+ * within HttpTimeout seconds.
+ */
+
+#ifndef ANDORMETRICS_H
+#define ANDORMETRICS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include <epicsTypes.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <osiSock.h>
+
+class AndorMetrics {
+ public:
+  enum {
+    TypeCounter = 0,
+    TypeGauge = 1,
+    TypeSummary = 2
+  };
+  enum {
+    MaxMetrics = 64
+  };
+  static const double HttpTimeout;
+
+  AndorMetrics(const char *portName);
+  ~AndorMetrics();
+  int add(const char *name, const char *help, int type, const char *label = NULL,
+          const char *labelValue = NULL);
+  void set(int id, double value);
+  void increment(int id, size_t delta = 1);
+  void observe(int id, double seconds);
+  void setSummary(int id, double sum, epicsInt64 count);
+  void write(FILE *fp);
+  int startFile(const char *fileName, double period);
+  int startHttp(int tcpPort);
+  void stopHttp();
+  void stop();
+
+ private:
+  typedef struct {
+    const char *name;
+    const char *help;
+    int type;
+    const char *label;
+    const char *labelValue;
+    double value;          // Value of gauges, sum of summaries set with setSummary
+    epicsInt64 count;      // Count of summaries set with setSummary
+    size_t events;         // Counter value, or number of observations of summaries
+    size_t sumMicroseconds;// Sum of the observations of summaries
+  } Metric;
+
+  size_t format(char *buffer, size_t size);
+  char *formatAll(size_t *pLength);
+  static void fileTaskC(void *drvPvt);
+  void fileTask();
+  static void httpTaskC(void *drvPvt);
+  void httpTask();
+  static bool waitReadable(SOCKET sock, double timeout);
+
+  char *mPortName;
+  epicsMutexId mLock;
+  Metric mMetrics[MaxMetrics];
+  int mNumMetrics;
+
+  char *mFileName;
+  double mFilePeriod;
+  bool mFileRunning;
+  bool mFileStop;
+  epicsEventId mFileWakeEvent;
+  epicsEventId mFileDoneEvent;
+  SOCKET mHttpSocket;
+  bool mHttpStop;
+  epicsEventId mHttpDoneEvent;
+};
+
+#endif //ANDORMETRICS_H
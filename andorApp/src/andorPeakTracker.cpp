@@ -0,0 +1,381 @@
+/**
+ * Spectral peak tracking for the ADAndor driver.
+ *
+ * The fits use pixel coordinates relative to the start of the window, so the normal
+ * equations stay well conditioned wherever the window is on the detector.  The fit of a
+ * window is limited to maxIterations iterations and each spectrum only has a few small
+ * windows, so the tracker keeps up with the spectral rate.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "andorPeakTracker.h"
+
+static const char *driverName = "andorPeakTracker";
+
+// FWHM of a Gaussian in units of sigma
+static const double GaussianFWHM = 2.3548200450309493;
+
+AndorPeakTracker::AndorPeakTracker()
+  : mNumWindows(0), mY(0), mMaxY(0), mCalibration(0), mCalibrationSize(0), mHistoryCount(0),
+    mHistoryHead(0)
+{
+  for (int i=0; i<NumResults; i++) {
+    for (int j=0; j<MaxWindows; j++) mLatest[i][j] = 0.;
+  }
+}
+
+AndorPeakTracker::~AndorPeakTracker()
+{
+  free(mY);
+  free(mCalibration);
+}
+
+/** Sets the search windows.
+  * \param[in] spec Comma separated list of windows, each the first and last pixel of the
+  *            window separated by a colon, for example "100:140, 300:360".
+  * \return The number of windows, or -1 if spec is not valid, in which case the windows
+  *         are not changed. */
+int AndorPeakTracker::setWindows(const char *spec)
+{
+  size_t start[MaxWindows], end[MaxWindows];
+  const char *p = spec;
+  char *pEnd;
+  long value;
+  int n = 0;
+
+  while (1) {
+    while ((*p == ' ') || (*p == '\t')) p++;
+    if (*p == 0) break;
+    if (n == MaxWindows) return -1;
+    value = strtol(p, &pEnd, 10);
+    if ((pEnd == p) || (value < 0)) return -1;
+    start[n] = value;
+    p = pEnd;
+    while (*p == ' ') p++;
+    if (*p++ != ':') return -1;
+    value = strtol(p, &pEnd, 10);
+    if ((pEnd == p) || (value < (long)start[n] + MinPixels - 1)) return -1;
+    end[n] = value;
+    n++;
+    p = pEnd;
+    while (*p == ' ') p++;
+    if (*p == ',') p++;
+    else if (*p != 0) return -1;
+  }
+  for (int i=0; i<n; i++) {
+    mWindowStart[i] = start[i];
+    mWindowEnd[i] = end[i];
+  }
+  mNumWindows = n;
+  resetHistory();
+  return n;
+}
+
+/** Sets the wavelength of each pixel.
+  * \param[in] pCalibration Wavelengths, or NULL to report positions in pixels.
+  * \param[in] size Number of pixels.  The calibration is only used for spectra of this width. */
+void AndorPeakTracker::setCalibration(const float *pCalibration, size_t size)
+{
+  free(mCalibration);
+  mCalibration = 0;
+  mCalibrationSize = 0;
+  if (!pCalibration || (size < 2)) return;
+  mCalibration = (float *)malloc(size * sizeof(float));
+  if (!mCalibration) {
+    printf("%s:setCalibration: unable to allocate %lu pixels\n", driverName, (unsigned long)size);
+    return;
+  }
+  memcpy(mCalibration, pCalibration, size * sizeof(float));
+  mCalibrationSize = size;
+}
+
+/** Discards the results of previous spectra. */
+void AndorPeakTracker::resetHistory()
+{
+  mHistoryCount = 0;
+  mHistoryHead = 0;
+}
+
+/** Returns the history of one result of a window, oldest first.  The pointer is valid
+  * until the next call. */
+const epicsFloat64 *AndorPeakTracker::history(int window, int result)
+{
+  const epicsFloat64 *pRing = mHistory[window][result];
+  size_t first = (mHistoryHead + HistoryLength - mHistoryCount) % HistoryLength;
+  size_t n = HistoryLength - first;
+
+  if (n > mHistoryCount) n = mHistoryCount;
+  memcpy(mHistoryOut, pRing + first, n * sizeof(epicsFloat64));
+  memcpy(mHistoryOut + n, pRing, (mHistoryCount - n) * sizeof(epicsFloat64));
+  return mHistoryOut;
+}
+
+template <typename epicsType>
+void AndorPeakTracker::copyWindow(const epicsType *pData, size_t start, size_t n)
+{
+  for (size_t i=0; i<n; i++) mY[i] = (epicsFloat64)pData[start + i];
+}
+
+/** Value of the peak model at x, and optionally its derivatives with respect to the
+  * amplitude, position, width and background. */
+static double model(int mode, const double *p, double x, double *pDeriv)
+{
+  double u = (x - p[1]) / p[2];
+
+  if (mode == AndorPeakTracker::ModeLorentzian) {
+    double l = 1. / (1. + u*u);
+    if (pDeriv) {
+      pDeriv[0] = l;
+      pDeriv[1] = 2. * p[0] * l * l * u / p[2];
+      pDeriv[2] = 2. * p[0] * l * l * u * u / p[2];
+      pDeriv[3] = 1.;
+    }
+    return p[3] + p[0] * l;
+  }
+  double e = exp(-0.5 * u*u);
+  if (pDeriv) {
+    pDeriv[0] = e;
+    pDeriv[1] = p[0] * e * u / p[2];
+    pDeriv[2] = p[0] * e * u * u / p[2];
+    pDeriv[3] = 1.;
+  }
+  return p[3] + p[0] * e;
+}
+
+/** Solves the 4x4 system a x = b by Gaussian elimination.  a and b are overwritten.
+  * \return false if a is singular. */
+static bool solve4(double a[4][4], double b[4], double x[4])
+{
+  for (int col=0; col<4; col++) {
+    int pivot = col;
+    for (int row=col+1; row<4; row++) {
+      if (fabs(a[row][col]) > fabs(a[pivot][col])) pivot = row;
+    }
+    if (fabs(a[pivot][col]) < 1e-300) return false;
+    if (pivot != col) {
+      for (int k=0; k<4; k++) {
+        double t = a[col][k]; a[col][k] = a[pivot][k]; a[pivot][k] = t;
+      }
+      double t = b[col]; b[col] = b[pivot]; b[pivot] = t;
+    }
+    for (int row=col+1; row<4; row++) {
+      double f = a[row][col] / a[col][col];
+      for (int k=col; k<4; k++) a[row][k] -= f * a[col][k];
+      b[row] -= f * b[col];
+    }
+  }
+  for (int row=3; row>=0; row--) {
+    double sum = b[row];
+    for (int k=row+1; k<4; k++) sum -= a[row][k] * x[k];
+    x[row] = sum / a[row][row];
+  }
+  return true;
+}
+
+double AndorPeakTracker::chiSquare(size_t n, int mode, const Peak *pPeak)
+{
+  double p[4] = {pPeak->amplitude, pPeak->position, pPeak->width, pPeak->background};
+  double sum = 0.;
+
+  for (size_t i=0; i<n; i++) {
+    double r = mY[i] - model(mode, p, (double)i, 0);
+    sum += r * r;
+  }
+  return sum;
+}
+
+/** Returns R^2 of the peak model, 1 for a perfect fit. */
+double AndorPeakTracker::quality(size_t n, int mode, const Peak *pPeak)
+{
+  double mean = 0., total = 0.;
+
+  for (size_t i=0; i<n; i++) mean += mY[i];
+  mean /= n;
+  for (size_t i=0; i<n; i++) total += (mY[i] - mean) * (mY[i] - mean);
+  if (total <= 0.) return 0.;
+  return 1. - chiSquare(n, mode, pPeak) / total;
+}
+
+/** Estimates the peak from the centroid and second moment of the pixels above the
+  * background.  The background is the lower of the means of the first two and the
+  * last two pixels.  The width is the sigma of a Gaussian with the same moment. */
+bool AndorPeakTracker::centroid(size_t n, Peak *pPeak)
+{
+  double background, sum = 0., sumX = 0., sumXX = 0., maximum = mY[0];
+
+  background = 0.5 * (mY[0] + mY[1]);
+  if (0.5 * (mY[n-2] + mY[n-1]) < background) background = 0.5 * (mY[n-2] + mY[n-1]);
+  for (size_t i=0; i<n; i++) {
+    double w = mY[i] - background;
+    if (mY[i] > maximum) maximum = mY[i];
+    if (w <= 0.) continue;
+    sum += w;
+    sumX += w * i;
+  }
+  if (sum <= 0.) return false;
+  pPeak->position = sumX / sum;
+  for (size_t i=0; i<n; i++) {
+    double w = mY[i] - background;
+    if (w > 0.) sumXX += w * (i - pPeak->position) * (i - pPeak->position);
+  }
+  pPeak->width = sqrt(sumXX / sum);
+  pPeak->amplitude = maximum - background;
+  pPeak->background = background;
+  return (pPeak->width > 0.);
+}
+
+/** Levenberg-Marquardt least squares fit of the peak model, starting from *pPeak.
+  * \return false if the fit did not give a peak inside the window. */
+bool AndorPeakTracker::fit(size_t n, int mode, int maxIterations, Peak *pPeak)
+{
+  double p[4] = {pPeak->amplitude, pPeak->position, pPeak->width, pPeak->background};
+  double lambda = 1e-3;
+  double chi2 = chiSquare(n, mode, pPeak);
+
+  for (int iteration=0; iteration<maxIterations; iteration++) {
+    double jtj[4][4], jtr[4], d[4];
+    bool improved = false;
+    double trialChi2 = chi2;
+
+    memset(jtj, 0, sizeof(jtj));
+    memset(jtr, 0, sizeof(jtr));
+    for (size_t i=0; i<n; i++) {
+      double r = mY[i] - model(mode, p, (double)i, d);
+      for (int j=0; j<4; j++) {
+        jtr[j] += d[j] * r;
+        for (int k=0; k<=j; k++) jtj[j][k] += d[j] * d[k];
+      }
+    }
+    for (int j=0; j<4; j++) {
+      for (int k=j+1; k<4; k++) jtj[j][k] = jtj[k][j];
+    }
+    while (lambda < 1e10) {
+      double a[4][4], b[4], delta[4];
+      Peak trial;
+      memcpy(a, jtj, sizeof(a));
+      memcpy(b, jtr, sizeof(b));
+      for (int j=0; j<4; j++) a[j][j] *= 1. + lambda;
+      if (!solve4(a, b, delta)) return false;
+      trial.amplitude  = p[0] + delta[0];
+      trial.position   = p[1] + delta[1];
+      trial.width      = p[2] + delta[2];
+      trial.background = p[3] + delta[3];
+      if (trial.width > 0.) {
+        trialChi2 = chiSquare(n, mode, &trial);
+        if (trialChi2 < chi2) {
+          p[0] = trial.amplitude;
+          p[1] = trial.position;
+          p[2] = trial.width;
+          p[3] = trial.background;
+          lambda *= 0.1;
+          improved = true;
+          break;
+        }
+      }
+      lambda *= 10.;
+    }
+    if (!improved) break;
+    bool converged = (chi2 - trialChi2 <= 1e-8 * chi2);
+    chi2 = trialChi2;
+    if (converged) break;
+  }
+  pPeak->amplitude = p[0];
+  pPeak->position = p[1];
+  pPeak->width = p[2];
+  pPeak->background = p[3];
+  return (p[0] > 0.) && (p[2] > 0.) && (p[1] >= -0.5) && (p[1] <= n - 0.5);
+}
+
+/** Converts a pixel position to the calibration units.
+  * \param[out] pDispersion Calibration units per pixel at the position. */
+double AndorPeakTracker::calibrate(double pixel, double *pDispersion)
+{
+  size_t i;
+  double fraction;
+
+  *pDispersion = 1.;
+  if (!mCalibration) return pixel;
+  if (pixel <= 0.) i = 0;
+  else if (pixel >= mCalibrationSize - 1) i = mCalibrationSize - 2;
+  else i = (size_t)pixel;
+  fraction = pixel - i;
+  *pDispersion = fabs((double)mCalibration[i+1] - mCalibration[i]);
+  return mCalibration[i] + fraction * ((double)mCalibration[i+1] - mCalibration[i]);
+}
+
+/** Finds the peak in each window of a spectrum and appends the results to the history.
+  * The results of windows without a peak are NaN.
+  * \param[in] pArray UInt16, UInt32 or Float32 spectrum, a 1-D array or a 2-D array with one row.
+  * \param[in] mode ModeCentroid, ModeGaussian or ModeLorentzian.
+  * \param[in] maxIterations Maximum number of iterations of the least squares fits.
+  * \return The number of windows without a peak, or -1 if the array is not a supported spectrum. */
+int AndorPeakTracker::process(NDArray *pArray, int mode, int maxIterations)
+{
+  size_t sizeX, start, n;
+  int failures = 0;
+  bool calibrated;
+
+  if (mode == ModeOff) return 0;
+  if ((pArray->dataType != NDUInt16) && (pArray->dataType != NDUInt32) &&
+      (pArray->dataType != NDFloat32)) return -1;
+  if ((pArray->ndims > 1) && (pArray->dims[1].size != 1)) return -1;
+  sizeX = pArray->dims[0].size;
+  calibrated = (mCalibrationSize == sizeX);
+  for (int w=0; w<mNumWindows; w++) {
+    size_t length = mWindowEnd[w] - mWindowStart[w] + 1;
+    if (length > mMaxY) {
+      free(mY);
+      mY = (epicsFloat64 *)malloc(length * sizeof(epicsFloat64));
+      mMaxY = mY ? length : 0;
+      if (!mY) {
+        printf("%s:process: unable to allocate %lu pixels\n", driverName, (unsigned long)length);
+        return -1;
+      }
+    }
+  }
+
+  for (int w=0; w<mNumWindows; w++) {
+    Peak peak;
+    double fwhm, dispersion, position;
+    bool found = false;
+    start = mWindowStart[w];
+    n = 0;
+    if (start < sizeX) n = ((mWindowEnd[w] < sizeX) ? mWindowEnd[w] + 1 : sizeX) - start;
+    if (n >= MinPixels) {
+      switch (pArray->dataType) {
+        case NDUInt16: copyWindow((epicsUInt16 *)pArray->pData, start, n); break;
+        case NDUInt32: copyWindow((epicsUInt32 *)pArray->pData, start, n); break;
+        default:       copyWindow((epicsFloat32 *)pArray->pData, start, n); break;
+      }
+      found = centroid(n, &peak);
+      if (found && (mode == ModeLorentzian)) peak.width *= GaussianFWHM / 2.;
+      if (found && (mode != ModeCentroid)) found = fit(n, mode, maxIterations, &peak);
+    }
+    if (found) {
+      fwhm = (mode == ModeLorentzian) ? 2. * peak.width : GaussianFWHM * peak.width;
+      mLatest[ResultQuality][w] = quality(n, (mode == ModeCentroid) ? ModeGaussian : mode, &peak);
+      position = start + peak.position;
+      if (calibrated) {
+        position = calibrate(position, &dispersion);
+        fwhm *= dispersion;
+      }
+      mLatest[ResultPosition][w] = position;
+      mLatest[ResultWidth][w] = fwhm;
+      mLatest[ResultAmplitude][w] = peak.amplitude;
+    } else {
+      for (int r=0; r<NumResults; r++) mLatest[r][w] = NAN;
+      failures++;
+    }
+  }
+
+  for (int w=0; w<mNumWindows; w++) {
+    for (int r=0; r<NumResults; r++) mHistory[w][r][mHistoryHead] = mLatest[r][w];
+  }
+  mHistoryHead = (mHistoryHead + 1) % HistoryLength;
+  if (mHistoryCount < HistoryLength) mHistoryCount++;
+  return failures;
+}
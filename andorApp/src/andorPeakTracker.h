@@ -0,0 +1,88 @@
+/**
+ * Spectral peak tracking for the ADAndor driver.
+ *
+ * Each spectrum is searched in up to MaxWindows pixel windows, and the peak in each
+ * window is described by its position, full width at half maximum, amplitude above the
+ * background and the fit quality (the coefficient of determination R^2 of the peak
+ * model).  The peak is found from the centroid and second moment of the window
+ * (ModeCentroid), or by a Levenberg-Marquardt least squares fit of a Gaussian
+ * (ModeGaussian) or Lorentzian (ModeLorentzian) on a constant background, started from
+ * the centroid.  With a wavelength calibration the position and width are converted
+ * from pixels to the calibration units.
+ *
+ * The results of the last HistoryLength spectra are kept for every window in a ring, which
+ * history() copies out oldest first.
+ */
+
+#ifndef ANDORPEAKTRACKER_H
+#define ANDORPEAKTRACKER_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#include "NDArray.h"
+
+class AndorPeakTracker {
+ public:
+  enum {
+    ModeOff = 0,
+    ModeCentroid = 1,
+    ModeGaussian = 2,
+    ModeLorentzian = 3
+  };
+  enum {
+    ResultPosition = 0,
+    ResultWidth = 1,
+    ResultAmplitude = 2,
+    ResultQuality = 3,
+    NumResults = 4
+  };
+  enum {
+    MaxWindows = 8,
+    HistoryLength = 1024,
+    MinPixels = 5
+  };
+
+  AndorPeakTracker();
+  ~AndorPeakTracker();
+  int setWindows(const char *spec);
+  int numWindows() const { return mNumWindows; }
+  void setCalibration(const float *pCalibration, size_t size);
+  size_t calibrationSize() const { return mCalibrationSize; }
+  int process(NDArray *pArray, int mode, int maxIterations);
+  void resetHistory();
+  const epicsFloat64 *latest(int result) const { return mLatest[result]; }
+  const epicsFloat64 *history(int window, int result);
+  size_t historyCount() const { return mHistoryCount; }
+
+ private:
+  typedef struct {
+    double amplitude;
+    double position;
+    double width;            // sigma for Gaussians, half width for Lorentzians
+    double background;
+  } Peak;
+
+  template <typename epicsType> void copyWindow(const epicsType *pData, size_t start, size_t n);
+  bool centroid(size_t n, Peak *pPeak);
+  bool fit(size_t n, int mode, int maxIterations, Peak *pPeak);
+  double chiSquare(size_t n, int mode, const Peak *pPeak);
+  double quality(size_t n, int mode, const Peak *pPeak);
+  double calibrate(double pixel, double *pDispersion);
+
+  size_t mWindowStart[MaxWindows];
+  size_t mWindowEnd[MaxWindows];     // Last pixel of the window
+  int mNumWindows;
+  epicsFloat64 *mY;                  // Pixels of the current window
+  size_t mMaxY;
+  float *mCalibration;
+  size_t mCalibrationSize;
+  epicsFloat64 mLatest[NumResults][MaxWindows];
+  epicsFloat64 mHistory[MaxWindows][NumResults][HistoryLength];
+  size_t mHistoryCount;
+  size_t mHistoryHead;               // Index of the next result in the ring
+  epicsFloat64 mHistoryOut[HistoryLength];
+};
+
+#endif //ANDORPEAKTRACKER_H
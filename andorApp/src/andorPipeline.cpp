@@ -0,0 +1,629 @@
+/**
+ * In-driver frame processing pipeline for the ADAndor driver.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include <epicsThread.h>
+#include <epicsStdio.h>
+
+#include "andorPipeline.h"
+
+static const char *driverName = "andorPipeline";
+
+// Limits of the frame types the reference stages support
+static const epicsFloat32 MaxUInt16 = 65535.f;
+static const epicsFloat32 MaxUInt32 = 4294967040.f;
+
+template <typename epicsType>
+static void toFloat(const void *pData, epicsFloat32 *pOut, size_t numPixels)
+{
+  const epicsType *pIn = (const epicsType *)pData;
+
+  for (size_t i=0; i<numPixels; i++) pOut[i] = (epicsFloat32)pIn[i];
+}
+
+template <typename epicsType>
+static void subtractReference(void *pData, const epicsFloat32 *pReference, size_t numPixels,
+                              epicsFloat32 minValue, epicsFloat32 maxValue, epicsFloat32 round)
+{
+  epicsType *pPixel = (epicsType *)pData;
+  epicsFloat32 value;
+
+  for (size_t i=0; i<numPixels; i++) {
+    value = (epicsFloat32)pPixel[i] - pReference[i];
+    value = (value < minValue) ? minValue : ((value > maxValue) ? maxValue : value);
+    pPixel[i] = (epicsType)(value + round);
+  }
+}
+
+template <typename epicsType>
+static void multiplyReference(void *pData, const epicsFloat32 *pReference, size_t numPixels,
+                              epicsFloat32 maxValue, epicsFloat32 round)
+{
+  epicsType *pPixel = (epicsType *)pData;
+  epicsFloat32 value;
+
+  for (size_t i=0; i<numPixels; i++) {
+    value = (epicsFloat32)pPixel[i] * pReference[i];
+    value = (value > maxValue) ? maxValue : value;
+    pPixel[i] = (epicsType)(value + round);
+  }
+}
+
+template <typename epicsType>
+static void frameStats(const void *pData, size_t numPixels, double *pMin, double *pMax,
+                       double *pTotal, double *pTotalSquares)
+{
+  const epicsType *pPixel = (const epicsType *)pData;
+  double value, minValue = pPixel[0], maxValue = pPixel[0], total = 0., totalSquares = 0.;
+
+  for (size_t i=0; i<numPixels; i++) {
+    value = pPixel[i];
+    if (value < minValue) minValue = value;
+    if (value > maxValue) maxValue = value;
+    total += value;
+    totalSquares += value * value;
+  }
+  *pMin = minValue;
+  *pMax = maxValue;
+  *pTotal = total;
+  *pTotalSquares = totalSquares;
+}
+
+AndorReferenceStage::AndorReferenceStage()
+  : mCapture(false), mReference(0)
+{
+  mLock = epicsMutexMustCreate();
+}
+
+AndorReferenceStage::~AndorReferenceStage()
+{
+  clear();
+  epicsMutexDestroy(mLock);
+}
+
+/** The next frame submitted to the pipeline with the stage enabled becomes the
+  * reference. */
+void AndorReferenceStage::capture()
+{
+  epicsMutexLock(mLock);
+  mCapture = true;
+  epicsMutexUnlock(mLock);
+}
+
+void AndorReferenceStage::clear()
+{
+  Reference *pOld;
+
+  epicsMutexLock(mLock);
+  pOld = mReference;
+  mReference = 0;
+  epicsMutexUnlock(mLock);
+  if (pOld) release(pOld);
+}
+
+bool AndorReferenceStage::valid()
+{
+  bool valid;
+
+  epicsMutexLock(mLock);
+  valid = (mReference != 0);
+  epicsMutexUnlock(mLock);
+  return valid;
+}
+
+AndorReferenceStage::Reference *AndorReferenceStage::acquire()
+{
+  Reference *pReference;
+
+  epicsMutexLock(mLock);
+  pReference = mReference;
+  if (pReference) pReference->refs++;
+  epicsMutexUnlock(mLock);
+  return pReference;
+}
+
+void AndorReferenceStage::release(Reference *pReference)
+{
+  bool last;
+
+  epicsMutexLock(mLock);
+  last = (--pReference->refs == 0);
+  epicsMutexUnlock(mLock);
+  if (last) {
+    free(pReference->pData);
+    free(pReference);
+  }
+}
+
+/** Takes a capture requested since the last frame was submitted. */
+bool AndorReferenceStage::latch()
+{
+  bool capture;
+
+  epicsMutexLock(mLock);
+  capture = mCapture;
+  mCapture = false;
+  epicsMutexUnlock(mLock);
+  return capture;
+}
+
+/** Makes the frame the reference, then corrects it with it.
+  * \param[in,out] pArray UInt16, UInt32 or Float32 frame.
+  * \return 0 on success, -1 if the frame type is not supported or the reference cannot
+  *         be allocated. */
+int AndorReferenceStage::processLatched(NDArray *pArray)
+{
+  NDArrayInfo arrayInfo;
+  Reference *pReference, *pOld;
+  size_t numPixels;
+
+  if ((pArray->dataType != NDUInt16) && (pArray->dataType != NDUInt32) &&
+      (pArray->dataType != NDFloat32)) return -1;
+  pArray->getInfo(&arrayInfo);
+  numPixels = arrayInfo.nElements;
+  if (numPixels == 0) return -1;
+
+  pReference = (Reference *)calloc(1, sizeof(Reference));
+  if (pReference) pReference->pData = (epicsFloat32 *)malloc(numPixels * sizeof(epicsFloat32));
+  if (!pReference || !pReference->pData) {
+    printf("%s:%s: unable to allocate a reference of %lu pixels\n",
+           driverName, name(), (unsigned long)numPixels);
+    free(pReference);
+    return -1;
+  }
+  pReference->refs = 1;
+  pReference->numPixels = numPixels;
+  makeReference(pArray, pReference->pData, numPixels);
+  epicsMutexLock(mLock);
+  pOld = mReference;
+  mReference = pReference;
+  epicsMutexUnlock(mLock);
+  if (pOld) release(pOld);
+  return process(pArray);
+}
+
+/** Corrects the frame with the current reference.
+  * \param[in,out] pArray UInt16, UInt32 or Float32 frame.
+  * \return 0 on success, -1 if the frame type is not supported, there is no reference,
+  *         or the reference has a different number of pixels. */
+int AndorReferenceStage::process(NDArray *pArray)
+{
+  NDArrayInfo arrayInfo;
+  Reference *pReference;
+  size_t numPixels;
+
+  if ((pArray->dataType != NDUInt16) && (pArray->dataType != NDUInt32) &&
+      (pArray->dataType != NDFloat32)) return -1;
+  pArray->getInfo(&arrayInfo);
+  numPixels = arrayInfo.nElements;
+  if (numPixels == 0) return -1;
+
+  pReference = acquire();
+  if (!pReference) return -1;
+  if (pReference->numPixels != numPixels) {
+    release(pReference);
+    return -1;
+  }
+  correct(pArray, pReference->pData, numPixels);
+  release(pReference);
+  return 0;
+}
+
+void AndorDarkStage::makeReference(const NDArray *pArray, epicsFloat32 *pOut, size_t numPixels)
+{
+  switch (pArray->dataType) {
+    case NDUInt16:  toFloat<epicsUInt16>(pArray->pData, pOut, numPixels); break;
+    case NDUInt32:  toFloat<epicsUInt32>(pArray->pData, pOut, numPixels); break;
+    default:        toFloat<epicsFloat32>(pArray->pData, pOut, numPixels); break;
+  }
+}
+
+void AndorDarkStage::correct(NDArray *pArray, const epicsFloat32 *pReference, size_t numPixels)
+{
+  switch (pArray->dataType) {
+    case NDUInt16:
+      subtractReference<epicsUInt16>(pArray->pData, pReference, numPixels, 0.f, MaxUInt16, 0.5f);
+      break;
+    case NDUInt32:
+      subtractReference<epicsUInt32>(pArray->pData, pReference, numPixels, 0.f, MaxUInt32, 0.5f);
+      break;
+    default:
+      subtractReference<epicsFloat32>(pArray->pData, pReference, numPixels, -FLT_MAX, FLT_MAX, 0.f);
+      break;
+  }
+}
+
+/** The reference is the gain of each pixel, the mean of the flat field divided by the
+  * pixel.  Pixels of the flat field that are 0 or less are not corrected. */
+void AndorFlatStage::makeReference(const NDArray *pArray, epicsFloat32 *pOut, size_t numPixels)
+{
+  double total = 0.;
+  size_t count = 0;
+  epicsFloat32 mean;
+
+  switch (pArray->dataType) {
+    case NDUInt16:  toFloat<epicsUInt16>(pArray->pData, pOut, numPixels); break;
+    case NDUInt32:  toFloat<epicsUInt32>(pArray->pData, pOut, numPixels); break;
+    default:        toFloat<epicsFloat32>(pArray->pData, pOut, numPixels); break;
+  }
+  for (size_t i=0; i<numPixels; i++) {
+    if (pOut[i] > 0.f) {
+      total += pOut[i];
+      count++;
+    }
+  }
+  mean = count ? (epicsFloat32)(total / count) : 1.f;
+  for (size_t i=0; i<numPixels; i++) {
+    pOut[i] = (pOut[i] > 0.f) ? mean / pOut[i] : 1.f;
+  }
+}
+
+void AndorFlatStage::correct(NDArray *pArray, const epicsFloat32 *pReference, size_t numPixels)
+{
+  switch (pArray->dataType) {
+    case NDUInt16:
+      multiplyReference<epicsUInt16>(pArray->pData, pReference, numPixels, MaxUInt16, 0.5f);
+      break;
+    case NDUInt32:
+      multiplyReference<epicsUInt32>(pArray->pData, pReference, numPixels, MaxUInt32, 0.5f);
+      break;
+    default:
+      multiplyReference<epicsFloat32>(pArray->pData, pReference, numPixels, FLT_MAX, 0.f);
+      break;
+  }
+}
+
+/** Adds the statistics of the frame as attributes.
+  * \return 0 on success, -1 if the frame type is not supported or the frame is empty. */
+int AndorStatsStage::process(NDArray *pArray)
+{
+  NDArrayInfo arrayInfo;
+  double minValue, maxValue, total, totalSquares, mean, sigma;
+
+  pArray->getInfo(&arrayInfo);
+  if (arrayInfo.nElements == 0) return -1;
+  switch (pArray->dataType) {
+    case NDUInt16:
+      frameStats<epicsUInt16>(pArray->pData, arrayInfo.nElements, &minValue, &maxValue, &total, &totalSquares);
+      break;
+    case NDUInt32:
+      frameStats<epicsUInt32>(pArray->pData, arrayInfo.nElements, &minValue, &maxValue, &total, &totalSquares);
+      break;
+    case NDFloat32:
+      frameStats<epicsFloat32>(pArray->pData, arrayInfo.nElements, &minValue, &maxValue, &total, &totalSquares);
+      break;
+    default:
+      return -1;
+  }
+  mean = total / arrayInfo.nElements;
+  sigma = totalSquares / arrayInfo.nElements - mean * mean;
+  sigma = (sigma > 0.) ? sqrt(sigma) : 0.;
+  pArray->pAttributeList->add("StatsMin", "Minimum pixel value", NDAttrFloat64, &minValue);
+  pArray->pAttributeList->add("StatsMax", "Maximum pixel value", NDAttrFloat64, &maxValue);
+  pArray->pAttributeList->add("StatsTotal", "Sum of the pixel values", NDAttrFloat64, &total);
+  pArray->pAttributeList->add("StatsMean", "Mean pixel value", NDAttrFloat64, &mean);
+  pArray->pAttributeList->add("StatsSigma", "Standard deviation of the pixel values", NDAttrFloat64, &sigma);
+  return 0;
+}
+
+AndorPipeline::AndorPipeline()
+  : mNumStages(0), mNumWorkers(0), mNumThreads(0), mExiting(false), mNextIn(0), mNextOut(0),
+    mSteals(0)
+{
+  memset(mStages, 0, sizeof(mStages));
+  memset(mEnabled, 0, sizeof(mEnabled));
+  memset(mWorkers, 0, sizeof(mWorkers));
+  memset(mSlots, 0, sizeof(mSlots));
+  memset(mStats, 0, sizeof(mStats));
+  mLock = epicsMutexMustCreate();
+  mStatsLock = epicsMutexMustCreate();
+  mDoneEvent = epicsEventMustCreate(epicsEventEmpty);
+}
+
+AndorPipeline::~AndorPipeline()
+{
+  mExiting = true;
+  for (int i=0; i<mNumWorkers; i++) {
+    epicsEventSignal(mWorkers[i].wakeEvent);
+    epicsEventWait(mWorkers[i].exitEvent);
+    epicsEventDestroy(mWorkers[i].wakeEvent);
+    epicsEventDestroy(mWorkers[i].exitEvent);
+    epicsMutexDestroy(mWorkers[i].queueLock);
+  }
+  for (int i=0; i<MaxFrames; i++) {
+    if ((mSlots[i].state != SlotFree) && mSlots[i].frame.pArray) mSlots[i].frame.pArray->release();
+  }
+  for (int i=0; i<mNumStages; i++) delete mStages[i];
+  epicsEventDestroy(mDoneEvent);
+  epicsMutexDestroy(mStatsLock);
+  epicsMutexDestroy(mLock);
+}
+
+/** Appends a stage.  The pipeline owns the stage and deletes it.  Stages must be added
+  * before any frame is submitted.  The stage is disabled until setEnabled() is called.
+  * \return Index of the stage, or -1 if there are already MaxStages stages. */
+int AndorPipeline::addStage(AndorPipelineStage *pStage)
+{
+  if (mNumStages >= MaxStages) return -1;
+  mStages[mNumStages] = pStage;
+  return mNumStages++;
+}
+
+/** Enables or disables a stage.  The change applies to frames submitted afterwards. */
+void AndorPipeline::setEnabled(int stage, bool enabled)
+{
+  if ((stage < 0) || (stage >= mNumStages)) return;
+  epicsMutexLock(mLock);
+  mEnabled[stage] = enabled;
+  epicsMutexUnlock(mLock);
+}
+
+/** Returns true if any stage is enabled, so frames should go through the pipeline. */
+bool AndorPipeline::active()
+{
+  bool active = false;
+
+  epicsMutexLock(mLock);
+  for (int i=0; i<mNumStages; i++) active = active || mEnabled[i];
+  epicsMutexUnlock(mLock);
+  return active;
+}
+
+/** Sets the number of worker threads frames are queued to, creating threads as needed.
+  * Must only be called while no frames are pending.
+  * \return The number of workers used, less than requested if a thread could not be
+  *         created. */
+int AndorPipeline::setThreads(int numThreads)
+{
+  char name[32];
+
+  if (numThreads < 1) numThreads = 1;
+  if (numThreads > MaxThreads) numThreads = MaxThreads;
+  while (mNumWorkers < numThreads) {
+    Worker *pWorker = &mWorkers[mNumWorkers];
+    pWorker->pOwner = this;
+    pWorker->wakeEvent = epicsEventCreate(epicsEventEmpty);
+    pWorker->exitEvent = epicsEventCreate(epicsEventEmpty);
+    pWorker->queueLock = epicsMutexCreate();
+    epicsSnprintf(name, sizeof(name), "AndorPipeline%d", mNumWorkers);
+    if (!pWorker->wakeEvent || !pWorker->exitEvent || !pWorker->queueLock ||
+        (epicsThreadCreate(name, epicsThreadPriorityMedium,
+                           epicsThreadGetStackSize(epicsThreadStackSmall),
+                           (EPICSTHREADFUNC)workerTaskC, pWorker) == NULL)) {
+      printf("%s:setThreads: unable to create worker %d\n", driverName, mNumWorkers);
+      if (pWorker->wakeEvent) epicsEventDestroy(pWorker->wakeEvent);
+      if (pWorker->exitEvent) epicsEventDestroy(pWorker->exitEvent);
+      if (pWorker->queueLock) epicsMutexDestroy(pWorker->queueLock);
+      memset(pWorker, 0, sizeof(*pWorker));
+      break;
+    }
+    mNumWorkers++;
+  }
+  mNumThreads = (numThreads < mNumWorkers) ? numThreads : mNumWorkers;
+  return mNumThreads;
+}
+
+/** Queues a frame.  The pipeline owns the array until next() returns it.  A frame that a
+  * stage latches is processed by the caller, once the frames submitted before it are
+  * done, so submit() can wait.
+  * \return 0 on success, -1 if MaxFrames frames are pending or there are no workers. */
+int AndorPipeline::submit(const Frame *pFrame)
+{
+  epicsInt64 sequence;
+  Slot *pSlot;
+  Worker *pWorker;
+  bool latched = false, earlierDone;
+
+  if (mNumThreads < 1) return -1;
+  epicsMutexLock(mLock);
+  if (mNextIn - mNextOut >= MaxFrames) {
+    epicsMutexUnlock(mLock);
+    return -1;
+  }
+  sequence = mNextIn++;
+  pSlot = &mSlots[sequence % MaxFrames];
+  pSlot->frame = *pFrame;
+  pSlot->state = SlotQueued;
+  memcpy(pSlot->enabled, mEnabled, sizeof(mEnabled));
+  for (int i=0; i<mNumStages; i++) {
+    pSlot->latched[i] = pSlot->enabled[i] && mStages[i]->latch();
+    latched = latched || pSlot->latched[i];
+  }
+  epicsMutexUnlock(mLock);
+
+  if (latched) {
+    while (1) {
+      epicsMutexLock(mLock);
+      earlierDone = true;
+      for (epicsInt64 s=mNextOut; s<sequence; s++) {
+        if (mSlots[s % MaxFrames].state != SlotDone) earlierDone = false;
+      }
+      epicsMutexUnlock(mLock);
+      if (earlierDone) break;
+      epicsEventMustWait(mDoneEvent);
+    }
+    run(sequence);
+    return 0;
+  }
+
+  pWorker = &mWorkers[sequence % mNumThreads];
+  epicsMutexLock(pWorker->queueLock);
+  pWorker->queue[(pWorker->head + pWorker->count) % MaxFrames] = sequence;
+  pWorker->count++;
+  epicsMutexUnlock(pWorker->queueLock);
+  // Idle workers may steal the frame if its worker is busy
+  for (int i=0; i<mNumThreads; i++) epicsEventSignal(mWorkers[i].wakeEvent);
+  return 0;
+}
+
+/** Returns the next frame in submission order once all its stages have run.
+  * \param[out] pFrame The frame.  The caller owns the array again.
+  * \param[in] timeout Seconds to wait, 0 not to wait, less than 0 to wait until the frame
+  *            is done.
+  * \return true if a frame was returned, false if no frame is pending or the next one was
+  *         not done in time. */
+bool AndorPipeline::next(Frame *pFrame, double timeout)
+{
+  Slot *pSlot;
+  bool pending, waited = false;
+
+  while (1) {
+    epicsMutexLock(mLock);
+    pSlot = &mSlots[mNextOut % MaxFrames];
+    pending = (mNextOut < mNextIn);
+    if (pending && (pSlot->state == SlotDone)) {
+      *pFrame = pSlot->frame;
+      pSlot->state = SlotFree;
+      pSlot->frame.pArray = 0;
+      mNextOut++;
+      epicsMutexUnlock(mLock);
+      return true;
+    }
+    epicsMutexUnlock(mLock);
+    if (!pending || (timeout == 0.) || waited) return false;
+    if (timeout < 0.) {
+      epicsEventMustWait(mDoneEvent);
+    } else {
+      waited = (epicsEventWaitWithTimeout(mDoneEvent, timeout) != epicsEventWaitOK);
+    }
+  }
+}
+
+/** Returns the number of frames submitted and not yet returned. */
+int AndorPipeline::pending()
+{
+  int pending;
+
+  epicsMutexLock(mLock);
+  pending = (int)(mNextIn - mNextOut);
+  epicsMutexUnlock(mLock);
+  return pending;
+}
+
+void AndorPipeline::getStats(int stage, StageStats *pStats)
+{
+  memset(pStats, 0, sizeof(*pStats));
+  if ((stage < 0) || (stage >= mNumStages)) return;
+  epicsMutexLock(mStatsLock);
+  *pStats = mStats[stage];
+  epicsMutexUnlock(mStatsLock);
+}
+
+/** Returns the number of frames processed by a worker other than the one they were
+  * queued to. */
+epicsInt64 AndorPipeline::steals()
+{
+  epicsInt64 steals;
+
+  epicsMutexLock(mStatsLock);
+  steals = mSteals;
+  epicsMutexUnlock(mStatsLock);
+  return steals;
+}
+
+void AndorPipeline::resetStats()
+{
+  epicsMutexLock(mStatsLock);
+  memset(mStats, 0, sizeof(mStats));
+  mSteals = 0;
+  epicsMutexUnlock(mStatsLock);
+}
+
+void AndorPipeline::workerTaskC(void *drvPvt)
+{
+  Worker *pWorker = (Worker *)drvPvt;
+  pWorker->pOwner->workerTask(pWorker);
+}
+
+/** Processes frames until the pipeline is destroyed. */
+void AndorPipeline::workerTask(Worker *pWorker)
+{
+  epicsInt64 sequence;
+
+  while (!mExiting) {
+    if (takeWork(pWorker, &sequence)) {
+      run(sequence);
+    } else {
+      epicsEventMustWait(pWorker->wakeEvent);
+    }
+  }
+  epicsEventSignal(pWorker->exitEvent);
+}
+
+/** Takes the oldest frame queued to a worker.  Called with no locks held. */
+bool AndorPipeline::popOldest(Worker *pWorker, epicsInt64 *pSequence)
+{
+  bool found = false;
+
+  epicsMutexLock(pWorker->queueLock);
+  if (pWorker->count > 0) {
+    *pSequence = pWorker->queue[pWorker->head];
+    pWorker->head = (pWorker->head + 1) % MaxFrames;
+    pWorker->count--;
+    found = true;
+  }
+  epicsMutexUnlock(pWorker->queueLock);
+  return found;
+}
+
+/** Takes a frame from the worker's own queue, or else steals one from the worker with
+  * the longest queue.  The oldest frame is taken in both cases, so the frame next() is
+  * waiting for is not left behind newer ones.  Workers beyond the current number of
+  * threads do not steal. */
+bool AndorPipeline::takeWork(Worker *pWorker, epicsInt64 *pSequence)
+{
+  Worker *pVictim = 0;
+  size_t longest = 0, count;
+
+  if (popOldest(pWorker, pSequence)) return true;
+  if (pWorker - mWorkers >= mNumThreads) return false;
+  for (int i=0; i<mNumThreads; i++) {
+    if (&mWorkers[i] == pWorker) continue;
+    epicsMutexLock(mWorkers[i].queueLock);
+    count = mWorkers[i].count;
+    epicsMutexUnlock(mWorkers[i].queueLock);
+    if (count > longest) {
+      longest = count;
+      pVictim = &mWorkers[i];
+    }
+  }
+  if (!pVictim || !popOldest(pVictim, pSequence)) return false;
+  epicsMutexLock(mStatsLock);
+  mSteals++;
+  epicsMutexUnlock(mStatsLock);
+  return true;
+}
+
+/** Runs the enabled stages on a frame, then marks it done. */
+void AndorPipeline::run(epicsInt64 sequence)
+{
+  Slot *pSlot = &mSlots[sequence % MaxFrames];
+  epicsTimeStamp start, end;
+  double elapsed;
+  int status;
+
+  for (int i=0; i<mNumStages; i++) {
+    if (!pSlot->enabled[i]) continue;
+    epicsTimeGetCurrent(&start);
+    status = pSlot->latched[i] ? mStages[i]->processLatched(pSlot->frame.pArray) :
+                                 mStages[i]->process(pSlot->frame.pArray);
+    epicsTimeGetCurrent(&end);
+    elapsed = epicsTimeDiffInSeconds(&end, &start);
+    epicsMutexLock(mStatsLock);
+    mStats[i].count++;
+    if (status) mStats[i].errors++;
+    mStats[i].total += elapsed;
+    if (elapsed > mStats[i].max) mStats[i].max = elapsed;
+    epicsMutexUnlock(mStatsLock);
+  }
+  epicsMutexLock(mLock);
+  pSlot->state = SlotDone;
+  epicsMutexUnlock(mLock);
+  epicsEventSignal(mDoneEvent);
+}
@@ -0,0 +1,197 @@
+/**
+ * In-driver frame processing pipeline for the ADAndor driver.
+ *
+ * A pipeline is an ordered list of stages that correct or measure a frame in place,
+ * between readout and the array callbacks, so chained corrections need neither a plugin
+ * queue nor a copy of the frame.  Each stage can be enabled separately, and the time it
+ * takes is recorded.  Frames are processed in parallel by a pool of worker threads: each
+ * frame is queued to one worker, and a worker with nothing to do steals the oldest frame
+ * of the busiest other worker.  A frame runs through all of its stages on one worker,
+ * and frames are returned in the order they were submitted.
+ *
+ * Stages are called concurrently for different frames, so they must not keep state that
+ * depends on the frame order.  Order dependent processing, such as averaging, stays in
+ * the driver after the pipeline.
+ */
+
+#ifndef ANDORPIPELINE_H
+#define ANDORPIPELINE_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+
+#include "NDArray.h"
+
+/** A stage of the pipeline. */
+class AndorPipelineStage {
+ public:
+  virtual ~AndorPipelineStage() {}
+  /** Short name, used in metrics labels. */
+  virtual const char *name() const = 0;
+  /** Processes a frame in place.  Called from the worker threads.
+    * \return 0 on success, -1 if the frame was not processed. */
+  virtual int process(NDArray *pArray) = 0;
+  /** Called by submit() for each frame, in submission order.  A stage that returns true
+    * has its processLatched() called for the frame instead of process(), with no other
+    * frame in the pipeline. */
+  virtual bool latch() { return false; }
+  virtual int processLatched(NDArray *pArray) { return process(pArray); }
+};
+
+/**
+ * Base of the stages that correct frames with a reference captured from a frame.  The
+ * first frame submitted after capture() becomes the reference, and is then corrected
+ * with it.  Since that frame is processed alone, the frames submitted before it are
+ * corrected with the old reference and those submitted after it with the new one,
+ * whichever workers they run on.
+ */
+class AndorReferenceStage : public AndorPipelineStage {
+ public:
+  AndorReferenceStage();
+  virtual ~AndorReferenceStage();
+  int process(NDArray *pArray);
+  bool latch();
+  int processLatched(NDArray *pArray);
+  void capture();
+  void clear();
+  bool valid();
+
+ protected:
+  typedef struct {
+    int refs;
+    size_t numPixels;
+    epicsFloat32 *pData;
+  } Reference;
+
+  /** Computes the reference from a frame.  pOut has one element per pixel. */
+  virtual void makeReference(const NDArray *pArray, epicsFloat32 *pOut, size_t numPixels) = 0;
+  /** Corrects a frame with the reference. */
+  virtual void correct(NDArray *pArray, const epicsFloat32 *pReference, size_t numPixels) = 0;
+
+ private:
+  Reference *acquire();
+  void release(Reference *pReference);
+
+  epicsMutexId mLock;
+  bool mCapture;
+  Reference *mReference;
+};
+
+/** Subtracts a dark frame.  Results below zero are clipped for unsigned frames. */
+class AndorDarkStage : public AndorReferenceStage {
+ public:
+  const char *name() const { return "dark"; }
+ protected:
+  void makeReference(const NDArray *pArray, epicsFloat32 *pOut, size_t numPixels);
+  void correct(NDArray *pArray, const epicsFloat32 *pReference, size_t numPixels);
+};
+
+/** Divides by a flat field, normalized to its mean so the mean level is preserved. */
+class AndorFlatStage : public AndorReferenceStage {
+ public:
+  const char *name() const { return "flat"; }
+ protected:
+  void makeReference(const NDArray *pArray, epicsFloat32 *pOut, size_t numPixels);
+  void correct(NDArray *pArray, const epicsFloat32 *pReference, size_t numPixels);
+};
+
+/** Adds the StatsMin, StatsMax, StatsTotal, StatsMean and StatsSigma attributes. */
+class AndorStatsStage : public AndorPipelineStage {
+ public:
+  const char *name() const { return "stats"; }
+  int process(NDArray *pArray);
+};
+
+class AndorPipeline {
+ public:
+  enum {
+    MaxStages = 8,
+    MaxThreads = 16,
+    MaxFrames = 64            // Frames submitted and not yet returned
+  };
+
+  typedef struct {
+    NDArray *pArray;
+    int frameIndex;           // Passed through for the caller
+    int imageCounter;
+    epicsTimeStamp readoutTime;
+  } Frame;
+
+  typedef struct {
+    epicsInt64 count;         // Frames processed by the stage
+    epicsInt64 errors;        // Frames the stage could not process
+    double total;             // Seconds
+    double max;
+  } StageStats;
+
+  AndorPipeline();
+  ~AndorPipeline();
+  int addStage(AndorPipelineStage *pStage);
+  void setEnabled(int stage, bool enabled);
+  bool active();
+  int setThreads(int numThreads);
+  int submit(const Frame *pFrame);
+  bool next(Frame *pFrame, double timeout);
+  int pending();
+  int numStages() const { return mNumStages; }
+  void getStats(int stage, StageStats *pStats);
+  epicsInt64 steals();
+  void resetStats();
+
+ private:
+  enum {
+    SlotFree = 0,
+    SlotQueued = 1,
+    SlotDone = 2
+  };
+
+  typedef struct {
+    AndorPipeline *pOwner;
+    epicsEventId wakeEvent;
+    epicsEventId exitEvent;
+    epicsMutexId queueLock;
+    epicsInt64 queue[MaxFrames];   // Sequence numbers, oldest at head
+    size_t head;
+    size_t count;
+  } Worker;
+
+  typedef struct {
+    Frame frame;
+    int state;
+    bool enabled[MaxStages];       // Stages enabled when the frame was submitted
+    bool latched[MaxStages];       // Stages that latched the frame
+  } Slot;
+
+  static void workerTaskC(void *drvPvt);
+  void workerTask(Worker *pWorker);
+  bool takeWork(Worker *pWorker, epicsInt64 *pSequence);
+  bool popOldest(Worker *pWorker, epicsInt64 *pSequence);
+  void run(epicsInt64 sequence);
+
+  AndorPipelineStage *mStages[MaxStages];
+  bool mEnabled[MaxStages];
+  int mNumStages;
+
+  Worker mWorkers[MaxThreads];
+  int mNumWorkers;                 // Worker threads created
+  int mNumThreads;                 // Workers frames are queued to
+  bool mExiting;
+
+  // Protected by mLock
+  epicsMutexId mLock;
+  Slot mSlots[MaxFrames];
+  epicsInt64 mNextIn;              // Sequence number of the next frame submitted
+  epicsInt64 mNextOut;             // Sequence number of the next frame returned
+  epicsEventId mDoneEvent;
+
+  // Protected by mStatsLock
+  epicsMutexId mStatsLock;
+  StageStats mStats[MaxStages];
+  epicsInt64 mSteals;
+};
+
+#endif //ANDORPIPELINE_H
@@ -0,0 +1,143 @@
+/**
+ * Named acquisition presets for the ADAndor driver.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "andorPresets.h"
+
+AndorPresetStore::AndorPresetStore()
+  : mNumPresets(0)
+{
+}
+
+/** Adds a preset, or replaces the preset with the same name.
+  * \return 0 on success, -1 if the name is empty or there are already MaxPresets presets. */
+int AndorPresetStore::save(const char *name, const Value *values, int numValues)
+{
+  Preset *pPreset = (Preset *)find(name);
+
+  if (!name[0]) return -1;
+  if (!pPreset) {
+    if (mNumPresets == MaxPresets) return -1;
+    pPreset = &mPresets[mNumPresets++];
+  }
+  if (numValues > MaxValues) numValues = MaxValues;
+  memset(pPreset, 0, sizeof(*pPreset));
+  strncpy(pPreset->name, name, NameSize - 1);
+  memcpy(pPreset->values, values, numValues * sizeof(Value));
+  pPreset->numValues = numValues;
+  return 0;
+}
+
+/** Deletes a preset.
+  * \return 0 on success, -1 if there is no preset with the name. */
+int AndorPresetStore::remove(const char *name)
+{
+  const Preset *pPreset = find(name);
+  int index;
+
+  if (!pPreset) return -1;
+  index = (int)(pPreset - mPresets);
+  memmove(&mPresets[index], &mPresets[index+1], (mNumPresets - index - 1) * sizeof(Preset));
+  mNumPresets--;
+  return 0;
+}
+
+const AndorPresetStore::Preset *AndorPresetStore::find(const char *name) const
+{
+  for (int i=0; i<mNumPresets; i++) {
+    if (strncmp(mPresets[i].name, name, NameSize - 1) == 0) return &mPresets[i];
+  }
+  return NULL;
+}
+
+const AndorPresetStore::Value *AndorPresetStore::findValue(const Preset *pPreset, const char *param)
+{
+  for (int i=0; i<pPreset->numValues; i++) {
+    if (strcmp(pPreset->values[i].param, param) == 0) return &pPreset->values[i];
+  }
+  return NULL;
+}
+
+/** Compares a preset value with the current value of a parameter.  Readbacks of times
+  * from the SDK are single precision, so values that differ by less than one part in 10^6
+  * are the same. */
+bool AndorPresetStore::sameValue(double a, double b)
+{
+  double scale = (fabs(a) > fabs(b)) ? fabs(a) : fabs(b);
+
+  return fabs(a - b) <= 1.e-6 * scale;
+}
+
+/** Writes the preset names to a buffer, separated by ", ". */
+void AndorPresetStore::list(char *buffer, size_t size) const
+{
+  size_t len = 0;
+
+  if (size == 0) return;
+  buffer[0] = 0;
+  for (int i=0; i<mNumPresets; i++) {
+    len += snprintf(buffer + len, size - len, "%s%s", i ? ", " : "", mPresets[i].name);
+    if (len >= size) break;
+  }
+}
+
+/** Replaces all presets with those in a file.
+  * \return 0 on success, -1 if the file could not be opened. */
+int AndorPresetStore::read(const char *fileName)
+{
+  FILE *fp = fopen(fileName, "r");
+  Preset *pPreset = NULL;
+  char line[256];
+  char *pEnd, *pEqual;
+
+  if (!fp) return -1;
+  mNumPresets = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    pEnd = line + strlen(line);
+    while ((pEnd > line) && ((pEnd[-1] == '\n') || (pEnd[-1] == '\r') || (pEnd[-1] == ' '))) *--pEnd = 0;
+    if ((line[0] == '#') || (line[0] == 0)) continue;
+    if (line[0] == '[') {
+      pEnd = strchr(line, ']');
+      if (pEnd) *pEnd = 0;
+      pPreset = NULL;
+      if (mNumPresets == MaxPresets) continue;
+      pPreset = &mPresets[mNumPresets++];
+      memset(pPreset, 0, sizeof(*pPreset));
+      strncpy(pPreset->name, line + 1, NameSize - 1);
+      continue;
+    }
+    pEqual = strchr(line, '=');
+    if (!pPreset || !pEqual || (pPreset->numValues == MaxValues)) continue;
+    *pEqual = 0;
+    strncpy(pPreset->values[pPreset->numValues].param, line, NameSize - 1);
+    pPreset->values[pPreset->numValues].value = atof(pEqual + 1);
+    pPreset->numValues++;
+  }
+  fclose(fp);
+  return 0;
+}
+
+/** Writes all presets to a file.
+  * \return 0 on success, -1 on error. */
+int AndorPresetStore::write(const char *fileName) const
+{
+  FILE *fp = fopen(fileName, "w");
+  int status = 0;
+
+  if (!fp) return -1;
+  fprintf(fp, "# ADAndor acquisition presets\n");
+  for (int i=0; i<mNumPresets; i++) {
+    fprintf(fp, "\n[%s]\n", mPresets[i].name);
+    for (int j=0; j<mPresets[i].numValues; j++) {
+      fprintf(fp, "%s=%.17g\n", mPresets[i].values[j].param, mPresets[i].values[j].value);
+    }
+  }
+  if (ferror(fp)) status = -1;
+  if (fclose(fp)) status = -1;
+  return status;
+}
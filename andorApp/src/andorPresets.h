@@ -0,0 +1,54 @@
+/**
+ * Named acquisition presets for the ADAndor driver.
+ *
+ * A preset is a named snapshot of parameter values, keyed by the asyn parameter name
+ * (drvInfo string), so presets stay valid when parameters are added to the driver and can
+ * be kept in a text file.  The driver decides which parameters are snapshotted and how
+ * they are applied; this class only stores, finds and persists them.
+ *
+ * The file format is one section per preset:
+ *   [preset name]
+ *   PARAM_NAME=value
+ */
+
+#ifndef ANDORPRESETS_H
+#define ANDORPRESETS_H
+
+#include <stddef.h>
+
+class AndorPresetStore {
+ public:
+  enum {
+    MaxPresets = 16,
+    MaxValues = 64,
+    NameSize = 40
+  };
+
+  typedef struct {
+    char param[NameSize];
+    double value;
+  } Value;
+
+  typedef struct {
+    char name[NameSize];
+    int numValues;
+    Value values[MaxValues];
+  } Preset;
+
+  AndorPresetStore();
+  int save(const char *name, const Value *values, int numValues);
+  int remove(const char *name);
+  const Preset *find(const char *name) const;
+  static const Value *findValue(const Preset *pPreset, const char *param);
+  static bool sameValue(double a, double b);
+  int numPresets() const { return mNumPresets; }
+  void list(char *buffer, size_t size) const;
+  int read(const char *fileName);
+  int write(const char *fileName) const;
+
+ private:
+  Preset mPresets[MaxPresets];
+  int mNumPresets;
+};
+
+#endif //ANDORPRESETS_H
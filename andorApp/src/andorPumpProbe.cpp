@@ -0,0 +1,189 @@
+/**
+ * Pump-probe processing for the ADAndor driver.
+ *
+ * A mean with a count of 0 holds stale or uninitialised data.  The first update of a mean
+ * assigns the frame instead of applying the running mean, which would keep a NaN or Inf in
+ * the stale data, so the means never need to be cleared.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "andorPumpProbe.h"
+
+static const char *driverName = "andorPumpProbe";
+
+AndorPumpProbe::AndorPumpProbe()
+  : mMode(ModeOff), mSeriesLength(1), mRepeats(0), mPairs(1),
+    mNDims(0), mDataType(NDUInt16), mNElements(0),
+    mMeans(0), mCounts(0), mIndex(0), mCount(0), mOn(0), mOff(0), mOnCount(0), mOffCount(0)
+{
+  memset(mDims, 0, sizeof(mDims));
+}
+
+AndorPumpProbe::~AndorPumpProbe()
+{
+  freeBuffers();
+}
+
+void AndorPumpProbe::freeBuffers()
+{
+  free(mMeans);
+  free(mCounts);
+  free(mOn);
+  free(mOff);
+  mMeans = 0;
+  mCounts = 0;
+  mOn = 0;
+  mOff = 0;
+  mNDims = 0;
+  mNElements = 0;
+  mIndex = 0;
+  mCount = 0;
+  mOnCount = 0;
+  mOffCount = 0;
+}
+
+/** Sets the pump-probe mode.  The means restart if anything changed.
+  * \param[in] mode ModeOff, ModeSeries or ModeDifference.
+  * \param[in] seriesLength Number of frames L in each series for ModeSeries.
+  * \param[in] repeats Number of series M averaged for each output for ModeSeries, 0 to
+  *            output the running mean after every frame.
+  * \param[in] pairs Number of on and off frames N averaged for each output for ModeDifference. */
+void AndorPumpProbe::configure(int mode, int seriesLength, int repeats, int pairs)
+{
+  if (seriesLength < 1) seriesLength = 1;
+  if (repeats < 0) repeats = 0;
+  if (pairs < 1) pairs = 1;
+  if ((mode == mMode) && (seriesLength == mSeriesLength) && (repeats == mRepeats) &&
+      (pairs == mPairs)) return;
+  mMode = mode;
+  mSeriesLength = seriesLength;
+  mRepeats = repeats;
+  mPairs = pairs;
+  freeBuffers();
+}
+
+/** Discards the frames averaged so far. */
+void AndorPumpProbe::reset()
+{
+  if (mCounts) memset(mCounts, 0, mSeriesLength * sizeof(int));
+  mIndex = 0;
+  mCount = 0;
+  mOnCount = 0;
+  mOffCount = 0;
+}
+
+int AndorPumpProbe::allocate(NDArray *pIn, size_t nElements)
+{
+  freeBuffers();
+  if (mMode == ModeSeries) {
+    mMeans = (epicsFloat32 *)malloc(mSeriesLength * nElements * sizeof(epicsFloat32));
+    mCounts = (int *)calloc(mSeriesLength, sizeof(int));
+    if (!mMeans || !mCounts) {
+      printf("%s:allocate: unable to allocate %d frame series of %lu pixels per frame\n",
+             driverName, mSeriesLength, (unsigned long)nElements);
+      freeBuffers();
+      return -1;
+    }
+  } else {
+    mOn = (epicsFloat32 *)malloc(nElements * sizeof(epicsFloat32));
+    mOff = (epicsFloat32 *)malloc(nElements * sizeof(epicsFloat32));
+    if (!mOn || !mOff) {
+      printf("%s:allocate: unable to allocate on and off frames\n", driverName);
+      freeBuffers();
+      return -1;
+    }
+  }
+  mNDims = pIn->ndims;
+  for (int i=0; i<mNDims; i++) mDims[i] = pIn->dims[i].size;
+  mDataType = pIn->dataType;
+  mNElements = nElements;
+  return 0;
+}
+
+template <typename epicsType>
+void AndorPumpProbe::update(const epicsType *pIn, epicsFloat32 *pMean, int count)
+{
+  size_t n = mNElements;
+  epicsFloat32 alpha = 1.0f / count;
+
+  if (count == 1) {
+    for (size_t i=0; i<n; i++) pMean[i] = (epicsFloat32)pIn[i];
+    return;
+  }
+  for (size_t i=0; i<n; i++) {
+    pMean[i] += ((epicsFloat32)pIn[i] - pMean[i]) * alpha;
+  }
+}
+
+/** Adds a frame.
+  * \param[in] pIn UInt16, UInt32 or Float32 frame.  It is not modified or released.
+  * \param[in] pPool Pool from which the output array is allocated.
+  * \param[in] frameIndex Index of the frame in the acquisition, from 1.  For ModeSeries
+  *            frame frameIndex is frame (frameIndex - 1) % L of a series.
+  * \param[in] on For ModeDifference, true if the frame was taken with the pump on.
+  * \return A new NDFloat32 array holding the mean or difference if one is complete,
+  *         otherwise NULL.  It has the attributes of pIn. */
+NDArray *AndorPumpProbe::process(NDArray *pIn, NDArrayPool *pPool, int frameIndex, bool on)
+{
+  NDArrayInfo arrayInfo;
+  NDArray *pOut;
+  size_t dims[ND_ARRAY_MAX_DIMS];
+  epicsFloat32 *pMean;
+  bool sameShape;
+  int count;
+  int i;
+
+  if (mMode == ModeOff) return NULL;
+  if ((pIn->dataType != NDUInt16) && (pIn->dataType != NDUInt32) && (pIn->dataType != NDFloat32)) return NULL;
+  pIn->getInfo(&arrayInfo);
+  sameShape = (mNElements > 0) && (pIn->ndims == mNDims) && (pIn->dataType == mDataType);
+  for (i=0; sameShape && (i<mNDims); i++) {
+    if (pIn->dims[i].size != mDims[i]) sameShape = false;
+  }
+  if (!sameShape) {
+    if (allocate(pIn, arrayInfo.nElements)) return NULL;
+  }
+
+  if (mMode == ModeSeries) {
+    mIndex = ((frameIndex > 0) ? frameIndex - 1 : 0) % mSeriesLength;
+    pMean = mMeans + mIndex * mNElements;
+    count = ++mCounts[mIndex];
+    mCount = count;
+  } else if (on) {
+    pMean = mOn;
+    count = ++mOnCount;
+  } else {
+    pMean = mOff;
+    count = ++mOffCount;
+  }
+  switch (pIn->dataType) {
+    case NDUInt16: update((epicsUInt16 *)pIn->pData, pMean, count); break;
+    case NDUInt32: update((epicsUInt32 *)pIn->pData, pMean, count); break;
+    default:       update((epicsFloat32 *)pIn->pData, pMean, count); break;
+  }
+
+  if (mMode == ModeSeries) {
+    if ((mRepeats > 0) && (count < mRepeats)) return NULL;
+  } else {
+    if ((mOnCount < mPairs) || (mOffCount < mPairs)) return NULL;
+  }
+  for (i=0; i<pIn->ndims; i++) dims[i] = pIn->dims[i].size;
+  pOut = pPool->alloc(pIn->ndims, dims, NDFloat32, 0, NULL);
+  if (!pOut) return NULL;
+  for (i=0; i<pIn->ndims; i++) pOut->dims[i].binning = pIn->dims[i].binning;
+  pIn->pAttributeList->copy(pOut->pAttributeList);
+  if (mMode == ModeSeries) {
+    memcpy(pOut->pData, pMean, mNElements * sizeof(epicsFloat32));
+    // The next series starts a new mean of this frame
+    if (mRepeats > 0) mCounts[mIndex] = 0;
+  } else {
+    epicsFloat32 *pDiff = (epicsFloat32 *)pOut->pData;
+    for (size_t j=0; j<mNElements; j++) pDiff[j] = mOn[j] - mOff[j];
+    mOnCount = 0;
+    mOffCount = 0;
+  }
+  return pOut;
+}
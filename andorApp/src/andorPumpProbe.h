@@ -0,0 +1,73 @@
+/**
+ * Pump-probe processing for the ADAndor driver.
+ *
+ * Two modes replace the raw frames by the result of a pump-probe measurement:
+ *   - Series: a kinetic series of L frames is repeated, and frame k of each series is
+ *     averaged with frame k of the previous series.  The mean of each of the L frames is
+ *     kept, so the repeats can span several acquisitions.  Either the running mean of
+ *     frame k is output after every frame, or the mean of M repeats is output once frame
+ *     k of the M'th series has been added.
+ *   - Difference: frames are taken alternately with the pump on and off.  The on and off
+ *     frames are averaged separately, and when N of each have been seen their difference
+ *     (on - off) is output.  The driver decides which frames are on, from the frame
+ *     parity or from an external gate flag.
+ * The mean of each frame index, and the on and off means, are updated by a running
+ * mean, mean += (frame - mean) / count, in a single pass with no dependencies between
+ * pixels.  The output is always NDFloat32.
+ */
+
+#ifndef ANDORPUMPPROBE_H
+#define ANDORPUMPPROBE_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#include "NDArray.h"
+
+class AndorPumpProbe {
+ public:
+  enum {
+    ModeOff = 0,
+    ModeSeries = 1,
+    ModeDifference = 2
+  };
+
+  AndorPumpProbe();
+  ~AndorPumpProbe();
+  void configure(int mode, int seriesLength, int repeats, int pairs);
+  void reset();
+  NDArray *process(NDArray *pIn, NDArrayPool *pPool, int frameIndex, bool on);
+  int mode() const { return mMode; }
+  int index() const { return mIndex; }
+  int count() const { return mCount; }
+  int onCount() const { return mOnCount; }
+  int offCount() const { return mOffCount; }
+
+ private:
+  int allocate(NDArray *pIn, size_t nElements);
+  void freeBuffers();
+  template <typename epicsType> void update(const epicsType *pIn, epicsFloat32 *pMean, int count);
+
+  int mMode;
+  int mSeriesLength;
+  int mRepeats;
+  int mPairs;
+
+  // Shape of the frames; a change of shape or type restarts the means
+  int mNDims;
+  size_t mDims[ND_ARRAY_MAX_DIMS];
+  NDDataType_t mDataType;
+  size_t mNElements;
+
+  epicsFloat32 *mMeans;     // Series: mean of each of the mSeriesLength frames
+  int *mCounts;             // Series: number of repeats in each mean
+  int mIndex;               // Series: index in the series of the last frame
+  int mCount;               // Series: repeats in the mean of the last frame
+  epicsFloat32 *mOn;        // Difference: mean of the on frames
+  epicsFloat32 *mOff;       // Difference: mean of the off frames
+  int mOnCount;
+  int mOffCount;
+};
+
+#endif //ANDORPUMPPROBE_H
@@ -0,0 +1,233 @@
+/**
+ * Timing event tagging for the ADAndor driver.
+ */
+
+#include <stdio.h>
+#include <math.h>
+
+#include <epicsThread.h>
+
+#include "andorTimingTagger.h"
+#include "andorMetrics.h"
+
+static const char *driverName = "andorTimingTagger";
+
+AndorTimingTagger::AndorTimingTagger()
+  : mHead(0), mCount(0), mNextSequence(0), mSynchronized(false), mOffset(0),
+    mMatched(0), mResyncs(0), mUnmatched(0), mOverflows(0),
+    mMetrics(0), mUnmatchedId(-1), mOverflowsId(-1),
+    mSimPeriod(0.), mSimPulseId(0), mSimRunning(false), mSimStop(false)
+{
+  mLock = epicsMutexMustCreate();
+  mSimWakeEvent = epicsEventMustCreate(epicsEventEmpty);
+  mSimDoneEvent = epicsEventMustCreate(epicsEventEmpty);
+}
+
+AndorTimingTagger::~AndorTimingTagger()
+{
+  stopSimulation();
+  epicsEventDestroy(mSimWakeEvent);
+  epicsEventDestroy(mSimDoneEvent);
+  epicsMutexDestroy(mLock);
+}
+
+/** Adds a timing event.  This can be called from any thread.  If the FIFO is full the
+  * oldest event is discarded.
+  * \param[in] pTriggerTime Time of the trigger.
+  * \param[in] pulseId Pulse ID of the trigger. */
+void AndorTimingTagger::push(const epicsTimeStamp *pTriggerTime, int pulseId)
+{
+  TimingEvent *pEvent;
+
+  epicsMutexLock(mLock);
+  if (mCount == FifoSize) {
+    mHead = (mHead + 1) % FifoSize;
+    mCount--;
+    mOverflows++;
+    if (mMetrics) mMetrics->increment(mOverflowsId);
+  }
+  pEvent = &mFifo[(mHead + mCount) % FifoSize];
+  pEvent->triggerTime = *pTriggerTime;
+  pEvent->pulseId = pulseId;
+  pEvent->sequence = mNextSequence++;
+  mCount++;
+  epicsMutexUnlock(mLock);
+}
+
+/** Discards all events and statistics.  Called at the start of each acquisition. */
+void AndorTimingTagger::reset()
+{
+  epicsMutexLock(mLock);
+  mHead = 0;
+  mCount = 0;
+  mNextSequence = 0;
+  mSynchronized = false;
+  mOffset = 0;
+  mMatched = 0;
+  mResyncs = 0;
+  mUnmatched = 0;
+  mOverflows = 0;
+  epicsMutexUnlock(mLock);
+}
+
+/** Returns the event with a sequence number, or NULL if it is not in the FIFO.  The
+  * sequence numbers in the FIFO are consecutive.  Must be called with mLock held. */
+AndorTimingTagger::TimingEvent *AndorTimingTagger::findSequence(epicsInt64 sequence)
+{
+  epicsInt64 first;
+
+  if (mCount == 0) return NULL;
+  first = mFifo[mHead].sequence;
+  if ((sequence < first) || (sequence >= first + (epicsInt64)mCount)) return NULL;
+  return &mFifo[(mHead + (size_t)(sequence - first)) % FifoSize];
+}
+
+/** Discards the events up to and including the one at a FIFO index.  Triggers arrive in
+  * order, so events older than a matched one cannot match later frames.  Must be called
+  * with mLock held. */
+void AndorTimingTagger::discardBefore(size_t index)
+{
+  size_t n = (index + FifoSize - mHead) % FifoSize + 1;
+
+  mHead = (mHead + n) % FifoSize;
+  mCount -= n;
+}
+
+/** Finds the timing event of a frame.
+  * \param[in] frameIndex Frame number from the camera's frame counter, counting from 1 at
+  *            the start of the acquisition.
+  * \param[in] pReadoutTime Time the frame was read out.
+  * \param[in] delay Expected time from the trigger to the readout, in seconds.
+  * \param[in] tolerance Largest allowed difference from the expected delay, in seconds.
+  * \param[out] pPulseId Pulse ID of the matched event.
+  * \param[out] pError Readout time minus trigger time minus delay of the matched event, in seconds.
+  * \return MatchNone, MatchCounter or MatchResync. */
+int AndorTimingTagger::match(int frameIndex, const epicsTimeStamp *pReadoutTime, double delay,
+                             double tolerance, int *pPulseId, double *pError)
+{
+  TimingEvent *pEvent;
+  double error, bestError = 0.;
+  size_t best = 0;
+  bool found = false;
+  int result;
+
+  epicsMutexLock(mLock);
+  if (mSynchronized) {
+    pEvent = findSequence(frameIndex + mOffset);
+    if (pEvent) {
+      error = epicsTimeDiffInSeconds(pReadoutTime, &pEvent->triggerTime) - delay;
+      if (fabs(error) <= tolerance) {
+        *pPulseId = pEvent->pulseId;
+        *pError = error;
+        discardBefore(pEvent - mFifo);
+        mMatched++;
+        epicsMutexUnlock(mLock);
+        return MatchCounter;
+      }
+    }
+  }
+  // Search the whole FIFO for the event that best fits the expected delay
+  for (size_t i=0; i<mCount; i++) {
+    size_t index = (mHead + i) % FifoSize;
+    error = epicsTimeDiffInSeconds(pReadoutTime, &mFifo[index].triggerTime) - delay;
+    if (!found || (fabs(error) < fabs(bestError))) {
+      best = index;
+      bestError = error;
+      found = true;
+    }
+  }
+  if (found && (fabs(bestError) <= tolerance)) {
+    pEvent = &mFifo[best];
+    // The first synchronization after a reset is not counted as a resync
+    if (mSynchronized) mResyncs++;
+    mSynchronized = true;
+    mOffset = pEvent->sequence - frameIndex;
+    *pPulseId = pEvent->pulseId;
+    *pError = bestError;
+    discardBefore(best);
+    mMatched++;
+    result = MatchResync;
+  } else {
+    mUnmatched++;
+    if (mMetrics) mMetrics->increment(mUnmatchedId);
+    result = MatchNone;
+  }
+  epicsMutexUnlock(mLock);
+  return result;
+}
+
+void AndorTimingTagger::getStats(epicsInt64 *matched, epicsInt64 *resyncs, epicsInt64 *unmatched,
+                                 epicsInt64 *overflows, int *queued)
+{
+  epicsMutexLock(mLock);
+  *matched = mMatched;
+  *resyncs = mResyncs;
+  *unmatched = mUnmatched;
+  *overflows = mOverflows;
+  *queued = (int)mCount;
+  epicsMutexUnlock(mLock);
+}
+
+/** Counts the unmatched frames and discarded events in a set of metrics as well as in the
+  * statistics, which are reset with each acquisition. */
+void AndorTimingTagger::setMetrics(AndorMetrics *pMetrics, int unmatchedId, int overflowsId)
+{
+  epicsMutexLock(mLock);
+  mMetrics = pMetrics;
+  mUnmatchedId = unmatchedId;
+  mOverflowsId = overflowsId;
+  epicsMutexUnlock(mLock);
+}
+
+/** Starts a thread that pushes an event with the current time and an incrementing
+  * pulse ID at a fixed rate, for testing without a timing system.
+  * \param[in] rate Events per second.  0 stops the simulation.
+  * \param[in] firstPulseId Pulse ID of the first event. */
+void AndorTimingTagger::startSimulation(double rate, int firstPulseId)
+{
+  stopSimulation();
+  if (rate <= 0.) return;
+  mSimPeriod = 1. / rate;
+  mSimPulseId = firstPulseId;
+  mSimStop = false;
+  mSimRunning = true;
+  // A stop request that arrived after the previous thread last checked mSimStop leaves
+  // the event signalled
+  epicsEventTryWait(mSimWakeEvent);
+  if (epicsThreadCreate("AndorTimingSim", epicsThreadPriorityMedium,
+                        epicsThreadGetStackSize(epicsThreadStackSmall),
+                        (EPICSTHREADFUNC)simulationTaskC, this) == NULL) {
+    printf("%s:startSimulation: unable to create simulation thread\n", driverName);
+    mSimRunning = false;
+  }
+}
+
+void AndorTimingTagger::stopSimulation()
+{
+  if (!mSimRunning) return;
+  mSimStop = true;
+  epicsEventSignal(mSimWakeEvent);
+  epicsEventMustWait(mSimDoneEvent);
+  mSimRunning = false;
+}
+
+void AndorTimingTagger::simulationTaskC(void *drvPvt)
+{
+  AndorTimingTagger *pTagger = (AndorTimingTagger *)drvPvt;
+
+  pTagger->simulationTask();
+}
+
+void AndorTimingTagger::simulationTask()
+{
+  epicsTimeStamp now;
+
+  // mSimStop is the run flag; the event only cuts the wait short
+  while (!mSimStop) {
+    if (epicsEventWaitWithTimeout(mSimWakeEvent, mSimPeriod) != epicsEventWaitTimeout) continue;
+    if (mSimStop) break;
+    epicsTimeGetCurrent(&now);
+    push(&now, mSimPulseId++);
+  }
+  epicsEventSignal(mSimDoneEvent);
+}
@@ -0,0 +1,88 @@
+/**
+ * Timing event tagging for the ADAndor driver.
+ *
+ * A timing system delivers one event per trigger, holding the trigger time stamp and a
+ * pulse ID.  Events are pushed into a FIFO from any thread: from the driver's
+ * ANDOR_TIMING_EVENT parameter, from the andorCCDTimingEvent() C function or iocsh
+ * command, or from a built-in simulated source.  Each frame is matched to the event of
+ * its trigger.  Once synchronized, frame N of the acquisition is expected to come from
+ * event N plus a fixed offset, as counted by the camera's frame counter, and the match
+ * is confirmed by checking that the frame was read out the expected delay after the
+ * trigger.  If that check fails, the event whose trigger time best fits the expected
+ * delay is used instead and the offset is updated.
+ */
+
+#ifndef ANDORTIMINGTAGGER_H
+#define ANDORTIMINGTAGGER_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+
+class AndorMetrics;
+
+class AndorTimingTagger {
+ public:
+  enum {
+    MatchNone = 0,      // No event fits the frame
+    MatchCounter = 1,   // Event found from the frame counter and confirmed by its time stamp
+    MatchResync = 2     // Event found from its time stamp, the frame counter offset was updated
+  };
+  enum {
+    FifoSize = 4096
+  };
+
+  AndorTimingTagger();
+  ~AndorTimingTagger();
+  void push(const epicsTimeStamp *pTriggerTime, int pulseId);
+  void reset();
+  int match(int frameIndex, const epicsTimeStamp *pReadoutTime, double delay, double tolerance,
+            int *pPulseId, double *pError);
+  void startSimulation(double rate, int firstPulseId);
+  void stopSimulation();
+  void getStats(epicsInt64 *matched, epicsInt64 *resyncs, epicsInt64 *unmatched,
+                epicsInt64 *overflows, int *queued);
+  void setMetrics(AndorMetrics *pMetrics, int unmatchedId, int overflowsId);
+
+ private:
+  typedef struct {
+    epicsTimeStamp triggerTime;
+    int pulseId;
+    epicsInt64 sequence;     // Position of the event in the stream since the last reset
+  } TimingEvent;
+
+  static void simulationTaskC(void *drvPvt);
+  void simulationTask();
+  TimingEvent *findSequence(epicsInt64 sequence);
+  void discardBefore(size_t index);
+
+  epicsMutexId mLock;
+  TimingEvent mFifo[FifoSize];
+  size_t mHead;              // Index of the oldest event
+  size_t mCount;             // Number of events in the FIFO
+  epicsInt64 mNextSequence;
+  bool mSynchronized;
+  epicsInt64 mOffset;        // Event sequence minus frame index
+  epicsInt64 mMatched;
+  epicsInt64 mResyncs;
+  epicsInt64 mUnmatched;
+  epicsInt64 mOverflows;
+
+  // Counters since the IOC started, updated as frames are unmatched and events discarded
+  AndorMetrics *mMetrics;
+  int mUnmatchedId;
+  int mOverflowsId;
+
+  // Simulated event source
+  double mSimPeriod;
+  int mSimPulseId;
+  bool mSimRunning;
+  bool mSimStop;
+  epicsEventId mSimWakeEvent;
+  epicsEventId mSimDoneEvent;
+};
+
+#endif //ANDORTIMINGTAGGER_H
@@ -29,6 +29,8 @@
 
 #include <epicsExport.h>
 
+#include "andorAutofocus.h"
+
 static const char *driverName = "shamrock";
 
 
@@ -44,6 +46,10 @@ static const char *driverName = "shamrock";
 #define SRFlipperMirrorPortString     "SR_FLIPPER_MIRROR_PORT"
 #define SRSlitExistsString            "SR_SLIT_EXISTS"
 #define SRSlitSizeString              "SR_SLIT_SIZE"
+#define SRFocusMirrorExistsString     "SR_FOCUS_MIRROR_EXISTS"
+#define SRFocusMirrorString           "SR_FOCUS_MIRROR"
+#define SRFocusMirrorMaxStepsString   "SR_FOCUS_MIRROR_MAX_STEPS"
+#define SRFocusRecallString           "SR_FOCUS_RECALL"
 
 
 #define MAX_ERROR_MESSAGE_SIZE 100
@@ -85,13 +91,19 @@ protected:
     int SRFlipperMirrorPort_;   /** Flipper Mirror Port          (int32 read/write) */
     int SRSlitExists_;          /** Slit exists                  (int32 read) */
     int SRSlitSize_;            /** Slit width                   (float64 read/write) */
-    #define LAST_SR_PARAM SRSlitSize_
+    int SRFocusMirrorExists_;   /** Focus mirror exists          (int32 read) */
+    int SRFocusMirror_;         /** Focus mirror position        (int32 read/write) */
+    int SRFocusMirrorMaxSteps_; /** Focus mirror maximum position (int32 read) */
+    int SRFocusRecall_;         /** Recall focus on moves        (int32 read/write) */
+    #define LAST_SR_PARAM SRFocusRecall_
 
 
 private:
     /* Local methods to this class */
     inline asynStatus checkError(eATSpectrographReturnCodes status, const char *functionName, const char *shamrockFunction);
     asynStatus getStatus();
+    asynStatus setFocusMirror(int position);
+    asynStatus recallFocus();
 
     /* Data */
     int shamrockId_;
@@ -100,6 +112,7 @@ private:
     float *calibration_;
     char lastError_[MAX_ERROR_MESSAGE_SIZE];
     bool flipperMirrorIsPresent_[MAX_FLIPPER_MIRRORS];
+    bool focusMirrorIsPresent_;
 };
 
 /** Configuration function to configure one spectrograph.
@@ -145,6 +158,8 @@ shamrock::shamrock(const char *portName, int shamrockID, const char *iniPath, in
     int numFlipperStatus;
     int width, height;
     float xSize, ySize;
+    int focusPresent = 0;
+    int focusMaxSteps = 0;
 
     createParam(SRWavelengthString,       asynParamFloat64,   &SRWavelength_);
     createParam(SRMinWavelengthString,    asynParamFloat64,   &SRMinWavelength_);
@@ -157,6 +172,15 @@ shamrock::shamrock(const char *portName, int shamrockID, const char *iniPath, in
     createParam(SRFlipperMirrorExistsString,    asynParamInt32,     &SRFlipperMirrorExists_);
     createParam(SRSlitExistsString,      asynParamInt32,     &SRSlitExists_);
     createParam(SRSlitSizeString,         asynParamFloat64,   &SRSlitSize_);
+    createParam(SRFocusMirrorExistsString,    asynParamInt32,     &SRFocusMirrorExists_);
+    createParam(SRFocusMirrorString,          asynParamInt32,     &SRFocusMirror_);
+    createParam(SRFocusMirrorMaxStepsString,  asynParamInt32,     &SRFocusMirrorMaxSteps_);
+    createParam(SRFocusRecallString,          asynParamInt32,     &SRFocusRecall_);
+    focusMirrorIsPresent_ = false;
+    setIntegerParam(SRFocusMirrorExists_, 0);
+    setIntegerParam(SRFocusMirror_, 0);
+    setIntegerParam(SRFocusMirrorMaxSteps_, 0);
+    setIntegerParam(SRFocusRecall_, 0);
 
     error = ATSpectrographInitialize((char *)iniPath);
 
@@ -238,6 +262,17 @@ shamrock::shamrock(const char *portName, int shamrockID, const char *iniPath, in
         flipperMirrorIsPresent_[i] = (numFlipperStatus== 1); 
         setIntegerParam(i, SRFlipperMirrorExists_, flipperMirrorIsPresent_[i]);
     }
+
+    // Determine if the focus mirror exists, and its range
+    error = ATSpectrographFocusMirrorIsPresent(shamrockId_, &focusPresent);
+    status = checkError(error, functionName, "ATSpectrographFocusMirrorIsPresent");
+    focusMirrorIsPresent_ = (status == asynSuccess) && (focusPresent == 1);
+    if (focusMirrorIsPresent_) {
+        error = ATSpectrographGetFocusMirrorMaxSteps(shamrockId_, &focusMaxSteps);
+        status = checkError(error, functionName, "ATSpectrographGetFocusMirrorMaxSteps");
+    }
+    setIntegerParam(SRFocusMirrorExists_, focusMirrorIsPresent_);
+    setIntegerParam(SRFocusMirrorMaxSteps_, focusMaxSteps);
     
     getStatus();
     
@@ -267,6 +302,7 @@ asynStatus shamrock::getStatus()
     int grating;
     float wavelength;
     float width;
+    int focus;
     int i;
     static const char *functionName = "getStatus";
     eATSpectrographPortPosition port;
@@ -291,6 +327,13 @@ asynStatus shamrock::getStatus()
     if (status) return asynError;
     setDoubleParam(SRWavelength_, wavelength);
 
+    if (focusMirrorIsPresent_) {
+        error = ATSpectrographGetFocusMirror(shamrockId_, &focus);
+        status = checkError(error, functionName, "ATSpectrographGetFocusMirror");
+        if (status) return asynError;
+        setIntegerParam(SRFocusMirror_, focus);
+    }
+
     for (i=0; i<MAX_SLITS; i++) {
         setDoubleParam(i, SRSlitSize_, 0.);
         if (slitIsPresent_[i] == 0) continue;
@@ -319,6 +362,73 @@ asynStatus shamrock::getStatus()
 }
   
 
+/** Moves the focus mirror to a position.  The SDK moves the mirror by a number of steps
+  * relative to the current position, so the move holds the mirror lock of the focus table,
+  * which the camera driver's autofocus also holds.  Refused while the autofocus runs.
+  * \param[in] position Position in steps, from 0 to the maximum number of steps. */
+asynStatus shamrock::setFocusMirror(int position)
+{
+    eATSpectrographReturnCodes error;
+    asynStatus status;
+    AndorFocusTable *pTable;
+    int current;
+    static const char *functionName = "setFocusMirror";
+
+    pTable = AndorFocusTable::device(shamrockId_);
+    if (pTable && pTable->searching()) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: the focus mirror cannot be moved while the autofocus runs\n",
+            driverName, functionName);
+        return asynError;
+    }
+    if (pTable) pTable->lockMirror();
+    error = ATSpectrographGetFocusMirror(shamrockId_, &current);
+    status = checkError(error, functionName, "ATSpectrographGetFocusMirror");
+    if ((status == asynSuccess) && (position != current)) {
+        error = ATSpectrographSetFocusMirror(shamrockId_, position - current);
+        status = checkError(error, functionName, "ATSpectrographSetFocusMirror");
+    }
+    if (pTable) pTable->unlockMirror();
+    return status;
+}
+
+/** Moves the focus mirror to the focus stored for the current grating and wavelength by
+  * the camera driver's autofocus, if SRFocusRecall is enabled and there is one.  Nothing
+  * is recalled while the autofocus runs, since it is moving the mirror. */
+asynStatus shamrock::recallFocus()
+{
+    eATSpectrographReturnCodes error;
+    asynStatus status;
+    AndorFocusTable *pTable;
+    int recall;
+    int grating;
+    float wavelength;
+    int focus;
+    static const char *functionName = "recallFocus";
+
+    getIntegerParam(SRFocusRecall_, &recall);
+    if (!recall || !focusMirrorIsPresent_) return asynSuccess;
+    pTable = AndorFocusTable::device(shamrockId_);
+    if (!pTable) return asynSuccess;
+    if (pTable->searching()) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+            "%s:%s: focus not recalled while the autofocus runs\n",
+            driverName, functionName);
+        return asynSuccess;
+    }
+    error = ATSpectrographGetGrating(shamrockId_, &grating);
+    status = checkError(error, functionName, "ATSpectrographGetGrating");
+    if (status) return asynError;
+    error = ATSpectrographGetWavelength(shamrockId_, &wavelength);
+    status = checkError(error, functionName, "ATSpectrographGetWavelength");
+    if (status) return asynError;
+    if (!pTable->lookup(grating, wavelength, &focus)) return asynSuccess;
+    asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+        "%s:%s: grating=%d, wavelength=%f, focus=%d\n",
+        driverName, functionName, grating, wavelength, focus);
+    return setFocusMirror(focus);
+}
+
 /** Sets an int32 parameter.
   * \param[in] pasynUser asynUser structure that contains the function code in pasynUser->reason. 
   * \param[in] value The value for this parameter 
@@ -342,6 +452,11 @@ asynStatus shamrock::writeInt32( asynUser *pasynUser, epicsInt32 value)
     if (function == SRGrating_) {
         error = ATSpectrographSetGrating(shamrockId_, value);
         status = checkError(error, functionName, "ATSpectrographSetGrating");
+        if (status == asynSuccess) status = recallFocus();
+    }
+
+    else if (function == SRFocusMirror_) {
+        if (focusMirrorIsPresent_) status = setFocusMirror(value);
     }
     
     // Port Information
@@ -385,7 +500,7 @@ asynStatus shamrock::writeFloat64( asynUser *pasynUser, epicsFloat64 value)
     if (function == SRWavelength_) {
         error = ATSpectrographSetWavelength(shamrockId_, (float) value);
         status = checkError(error, functionName, "ATSpectrographSetWavelength");
-    
+        if (status == asynSuccess) status = recallFocus();
     } 
     else if (function == SRSlitSize_) {
         if (slitIsPresent_[addr]) {
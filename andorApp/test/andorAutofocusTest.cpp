@@ -0,0 +1,122 @@
+/**
+ * Unit tests for AndorFocusSearch and AndorFocusTable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorAutofocus.h"
+
+static const char *tableFile = "andorAutofocusTest.txt";
+
+/** Fills a 512 pixel spectrum with two lines whose width grows with the distance from focus. */
+static void fillSpectrum(NDArray *pArray, int position, int focus)
+{
+  epicsFloat32 *pData = (epicsFloat32 *)pArray->pData;
+  double width = 1.0 + fabs((double)(position - focus)) / 40.0;
+
+  for (int i=0; i<512; i++) {
+    pData[i] = (epicsFloat32)(100 + 5000 / width * exp(-0.5 * pow((i - 200) / width, 2)) +
+                             3000 / width * exp(-0.5 * pow((i - 350) / width, 2)));
+  }
+}
+
+MAIN(andorAutofocusTest)
+{
+  NDArrayPool pool;
+  AndorFocusSearch search;
+  AndorFocusTable *pTable, *pCopy;
+  NDArray *pArray;
+  size_t dims[2] = {512, 4};
+  double sharp, wide;
+  int passes, focus;
+  bool found;
+
+  testPlan(21);
+
+  testDiag("Sharpness");
+  pArray = pool.alloc(1, dims, NDFloat32, 0, NULL);
+  fillSpectrum(pArray, 1000, 1000);
+  sharp = AndorFocusSearch::sharpness(pArray);
+  fillSpectrum(pArray, 1200, 1000);
+  wide = AndorFocusSearch::sharpness(pArray);
+  testOk((sharp > 0) && (sharp > 10 * wide), "narrow lines are sharper, %g and %g", sharp, wide);
+  for (int i=0; i<512; i++) ((epicsFloat32 *)pArray->pData)[i] *= 3;
+  testOk(fabs(AndorFocusSearch::sharpness(pArray) - wide) < 1e-6 * wide,
+         "sharpness does not depend on the intensity");
+  pArray->release();
+  pArray = pool.alloc(1, dims, NDUInt16, 0, NULL);
+  for (int i=0; i<512; i++) ((epicsUInt16 *)pArray->pData)[i] = 100;
+  testOk(AndorFocusSearch::sharpness(pArray) == 0, "flat spectrum has no sharpness");
+  pArray->release();
+  // Each row alternates 0 and 2: 511 differences of 2, 512 deviations of 1
+  pArray = pool.alloc(2, dims, NDUInt32, 0, NULL);
+  for (int i=0; i<512*4; i++) ((epicsUInt32 *)pArray->pData)[i] = (i & 1) ? 2 : 0;
+  sharp = AndorFocusSearch::sharpness(pArray);
+  testOk(fabs(sharp - 4. * 511 / 512) < 1e-9, "2-D UInt32 image, sharpness %g", sharp);
+  pArray->release();
+  pArray = pool.alloc(1, dims, NDInt32, 0, NULL);
+  testOk(AndorFocusSearch::sharpness(pArray) == -1, "Int32 is not supported");
+  pArray->release();
+
+  testDiag("Coarse to fine search");
+  testOk(search.start(100, 100, 10, 1) != 0, "empty range is refused");
+  testOk(search.start(0, 4000, 10, 20) != 0, "coarse step smaller than the minimum step is refused");
+  testOk((search.start(0, 4000, 200, 2) == 0) && !search.done() && (search.position() == 0),
+         "search starts at the low end");
+  pArray = pool.alloc(1, dims, NDFloat32, 0, NULL);
+  passes = 0;
+  while (!search.done() && (passes < AndorFocusSearch::MaxSamples)) {
+    fillSpectrum(pArray, search.position(), 1234);
+    search.report(AndorFocusSearch::sharpness(pArray));
+    passes++;
+  }
+  testOk(search.done() && (abs(search.best() - 1234) <= 1), "best position %d, focus at 1234", search.best());
+  testOk(search.samples() == passes, "%d positions measured", passes);
+  testOk(passes < 60, "coarse to fine needs far fewer positions than the 2001 of a full scan");
+  fillSpectrum(pArray, search.best(), 1234);
+  testOk(search.bestSharpness() == AndorFocusSearch::sharpness(pArray),
+         "best sharpness is that of the best position");
+  testOk(search.report(0), "report after the end is ignored");
+
+  // The step is increased to fit a pass into MaxPassPositions
+  search.start(0, 100000, 1, 1);
+  passes = 0;
+  while (!search.done() && (passes < AndorFocusSearch::MaxSamples)) {
+    fillSpectrum(pArray, search.position(), 56789);
+    search.report(AndorFocusSearch::sharpness(pArray));
+    passes++;
+  }
+  testOk(search.done() && (abs(search.best() - 56789) <= 400) && (passes < AndorFocusSearch::MaxSamples),
+         "wide range with a step of 1 ends near focus, %d after %d positions", search.best(), passes);
+  pArray->release();
+
+  testDiag("Focus table");
+  pTable = AndorFocusTable::device(0);
+  testOk(pTable && (pTable == AndorFocusTable::device(0)) && (AndorFocusTable::device(-1) == 0) &&
+         (AndorFocusTable::device(AndorFocusTable::MaxDevices) == 0), "one table per spectrograph");
+  pTable->store(1, 500, 1000);
+  pTable->store(1, 700, 1400);
+  pTable->store(2, 500, 900);
+  pTable->store(1, 500.2, 1010);
+  testOk(pTable->size() == 3, "nearby wavelength replaces an entry, %d entries", pTable->size());
+  focus = -1;
+  found = pTable->lookup(1, 600, &focus);
+  testOk(found && (focus == 1205), "interpolated focus %d", focus);
+  testOk(pTable->lookup(1, 100, &focus) && (focus == 1010) && pTable->lookup(1, 800, &focus) &&
+         (focus == 1400), "nearest entry outside the stored wavelengths");
+  focus = -1;
+  testOk(!pTable->lookup(3, 500, &focus) && (focus == -1), "no entry for another grating");
+  testOk(pTable->write(tableFile) == 0, "table written");
+  pCopy = AndorFocusTable::device(1);
+  pCopy->store(5, 100, 1);
+  testOk((pCopy->read(tableFile) == 0) && (pCopy->size() == 3) && pCopy->lookup(1, 600, &focus) &&
+         (focus == 1205) && pCopy->lookup(2, 500, &focus) && (focus == 900) && !pCopy->lookup(5, 100, &focus),
+         "file replaces the entries of another table");
+  remove(tableFile);
+  return testDone();
+}
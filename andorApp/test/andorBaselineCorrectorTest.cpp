@@ -0,0 +1,90 @@
+/**
+ * Unit tests for AndorBaselineCorrector.
+ */
+
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorBaselineCorrector.h"
+
+static const size_t SizeX = 6;
+static const size_t SizeY = 3;
+
+static void testRowMode()
+{
+  NDArrayPool pool;
+  size_t dims[2] = {SizeX, SizeY};
+  NDArray *pArray = pool.alloc(2, dims, NDUInt16, 0, NULL);
+  epicsUInt16 *pData = (epicsUInt16 *)pArray->pData;
+  AndorBaselineCorrector corrector;
+  int bad = 0;
+
+  testDiag("Row baseline from 2 reference columns on the left");
+  // Reference columns hold 100 + 10*y, the active pixels 150 + x
+  for (size_t y=0; y<SizeY; y++)
+    for (size_t x=0; x<SizeX; x++)
+      pData[y * SizeX + x] = (epicsUInt16)(x < 2 ? 100 + 10 * y : 150 + x);
+  testOk(corrector.process(pArray, AndorBaselineCorrector::ModeRow, 2, AndorBaselineCorrector::SideLeft) == 0,
+         "process");
+  testOk(pArray->dims[0].size == SizeX - 2, "reference columns are removed");
+  testOk(fabs(corrector.baseline() - 110) < 1e-4, "baseline is the mean of the row baselines");
+  for (size_t y=0; y<SizeY; y++)
+    for (size_t x=0; x<SizeX-2; x++)
+      if (pData[y * (SizeX - 2) + x] != 150 + (x + 2) - (100 + 10 * y)) bad++;
+  testOk(bad == 0, "each row has its own baseline subtracted, %d bad pixels", bad);
+
+  testDiag("Integer pixels below the baseline are clipped at 0");
+  dims[0] = 4;
+  dims[1] = 1;
+  pArray->release();
+  pArray = pool.alloc(2, dims, NDUInt16, 0, NULL);
+  pData = (epicsUInt16 *)pArray->pData;
+  pData[0] = 50;
+  pData[1] = 200;
+  pData[2] = 100;
+  pData[3] = 100;
+  testOk(corrector.process(pArray, AndorBaselineCorrector::ModeFrame, 2, AndorBaselineCorrector::SideRight) == 0 &&
+         (pData[0] == 0) && (pData[1] == 100), "clipped at 0");
+  pArray->release();
+}
+
+static void testFrameMode()
+{
+  NDArrayPool pool;
+  size_t dims[2] = {SizeX, SizeY};
+  NDArray *pArray = pool.alloc(2, dims, NDFloat32, 0, NULL);
+  epicsFloat32 *pData = (epicsFloat32 *)pArray->pData;
+  AndorBaselineCorrector corrector;
+  int bad = 0;
+
+  testDiag("Frame baseline from 2 reference columns on the right");
+  // Reference pixels 14..17; the median of all of them is 15.5
+  for (size_t y=0; y<SizeY; y++)
+    for (size_t x=0; x<SizeX; x++)
+      pData[y * SizeX + x] = (epicsFloat32)(x >= 4 ? 10 + x + y : 5);
+  testOk(corrector.process(pArray, AndorBaselineCorrector::ModeFrame, 2, AndorBaselineCorrector::SideRight) == 0,
+         "process");
+  testOk(fabs(corrector.baseline() - 15.5) < 1e-4, "baseline is the median of the reference pixels");
+  for (size_t i=0; i<(SizeX-2)*SizeY; i++)
+    if (fabs(pData[i] + 10.5) > 1e-4) bad++;
+  testOk(bad == 0, "Float32 pixels may go negative, %d bad pixels", bad);
+  testOk(corrector.trendCount() == 1 && fabs(corrector.trend()[0] - 15.5) < 1e-4, "baseline is added to the trend");
+  corrector.resetTrend();
+  testOk(corrector.trendCount() == 0, "resetTrend");
+
+  testOk(corrector.process(pArray, AndorBaselineCorrector::ModeFrame, (int)SizeX, AndorBaselineCorrector::SideLeft) != 0,
+         "no active columns left is an error");
+  testOk(corrector.process(pArray, AndorBaselineCorrector::ModeOff, 2, AndorBaselineCorrector::SideLeft) == 0 &&
+         pArray->dims[0].size == SizeX - 2, "ModeOff leaves the frame alone");
+  pArray->release();
+}
+
+MAIN(andorBaselineCorrectorTest)
+{
+  testPlan(12);
+  testRowMode();
+  testFrameMode();
+  return testDone();
+}
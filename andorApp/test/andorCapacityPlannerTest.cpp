@@ -0,0 +1,71 @@
+/**
+ * Unit tests for AndorCapacityPlanner.
+ */
+
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorCapacityPlanner.h"
+
+static void setInputs(AndorCapacityPlanner::Inputs *pInputs)
+{
+  // 8 MB frames at 10 Hz for 100 s, with 800 MB of memory and 1 TB of disk
+  pInputs->frameBytes = 8e6;
+  pInputs->frameRate = 10;
+  pInputs->plannedLength = 100;
+  pInputs->bufferBytes = 800e6;
+  pInputs->diskRate = 50e6;
+  pInputs->diskFreeBytes = 1e12;
+}
+
+MAIN(andorCapacityPlannerTest)
+{
+  AndorCapacityPlanner::Inputs inputs;
+  AndorCapacityPlanner::Plan plan;
+  double rate, freeBytes;
+
+  testPlan(12);
+
+  testDiag("Disk slower than the camera: memory fills at 30 MB/s");
+  setInputs(&inputs);
+  testOk(AndorCapacityPlanner::plan(&inputs, &plan) == 0, "plan");
+  testOk(fabs(plan.dataRate - 80e6) < 1, "data rate %g", plan.dataRate);
+  testOk((fabs(plan.runLength - 800e6 / 30e6) < 1e-6) &&
+         (plan.bottleneck == AndorCapacityPlanner::BottleneckDiskSpeed) && plan.drops,
+         "run length %g limited by the disk speed", plan.runLength);
+
+  testDiag("Disk faster than the camera: the run ends when the disk is full");
+  inputs.diskRate = 100e6;
+  AndorCapacityPlanner::plan(&inputs, &plan);
+  testOk((fabs(plan.runLength - 1e12 / 80e6) < 1e-6) &&
+         (plan.bottleneck == AndorCapacityPlanner::BottleneckDiskSpace) && !plan.drops,
+         "run length %g limited by the disk space", plan.runLength);
+  inputs.diskFreeBytes = 4e9;
+  AndorCapacityPlanner::plan(&inputs, &plan);
+  testOk((fabs(plan.runLength - 50) < 1e-6) && plan.drops, "small disk drops frames");
+
+  testDiag("Disk slower than the camera and nearly full");
+  inputs.diskRate = 50e6;
+  inputs.diskFreeBytes = 1e9;
+  AndorCapacityPlanner::plan(&inputs, &plan);
+  testOk((fabs(plan.runLength - 20) < 1e-6) && (plan.bottleneck == AndorCapacityPlanner::BottleneckDiskSpace),
+         "disk fills before memory");
+  inputs.diskRate = 0;
+  AndorCapacityPlanner::plan(&inputs, &plan);
+  testOk((fabs(plan.runLength - 10) < 1e-6) && (plan.bottleneck == AndorCapacityPlanner::BottleneckDiskSpeed),
+         "no disk: the run lasts until memory is full");
+
+  inputs.frameRate = 0;
+  testOk((AndorCapacityPlanner::plan(&inputs, &plan) != 0) &&
+         (plan.bottleneck == AndorCapacityPlanner::BottleneckNone), "no frame rate is an error");
+
+  testDiag("Disk measurement");
+  testOk(AndorCapacityPlanner::measureDisk(".", 1024 * 1024, &rate, &freeBytes) == 0, "measure the current directory");
+  testOk(rate > 0, "write rate %g bytes/s", rate);
+  testOk(freeBytes > 0, "free space %g bytes", freeBytes);
+  testOk(AndorCapacityPlanner::measureDisk("/nonexistent/andorCapacityPlannerTest", 1024, &rate, &freeBytes) != 0,
+         "missing directory is an error");
+  return testDone();
+}
@@ -0,0 +1,138 @@
+/**
+ * Unit tests for AndorCommonMode.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorCommonMode.h"
+
+static NDArrayPool pool;
+
+static NDArray *makeFrame(NDDataType_t dataType, size_t sizeX, size_t sizeY)
+{
+  size_t dims[2] = {sizeX, sizeY};
+  NDArray *pArray = pool.alloc(2, dims, dataType, 0, NULL);
+
+  memset(pArray->pData, 0, sizeX * sizeY * ((dataType == NDUInt16) ? 2 : 4));
+  return pArray;
+}
+
+/** Row and column banding, noise and a bright spot on a 500 count background. */
+static void fillLarge(epicsUInt16 *pData, size_t sizeX, size_t sizeY)
+{
+  srand(1);
+  for (size_t y=0; y<sizeY; y++) {
+    for (size_t x=0; x<sizeX; x++) {
+      double value = 500 + 20 * sin(y * 0.1) + ((x % 7 == 0) ? 15 : 0) + (rand() % 7) - 3;
+      if ((x > 100) && (x < 140) && (y > 100) && (y < 140)) value += 5000;
+      pData[y * sizeX + x] = (epicsUInt16)value;
+    }
+  }
+}
+
+/** RMS of the background around 500, outside the bright spot. */
+static double backgroundRMS(const epicsUInt16 *pData, size_t sizeX, size_t sizeY)
+{
+  double sum = 0.;
+  size_t n = 0;
+
+  for (size_t y=0; y<sizeY; y++) {
+    for (size_t x=0; x<sizeX; x++) {
+      if ((x > 90) && (x < 150) && (y > 90) && (y < 150)) continue;
+      double diff = pData[y * sizeX + x] - 500.;
+      sum += diff * diff;
+      n++;
+    }
+  }
+  return sqrt(sum / n);
+}
+
+MAIN(andorCommonModeTest)
+{
+  AndorCommonMode commonMode;
+  NDArray *pArray, *pCopy;
+  epicsFloat32 *pFloat;
+  epicsUInt16 *pData;
+  int bad;
+
+  testPlan(16);
+
+  testDiag("Row offsets with masked pixels");
+  // Rows 0-4 are offset by 0, 2, 4, 6 and 8.  Row 4 has only 2 pixels below the threshold.
+  pArray = makeFrame(NDFloat32, 8, 5);
+  pFloat = (epicsFloat32 *)pArray->pData;
+  for (int y=0; y<5; y++)
+    for (int x=0; x<8; x++) pFloat[y * 8 + x] = (epicsFloat32)(100 + 2 * y);
+  pFloat[3] = 1000;
+  for (int x=2; x<8; x++) pFloat[4 * 8 + x] = 1000;
+  testOk(commonMode.process(pArray, AndorCommonMode::ModeRow, 500, 3, 1) == 0, "ModeRow on Float32");
+  bad = 0;
+  for (int y=0; y<4; y++)
+    for (int x=0; x<8; x++)
+      if ((y * 8 + x != 3) && (pFloat[y * 8 + x] != 103)) bad++;
+  testOk(bad == 0, "rows are moved to the median of the row medians, %d bad pixels", bad);
+  testOk(pFloat[3] == 1003, "pixel above the threshold is corrected but not used, %g", pFloat[3]);
+  testOk((pFloat[4 * 8] == 108) && (pFloat[4 * 8 + 7] == 1000), "row with too few low pixels is not corrected");
+  testOk(fabs(commonMode.rowRMS() - 2) < 1e-6, "row RMS %g", commonMode.rowRMS());
+  pArray->release();
+
+  testDiag("Column offsets");
+  pArray = makeFrame(NDFloat32, 8, 5);
+  pFloat = (epicsFloat32 *)pArray->pData;
+  for (int y=0; y<5; y++)
+    for (int x=0; x<8; x++) pFloat[y * 8 + x] = (epicsFloat32)((x & 1) ? 103 : 100);
+  commonMode.process(pArray, AndorCommonMode::ModeColumn, 0, 1, 1);
+  bad = 0;
+  for (int i=0; i<40; i++)
+    if (pFloat[i] != 101.5f) bad++;
+  testOk(bad == 0, "columns are moved to the median of the column medians, %d bad pixels", bad);
+  testOk((fabs(commonMode.columnRMS() - 1.5) < 1e-6) && (commonMode.rowRMS() == 0),
+         "column RMS %g, no row RMS", commonMode.columnRMS());
+  pArray->release();
+
+  testDiag("Integer rounding and clipping");
+  pArray = makeFrame(NDUInt16, 8, 3);
+  pData = (epicsUInt16 *)pArray->pData;
+  for (int y=0; y<3; y++)
+    for (int x=0; x<8; x++) pData[y * 8 + x] = (epicsUInt16)(100 * y);
+  pData[2 * 8 + 5] = 5;
+  commonMode.process(pArray, AndorCommonMode::ModeRowColumn, 0, 1, 1);
+  testOk((pData[0] == 100) && (pData[8] == 100) && (pData[2 * 8] == 100), "UInt16 rows are corrected");
+  testOk(pData[2 * 8 + 5] == 0, "UInt16 pixels are clipped at 0");
+  pArray->release();
+
+  pArray = makeFrame(NDUInt16, 8, 3);
+  pData = (epicsUInt16 *)pArray->pData;
+  pData[0] = 7;
+  testOk((commonMode.process(pArray, AndorCommonMode::ModeOff, 0, 1, 1) == 0) && (pData[0] == 7),
+         "ModeOff does nothing");
+  pArray->release();
+  pArray = makeFrame(NDInt32, 8, 3);
+  testOk(commonMode.process(pArray, AndorCommonMode::ModeRow, 0, 1, 1) != 0, "Int32 frames are refused");
+  pArray->release();
+
+  testDiag("One thread and 4 threads on a 1024x512 frame");
+  pArray = makeFrame(NDUInt16, 1024, 512);
+  pCopy = makeFrame(NDUInt16, 1024, 512);
+  fillLarge((epicsUInt16 *)pArray->pData, 1024, 512);
+  memcpy(pCopy->pData, pArray->pData, 1024 * 512 * sizeof(epicsUInt16));
+  double before = backgroundRMS((epicsUInt16 *)pArray->pData, 1024, 512);
+  testOk(commonMode.process(pArray, AndorCommonMode::ModeRowColumn, 1000, 16, 1) == 0, "1 thread");
+  double rowRMS = commonMode.rowRMS();
+  double columnRMS = commonMode.columnRMS();
+  double after = backgroundRMS((epicsUInt16 *)pArray->pData, 1024, 512);
+  testOk(after < before / 3, "background RMS %g before and %g after", before, after);
+  testOk(commonMode.process(pCopy, AndorCommonMode::ModeRowColumn, 1000, 16, 4) == 0, "4 threads");
+  testOk(memcmp(pArray->pData, pCopy->pData, 1024 * 512 * sizeof(epicsUInt16)) == 0,
+         "4 threads give the same frame as 1 thread");
+  testOk((commonMode.rowRMS() == rowRMS) && (commonMode.columnRMS() == columnRMS),
+         "4 threads give the same row and column RMS");
+  pArray->release();
+  pCopy->release();
+  return testDone();
+}
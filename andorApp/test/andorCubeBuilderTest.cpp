@@ -0,0 +1,70 @@
+/**
+ * Unit tests for AndorCubeBuilder.
+ */
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorCubeBuilder.h"
+
+static void fillFrame(NDArray *pFrame, int value)
+{
+  for (int i=0; i<6; i++) ((epicsUInt16 *)pFrame->pData)[i] = (epicsUInt16)(value + i);
+}
+
+MAIN(andorCubeBuilderTest)
+{
+  NDArrayPool pool;
+  size_t dims[2] = {3, 2};
+  size_t otherDims[2] = {2, 3};
+  NDArray *pFrame = pool.alloc(2, dims, NDUInt16, 0, NULL);
+  NDArray *pOther = pool.alloc(2, otherDims, NDUInt16, 0, NULL);
+  NDArray *pCube;
+  AndorCubeBuilder builder;
+  epicsUInt16 *pData;
+  int bad = 0;
+
+  testPlan(13);
+  fillFrame(pFrame, 0);
+  testOk(builder.insert(pFrame, 0, 0, &pool) != 0, "a cube needs at least one scan");
+  testOk(builder.insert(pFrame, 0, 3, &pool) == 0, "first frame allocates the cube");
+  pCube = builder.cube();
+  testOk(pCube && (pCube->ndims == 3) && (pCube->dims[0].size == 3) && (pCube->dims[1].size == 2) &&
+         (pCube->dims[2].size == 3) && (pCube->dataType == NDUInt16), "cube is 3x2x3 UInt16");
+  fillFrame(pFrame, 10);
+  builder.insert(pFrame, 1, 3, &pool);
+  testOk((builder.filled() == 2) && (builder.frames() == 2) && !builder.complete(), "2 planes filled");
+
+  // A repeated scan point replaces its plane and does not fill another
+  fillFrame(pFrame, 20);
+  builder.insert(pFrame, 1, 3, &pool);
+  testOk((builder.filled() == 2) && (builder.frames() == 3), "refilled plane is counted once");
+  testOk(builder.insert(pFrame, 3, 3, &pool) != 0, "index past the last scan is refused");
+  testOk(builder.insert(pFrame, -1, 3, &pool) != 0, "negative index is refused");
+  testOk(builder.insert(pOther, 2, 3, &pool) != 0, "frame of another shape is refused");
+  testOk(builder.filled() == 2, "refused frames fill nothing");
+
+  fillFrame(pFrame, 30);
+  builder.insert(pFrame, 2, 3, &pool);
+  testOk(builder.complete(), "complete when every plane is filled");
+
+  pCube = builder.take();
+  testOk(pCube && !builder.cube() && (builder.filled() == 0) && (builder.frames() == 0),
+         "take hands over the cube and starts a new one");
+  pData = (epicsUInt16 *)pCube->pData;
+  for (int plane=0; plane<3; plane++) {
+    int value = (plane == 0) ? 0 : (plane == 1) ? 20 : 30;
+    for (int i=0; i<6; i++)
+      if (pData[plane * 6 + i] != value + i) bad++;
+  }
+  testOk(bad == 0, "each frame is in the plane of its index, %d bad pixels", bad);
+  pCube->release();
+
+  builder.insert(pFrame, 1, 2, &pool);
+  pData = (epicsUInt16 *)builder.cube()->pData;
+  testOk((pData[0] == 0) && (pData[5] == 0) && !builder.complete(), "planes not filled are 0");
+  builder.reset();
+  pFrame->release();
+  pOther->release();
+  return testDone();
+}
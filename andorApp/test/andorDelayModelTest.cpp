@@ -0,0 +1,61 @@
+/**
+ * Unit tests for AndorDelayModel.
+ */
+
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorDelayModel.h"
+
+// Delay of a frame: fixed overhead, the readout time and a per pixel transfer time
+static const double Overhead = 2e-5;
+static const double ReadOutGain = 1.0;
+static const double PixelTime = 4.6e-9;
+static const double Noise = 5e-6;
+
+static double delay(double readOutTime, double numPixels, int sample)
+{
+  return Overhead + ReadOutGain * readOutTime + PixelTime * numPixels + ((sample & 1) ? Noise : -Noise);
+}
+
+MAIN(andorDelayModelTest)
+{
+  AndorDelayModel model;
+  int key1[AndorDelayModel::KeySize] = {1, 1, 1, 1, 0, 0};
+  int key2[AndorDelayModel::KeySize] = {2, 1, 1, 1, 0, 0};
+  int key3[AndorDelayModel::KeySize] = {3, 1, 1, 1, 0, 0};
+  int key4[AndorDelayModel::KeySize] = {4, 1, 1, 1, 0, 0};
+  const double *coef;
+  double mean, stdDev;
+  epicsInt64 numSamples;
+  int i;
+
+  testPlan(12);
+  testOk(model.predict(0.02, 1e5) == 0.02, "with no samples the readout time is the prediction");
+
+  for (i=0; i<50; i++) model.addSample(key1, 0.02, 1e5, delay(0.02, 1e5, i));
+  testOk(model.numSamples() == 50, "numSamples");
+  testOk(fabs(model.predict(0.02, 1e5) - delay(0.02, 1e5, 0) - Noise) < 1e-6,
+         "one configuration predicts its own mean");
+
+  for (i=0; i<50; i++) model.addSample(key2, 0.05, 2e5, delay(0.05, 2e5, i));
+  for (i=0; i<50; i++) model.addSample(key3, 0.2, 4e6, delay(0.2, 4e6, i));
+  coef = model.coefficients();
+  testOk(fabs(coef[0] - Overhead) < 1e-6, "overhead %g", coef[0]);
+  testOk(fabs(coef[1] - ReadOutGain) < 1e-3, "readout gain %g", coef[1]);
+  testOk(fabs(coef[2] - PixelTime) < 1e-11, "pixel time %g", coef[2]);
+  testOk(fabs(model.rmsResidual() - Noise) < 1e-6, "rms residual %g", model.rmsResidual());
+  testOk(fabs(model.predict(0.1, 1e6) - (Overhead + ReadOutGain * 0.1 + PixelTime * 1e6)) < 1e-5,
+         "prediction for an unseen configuration");
+
+  testOk(model.configStats(key2, &mean, &stdDev, &numSamples) && (numSamples == 50) &&
+         (fabs(mean - delay(0.05, 2e5, 0) - Noise) < 1e-9), "configuration mean");
+  testOk(fabs(stdDev - Noise * sqrt(50.0 / 49.0)) < 1e-9, "configuration standard deviation %g", stdDev);
+  testOk(!model.configStats(key4, &mean, &stdDev, &numSamples), "unknown configuration");
+
+  model.reset();
+  testOk((model.numSamples() == 0) && !model.configStats(key1, &mean, &stdDev, &numSamples), "reset");
+  return testDone();
+}
@@ -0,0 +1,83 @@
+/**
+ * Unit tests for AndorEventFinder.
+ */
+
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorEventFinder.h"
+
+static const size_t SizeX = 20;
+static const size_t SizeY = 10;
+static const double Pedestal = 100;
+static const double Threshold = 120;
+
+static void setPixel(NDArray *pArray, size_t x, size_t y, epicsUInt16 value)
+{
+  ((epicsUInt16 *)pArray->pData)[y * SizeX + x] = value;
+}
+
+static bool near(double a, double b)
+{
+  return fabs(a - b) < 1e-4;
+}
+
+MAIN(andorEventFinderTest)
+{
+  NDArrayPool pool;
+  size_t dims[2] = {SizeX, SizeY};
+  NDArray *pArray = pool.alloc(2, dims, NDUInt16, 0, NULL);
+  NDArray *pEvents;
+  AndorEventFinder finder;
+  epicsFloat64 *pOut;
+
+  testPlan(12);
+  for (size_t i=0; i<SizeX*SizeY; i++) ((epicsUInt16 *)pArray->pData)[i] = (epicsUInt16)Pedestal;
+  // Diagonal neighbours belong to the same event
+  setPixel(pArray, 3, 2, 200);
+  setPixel(pArray, 4, 2, 300);
+  setPixel(pArray, 5, 3, 150);
+  // Event touching the edge of the frame
+  setPixel(pArray, 19, 8, 500);
+  setPixel(pArray, 18, 9, 400);
+  // Single pixel event
+  setPixel(pArray, 10, 5, 1000);
+  // U shape whose arms are only joined on a later row
+  setPixel(pArray, 15, 0, 150);
+  setPixel(pArray, 15, 1, 150);
+  setPixel(pArray, 17, 0, 150);
+  setPixel(pArray, 17, 1, 150);
+  setPixel(pArray, 16, 2, 150);
+
+  testOk(finder.find(pArray, Threshold, Pedestal, 1000) == 4, "4 events found");
+  pEvents = finder.makeEventArray(&pool, 42);
+  testOk(pEvents && (pEvents->ndims == 1) && (pEvents->dataType == NDFloat64) &&
+         (pEvents->dims[0].size == 4 * AndorEventFinder::NumFields), "event array holds 4 events");
+  if (!pEvents) testAbort("no event array");
+  pOut = (epicsFloat64 *)pEvents->pData;
+  // x and y of the brightest pixel, sum above the pedestal, frame, centroid x and y, pixels
+  testOk(near(pOut[0], 15) && near(pOut[1], 0) && near(pOut[2], 250) && near(pOut[3], 42) &&
+         near(pOut[4], 16) && near(pOut[5], 0.8) && near(pOut[6], 5), "U shape is one event");
+  pOut += AndorEventFinder::NumFields;
+  testOk(near(pOut[0], 4) && near(pOut[1], 2) && near(pOut[2], 350) &&
+         near(pOut[4], 27.0 / 7.0) && near(pOut[5], 15.0 / 7.0) && near(pOut[6], 3),
+         "diagonal pixels are one event");
+  pOut += AndorEventFinder::NumFields;
+  testOk(near(pOut[0], 10) && near(pOut[1], 5) && near(pOut[2], 900) &&
+         near(pOut[4], 10) && near(pOut[5], 5) && near(pOut[6], 1), "single pixel event");
+  pOut += AndorEventFinder::NumFields;
+  testOk(near(pOut[0], 19) && near(pOut[1], 8) && near(pOut[2], 700) && near(pOut[6], 2),
+         "event at the edge of the frame");
+  pEvents->release();
+
+  testOk(finder.find(pArray, Threshold, Pedestal, 1000) == 4, "repeated search gives the same events");
+  testOk(finder.numEvents() == 4, "numEvents");
+  testOk(finder.find(pArray, Threshold, Pedestal, 5) < 0, "too many hits is an error");
+  testOk(finder.makeEventArray(&pool, 43) == NULL, "no event array after an error");
+  testOk(finder.find(pArray, Threshold, Pedestal, 1000) == 4, "recovers after too many hits");
+  testOk(finder.find(pArray, 2000, Pedestal, 1000) == 0, "no events above a high threshold");
+  pArray->release();
+  return testDone();
+}
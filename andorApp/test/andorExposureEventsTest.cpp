@@ -0,0 +1,120 @@
+/**
+ * Unit tests for AndorExposureEvents.
+ */
+
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorExposureEvents.h"
+
+static epicsTimeStamp startTime = {1000000, 0};
+
+static epicsTimeStamp at(double seconds)
+{
+  epicsTimeStamp stamp = startTime;
+  epicsTimeAddSeconds(&stamp, seconds);
+  return stamp;
+}
+
+/** Samples one exposure from start to end, with a sample on each side of both edges. */
+static void expose(AndorExposureEvents *pEvents, double start, double end)
+{
+  epicsTimeStamp time;
+
+  time = at(start - 0.001);
+  pEvents->sample(false, &time);
+  time = at(start);
+  pEvents->sample(true, &time);
+  time = at(end);
+  pEvents->sample(false, &time);
+}
+
+static bool isAt(const epicsTimeStamp *pTime, double seconds)
+{
+  epicsTimeStamp expected = at(seconds);
+  return fabs(epicsTimeDiffInSeconds(pTime, &expected)) < 1e-9;
+}
+
+MAIN(andorExposureEventsTest)
+{
+  AndorExposureEvents events;
+  AndorExposureEvents::Exposure exposure;
+  epicsTimeStamp time, readout;
+  epicsInt64 starts, ends, unmatched;
+  int edge, matched, bad;
+
+  testPlan(17);
+
+  testDiag("Edges");
+  time = at(0);
+  testOk(events.sample(false, &time) == AndorExposureEvents::EdgeNone, "not exposing is no edge");
+  time = at(0.001);
+  testOk(events.sample(true, &time) == AndorExposureEvents::EdgeStart, "start of exposure");
+  time = at(0.002);
+  testOk(events.sample(true, &time) == AndorExposureEvents::EdgeNone, "still exposing is no edge");
+  time = at(0.010);
+  testOk(events.sample(false, &time) == AndorExposureEvents::EdgeEnd, "end of exposure");
+  time = at(0.011);
+  edge = events.sample(false, &time);
+  events.getStats(&starts, &ends, &unmatched);
+  testOk((edge == AndorExposureEvents::EdgeNone) && (starts == 1) && (ends == 1),
+         "1 start and 1 end counted");
+
+  testDiag("Matching");
+  readout = at(0.012);
+  matched = events.match(1, &readout, &exposure);
+  testOk((matched == 1) && isAt(&exposure.start, 0.001) && isAt(&exposure.end, 0.010),
+         "frame takes the exposure that ended before its readout");
+  matched = events.match(1, &readout, &exposure);
+  events.getStats(&starts, &ends, &unmatched);
+  testOk((matched == 0) && (unmatched == 1), "exposure is matched only once, the next frame is unmatched");
+
+  // Two exposures per frame, and the exposure of the next frame ends after the readout
+  expose(&events, 0.100, 0.110);
+  expose(&events, 0.120, 0.130);
+  expose(&events, 0.140, 0.150);
+  readout = at(0.135);
+  matched = events.match(2, &readout, &exposure);
+  testOk((matched == 2) && isAt(&exposure.start, 0.100) && isAt(&exposure.end, 0.130),
+         "2 exposures per frame, start of the first and end of the second");
+  readout = at(0.145);
+  testOk(events.match(2, &readout, &exposure) == 0, "exposure that ended after the readout is not matched");
+  readout = at(0.160);
+  matched = events.match(2, &readout, &exposure);
+  testOk((matched == 1) && isAt(&exposure.start, 0.140) && isAt(&exposure.end, 0.150),
+         "frame with a missed exposure takes the one that was seen");
+  events.getStats(&starts, &ends, &unmatched);
+  testOk((starts == 4) && (ends == 4) && (unmatched == 2), "4 starts, 4 ends and 2 unmatched frames");
+
+  testDiag("Reset");
+  expose(&events, 0.200, 0.210);
+  time = at(0.220);
+  events.sample(true, &time);
+  events.reset();
+  events.getStats(&starts, &ends, &unmatched);
+  testOk((starts == 0) && (ends == 0) && (unmatched == 0), "reset clears the statistics");
+  readout = at(1.0);
+  testOk(events.match(1, &readout, &exposure) == 0, "reset discards the queued exposures");
+  time = at(0.230);
+  testOk(events.sample(true, &time) == AndorExposureEvents::EdgeStart,
+         "reset forgets the exposure in progress");
+  events.reset();
+
+  testDiag("Full queue");
+  for (int i=0; i<AndorExposureEvents::QueueSize + 5; i++)
+    expose(&events, 0.010 * i + 0.002, 0.010 * i + 0.008);
+  events.getStats(&starts, &ends, &unmatched);
+  testOk(ends == AndorExposureEvents::QueueSize + 5, "%d ends counted", (int)ends);
+  readout = at(100);
+  matched = events.match(1, &readout, &exposure);
+  testOk((matched == 1) && isAt(&exposure.start, 0.052), "oldest 5 exposures were discarded");
+  bad = 0;
+  for (int i=6; i<AndorExposureEvents::QueueSize + 5; i++) {
+    if ((events.match(1, &readout, &exposure) != 1) || !isAt(&exposure.end, 0.010 * i + 0.008)) bad++;
+  }
+  testOk((bad == 0) && (events.match(1, &readout, &exposure) == 0),
+         "remaining exposures are matched in order, %d bad", bad);
+  return testDone();
+}
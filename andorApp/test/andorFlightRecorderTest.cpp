@@ -0,0 +1,102 @@
+/**
+ * Unit tests for AndorFlightRecorder.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorFlightRecorder.h"
+
+static const char *dumpFile = "andorFlightRecorderTest.bin";
+
+MAIN(andorFlightRecorderTest)
+{
+  AndorFlightRecorder recorder;
+  AndorFlightEntry *pEntries;
+  AndorFlightHeader header;
+  AndorFlightEntry entries[3];
+  char name[ANDOR_FLIGHT_NAME_SIZE];
+  const char *names[] = {"ACQUIRE", "IMAGE_MODE"};
+  size_t numEntries;
+  int bad;
+  FILE *fp;
+
+  testPlan(16);
+
+  testDiag("Snapshot");
+  pEntries = recorder.snapshot(&numEntries);
+  testOk(pEntries && (numEntries == 0), "empty recorder gives an empty snapshot");
+  free(pEntries);
+  recorder.record(AndorFlightRecorder::EventReadoutStart, 7);
+  recorder.record(AndorFlightRecorder::EventReadoutEnd, 7, 1024);
+  pEntries = recorder.snapshot(&numEntries);
+  testOk(pEntries && (numEntries == 2), "%d entries", (int)numEntries);
+  testOk((pEntries[0].sequence == 1) && (pEntries[0].type == AndorFlightRecorder::EventReadoutStart) &&
+         (pEntries[0].arg1 == 7) && (pEntries[0].arg2 == 0), "first entry is the readout start");
+  testOk((pEntries[1].sequence == 2) && (pEntries[1].type == AndorFlightRecorder::EventReadoutEnd) &&
+         (pEntries[1].arg1 == 7) && (pEntries[1].arg2 == 1024), "second entry is the readout end");
+  testOk((pEntries[1].tsSec > pEntries[0].tsSec) ||
+         ((pEntries[1].tsSec == pEntries[0].tsSec) && (pEntries[1].tsNsec >= pEntries[0].tsNsec)),
+         "entries are time stamped in order");
+  free(pEntries);
+  recorder.record(AndorFlightRecorder::EventStatus, 20072);
+  pEntries = recorder.snapshot(&numEntries);
+  testOk(pEntries && (numEntries == 3) && (pEntries[2].sequence == 3),
+         "recording resumes after a snapshot");
+  free(pEntries);
+
+  testDiag("Ring wraparound");
+  for (int i=0; i<AndorFlightRecorder::NumEntries + 10; i++)
+    recorder.record(AndorFlightRecorder::EventParamChange, i, 2 * i);
+  pEntries = recorder.snapshot(&numEntries);
+  testOk(pEntries && (numEntries == AndorFlightRecorder::NumEntries),
+         "full ring keeps the last %d entries", (int)numEntries);
+  bad = 0;
+  for (size_t i=0; i<numEntries; i++) {
+    // The 3 entries above and the first 10 of the loop were overwritten
+    int arg = (int)i + 10;
+    if ((pEntries[i].sequence != (epicsUInt64)arg + 4) || (pEntries[i].arg1 != arg) ||
+        (pEntries[i].arg2 != 2 * arg)) bad++;
+  }
+  testOk(bad == 0, "entries are copied oldest first, %d bad", bad);
+  free(pEntries);
+
+  testDiag("Write and decode");
+  memset(entries, 0, sizeof(entries));
+  for (int i=0; i<3; i++) {
+    entries[i].sequence = i + 1;
+    entries[i].tsSec = 1000;
+    entries[i].tsNsec = 1000 * i;
+    entries[i].type = AndorFlightRecorder::EventParamChange;
+    entries[i].arg1 = i % 2;
+    entries[i].arg2 = 10 * i;
+  }
+  testOk(AndorFlightRecorder::write(dumpFile, 20072, entries, 3, names, 2) == 0, "dump file written");
+  fp = fopen(dumpFile, "rb");
+  testOk(fp && (fread(&header, sizeof(header), 1, fp) == 1) &&
+         (memcmp(header.magic, ANDOR_FLIGHT_MAGIC, sizeof(header.magic)) == 0) &&
+         (header.version == ANDOR_FLIGHT_VERSION), "header has the magic and version");
+  testOk((header.entrySize == sizeof(AndorFlightEntry)) && (header.numEntries == 3) &&
+         (header.numNames == 2) && (header.reason == 20072), "header describes the contents");
+  memset(entries, 0, sizeof(entries));
+  testOk((fread(entries, sizeof(AndorFlightEntry), 3, fp) == 3) && (entries[2].sequence == 3) &&
+         (entries[2].tsNsec == 2000) && (entries[2].arg1 == 0) && (entries[2].arg2 == 20),
+         "entries are read back");
+  testOk((fread(name, sizeof(name), 1, fp) == 1) && (strcmp(name, "ACQUIRE") == 0) &&
+         (fread(name, sizeof(name), 1, fp) == 1) && (strcmp(name, "IMAGE_MODE") == 0),
+         "parameter names follow the entries");
+  testOk(fread(name, 1, 1, fp) == 0, "nothing after the names");
+  if (fp) fclose(fp);
+  remove(dumpFile);
+
+  testOk((strcmp(AndorFlightRecorder::eventName(AndorFlightRecorder::EventFault), "fault") == 0) &&
+         (strcmp(AndorFlightRecorder::eventName(AndorFlightRecorder::NumEventTypes), "unknown") == 0),
+         "event names");
+  testOk(AndorFlightRecorder::write("no/such/directory/andorFlightRecorderTest.bin", 0, entries, 3,
+                                    names, 2) != 0, "unwritable file is an error");
+  return testDone();
+}
@@ -0,0 +1,117 @@
+/**
+ * Unit tests for AndorFrameAverager.
+ */
+
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorFrameAverager.h"
+
+static NDArray *makeFrame(NDArrayPool *pPool, NDDataType_t dataType, double value)
+{
+  size_t dims[2] = {4, 3};
+  NDArray *pArray = pPool->alloc(2, dims, dataType, 0, NULL);
+
+  for (int i=0; i<12; i++) {
+    if (dataType == NDUInt16) ((epicsUInt16 *)pArray->pData)[i] = (epicsUInt16)(value + i);
+    else                      ((epicsUInt32 *)pArray->pData)[i] = (epicsUInt32)(value + i);
+  }
+  return pArray;
+}
+
+static void testRolling()
+{
+  NDArrayPool pool;
+  AndorFrameAverager averager;
+  NDArray *pIn, *pOut;
+
+  testDiag("Rolling average of 3 frames");
+  averager.configure(AndorFrameAverager::ModeRolling, 3, 1);
+  // Frames of 10, 20, ... 60; until the window fills the mean of the frames so far
+  for (int frame=1; frame<=6; frame++) {
+    pIn = makeFrame(&pool, NDUInt16, frame * 10);
+    pOut = averager.process(pIn, &pool);
+    pIn->release();
+    if (!pOut) {
+      testFail("frame %d: no output", frame);
+      continue;
+    }
+    int first = frame > 3 ? frame - 2 : 1;
+    double expected = 10.0 * (first + frame) / 2.0;
+    testOk((pOut->dataType == NDFloat32) &&
+           (fabs(((epicsFloat32 *)pOut->pData)[0] - expected) < 1e-4) &&
+           (fabs(((epicsFloat32 *)pOut->pData)[11] - (expected + 11)) < 1e-4),
+           "frame %d: mean %g", frame, expected);
+    pOut->release();
+  }
+  testOk(averager.count() == 3, "count stops at the window length");
+
+  averager.reset();
+  testOk(averager.count() == 0, "reset clears the count");
+  pIn = makeFrame(&pool, NDUInt16, 100);
+  pOut = averager.process(pIn, &pool);
+  testOk(pOut && (fabs(((epicsFloat32 *)pOut->pData)[0] - 100) < 1e-4),
+         "after reset the old frames are not in the average");
+  pIn->release();
+  if (pOut) pOut->release();
+}
+
+static void testExponential()
+{
+  NDArrayPool pool;
+  AndorFrameAverager averager;
+  NDArray *pIn, *pOut;
+  double average = 0;
+
+  testDiag("Exponential average with factor 4");
+  averager.configure(AndorFrameAverager::ModeExponential, 1, 4);
+  for (int frame=1; frame<=6; frame++) {
+    pIn = makeFrame(&pool, NDUInt32, frame * 10);
+    pOut = averager.process(pIn, &pool);
+    pIn->release();
+    // The plain mean until 4 frames have been seen, then a weight of 1/4
+    int n = frame < 4 ? frame : 4;
+    average += (frame * 10 - average) / n;
+    testOk(pOut && (fabs(((epicsFloat32 *)pOut->pData)[0] - average) < 1e-3),
+           "frame %d: average %g", frame, average);
+    if (pOut) pOut->release();
+  }
+}
+
+static void testShapeChange()
+{
+  NDArrayPool pool;
+  AndorFrameAverager averager;
+  size_t dims[1] = {8};
+  NDArray *pIn, *pOut;
+
+  testDiag("A change of shape restarts the average");
+  averager.configure(AndorFrameAverager::ModeRolling, 4, 1);
+  pIn = makeFrame(&pool, NDUInt16, 10);
+  pOut = averager.process(pIn, &pool);
+  pIn->release();
+  if (pOut) pOut->release();
+  pIn = pool.alloc(1, dims, NDUInt16, 0, NULL);
+  for (int i=0; i<8; i++) ((epicsUInt16 *)pIn->pData)[i] = 50;
+  pOut = averager.process(pIn, &pool);
+  testOk(pOut && (pOut->ndims == 1) && (averager.count() == 1) &&
+         (fabs(((epicsFloat32 *)pOut->pData)[7] - 50) < 1e-4), "1-D frame starts a new average");
+  pIn->release();
+  if (pOut) pOut->release();
+
+  averager.configure(AndorFrameAverager::ModeNone, 1, 1);
+  pIn = makeFrame(&pool, NDUInt16, 10);
+  testOk(averager.process(pIn, &pool) == NULL, "ModeNone gives no output");
+  pIn->release();
+}
+
+MAIN(andorFrameAveragerTest)
+{
+  testPlan(17);
+  testRolling();
+  testExponential();
+  testShapeChange();
+  return testDone();
+}
@@ -0,0 +1,91 @@
+/**
+ * Unit tests for AndorFrameBinner.
+ */
+
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorFrameBinner.h"
+
+static const size_t SizeX = 7;
+static const size_t SizeY = 5;
+
+// Value of input pixel (x, y); large enough that sums of 16-bit pixels need 32 bits
+static double pixel(size_t x, size_t y)
+{
+  return 60000 + y * SizeX + x;
+}
+
+static void testBinning(AndorFrameBinner *pBinner, NDDataType_t dataType,
+                        int binX, int binY, int mode, int output)
+{
+  NDArrayPool pool;
+  size_t dims[2] = {SizeX, SizeY};
+  NDArray *pArray = pool.alloc(2, dims, dataType, 0, NULL);
+  size_t outX = SizeX / binX, outY = SizeY / binY;
+  int bad = 0;
+
+  for (size_t i=0; i<SizeX*SizeY; i++) {
+    if (dataType == NDUInt16) ((epicsUInt16 *)pArray->pData)[i] = (epicsUInt16)pixel(i % SizeX, i / SizeX);
+    else                      ((epicsUInt32 *)pArray->pData)[i] = (epicsUInt32)pixel(i % SizeX, i / SizeX);
+  }
+  pArray->dims[0].binning = 1;
+  pArray->dims[1].binning = 1;
+
+  testOk(pBinner->process(pArray, binX, binY, mode, output) == 0, "%dx%d mode %d output %d",
+         binX, binY, mode, output);
+  testOk((pArray->dims[0].size == outX) && (pArray->dims[1].size == outY) &&
+         (pArray->dims[0].binning == binX) && (pArray->dims[1].binning == binY),
+         "output is %lux%lu with binning %dx%d", (unsigned long)outX, (unsigned long)outY, binX, binY);
+  testOk(pArray->dataType == (output == AndorFrameBinner::OutputFloat32 ? NDFloat32 : NDUInt32),
+         "output data type");
+  // Remainder rows and columns are dropped
+  for (size_t y=0; y<outY; y++) {
+    for (size_t x=0; x<outX; x++) {
+      double expected = 0, value;
+      for (int j=0; j<binY; j++)
+        for (int i=0; i<binX; i++)
+          expected += pixel(x * binX + i, y * binY + j);
+      if (mode == AndorFrameBinner::ModeMean) {
+        expected /= binX * binY;
+        if (output == AndorFrameBinner::OutputUInt32) expected = floor(expected + 0.5);
+      }
+      if (pArray->dataType == NDFloat32) value = ((epicsFloat32 *)pArray->pData)[y * outX + x];
+      else                               value = ((epicsUInt32 *)pArray->pData)[y * outX + x];
+      if (fabs(value - expected) > 0.01) bad++;
+    }
+  }
+  testOk(bad == 0, "%d bad pixels", bad);
+  pArray->release();
+}
+
+MAIN(andorFrameBinnerTest)
+{
+  AndorFrameBinner binner;
+  NDArrayPool pool;
+  size_t dims[2] = {SizeX, SizeY};
+  NDArray *pArray;
+
+  testPlan(23);
+  testBinning(&binner, NDUInt16, 2, 1, AndorFrameBinner::ModeSum, AndorFrameBinner::OutputUInt32);
+  testBinning(&binner, NDUInt16, 1, 2, AndorFrameBinner::ModeSum, AndorFrameBinner::OutputUInt32);
+  testBinning(&binner, NDUInt16, 3, 2, AndorFrameBinner::ModeMean, AndorFrameBinner::OutputFloat32);
+  testBinning(&binner, NDUInt32, 2, 2, AndorFrameBinner::ModeSum, AndorFrameBinner::OutputFloat32);
+  testBinning(&binner, NDUInt32, 5, 3, AndorFrameBinner::ModeMean, AndorFrameBinner::OutputUInt32);
+
+  pArray = pool.alloc(2, dims, NDUInt16, 0, NULL);
+  testOk(binner.process(pArray, 1, 1, AndorFrameBinner::ModeSum, AndorFrameBinner::OutputUInt32) == 0 &&
+         pArray->dataType == NDUInt16 && pArray->dims[0].size == SizeX, "1x1 binning leaves the frame alone");
+  pArray->release();
+  pArray = pool.alloc(1, dims, NDUInt16, 0, NULL);
+  testOk(binner.process(pArray, 2, 1, AndorFrameBinner::ModeSum, AndorFrameBinner::OutputUInt32) != 0,
+         "1-D frames are refused");
+  pArray->release();
+  pArray = pool.alloc(2, dims, NDFloat32, 0, NULL);
+  testOk(binner.process(pArray, 2, 2, AndorFrameBinner::ModeSum, AndorFrameBinner::OutputUInt32) != 0,
+         "Float32 frames are refused");
+  pArray->release();
+  return testDone();
+}
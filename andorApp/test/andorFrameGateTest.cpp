@@ -0,0 +1,130 @@
+/**
+ * Unit tests for AndorFrameGate.
+ */
+
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorFrameGate.h"
+
+static NDArrayPool pool;
+
+template <typename epicsType>
+static NDArray *makeFrame(NDDataType_t dataType, size_t sizeX, size_t sizeY, double value)
+{
+  size_t dims[2] = {sizeX, sizeY};
+  NDArray *pArray = pool.alloc(2, dims, dataType, 0, NULL);
+  epicsType *pData = (epicsType *)pArray->pData;
+
+  for (size_t i=0; i<sizeX*sizeY; i++) pData[i] = (epicsType)value;
+  return pArray;
+}
+
+/** Runs a sequence of uniform 16x8 frames through a gate.
+  * \return A bit per frame, set if the frame was published. */
+template <typename epicsType>
+static int runGate(AndorFrameGate *pGate, NDDataType_t dataType, const double *values, int numFrames,
+                   double threshold, int keyframeInterval)
+{
+  int passed = 0;
+
+  for (int i=0; i<numFrames; i++) {
+    NDArray *pArray = makeFrame<epicsType>(dataType, 16, 8, values[i]);
+    if (pGate->process(pArray, threshold, keyframeInterval)) passed |= 1 << i;
+    pArray->release();
+  }
+  return passed;
+}
+
+template <typename epicsType>
+static void testType(NDDataType_t dataType, const char *typeName)
+{
+  const double values[] = {100, 101, 102, 110, 110, 110, 110, 110, 90};
+  AndorFrameGate gate;
+  int passed;
+  bool pass;
+
+  testDiag("%s frames", typeName);
+  gate.configure(AndorFrameGate::ModePrevious, 1, 0, 0, 0, 0);
+  passed = runGate<epicsType>(&gate, dataType, values, 9, 5.0, 0);
+  testOk(passed == 0x109, "%s: first frame and changes of at least 5 from the last published frame pass",
+         typeName);
+  testOk((gate.passed() == 3) && (gate.skipped() == 6), "%s: 3 passed and 6 skipped", typeName);
+  testOk(fabs(gate.metric() - 20) < 1e-9, "%s: metric is the mean absolute difference, %g", typeName,
+         gate.metric());
+
+  gate.resetStats();
+  passed = runGate<epicsType>(&gate, dataType, values, 9, 5.0, 3);
+  testOk(passed == 0x149, "%s: keyframe interval 3 publishes after 2 skipped frames", typeName);
+
+  gate.configure(AndorFrameGate::ModeReference, 1, 0, 0, 0, 0);
+  gate.resetStats();
+  passed = runGate<epicsType>(&gate, dataType, values, 9, 5.0, 0);
+  testOk(passed == 0x1f9, "%s: frames are compared with the reference, not the last published frame",
+         typeName);
+
+  // A change outside the region, or between the sampled pixels, is not seen
+  gate.configure(AndorFrameGate::ModePrevious, 2, 4, 2, 8, 4);
+  gate.resetStats();
+  {
+    NDArray *pArray = makeFrame<epicsType>(dataType, 16, 8, 100);
+    epicsType *pData = (epicsType *)pArray->pData;
+    gate.process(pArray, 5.0, 0);
+    pData[0] = pData[16 * 7 + 15] = pData[16 * 2 + 5] = (epicsType)200;
+    testOk(!gate.process(pArray, 5.0, 0), "%s: changes outside the sampled pixels are ignored", typeName);
+    pData[16 * 2 + 4] = (epicsType)200;
+    pass = gate.process(pArray, 5.0, 0);
+    testOk(pass && (fabs(gate.metric() - 100. / 8) < 1e-9),
+           "%s: change of a sampled pixel is averaged over the 8 samples, %g", typeName, gate.metric());
+    pArray->release();
+  }
+}
+
+MAIN(andorFrameGateTest)
+{
+  AndorFrameGate gate;
+  NDArray *pArray;
+  bool pass;
+
+  testPlan(26);
+  testType<epicsUInt16>(NDUInt16, "UInt16");
+  testType<epicsUInt32>(NDUInt32, "UInt32");
+  testType<epicsFloat32>(NDFloat32, "Float32");
+
+  testDiag("Off, unsupported types and large differences");
+  {
+    const double values[] = {100, 100, 100};
+    testOk(runGate<epicsUInt16>(&gate, NDUInt16, values, 3, 5.0, 0) == 0x7, "ModeOff publishes every frame");
+  }
+  gate.configure(AndorFrameGate::ModePrevious, 1, 0, 0, 0, 0);
+  pArray = makeFrame<epicsInt32>(NDInt32, 16, 8, 100);
+  testOk(gate.process(pArray, 5.0, 0) && gate.process(pArray, 5.0, 0),
+         "frames of unsupported types are always published");
+  pArray->release();
+
+  // More than one block of 16-bit sums, each difference as large as possible
+  gate.resetStats();
+  pArray = makeFrame<epicsUInt16>(NDUInt16, 512, 512, 0);
+  gate.process(pArray, 1.0, 0);
+  pArray->release();
+  pArray = makeFrame<epicsUInt16>(NDUInt16, 512, 512, 65535);
+  pass = gate.process(pArray, 1.0, 0);
+  testOk(pass && (gate.metric() == 65535),
+         "UInt16 sums do not overflow, metric %g", gate.metric());
+  pArray->release();
+
+  gate.resetStats();
+  pArray = makeFrame<epicsUInt32>(NDUInt32, 512, 512, 4000000000.);
+  gate.process(pArray, 1.0, 0);
+  pArray->release();
+  pArray = makeFrame<epicsUInt32>(NDUInt32, 512, 512, 0);
+  pass = gate.process(pArray, 1.0, 0);
+  testOk(pass && (gate.metric() == 4e9),
+         "UInt32 sums do not overflow, metric %g", gate.metric());
+  pArray->release();
+
+  testOk((gate.passed() == 2) && (gate.skipped() == 0), "a change of data type starts a new comparison");
+  return testDone();
+}
@@ -0,0 +1,141 @@
+/**
+ * Unit tests for AndorFrameStore and AndorFrameStoreReader.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+#include <NDArray.h>
+
+#include "andorFrameStore.h"
+
+static const char *storeFile = "andorFrameStoreTest.afs";
+static const char *indexFile = "andorFrameStoreTest.afs.idx";
+
+/** Writes one 4x3 UInt16 frame per frame number, filled with the frame number. */
+static void writeStore(NDArrayPool *pPool, const epicsInt64 *frameNumbers, int numFrames)
+{
+  size_t dims[2] = {4, 3};
+  AndorFrameStore store(storeFile, 0, numFrames);
+
+  for (int i=0; i<numFrames; i++) {
+    NDArray *pArray = pPool->alloc(2, dims, NDUInt16, 0, NULL);
+    for (int j=0; j<12; j++) ((epicsUInt16 *)pArray->pData)[j] = (epicsUInt16)(frameNumbers[i] + j);
+    pArray->timeStamp = 0.5 * i;
+    store.append(pArray, frameNumbers[i], 0.01);
+    pArray->release();
+  }
+  store.close();
+}
+
+static bool frameMatches(const AndorFrameStoreReader *pReader, epicsInt64 frameNumber)
+{
+  const AndorFrameIndexEntry *pEntry = pReader->findFrame(frameNumber);
+  const epicsUInt16 *pData;
+
+  if (!pEntry || (pEntry->frameNumber != frameNumber)) return false;
+  pData = (const epicsUInt16 *)pReader->frameData(pEntry);
+  if (!pData) return false;
+  for (int j=0; j<12; j++)
+    if (pData[j] != (epicsUInt16)(frameNumber + j)) return false;
+  return true;
+}
+
+MAIN(andorFrameStoreTest)
+{
+  NDArrayPool pool;
+  AndorFrameStoreReader reader;
+  const AndorFrameIndexEntry *pEntry;
+  epicsInt64 framesWritten, framesDropped;
+  double bytesWritten;
+  int queueFree, bad;
+
+  testPlan(20);
+  testOk(andorFrameStoreChecksum("123456789", 9) == 0xCBF43926, "CRC-32 check value");
+
+  testDiag("Write and reopen");
+  {
+    size_t dims[2] = {4, 3};
+    AndorFrameStore store(storeFile, 0, 10);
+    testOk(store.isOpen(), "store is open");
+    for (int i=0; i<10; i++) {
+      NDArray *pArray = pool.alloc(2, dims, NDUInt16, 0, NULL);
+      for (int j=0; j<12; j++) ((epicsUInt16 *)pArray->pData)[j] = (epicsUInt16)(100 + i + j);
+      pArray->timeStamp = 0.5 * i;
+      store.append(pArray, 100 + i, 0.01);
+      pArray->release();
+    }
+    store.close();
+    store.getStats(&framesWritten, &framesDropped, &bytesWritten, &queueFree);
+    testOk((framesWritten == 10) && (framesDropped == 0) && (bytesWritten == 240),
+           "10 frames and 240 bytes written");
+    testOk(!store.isOpen() && (store.append(0, 0, 0) != 0), "closed store refuses frames");
+  }
+  testOk(reader.open(storeFile) == 0, "reader opens the store");
+  testOk(reader.numFrames() == 10, "index has %d frames", (int)reader.numFrames());
+  pEntry = reader.entry(3);
+  testOk(pEntry && (pEntry->frameNumber == 103) && (pEntry->offset == 72) && (pEntry->size == 24) &&
+         (pEntry->sizeX == 4) && (pEntry->sizeY == 3) && (pEntry->dataType == NDUInt16) &&
+         (pEntry->timeStamp == 1.5) && (pEntry->exposure == 0.01), "entry 3 describes frame 103");
+  testOk(reader.entry(10) == 0, "no entry past the last frame");
+  bad = 0;
+  for (int i=100; i<110; i++)
+    if (!frameMatches(&reader, i)) bad++;
+  testOk(bad == 0, "findFrame returns the data of every frame, %d bad", bad);
+  testOk((reader.findFrame(99) == 0) && (reader.findFrame(110) == 0), "missing frames are not found");
+  bad = 0;
+  for (size_t i=0; i<reader.numFrames(); i++)
+    if (!reader.verify(reader.entry(i))) bad++;
+  testOk(bad == 0, "every checksum matches, %d bad", bad);
+  reader.close();
+
+  testDiag("Dropped frames");
+  {
+    const epicsInt64 frameNumbers[] = {0, 1, 2, 5, 6, 9};
+    writeStore(&pool, frameNumbers, 6);
+  }
+  reader.open(storeFile);
+  testOk(frameMatches(&reader, 5) && frameMatches(&reader, 9),
+         "frames after a gap are found by the binary search");
+  testOk((reader.findFrame(3) == 0) && (reader.findFrame(8) == 0), "dropped frames are not found");
+  reader.close();
+
+  testDiag("Counter reset while the file was open");
+  {
+    const epicsInt64 frameNumbers[] = {10, 11, 12, 13, 0, 1, 2, 3};
+    writeStore(&pool, frameNumbers, 8);
+  }
+  reader.open(storeFile);
+  testOk(frameMatches(&reader, 2), "frame after the reset is found in the unsorted index");
+  testOk(frameMatches(&reader, 12), "frame before the reset is found");
+  testOk(reader.findFrame(7) == 0, "missing frame is not found in the unsorted index");
+  reader.close();
+
+  testDiag("Corrupted frame");
+  {
+    FILE *fp = fopen(storeFile, "r+b");
+    epicsUInt16 value = 0xFFFF;
+    fseek(fp, 2 * 24 + 6, SEEK_SET);
+    fwrite(&value, sizeof(value), 1, fp);
+    fclose(fp);
+  }
+  reader.open(storeFile);
+  testOk(!reader.verify(reader.entry(2)), "checksum of the corrupted frame does not match");
+  testOk(reader.verify(reader.entry(1)) && reader.verify(reader.entry(3)), "other frames still match");
+  reader.close();
+
+  testDiag("Bad index");
+  {
+    FILE *fp = fopen(indexFile, "r+b");
+    fwrite("XXXX", 4, 1, fp);
+    fclose(fp);
+  }
+  testOk(reader.open(storeFile) != 0, "index with a bad magic is refused");
+  testOk(reader.open("andorFrameStoreTest.missing") != 0, "missing store is refused");
+
+  remove(storeFile);
+  remove(indexFile);
+  return testDone();
+}
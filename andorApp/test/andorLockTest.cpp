@@ -0,0 +1,90 @@
+/**
+ * Unit tests for AndorLock.
+ */
+
+#include <string.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+#include <epicsThread.h>
+#include <epicsEvent.h>
+
+#include "andorLock.h"
+
+typedef struct {
+  AndorLock *pLock;
+  epicsEventId lockedEvent;
+  epicsEventId doneEvent;
+} HolderArgs;
+
+/** Holds the lock, locked twice, for 0.2 s. */
+static void holder(void *arg)
+{
+  HolderArgs *pArgs = (HolderArgs *)arg;
+
+  {
+    AndorLock::Guard guard(pArgs->pLock);
+    AndorLock::Guard nested(pArgs->pLock);
+    epicsEventSignal(pArgs->lockedEvent);
+    epicsThreadSleep(0.2);
+  }
+  epicsEventSignal(pArgs->doneEvent);
+}
+
+MAIN(andorLockTest)
+{
+  AndorLock lock("sdk");
+  AndorLock portLock("port", false);
+  AndorLock::Stats stats;
+  HolderArgs args;
+  epicsTimeStamp requested;
+
+  testPlan(11);
+  testOk(strcmp(lock.name(), "sdk") == 0, "name");
+
+  testDiag("Recursive locking");
+  lock.lock();
+  lock.lock();
+  lock.unlock();
+  lock.getStats(&stats);
+  testOk(stats.count == 0, "nested unlock does not complete a hold");
+  epicsThreadSleep(0.05);
+  lock.unlock();
+  lock.getStats(&stats);
+  testOk(stats.count == 1, "outermost unlock completes 1 hold");
+  testOk((stats.holdMax >= 0.04) && (stats.holdTotal == stats.holdMax), "hold time %g s", stats.holdMax);
+  testOk(stats.waitMax < 0.04, "no wait for a free lock, %g s", stats.waitMax);
+
+  testDiag("Wait for another thread");
+  lock.resetStats();
+  lock.getStats(&stats);
+  testOk((stats.count == 0) && (stats.waitTotal == 0) && (stats.holdTotal == 0), "statistics reset");
+  args.pLock = &lock;
+  args.lockedEvent = epicsEventMustCreate(epicsEventEmpty);
+  args.doneEvent = epicsEventMustCreate(epicsEventEmpty);
+  epicsThreadCreate("andorLockTest", epicsThreadPriorityMedium,
+                    epicsThreadGetStackSize(epicsThreadStackSmall), holder, &args);
+  epicsEventMustWait(args.lockedEvent);
+  lock.getStats(&stats);
+  testOk(stats.count == 0, "statistics can be read while another thread holds the lock");
+  {
+    AndorLock::Guard guard(&lock);
+  }
+  epicsEventMustWait(args.doneEvent);
+  lock.getStats(&stats);
+  testOk(stats.count == 2, "2 holds, the nested lock is not counted");
+  testOk((stats.waitMax >= 0.1) && (stats.waitTotal >= stats.waitMax),
+         "wait for the other thread %g s", stats.waitMax);
+  testOk(stats.holdMax >= 0.15, "hold of the other thread %g s", stats.holdMax);
+  epicsEventDestroy(args.lockedEvent);
+  epicsEventDestroy(args.doneEvent);
+
+  testDiag("Mutex owned by the caller");
+  epicsTimeGetCurrent(&requested);
+  epicsThreadSleep(0.05);
+  portLock.acquired(&requested);
+  portLock.releasing();
+  portLock.getStats(&stats);
+  testOk((stats.count == 1) && (stats.waitMax >= 0.04), "acquired and releasing time the caller's mutex");
+  return testDone();
+}
@@ -0,0 +1,160 @@
+/**
+ * Unit tests for AndorMetrics.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+#include <epicsThread.h>
+
+#include "andorMetrics.h"
+
+static const char *metricsFile = "andorMetricsTest.txt";
+
+/** Reads a whole file into a buffer allocated with malloc, which the caller frees. */
+static char *readText(FILE *fp)
+{
+  long length;
+  char *text;
+
+  fseek(fp, 0, SEEK_END);
+  length = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  text = (char *)calloc(length + 1, 1);
+  if (fread(text, 1, length, fp) != (size_t)length) text[0] = 0;
+  return text;
+}
+
+/** Returns the text written by AndorMetrics::write. */
+static char *format(AndorMetrics *pMetrics)
+{
+  FILE *fp = tmpfile();
+  char *text;
+
+  pMetrics->write(fp);
+  text = readText(fp);
+  fclose(fp);
+  return text;
+}
+
+static bool contains(const char *text, const char *line)
+{
+  return strstr(text, line) != NULL;
+}
+
+static bool endsWith(const char *text, const char *end)
+{
+  size_t length = strlen(text), endLength = strlen(end);
+
+  return (length >= endLength) && (strcmp(text + length - endLength, end) == 0);
+}
+
+/** Counts the lines of the text that start with a prefix. */
+static int countLines(const char *text, const char *prefix)
+{
+  const char *pLine = text;
+  int count = 0;
+
+  while (pLine && *pLine) {
+    if (strncmp(pLine, prefix, strlen(prefix)) == 0) count++;
+    pLine = strchr(pLine, '\n');
+    if (pLine) pLine++;
+  }
+  return count;
+}
+
+MAIN(andorMetricsTest)
+{
+  AndorMetrics metrics("CAM1");
+  char *text;
+  int frames, temperature, readout, callbacks, stage[2];
+
+  testPlan(17);
+
+  testDiag("Format");
+  text = format(&metrics);
+  testOk(strcmp(text, "# EOF\n") == 0, "no metrics is only the end marker");
+  free(text);
+
+  frames = metrics.add("andor_frames", "Frames read", AndorMetrics::TypeCounter);
+  temperature = metrics.add("andor_temperature_celsius", "Sensor temperature", AndorMetrics::TypeGauge);
+  readout = metrics.add("andor_readout_seconds", "Readout time", AndorMetrics::TypeSummary);
+  stage[0] = metrics.add("andor_stage_seconds", "Stage time", AndorMetrics::TypeSummary, "stage", "binning");
+  stage[1] = metrics.add("andor_stage_seconds", "Stage time", AndorMetrics::TypeSummary, "stage", "gate");
+  callbacks = metrics.add("andor_callbacks_seconds", "Callback time", AndorMetrics::TypeSummary);
+  metrics.increment(frames);
+  metrics.increment(frames, 4);
+  metrics.set(temperature, -60.5);
+  metrics.observe(readout, 0.5);
+  metrics.observe(readout, 0.25);
+  metrics.observe(stage[0], 0.000001);
+  metrics.observe(stage[1], 0.002);
+  metrics.observe(stage[1], 0.003);
+  metrics.setSummary(callbacks, 1.5, 10);
+  metrics.observe(callbacks, 0.5);
+  text = format(&metrics);
+  testOk(contains(text, "# TYPE andor_frames counter\n# HELP andor_frames Frames read\n"),
+         "counter TYPE and HELP use the family name");
+  testOk(contains(text, "\nandor_frames_total{port=\"CAM1\"} 5\n"), "counter sample has the _total suffix");
+  testOk(contains(text, "# TYPE andor_temperature_celsius gauge\n") &&
+         contains(text, "\nandor_temperature_celsius{port=\"CAM1\"} -60.5\n"), "gauge");
+  testOk(contains(text, "# TYPE andor_readout_seconds summary\n") &&
+         contains(text, "\nandor_readout_seconds_count{port=\"CAM1\"} 2\n") &&
+         contains(text, "\nandor_readout_seconds_sum{port=\"CAM1\"} 0.75\n"), "summary _count and _sum");
+  testOk(contains(text, "\nandor_stage_seconds_count{port=\"CAM1\",stage=\"binning\"} 1\n") &&
+         contains(text, "\nandor_stage_seconds_sum{port=\"CAM1\",stage=\"binning\"} 1e-06\n") &&
+         contains(text, "\nandor_stage_seconds_sum{port=\"CAM1\",stage=\"gate\"} 0.005\n"),
+         "labelled samples, sums in microseconds");
+  testOk((countLines(text, "# TYPE andor_stage_seconds") == 1) && (countLines(text, "# HELP") == 5),
+         "one TYPE and HELP per family");
+  testOk(contains(text, "\nandor_callbacks_seconds_count{port=\"CAM1\"} 11\n") &&
+         contains(text, "\nandor_callbacks_seconds_sum{port=\"CAM1\"} 2\n"),
+         "summary set elsewhere adds the observations");
+  testOk(endsWith(text, "\n# EOF\n") && (countLines(text, "# EOF") == 1), "text ends with a single # EOF");
+  free(text);
+
+  testDiag("Invalid ids and full registry");
+  metrics.increment(-1);
+  metrics.increment(AndorMetrics::MaxMetrics);
+  metrics.set(99, 1);
+  metrics.observe(-1, 1);
+  text = format(&metrics);
+  testOk(contains(text, "\nandor_frames_total{port=\"CAM1\"} 5\n"), "invalid ids are ignored");
+  free(text);
+  // Samples with long label values, so the text does not fit in the first 8 kB buffer
+  for (int i=callbacks+1; i<AndorMetrics::MaxMetrics; i++)
+    metrics.add("andor_padding", "Padding", AndorMetrics::TypeGauge, "value",
+                "0123456789012345678901234567890123456789012345678901234567890123456789"
+                "0123456789012345678901234567890123456789012345678901234567890123456789");
+  testOk(metrics.add("andor_extra", "Extra", AndorMetrics::TypeGauge) == -1, "full registry refuses metrics");
+  text = format(&metrics);
+  testOk((strlen(text) > 8192) && endsWith(text, "\n# EOF\n"),
+         "text longer than the first buffer is complete, %d bytes", (int)strlen(text));
+  free(text);
+
+  testDiag("File");
+  testOk(metrics.startFile(metricsFile, 0.05) == 0, "file thread started");
+  epicsThreadSleep(0.2);
+  metrics.increment(frames, 5);
+  testOk(metrics.startFile(metricsFile, 0) == 0, "file thread stopped");
+  {
+    FILE *fp = fopen(metricsFile, "r");
+    text = fp ? readText(fp) : NULL;
+    if (fp) fclose(fp);
+  }
+  testOk(text && contains(text, "\nandor_frames_total{port=\"CAM1\"} 10\n"),
+         "file is written once more when stopped");
+  testOk(text && endsWith(text, "\n# EOF\n"), "file ends with # EOF");
+  free(text);
+  {
+    FILE *fp = fopen("andorMetricsTest.txt.tmp", "r");
+    testOk(fp == NULL, "temporary file was renamed");
+    if (fp) fclose(fp);
+  }
+  remove(metricsFile);
+  metrics.stop();
+  return testDone();
+}
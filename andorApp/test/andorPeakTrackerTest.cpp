@@ -0,0 +1,89 @@
+/**
+ * Unit tests for AndorPeakTracker.
+ */
+
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorPeakTracker.h"
+
+static const size_t SizeX = 512;
+// A Gaussian in the first window and a Lorentzian in the second, on a background of 100
+static const double GaussPosition = 120.3;
+static const double GaussSigma = 3.0;
+static const double GaussAmplitude = 1000;
+static const double LorentzPosition = 330.7;
+static const double LorentzHalfWidth = 4.0;
+static const double LorentzAmplitude = 500;
+
+static NDArray *makeSpectrum(NDArrayPool *pPool)
+{
+  size_t dims[1] = {SizeX};
+  NDArray *pArray = pPool->alloc(1, dims, NDFloat32, 0, NULL);
+
+  for (size_t x=0; x<SizeX; x++) {
+    double g = (x - GaussPosition) / GaussSigma;
+    double l = (x - LorentzPosition) / LorentzHalfWidth;
+    ((epicsFloat32 *)pArray->pData)[x] =
+      (epicsFloat32)(100 + GaussAmplitude * exp(-0.5 * g * g) + LorentzAmplitude / (1 + l * l));
+  }
+  return pArray;
+}
+
+static void testFit(AndorPeakTracker *pTracker, NDArray *pArray, int mode, const char *name)
+{
+  const double gaussFWHM = 2 * sqrt(2 * log(2.)) * GaussSigma;
+
+  testOk(pTracker->process(pArray, mode, 20) == 0, "%s: both peaks found", name);
+  testOk(fabs(pTracker->latest(AndorPeakTracker::ResultPosition)[0] - GaussPosition) < 0.05 &&
+         fabs(pTracker->latest(AndorPeakTracker::ResultPosition)[1] - LorentzPosition) < 0.05,
+         "%s: positions %g %g", name, pTracker->latest(AndorPeakTracker::ResultPosition)[0],
+         pTracker->latest(AndorPeakTracker::ResultPosition)[1]);
+  if (mode == AndorPeakTracker::ModeGaussian) {
+    testOk(fabs(pTracker->latest(AndorPeakTracker::ResultWidth)[0] - gaussFWHM) < 0.01 &&
+           fabs(pTracker->latest(AndorPeakTracker::ResultAmplitude)[0] - GaussAmplitude) < 1 &&
+           pTracker->latest(AndorPeakTracker::ResultQuality)[0] > 0.9999,
+           "%s: Gaussian width %g, amplitude %g", name, pTracker->latest(AndorPeakTracker::ResultWidth)[0],
+           pTracker->latest(AndorPeakTracker::ResultAmplitude)[0]);
+  } else if (mode == AndorPeakTracker::ModeLorentzian) {
+    testOk(fabs(pTracker->latest(AndorPeakTracker::ResultWidth)[1] - 2 * LorentzHalfWidth) < 0.1 &&
+           fabs(pTracker->latest(AndorPeakTracker::ResultAmplitude)[1] - LorentzAmplitude) < 5 &&
+           pTracker->latest(AndorPeakTracker::ResultQuality)[1] > 0.999,
+           "%s: Lorentzian width %g, amplitude %g", name, pTracker->latest(AndorPeakTracker::ResultWidth)[1],
+           pTracker->latest(AndorPeakTracker::ResultAmplitude)[1]);
+  }
+}
+
+MAIN(andorPeakTrackerTest)
+{
+  NDArrayPool pool;
+  NDArray *pArray = makeSpectrum(&pool);
+  AndorPeakTracker tracker;
+  float calibration[SizeX];
+  const epicsFloat64 *pHistory;
+
+  testPlan(14);
+  testOk(tracker.setWindows("5:3") < 0, "window ending before its start is refused");
+  testOk(tracker.setWindows("10:12") < 0, "window shorter than MinPixels is refused");
+  testOk(tracker.setWindows("100:140, 300 : 360") == 2, "2 windows");
+
+  testFit(&tracker, pArray, AndorPeakTracker::ModeCentroid, "centroid");
+  testFit(&tracker, pArray, AndorPeakTracker::ModeGaussian, "Gaussian");
+  testFit(&tracker, pArray, AndorPeakTracker::ModeLorentzian, "Lorentzian");
+
+  testOk(tracker.historyCount() == 3, "3 spectra in the history");
+  pHistory = tracker.history(0, AndorPeakTracker::ResultPosition);
+  testOk(fabs(pHistory[2] - GaussPosition) < 0.05, "history is oldest first");
+
+  // 500 nm plus 0.1 nm per pixel
+  for (size_t x=0; x<SizeX; x++) calibration[x] = (float)(500 + 0.1 * x);
+  tracker.setCalibration(calibration, SizeX);
+  tracker.process(pArray, AndorPeakTracker::ModeGaussian, 20);
+  testOk(fabs(tracker.latest(AndorPeakTracker::ResultPosition)[0] - (500 + 0.1 * GaussPosition)) < 0.005 &&
+         fabs(tracker.latest(AndorPeakTracker::ResultWidth)[0] - 0.1 * 2 * sqrt(2 * log(2.)) * GaussSigma) < 0.005,
+         "calibrated position %g", tracker.latest(AndorPeakTracker::ResultPosition)[0]);
+  pArray->release();
+  return testDone();
+}
@@ -0,0 +1,160 @@
+/**
+ * Unit tests for AndorPipeline and its reference stages.
+ */
+
+#include <epicsThread.h>
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorPipeline.h"
+
+static const int NumFrames = 200;
+
+/** Adds 1 to the first pixel after a delay that varies from frame to frame, so the
+  * workers finish frames out of order. */
+class DelayStage : public AndorPipelineStage {
+ public:
+  const char *name() const { return "delay"; }
+  int process(NDArray *pArray) {
+    epicsUInt16 *pData = (epicsUInt16 *)pArray->pData;
+    epicsThreadSleep(((pData[1] * 7) % 5) * 0.001);
+    pData[0]++;
+    return 0;
+  }
+};
+
+static NDArray *makeFrame(NDArrayPool *pPool, int value)
+{
+  size_t dims[2] = {4, 2};
+  NDArray *pArray = pPool->alloc(2, dims, NDUInt16, 0, NULL);
+
+  for (int i=0; i<8; i++) ((epicsUInt16 *)pArray->pData)[i] = (epicsUInt16)value;
+  return pArray;
+}
+
+static void submit(AndorPipeline *pPipeline, NDArray *pArray, int frameIndex)
+{
+  AndorPipeline::Frame frame;
+
+  frame.pArray = pArray;
+  frame.frameIndex = frameIndex;
+  frame.imageCounter = frameIndex + 1;
+  epicsTimeGetCurrent(&frame.readoutTime);
+  if (pPipeline->submit(&frame)) testAbort("submit of frame %d failed", frameIndex);
+}
+
+static void testOrder(NDArrayPool *pPool)
+{
+  AndorPipeline pipeline;
+  AndorPipeline::Frame frame;
+  AndorPipeline::StageStats stats;
+  int stage = pipeline.addStage(new DelayStage);
+  int expected = 0, outOfOrder = 0, wrong = 0;
+
+  testDiag("%d frames through 4 workers", NumFrames);
+  testOk(pipeline.setThreads(4) == 4, "4 worker threads");
+  testOk(!pipeline.active(), "not active with no stage enabled");
+  pipeline.setEnabled(stage, true);
+  testOk(pipeline.active(), "active with a stage enabled");
+  for (int i=0; i<NumFrames; i++) {
+    NDArray *pArray = makeFrame(pPool, 0);
+    ((epicsUInt16 *)pArray->pData)[1] = (epicsUInt16)i;
+    if (pipeline.pending() == AndorPipeline::MaxFrames) {
+      pipeline.next(&frame, -1);
+      if (frame.frameIndex != expected++) outOfOrder++;
+      if (((epicsUInt16 *)frame.pArray->pData)[0] != 1) wrong++;
+      frame.pArray->release();
+    }
+    submit(&pipeline, pArray, i);
+  }
+  while (pipeline.next(&frame, -1)) {
+    if ((frame.frameIndex != expected++) || (frame.imageCounter != frame.frameIndex + 1)) outOfOrder++;
+    if (((epicsUInt16 *)frame.pArray->pData)[0] != 1) wrong++;
+    frame.pArray->release();
+  }
+  testOk((expected == NumFrames) && (outOfOrder == 0), "frames returned in submission order, %d out of order",
+         outOfOrder);
+  testOk(wrong == 0, "each frame processed once, %d wrong", wrong);
+  testOk(pipeline.pending() == 0, "nothing pending");
+  pipeline.getStats(stage, &stats);
+  testOk((stats.count == NumFrames) && (stats.errors == 0) && (stats.max >= stats.total / stats.count),
+         "stage statistics count %d frames", (int)stats.count);
+
+  pipeline.setEnabled(stage, false);
+  submit(&pipeline, makeFrame(pPool, 0), 0);
+  pipeline.next(&frame, -1);
+  testOk(((epicsUInt16 *)frame.pArray->pData)[0] == 0, "disabled stage is not run");
+  frame.pArray->release();
+  testOk(!pipeline.next(&frame, 0), "next does not wait with a timeout of 0");
+}
+
+static void testReference(NDArrayPool *pPool)
+{
+  AndorPipeline pipeline;
+  AndorPipeline::Frame frame;
+  AndorPipeline::StageStats stats;
+  AndorDarkStage *pDark = new AndorDarkStage;
+  AndorFlatStage *pFlat = new AndorFlatStage;
+  int dark = pipeline.addStage(pDark);
+  int flat = pipeline.addStage(pFlat);
+  int wrong = 0;
+  epicsUInt16 *pData;
+
+  testDiag("Dark frame captured while frames are in the pipeline");
+  pipeline.setEnabled(pipeline.addStage(new DelayStage), true);
+  pipeline.setThreads(4);
+  pipeline.setEnabled(dark, true);
+  submit(&pipeline, makeFrame(pPool, 10), 0);
+  pipeline.next(&frame, -1);
+  pipeline.getStats(dark, &stats);
+  testOk((stats.errors == 1) && !pDark->valid() && (((epicsUInt16 *)frame.pArray->pData)[2] == 10),
+         "no correction without a reference");
+  frame.pArray->release();
+
+  pDark->capture();
+  submit(&pipeline, makeFrame(pPool, 10), 0);
+  pipeline.next(&frame, -1);
+  testOk(pDark->valid() && (((epicsUInt16 *)frame.pArray->pData)[2] == 0), "reference frame is corrected with itself");
+  frame.pArray->release();
+
+  // Frames 0-4 are submitted before the capture and frame 5 becomes the new reference
+  for (int i=0; i<10; i++) {
+    if (i == 5) pDark->capture();
+    submit(&pipeline, makeFrame(pPool, (i == 5) ? 30 : 100), i);
+  }
+  while (pipeline.next(&frame, -1)) {
+    int expected = (frame.frameIndex < 5) ? 90 : (frame.frameIndex == 5) ? 0 : 70;
+    pData = (epicsUInt16 *)frame.pArray->pData;
+    if ((pData[2] != expected) || (pData[7] != expected)) wrong++;
+    frame.pArray->release();
+  }
+  testOk(wrong == 0, "each frame corrected with the reference captured before it, %d wrong", wrong);
+  pDark->clear();
+  testOk(!pDark->valid(), "clear");
+
+  testDiag("Flat field");
+  pipeline.setEnabled(dark, false);
+  pipeline.setEnabled(flat, true);
+  pFlat->capture();
+  for (int i=0; i<2; i++) {
+    NDArray *pArray = makeFrame(pPool, 50);
+    for (int j=4; j<8; j++) ((epicsUInt16 *)pArray->pData)[j] = 150;
+    submit(&pipeline, pArray, i);
+  }
+  pipeline.next(&frame, -1);
+  frame.pArray->release();
+  pipeline.next(&frame, -1);
+  pData = (epicsUInt16 *)frame.pArray->pData;
+  testOk((pData[2] == 100) && (pData[6] == 100), "flat field keeps the mean level");
+  frame.pArray->release();
+}
+
+MAIN(andorPipelineTest)
+{
+  NDArrayPool pool;
+
+  testPlan(14);
+  testOrder(&pool);
+  testReference(&pool);
+  return testDone();
+}
@@ -0,0 +1,92 @@
+/**
+ * Unit tests for AndorPresetStore.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorPresets.h"
+
+static const char *presetFile = "andorPresetsTest.txt";
+
+static void setValue(AndorPresetStore::Value *pValue, const char *param, double value)
+{
+  memset(pValue, 0, sizeof(*pValue));
+  strncpy(pValue->param, param, AndorPresetStore::NameSize - 1);
+  pValue->value = value;
+}
+
+MAIN(andorPresetsTest)
+{
+  AndorPresetStore store, copy;
+  AndorPresetStore::Value values[3];
+  const AndorPresetStore::Preset *pPreset;
+  const AndorPresetStore::Value *pValue;
+  char names[256];
+  int status, bad;
+
+  testPlan(19);
+
+  testDiag("Save and find");
+  setValue(&values[0], "ACQ_TIME", 0.1);
+  setValue(&values[1], "ANDOR_ADC_SPEED", 2);
+  setValue(&values[2], "BIN_X", 4);
+  testOk(store.save("fast spectra", values, 3) == 0, "preset saved");
+  values[0].value = 30;
+  store.save("deep image", values, 3);
+  values[0].value = 0.1 / 3;
+  store.save("fast spectra", values, 2);
+  testOk(store.numPresets() == 2, "saving with the same name replaces the preset");
+  pPreset = store.find("fast spectra");
+  testOk(pPreset && (pPreset->numValues == 2), "preset found with its values");
+  pValue = pPreset ? AndorPresetStore::findValue(pPreset, "ACQ_TIME") : NULL;
+  testOk(pValue && (pValue->value == 0.1 / 3), "value found by parameter name");
+  testOk(pPreset && (AndorPresetStore::findValue(pPreset, "BIN_X") == NULL), "missing parameter not found");
+  testOk(store.find("slow") == NULL, "missing preset not found");
+  store.list(names, sizeof(names));
+  testOk(strcmp(names, "fast spectra, deep image") == 0, "list \"%s\"", names);
+  store.list(names, 8);
+  testOk(strcmp(names, "fast sp") == 0, "list is truncated to the buffer");
+  testOk(store.save("", values, 3) != 0, "empty name is refused");
+
+  testDiag("Full store and remove");
+  bad = 0;
+  for (int i=2; i<AndorPresetStore::MaxPresets; i++) {
+    char name[AndorPresetStore::NameSize];
+    sprintf(name, "preset %d", i);
+    if (store.save(name, values, 1)) bad++;
+  }
+  testOk(bad == 0, "%d presets saved", AndorPresetStore::MaxPresets);
+  testOk(store.save("one too many", values, 1) != 0, "full store refuses a new preset");
+  testOk(store.save("deep image", values, 1) == 0, "full store replaces an existing preset");
+  status = store.remove("preset 2");
+  pPreset = store.find("preset 3");
+  testOk((status == 0) && (store.numPresets() == AndorPresetStore::MaxPresets - 1) && pPreset &&
+         (strcmp(pPreset->name, "preset 3") == 0), "removed preset leaves the others");
+  testOk(store.remove("preset 2") != 0, "removing a missing preset is an error");
+
+  testDiag("Value comparison");
+  testOk(AndorPresetStore::sameValue(0.1, (float)0.1) && AndorPresetStore::sameValue(0, 0),
+         "single precision readback is the same value");
+  testOk(!AndorPresetStore::sameValue(0.1, 0.1001) && !AndorPresetStore::sameValue(0, 1e-9),
+         "different values");
+
+  testDiag("File");
+  testOk(store.write(presetFile) == 0, "presets written");
+  copy.save("old", values, 1);
+  status = copy.read(presetFile);
+  {
+    char copyNames[256];
+    store.list(names, sizeof(names));
+    copy.list(copyNames, sizeof(copyNames));
+    testOk((status == 0) && (strcmp(names, copyNames) == 0), "file replaces the presets, in order");
+  }
+  pPreset = copy.find("fast spectra");
+  pValue = pPreset ? AndorPresetStore::findValue(pPreset, "ACQ_TIME") : NULL;
+  testOk(pValue && (pValue->value == 0.1 / 3) && (pPreset->numValues == 2), "values are read back exactly");
+  remove(presetFile);
+  return testDone();
+}
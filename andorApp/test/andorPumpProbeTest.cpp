@@ -0,0 +1,102 @@
+/**
+ * Unit tests for AndorPumpProbe.
+ */
+
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "andorPumpProbe.h"
+
+static NDArray *makeFrame(NDArrayPool *pPool, double value)
+{
+  size_t dims[2] = {4, 4};
+  NDArray *pArray = pPool->alloc(2, dims, NDUInt16, 0, NULL);
+
+  for (int i=0; i<16; i++) ((epicsUInt16 *)pArray->pData)[i] = (epicsUInt16)value;
+  return pArray;
+}
+
+static double pixel(NDArray *pArray, int i)
+{
+  return ((epicsFloat32 *)pArray->pData)[i];
+}
+
+static void testSeries()
+{
+  NDArrayPool pool;
+  AndorPumpProbe pumpProbe;
+  NDArray *pIn, *pOut;
+
+  testDiag("Series of 3 frames, mean of 2 repeats");
+  pumpProbe.configure(AndorPumpProbe::ModeSeries, 3, 2, 1);
+  // Frame k of repeat r has the value 10*k + r
+  for (int frame=1; frame<=12; frame++) {
+    int k = (frame - 1) % 3, r = (frame - 1) / 3;
+    pIn = makeFrame(&pool, 10 * k + r);
+    pOut = pumpProbe.process(pIn, &pool, frame, false);
+    pIn->release();
+    if (r % 2 == 0) {
+      testOk(!pOut && (pumpProbe.index() == k) && (pumpProbe.count() == 1),
+             "frame %d: first repeat of index %d, no output", frame, k);
+    } else {
+      testOk(pOut && (pOut->dataType == NDFloat32) && (fabs(pixel(pOut, 15) - (10 * k + r - 0.5)) < 1e-4),
+             "frame %d: mean of index %d is %g", frame, k, 10 * k + r - 0.5);
+    }
+    if (pOut) pOut->release();
+  }
+
+  testDiag("Running mean when repeats is 0");
+  pumpProbe.configure(AndorPumpProbe::ModeSeries, 2, 0, 1);
+  for (int frame=1; frame<=4; frame++) {
+    pIn = makeFrame(&pool, frame);
+    pOut = pumpProbe.process(pIn, &pool, frame, false);
+    pIn->release();
+    // Index 0 sees frames 1, 3; index 1 sees frames 2, 4
+    double expected = (frame <= 2) ? frame : frame - 1;
+    testOk(pOut && (fabs(pixel(pOut, 0) - expected) < 1e-4), "frame %d: running mean %g", frame, expected);
+    if (pOut) pOut->release();
+  }
+}
+
+static void testDifference()
+{
+  NDArrayPool pool;
+  AndorPumpProbe pumpProbe;
+  NDArray *pIn, *pOut;
+  int outputs = 0;
+
+  testDiag("Difference of 2 on and 2 off frames");
+  pumpProbe.configure(AndorPumpProbe::ModeDifference, 1, 0, 2);
+  for (int frame=1; frame<=8; frame++) {
+    bool on = (frame & 1) != 0;
+    pIn = makeFrame(&pool, on ? 100 + frame : 50);
+    pOut = pumpProbe.process(pIn, &pool, frame, on);
+    pIn->release();
+    if (frame % 4 != 0) {
+      testOk(pOut == NULL, "frame %d: no output", frame);
+    } else {
+      // On frames frame-3 and frame-1
+      double expected = 100 + (frame - 2) - 50;
+      testOk(pOut && (fabs(pixel(pOut, 5) - expected) < 1e-4) && (pumpProbe.onCount() == 0) &&
+             (pumpProbe.offCount() == 0), "frame %d: difference %g", frame, expected);
+      outputs++;
+    }
+    if (pOut) pOut->release();
+  }
+  testOk(outputs == 2, "one difference per 2 pairs");
+
+  pumpProbe.configure(AndorPumpProbe::ModeOff, 1, 0, 1);
+  pIn = makeFrame(&pool, 1);
+  testOk(pumpProbe.process(pIn, &pool, 1, true) == NULL, "ModeOff gives no output");
+  pIn->release();
+}
+
+MAIN(andorPumpProbeTest)
+{
+  testPlan(26);
+  testSeries();
+  testDifference();
+  return testDone();
+}
@@ -0,0 +1,119 @@
+/**
+ * Unit tests for AndorTimingTagger.
+ */
+
+#include <math.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+#include <epicsThread.h>
+
+#include "andorTimingTagger.h"
+
+static epicsTimeStamp startTime = {1000000, 0};
+
+static epicsTimeStamp at(double seconds)
+{
+  epicsTimeStamp stamp = startTime;
+  epicsTimeAddSeconds(&stamp, seconds);
+  return stamp;
+}
+
+/** Pushes events 10 ms apart from triggers first to last, with pulse IDs 1000 + trigger. */
+static void pushEvents(AndorTimingTagger *pTagger, int first, int last)
+{
+  for (int i=first; i<=last; i++) {
+    epicsTimeStamp trigger = at(0.01 * i);
+    pTagger->push(&trigger, 1000 + i);
+  }
+}
+
+/** Matches a frame read out 2 ms plus extra after a trigger. */
+static int matchFrame(AndorTimingTagger *pTagger, int frameIndex, int trigger, double extra,
+                      int *pPulseId, double *pError)
+{
+  epicsTimeStamp readout = at(0.01 * trigger + 0.002 + extra);
+  *pPulseId = -1;
+  return pTagger->match(frameIndex, &readout, 0.002, 0.001, pPulseId, pError);
+}
+
+MAIN(andorTimingTaggerTest)
+{
+  AndorTimingTagger tagger;
+  epicsInt64 matched, resyncs, unmatched, overflows;
+  int queued, pulseId, result;
+  double error;
+
+  testPlan(19);
+
+  testDiag("Synchronize and follow the frame counter");
+  pushEvents(&tagger, 0, 9);
+  result = matchFrame(&tagger, 1, 0, 0, &pulseId, &error);
+  testOk((result == AndorTimingTagger::MatchResync) && (pulseId == 1000),
+         "first frame synchronizes on the event that fits the delay, pulse %d", pulseId);
+  result = matchFrame(&tagger, 2, 1, 0.0005, &pulseId, &error);
+  testOk((result == AndorTimingTagger::MatchCounter) && (pulseId == 1001),
+         "next frame uses the next event, pulse %d", pulseId);
+  testOk(fabs(error - 0.0005) < 1e-6, "error is the difference from the expected delay, %g", error);
+  tagger.getStats(&matched, &resyncs, &unmatched, &overflows, &queued);
+  testOk((matched == 2) && (resyncs == 0) && (unmatched == 0) && (queued == 8),
+         "2 matched, the first synchronization is not a resync, matched events are discarded");
+
+  testDiag("Missed trigger");
+  // The camera missed trigger 2, so frame 3 comes from trigger 3
+  result = matchFrame(&tagger, 3, 3, 0, &pulseId, &error);
+  testOk((result == AndorTimingTagger::MatchResync) && (pulseId == 1003),
+         "frame counter event does not fit, the event of trigger 3 is found, pulse %d", pulseId);
+  result = matchFrame(&tagger, 4, 4, 0, &pulseId, &error);
+  testOk((result == AndorTimingTagger::MatchCounter) && (pulseId == 1004),
+         "new offset is used for the next frame, pulse %d", pulseId);
+  tagger.getStats(&matched, &resyncs, &unmatched, &overflows, &queued);
+  testOk((matched == 4) && (resyncs == 1) && (queued == 5), "1 resync, the skipped event is discarded");
+
+  testDiag("No fitting event");
+  result = matchFrame(&tagger, 5, 5, 0.003, &pulseId, &error);
+  testOk((result == AndorTimingTagger::MatchNone) && (pulseId == -1), "readout 3 ms late is not matched");
+  tagger.getStats(&matched, &resyncs, &unmatched, &overflows, &queued);
+  testOk((unmatched == 1) && (queued == 5), "unmatched frame is counted and keeps the events");
+  result = matchFrame(&tagger, 6, 6, 0, &pulseId, &error);
+  testOk((result == AndorTimingTagger::MatchCounter) && (pulseId == 1006),
+         "counter match continues after an unmatched frame, pulse %d", pulseId);
+  result = matchFrame(&tagger, 7, 12, 0, &pulseId, &error);
+  testOk(result == AndorTimingTagger::MatchNone, "frame whose event has not arrived is not matched");
+
+  testDiag("Reset");
+  tagger.reset();
+  tagger.getStats(&matched, &resyncs, &unmatched, &overflows, &queued);
+  testOk((matched == 0) && (resyncs == 0) && (unmatched == 0) && (overflows == 0) && (queued == 0),
+         "reset clears the events and statistics");
+  result = matchFrame(&tagger, 1, 0, 0, &pulseId, &error);
+  testOk(result == AndorTimingTagger::MatchNone, "no events, no match");
+
+  testDiag("Overflow");
+  tagger.reset();
+  pushEvents(&tagger, 0, AndorTimingTagger::FifoSize + 4);
+  tagger.getStats(&matched, &resyncs, &unmatched, &overflows, &queued);
+  testOk((overflows == 5) && (queued == AndorTimingTagger::FifoSize),
+         "full FIFO discards the oldest events, %d overflows", (int)overflows);
+  result = matchFrame(&tagger, 1, 0, 0, &pulseId, &error);
+  testOk(result == AndorTimingTagger::MatchNone, "discarded event cannot be matched");
+  result = matchFrame(&tagger, 1, 5, 0, &pulseId, &error);
+  testOk((result == AndorTimingTagger::MatchResync) && (pulseId == 1005),
+         "oldest event kept is matched, pulse %d", pulseId);
+  result = matchFrame(&tagger, 2, 6, 0, &pulseId, &error);
+  testOk((result == AndorTimingTagger::MatchCounter) && (pulseId == 1006),
+         "counter match across the FIFO wrap, pulse %d", pulseId);
+
+  testDiag("Simulated source");
+  tagger.reset();
+  tagger.startSimulation(200, 7);
+  epicsThreadSleep(0.2);
+  tagger.stopSimulation();
+  tagger.getStats(&matched, &resyncs, &unmatched, &overflows, &queued);
+  testOk(queued >= 10, "200 Hz simulation pushed %d events in 0.2 s", queued);
+  int stopped = queued;
+  epicsThreadSleep(0.05);
+  tagger.getStats(&matched, &resyncs, &unmatched, &overflows, &queued);
+  testOk(queued == stopped, "no events after the simulation is stopped");
+  return testDone();
+}